@@ -0,0 +1,94 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Runtime of the programs translated to C by emitc.c . */
+
+#include <config.h>
+#include "ecma55.h"
+#include "aot.h"
+#include "arraydsc.h"
+#include "dbg.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Installs the program as if we had just compiled it. */
+static enum error_code load_program(const struct aot_program *prog)
+{
+	int i, pos;
+	union instruction *new_code;
+
+	if (init_strings() != 0)
+		return E_NO_MEM;
+
+	for (i = 1; i < prog->nstrings; i++) {
+		if (add_string(prog->strings[i], strlen(prog->strings[i]),
+			&pos) != 0)
+		{
+			return E_NO_MEM;
+		}
+	}
+	mark_const_strings();
+
+	for (i = 0; i < prog->ndata; i++) {
+		if (add_data_str(prog->data[i].i, prog->data[i].type) != 0)
+			return E_NO_MEM;
+	}
+
+	reset_array_descriptors();
+	for (i = 0; i < N_VARNAMES; i++) {
+		set_array_descriptor(i, prog->arrays[i].rampos,
+			prog->arrays[i].dim1, prog->arrays[i].dim2);
+	}
+
+	reset_ram_var_map();
+	for (i = 0; i < prog->nvars; i++) {
+		set_ram_var_pos(prog->vars[i].rampos, prog->vars[i].coded_var);
+	}
+
+	for (i = 0; i < prog->nlines; i++) {
+		if (add_line_start(prog->lines[i].pc, prog->lines[i].line_num)
+			!= 0)
+		{
+			return E_NO_MEM;
+		}
+	}
+
+	new_code = malloc(prog->code_size * sizeof *new_code);
+	if (new_code == NULL)
+		return E_NO_MEM;
+
+	memcpy(new_code, prog->code, prog->code_size * sizeof *new_code);
+	replace_code(new_code, prog->code_size);
+	return 0;
+}
+
+/*
+ * Runs the program 'prog'. This is called by the main() of the C file.
+ * Returns the exit status for main().
+ */
+int aot_main(const struct aot_program *prog)
+{
+	enum error_code ecode;
+
+	if (prog->nops != VM_NOPS) {
+		eprogname();
+		fprintf(stderr, "program translated by another version\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((ecode = load_program(prog)) != 0) {
+		eprint(ecode);
+		enl();
+		return EXIT_FAILURE;
+	}
+
+	s_debug_mode = prog->debug;
+	get_line_init();
+	set_native_program(prog->program);
+	run(prog->ram_size, prog->base, prog->stack_size,
+		prog->gosub_stack_size);
+	return 0;
+}
@@ -0,0 +1,71 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef AOT_H
+#define AOT_H
+
+#include "jit.h"
+
+/*
+ * A program translated to C by emitc.c . The C file has its own copy of
+ * these declarations and of the ones in jit.h; change them together.
+ */
+
+struct aot_datum {
+	int type;
+	int i;
+};
+
+struct aot_array {
+	int rampos;
+	int dim1;
+	int dim2;
+};
+
+struct aot_var {
+	int rampos;
+	int coded_var;
+};
+
+struct aot_line {
+	int pc;
+	int line_num;
+};
+
+/*
+ * 'nops'	VM_NOPS when the program was translated, to check that the
+ *		runtime is the same version.
+ * 'strings'	The constant strings, from position 1 ("" is at 0).
+ * 'arrays'	An array descriptor for each letter.
+ * 'vars'	The map of ram positions to variables, for debug mode.
+ * 'lines'	The line table: the pc where each line starts.
+ * 'program'	The native code.
+ */
+struct aot_program {
+	int nops;
+	const union instruction *code;
+	int code_size;
+	const char *const *strings;
+	int nstrings;
+	const struct aot_datum *data;
+	int ndata;
+	const struct aot_array *arrays;
+	const struct aot_var *vars;
+	int nvars;
+	const struct aot_line *lines;
+	int nlines;
+	int ram_size;
+	int base;
+	int stack_size;
+	int gosub_stack_size;
+	int debug;
+	native_program program;
+};
+
+/* aot.c */
+int aot_main(const struct aot_program *prog);
+
+#endif
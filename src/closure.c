@@ -0,0 +1,1155 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Compilation of the bytecode to trees of closures. */
+
+#include <config.h>
+
+#if defined(CLOSURES)
+
+#include "ecma55.h"
+#include "arraydsc.h"
+#include "jit.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Where there is no native code, we can still avoid decoding and dispatching
+ * each instruction of an expression. The stack code of an expression is the
+ * postfix form of its tree: we rebuild the tree going through the code with
+ * a symbolic stack, as reg.c does, and make a node for each operation. A
+ * node is a closure: a C function specialized for the kind of its operands
+ * (a variable, a constant or another node) and the data it needs, so that
+ *
+ *	LET S = S + I * J / 2
+ *
+ * is a single step that calls add_vn(), which reads S and calls div_nc(),
+ * which calls mul_vv(). The leaves and the operators are resolved here, once,
+ * and not each time the instruction is executed.
+ *
+ * The program is a table of steps, one at the code position where each one
+ * starts. A step is an expression and the instruction that uses its value
+ * (LET_VAR_OP, an IF_*_OP, an unchecked array assignment...), an expression
+ * that is left on the stack for the next instruction, a jump, or any other
+ * instruction, which calls the function of the virtual machine. Each step
+ * returns the position of the next one. The register instructions of reg.c
+ * are steps with variables as operands.
+ *
+ * An operator whose operands were left on the real stack by the instructions
+ * before reads them from there. We don't build trees across jump targets, as
+ * the code that jumps there doesn't go through the start of the tree.
+ *
+ * The nodes that would print a warning or an error (an overflow in a
+ * multiplication, a division by zero, a function out of its domain) set
+ * s_slow. As the expressions have no side effects, the step then discards
+ * what it computed and executes its instructions with the functions of the
+ * virtual machine (the slow path), which print the messages in the same
+ * order as when interpreting.
+ *
+ * Many programs loop with IF ... THEN and GOTO instead of FOR. We count the
+ * jumps back to each position; when one is hot, we record the steps executed
+ * from there until execution comes back (a trace) and the position of the
+ * step that followed each one. The trace is installed at the loop head as a
+ * step that runs those steps in a straight line, without looking them up in
+ * the table and without the GOTO_OP, which always go to the same place. The
+ * position that each step returns is its guard: if it is not the recorded
+ * one, the loop went another way and we return to the table at that position
+ * (a side exit). An inner loop with a trace is a step of the trace of the
+ * outer loop.
+ */
+
+union operand {
+	const double *var;
+	double num;
+	const struct node *node;
+};
+
+/* The kinds of operands, in this order in the tables of functions. */
+enum opnd_kind {
+	K_NUM,
+	K_VAR,
+	K_NODE
+};
+
+struct opnd {
+	enum opnd_kind kind;
+	union operand u;
+};
+
+struct node;
+
+/* Computes the value of the node. 'sp' is the top of the real stack. */
+typedef double node_func(const struct node *n, const double *sp);
+
+struct node {
+	node_func *eval;
+	union operand a, b;
+	const double *base;
+	int id;
+};
+
+struct step;
+
+/* Executes the step. Returns the position of the next one, or -1 to stop. */
+typedef int step_func(const struct step *st);
+
+struct step {
+	step_func *run;
+	union operand a, b, c;
+	double *dest;
+	vm_func func;
+	const struct trace *trace;
+	int pc;		/* first instruction */
+	int last;	/* last instruction */
+	int next;	/* position after the last instruction */
+	int target;
+	int npop;	/* real stack values used by the expression */
+	int id;
+};
+
+/* A trace: its steps and the position that followed each one. */
+struct trace {
+	struct trace *next_trace;
+	int head;
+	int n;
+	struct step *steps;
+	int *nexts;
+};
+
+/* The nodes are allocated in chunks, freed all together. */
+enum { NODES_PER_CHUNK = 256 };
+
+/* Jumps back to a position before recording a trace there, and the maximum
+ * number of steps of a trace.
+ */
+enum {
+	TRACE_THRESHOLD = 64,
+	TRACE_MAX_STEPS = 256
+};
+
+/* Returned by a step to start recording a trace at s_rec_head. */
+enum { TO_RECORD = -2 };
+
+struct chunk {
+	struct chunk *next;
+	struct node nodes[NODES_PER_CHUNK];
+};
+
+/* An operand on the symbolic stack and where its code starts. */
+struct pending {
+	struct opnd o;
+	int pc;
+};
+
+static const struct jit_vm *s_vm;
+static double *s_stack;
+static double *s_ram;
+static int *s_sp;
+
+/* The step that starts at each code position. */
+static struct step *s_steps = NULL;
+
+static struct chunk *s_chunks = NULL;
+static int s_chunk_used;
+
+/* Symbolic stack. */
+static struct pending *s_pend;
+static int s_npend;
+
+/* Real stack values read by the expressions on the symbolic stack. */
+static int s_npop;
+
+static int s_no_mem;
+
+/* Set by a node whose operation must go through the slow path. */
+static int s_slow = 0;
+
+/* Number of jumps back to each position, up to TRACE_THRESHOLD. */
+static unsigned char *s_counts = NULL;
+
+static struct trace *s_traces = NULL;
+
+/* The trace being recorded. */
+static int s_recording = 0;
+static int s_rec_head;
+static const struct step *s_rec_steps[TRACE_MAX_STEPS];
+static int s_rec_nexts[TRACE_MAX_STEPS];
+
+#define OPND_C(o)	((o).num)
+#define OPND_V(o)	(*(o).var)
+#define OPND_N(o)	((o).node->eval((o).node, sp))
+
+/* The value of a node operand of a step. */
+#define STEP_N(o)	((o).node->eval((o).node, s_stack + *s_sp))
+
+static double num_node(const struct node *n, const double *sp)
+{
+	return n->a.num;
+}
+
+static double var_node(const struct node *n, const double *sp)
+{
+	return *n->a.var;
+}
+
+static double stack_node(const struct node *n, const double *sp)
+{
+	return sp[-n->id];
+}
+
+static double neg_node(const struct node *n, const double *sp)
+{
+	return -OPND_N(n->a);
+}
+
+static double ifun1_node(const struct node *n, const double *sp)
+{
+	double d;
+
+	d = call_ifun1(n->id, OPND_N(n->a));
+	if (errno != 0)
+		s_slow = 1;
+	return d;
+}
+
+static double list_v_node(const struct node *n, const double *sp)
+{
+	return n->base[(int) OPND_V(n->a)];
+}
+
+static double list_n_node(const struct node *n, const double *sp)
+{
+	return n->base[(int) OPND_N(n->a)];
+}
+
+static double table_vv_node(const struct node *n, const double *sp)
+{
+	return n->base[(int) OPND_V(n->a) * n->id + (int) OPND_V(n->b)];
+}
+
+static double table_nn_node(const struct node *n, const double *sp)
+{
+	int i;
+
+	i = (int) OPND_N(n->a);
+	return n->base[i * n->id + (int) OPND_N(n->b)];
+}
+
+/* mul_num() in vm.c warns if the result is an infinity. */
+static double checked_mul(double a, double b)
+{
+	double d;
+
+	d = a * b;
+	if (d - d != 0.0)
+		s_slow = 1;
+	return d;
+}
+
+/* div_num() in vm.c warns on a division by zero. */
+static double checked_div(double a, double b)
+{
+	if (b == 0.0)
+		s_slow = 1;
+	return a / b;
+}
+
+#define BINARY(name, A, B, expr) \
+static double name(const struct node *n, const double *sp) \
+{ \
+	double a, b; \
+\
+	a = A(n->a); \
+	b = B(n->b); \
+	return expr; \
+}
+
+/*
+ * The functions of a binary operator for each kind of operands, and their
+ * table. Two constants are not combined: the left one is made a node.
+ */
+#define BINARY_OPS(name, expr) \
+BINARY(name##_cv, OPND_C, OPND_V, expr) \
+BINARY(name##_cn, OPND_C, OPND_N, expr) \
+BINARY(name##_vc, OPND_V, OPND_C, expr) \
+BINARY(name##_vv, OPND_V, OPND_V, expr) \
+BINARY(name##_vn, OPND_V, OPND_N, expr) \
+BINARY(name##_nc, OPND_N, OPND_C, expr) \
+BINARY(name##_nv, OPND_N, OPND_V, expr) \
+BINARY(name##_nn, OPND_N, OPND_N, expr) \
+static node_func *const name##_funcs[3][3] = { \
+	{ NULL, name##_cv, name##_cn }, \
+	{ name##_vc, name##_vv, name##_vn }, \
+	{ name##_nc, name##_nv, name##_nn } \
+};
+
+BINARY_OPS(add, a + b)
+BINARY_OPS(sub, a - b)
+BINARY_OPS(mul, checked_mul(a, b))
+BINARY_OPS(div, checked_div(a, b))
+
+/* Executes the instructions of the step with the virtual machine. */
+static int run_slow(const struct step *st)
+{
+	int pc, next;
+
+	s_slow = 0;
+	for (pc = st->pc; pc < st->next; pc = next) {
+		next = pc + get_instr_size(&code[pc]);
+		*s_vm->pc = pc + 1;
+		get_opcode_func(code[pc].opcode)();
+		if (*s_vm->pc != next)
+			return *s_vm->pc;
+	}
+
+	return pc;
+}
+
+/*
+ * Polling point for Ctrl+C. Returns 1 if the user pressed it, with the break
+ * at the line of 'pc', where execution would continue.
+ */
+static int is_break(int pc)
+{
+	if (*s_vm->brk) {
+		*s_vm->line_num = get_pc_line(pc);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Continues at 'target'. A jump back is a polling point, and it is counted to
+ * find the loops to trace.
+ */
+static int jump(const struct step *st, int target)
+{
+	if (target <= st->last) {
+		if (is_break(target))
+			return -1;
+		if (!s_recording && s_counts[target] < TRACE_THRESHOLD &&
+		    ++s_counts[target] == TRACE_THRESHOLD)
+		{
+			s_rec_head = target;
+			return TO_RECORD;
+		}
+	}
+
+	return target;
+}
+
+static int vm_step(const struct step *st)
+{
+	*s_vm->pc = st->pc + 1;
+	st->func();
+	return *s_vm->pc;
+}
+
+static int end_step(const struct step *st)
+{
+	return -1;
+}
+
+static int goto_step(const struct step *st)
+{
+	return jump(st, st->target);
+}
+
+/*
+ * NEXT_INT_OP: 'dest' is the variable, 'a' the limit and 'id' the step. The
+ * FOR loops are not traced, they have their own instructions.
+ */
+static int next_int_step(const struct step *st)
+{
+	double var;
+
+	var = *st->dest + st->id;
+	*st->dest = var;
+	if (st->id > 0 ? var > OPND_V(st->a) : var < OPND_V(st->a))
+		return st->next;
+	if (is_break(st->target))
+		return -1;
+	return st->target;
+}
+
+static int push_num_step(const struct step *st)
+{
+	s_stack[(*s_sp)++] = OPND_C(st->a);
+	return st->next;
+}
+
+static int push_var_step(const struct step *st)
+{
+	s_stack[(*s_sp)++] = OPND_V(st->a);
+	return st->next;
+}
+
+static int push_node_step(const struct step *st)
+{
+	double d;
+
+	d = STEP_N(st->a);
+	if (s_slow)
+		return run_slow(st);
+	*s_sp -= st->npop;
+	s_stack[(*s_sp)++] = d;
+	return st->next;
+}
+
+static int let_num_step(const struct step *st)
+{
+	*st->dest = OPND_C(st->a);
+	return st->next;
+}
+
+static int let_var_step(const struct step *st)
+{
+	*st->dest = OPND_V(st->a);
+	return st->next;
+}
+
+static int let_node_step(const struct step *st)
+{
+	double d;
+
+	d = STEP_N(st->a);
+	if (s_slow)
+		return run_slow(st);
+	*s_sp -= st->npop;
+	*st->dest = d;
+	return st->next;
+}
+
+/* 'dest' is the array, 'a' the index and 'b' the value. */
+static int let_list_step(const struct step *st)
+{
+	double i, d;
+
+	i = STEP_N(st->a);
+	d = STEP_N(st->b);
+	if (s_slow)
+		return run_slow(st);
+	*s_sp -= st->npop;
+	st->dest[(int) i] = d;
+	return st->next;
+}
+
+/* 'dest' is the array, 'a' and 'b' the indexes, 'c' the value and 'id' the
+ * second dimension.
+ */
+static int let_table_step(const struct step *st)
+{
+	double i, j, d;
+
+	i = STEP_N(st->a);
+	j = STEP_N(st->b);
+	d = STEP_N(st->c);
+	if (s_slow)
+		return run_slow(st);
+	*s_sp -= st->npop;
+	st->dest[(int) i * st->id + (int) j] = d;
+	return st->next;
+}
+
+#define IF_STEP(name, A, B, op) \
+static int name(const struct step *st) \
+{ \
+	double a, b; \
+\
+	a = A(st->a); \
+	b = B(st->b); \
+	if (s_slow) \
+		return run_slow(st); \
+	*s_sp -= st->npop; \
+	if (a op b) \
+		return jump(st, st->target); \
+	return st->next; \
+}
+
+/* The steps of a comparison for each kind of operands, and their table. */
+#define IF_STEPS(name, op) \
+IF_STEP(name##_vc, OPND_V, OPND_C, op) \
+IF_STEP(name##_vv, OPND_V, OPND_V, op) \
+IF_STEP(name##_vn, OPND_V, STEP_N, op) \
+IF_STEP(name##_nc, STEP_N, OPND_C, op) \
+IF_STEP(name##_nv, STEP_N, OPND_V, op) \
+IF_STEP(name##_nn, STEP_N, STEP_N, op) \
+static step_func *const name##_steps[3][3] = { \
+	{ NULL, NULL, NULL }, \
+	{ name##_vc, name##_vv, name##_vn }, \
+	{ name##_nc, name##_nv, name##_nn } \
+};
+
+IF_STEPS(if_less, <)
+IF_STEPS(if_greater, >)
+IF_STEPS(if_less_eq, <=)
+IF_STEPS(if_greater_eq, >=)
+IF_STEPS(if_eq, ==)
+IF_STEPS(if_not_eq, !=)
+
+/* Runs the steps of a trace until a side exit. */
+static int trace_step(const struct step *st)
+{
+	const struct trace *t;
+	const struct step *s, *end;
+	const int *next;
+	int pc;
+
+	t = st->trace;
+	end = t->steps + t->n;
+	for (;;) {
+		next = t->nexts;
+		for (s = t->steps; s != end; s++, next++) {
+			if ((pc = s->run(s)) != *next)
+				return pc;
+		}
+		/* the GOTO_OP that closed the loop is not in the trace */
+		if (is_break(t->head))
+			return -1;
+	}
+}
+
+/*
+ * Makes a trace of the 'n' steps recorded and installs it at its head.
+ * Without memory, the loop goes on without trace.
+ */
+static void install_trace(int n)
+{
+	struct trace *t;
+	struct step *st;
+	int i;
+
+	if ((t = malloc(sizeof *t)) == NULL)
+		return;
+
+	t->steps = malloc(n * sizeof *t->steps);
+	t->nexts = malloc(n * sizeof *t->nexts);
+	if (t->steps == NULL || t->nexts == NULL) {
+		free(t->steps);
+		free(t->nexts);
+		free(t);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		t->steps[i] = *s_rec_steps[i];
+		t->nexts[i] = s_rec_nexts[i];
+	}
+	t->head = s_rec_head;
+	t->n = n;
+	t->next_trace = s_traces;
+	s_traces = t;
+
+	st = &s_steps[s_rec_head];
+	st->run = trace_step;
+	st->trace = t;
+}
+
+/*
+ * Executes the steps from s_rec_head, recording them, until execution comes
+ * back there. Returns the position where execution goes on.
+ */
+static int record_trace(void)
+{
+	const struct step *st;
+	int pc, n;
+
+	s_recording = 1;
+	n = 0;
+	pc = s_rec_head;
+	do {
+		st = &s_steps[pc];
+		pc = st->run(st);
+		if (st->run == goto_step)
+			continue;
+		if (n == TRACE_MAX_STEPS) {
+			n = 0;
+			break;
+		}
+		s_rec_steps[n] = st;
+		s_rec_nexts[n] = pc;
+		n++;
+	} while (pc >= 0 && pc != s_rec_head);
+	s_recording = 0;
+
+	if (pc == s_rec_head && n > 0)
+		install_trace(n);
+	return pc;
+}
+
+static void run_program(void)
+{
+	int pc;
+
+	pc = *s_vm->pc;
+	for (;;) {
+		while (pc >= 0) {
+			pc = s_steps[pc].run(&s_steps[pc]);
+		}
+		if (pc != TO_RECORD)
+			break;
+		pc = record_trace();
+	}
+}
+
+/* Returns a new node with 'eval'. Without memory, a dummy one. */
+static struct node *new_node(node_func *eval)
+{
+	static struct node dummy;
+	struct chunk *c;
+	struct node *n;
+
+	if (s_chunks == NULL || s_chunk_used == NODES_PER_CHUNK) {
+		if ((c = malloc(sizeof *c)) == NULL) {
+			s_no_mem = 1;
+			return &dummy;
+		}
+		c->next = s_chunks;
+		s_chunks = c;
+		s_chunk_used = 0;
+	}
+
+	n = &s_chunks->nodes[s_chunk_used++];
+	memset(n, 0, sizeof *n);
+	n->eval = eval;
+	return n;
+}
+
+static struct opnd node_opnd(const struct node *n)
+{
+	struct opnd o;
+
+	o.kind = K_NODE;
+	o.u.node = n;
+	return o;
+}
+
+static struct opnd var_opnd(int rampos)
+{
+	struct opnd o;
+
+	o.kind = K_VAR;
+	o.u.var = &s_ram[rampos];
+	return o;
+}
+
+static struct opnd num_opnd(double num)
+{
+	struct opnd o;
+
+	o.kind = K_NUM;
+	o.u.num = num;
+	return o;
+}
+
+/* Makes a node of the operand 'o'. */
+static union operand to_node(struct opnd o)
+{
+	struct node *n;
+	union operand u;
+
+	switch (o.kind) {
+	case K_NUM:
+		n = new_node(num_node);
+		n->a = o.u;
+		u.node = n;
+		return u;
+	case K_VAR:
+		n = new_node(var_node);
+		n->a = o.u;
+		u.node = n;
+		return u;
+	default:
+		return o.u;
+	}
+}
+
+static void push_opnd(struct opnd o, int pc)
+{
+	s_pend[s_npend].o = o;
+	s_pend[s_npend].pc = pc;
+	s_npend++;
+}
+
+/*
+ * Takes the operand on top of the symbolic stack, or the next value on the
+ * real stack if it is empty. Sets 'start' to the start of its code, if it
+ * has code.
+ */
+static struct opnd pop_opnd(int *start)
+{
+	struct node *n;
+
+	if (s_npend > 0) {
+		s_npend--;
+		*start = s_pend[s_npend].pc;
+		return s_pend[s_npend].o;
+	}
+
+	n = new_node(stack_node);
+	n->id = ++s_npop;
+	return node_opnd(n);
+}
+
+static struct step *new_step(int pc, int last, int next, step_func *run)
+{
+	struct step *st;
+
+	st = &s_steps[pc];
+	st->run = run;
+	st->pc = pc;
+	st->last = last;
+	st->next = next;
+	return st;
+}
+
+/*
+ * Makes a step for the expressions on the symbolic stack, that leaves them
+ * on the real stack. 'end' is the end of the code of the last one.
+ */
+static void flush(int end)
+{
+	static step_func *const push_steps[] = {
+		push_num_step, push_var_step, push_node_step
+	};
+	struct step *st;
+	int i, next;
+
+	for (i = 0; i < s_npend; i++) {
+		next = i + 1 < s_npend ? s_pend[i + 1].pc : end;
+		st = new_step(s_pend[i].pc, next - 1, next,
+			push_steps[s_pend[i].o.kind]);
+		st->a = s_pend[i].o.u;
+		if (i == 0)
+			st->npop = s_npop;
+	}
+
+	s_npend = 0;
+	s_npop = 0;
+}
+
+/*
+ * Makes a step that starts at 'start' and ends with the instruction at 'pc',
+ * which uses the operands taken from the symbolic stack. The expressions left
+ * there are before: they go to the real stack.
+ */
+static struct step *new_stmt(int start, int pc, int next, step_func *run)
+{
+	struct step *st;
+	int npop;
+
+	npop = s_npend == 0 ? s_npop : 0;
+	if (s_npend == 0)
+		s_npop = 0;
+	flush(start);
+	st = new_step(start, pc, next, run);
+	st->npop = npop;
+	return st;
+}
+
+static node_func *const *binary_funcs(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case ADD_OP:
+	case ADD_CONST_OP:
+	case ADD_VAR_CONST_OP:
+	case ADD_VAR_VAR_OP:
+	case R_ADD_OP:
+		return &add_funcs[0][0];
+	case SUB_OP:
+	case SUB_VAR_VAR_OP:
+	case R_SUB_OP:
+		return &sub_funcs[0][0];
+	case MUL_OP:
+	case R_MUL_OP:
+		return &mul_funcs[0][0];
+	default:
+		return &div_funcs[0][0];
+	}
+}
+
+/*
+ * Returns the node of the binary operator of 'opcode' with the operands 'a'
+ * and 'b'.
+ */
+static struct opnd binary_opnd(enum vm_opcode opcode, struct opnd a,
+	struct opnd b)
+{
+	node_func *const *funcs;
+	struct node *n;
+
+	if (a.kind == K_NUM && b.kind == K_NUM) {
+		a.u = to_node(a);
+		a.kind = K_NODE;
+	}
+	funcs = binary_funcs(opcode);
+	n = new_node(funcs[a.kind * 3 + b.kind]);
+	n->a = a.u;
+	n->b = b.u;
+	return node_opnd(n);
+}
+
+static step_func *const *if_steps(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case IF_LESS_OP:
+	case IF_LESS_VAR_OP:
+	case IF_LESS_CONST_OP:
+	case R_IF_LESS_OP:
+		return &if_less_steps[0][0];
+	case IF_GREATER_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_GREATER_CONST_OP:
+	case R_IF_GREATER_OP:
+		return &if_greater_steps[0][0];
+	case IF_LESS_EQ_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case R_IF_LESS_EQ_OP:
+		return &if_less_eq_steps[0][0];
+	case IF_GREATER_EQ_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case R_IF_GREATER_EQ_OP:
+		return &if_greater_eq_steps[0][0];
+	case IF_EQ_OP:
+	case IF_EQ_VAR_OP:
+	case IF_EQ_CONST_OP:
+	case R_IF_EQ_OP:
+	case GOTO_IF_TRUE_OP:
+	case R_GOTO_IF_TRUE_OP:
+		return &if_eq_steps[0][0];
+	default:
+		return &if_not_eq_steps[0][0];
+	}
+}
+
+/* Makes the step of a comparison that jumps to 'target'. */
+static void compile_if(int start, int pc, int next, struct opnd a,
+	struct opnd b, int target)
+{
+	step_func *const *steps;
+	struct step *st;
+
+	if (a.kind == K_NUM) {
+		a.u = to_node(a);
+		a.kind = K_NODE;
+	}
+	steps = if_steps(code[pc].opcode);
+	st = new_stmt(start, pc, next, steps[a.kind * 3 + b.kind]);
+	st->a = a.u;
+	st->b = b.u;
+	st->target = target;
+}
+
+/* Makes the step of an assignment of 'o' to the variable at 'rampos'. */
+static void compile_let(int start, int pc, int next, struct opnd o,
+	int rampos)
+{
+	static step_func *const let_steps[] = {
+		let_num_step, let_var_step, let_node_step
+	};
+	struct step *st;
+
+	st = new_stmt(start, pc, next, let_steps[o.kind]);
+	st->a = o.u;
+	st->dest = &s_ram[rampos];
+}
+
+/*
+ * Compiles the instruction at 'pc' if it is part of an expression or uses
+ * the value of one. Returns -1 if it is not.
+ */
+static int compile_expr(int pc, int next)
+{
+	const union instruction *in;
+	struct opnd a, b, c;
+	struct node *n;
+	struct step *st;
+	int start, dim2;
+
+	in = &code[pc];
+	start = pc;
+	switch (in->opcode) {
+	case PUSH_NUM_OP:
+		push_opnd(num_opnd(in[1].num), pc);
+		break;
+	case GET_VAR_OP:
+	case GET_FN_VAR_OP:
+		push_opnd(var_opnd(in[1].id), pc);
+		break;
+	case ADD_OP:
+	case SUB_OP:
+	case MUL_OP:
+	case DIV_OP:
+		b = pop_opnd(&start);
+		a = pop_opnd(&start);
+		push_opnd(binary_opnd(in->opcode, a, b), start);
+		break;
+	case ADD_CONST_OP:
+		a = pop_opnd(&start);
+		push_opnd(binary_opnd(in->opcode, a, num_opnd(in[1].num)),
+			start);
+		break;
+	case ADD_VAR_CONST_OP:
+		push_opnd(binary_opnd(in->opcode, var_opnd(in[1].id),
+			num_opnd(in[2].num)), pc);
+		break;
+	case ADD_VAR_VAR_OP:
+	case SUB_VAR_VAR_OP:
+		push_opnd(binary_opnd(in->opcode, var_opnd(in[1].id),
+			var_opnd(in[2].id)), pc);
+		break;
+	case NEG_OP:
+		n = new_node(neg_node);
+		n->a = to_node(pop_opnd(&start));
+		push_opnd(node_opnd(n), start);
+		break;
+	case IFUN1_OP:
+		n = new_node(ifun1_node);
+		n->a = to_node(pop_opnd(&start));
+		n->id = in[1].id;
+		push_opnd(node_opnd(n), start);
+		break;
+	case GET_LIST_UNCHECKED_OP:
+		a = pop_opnd(&start);
+		n = new_node(a.kind == K_VAR ? list_v_node : list_n_node);
+		n->a = a.kind == K_VAR ? a.u : to_node(a);
+		n->base = &s_ram[in[2].id];
+		push_opnd(node_opnd(n), start);
+		break;
+	case GET_TABLE_UNCHECKED_OP:
+		b = pop_opnd(&start);
+		a = pop_opnd(&start);
+		if (a.kind == K_VAR && b.kind == K_VAR) {
+			n = new_node(table_vv_node);
+			n->a = a.u;
+			n->b = b.u;
+		} else {
+			n = new_node(table_nn_node);
+			n->a = to_node(a);
+			n->b = to_node(b);
+		}
+		n->base = &s_ram[in[2].id];
+		n->id = s_array_descs[in[1].id].dim2;
+		push_opnd(node_opnd(n), start);
+		break;
+	case LET_VAR_OP:
+		a = pop_opnd(&start);
+		compile_let(start, pc, next, a, in[1].id);
+		break;
+	case LET_VAR_CONST_OP:
+		compile_let(start, pc, next, num_opnd(in[1].num), in[2].id);
+		break;
+	case LET_VAR_FROM_VAR_OP:
+	case R_MOV_OP:
+		compile_let(start, pc, next, var_opnd(in[1].id), in[2].id);
+		break;
+	case INC_VAR_OP:
+		a = binary_opnd(ADD_OP, var_opnd(in[1].id),
+			num_opnd(in[2].num));
+		compile_let(start, pc, next, a, in[1].id);
+		break;
+	case R_ADD_OP:
+	case R_SUB_OP:
+	case R_MUL_OP:
+	case R_DIV_OP:
+		a = binary_opnd(in->opcode, var_opnd(in[1].id),
+			var_opnd(in[2].id));
+		compile_let(start, pc, next, a, in[3].id);
+		break;
+	case R_NEG_OP:
+		n = new_node(neg_node);
+		n->a = to_node(var_opnd(in[1].id));
+		compile_let(start, pc, next, node_opnd(n), in[2].id);
+		break;
+	case LET_LIST_UNCHECKED_OP:
+		b = pop_opnd(&start);
+		a = pop_opnd(&start);
+		st = new_stmt(start, pc, next, let_list_step);
+		st->a = to_node(a);
+		st->b = to_node(b);
+		st->dest = &s_ram[in[2].id];
+		break;
+	case LET_TABLE_UNCHECKED_OP:
+		dim2 = s_array_descs[in[1].id].dim2;
+		c = pop_opnd(&start);
+		b = pop_opnd(&start);
+		a = pop_opnd(&start);
+		st = new_stmt(start, pc, next, let_table_step);
+		st->a = to_node(a);
+		st->b = to_node(b);
+		st->c = to_node(c);
+		st->dest = &s_ram[in[2].id];
+		st->id = dim2;
+		break;
+	case IF_LESS_OP:
+	case IF_GREATER_OP:
+	case IF_LESS_EQ_OP:
+	case IF_GREATER_EQ_OP:
+	case IF_EQ_OP:
+	case IF_NOT_EQ_OP:
+		b = pop_opnd(&start);
+		a = pop_opnd(&start);
+		compile_if(start, pc, next, a, b, in[1].id);
+		break;
+	case IF_LESS_VAR_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_EQ_VAR_OP:
+	case IF_NOT_EQ_VAR_OP:
+		a = pop_opnd(&start);
+		compile_if(start, pc, next, a, var_opnd(in[1].id), in[2].id);
+		break;
+	case IF_LESS_CONST_OP:
+	case IF_GREATER_CONST_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case IF_EQ_CONST_OP:
+	case IF_NOT_EQ_CONST_OP:
+		a = pop_opnd(&start);
+		compile_if(start, pc, next, a, num_opnd(in[1].num), in[2].id);
+		break;
+	case R_IF_LESS_OP:
+	case R_IF_GREATER_OP:
+	case R_IF_LESS_EQ_OP:
+	case R_IF_GREATER_EQ_OP:
+	case R_IF_EQ_OP:
+	case R_IF_NOT_EQ_OP:
+		compile_if(start, pc, next, var_opnd(in[1].id),
+			var_opnd(in[2].id), in[3].id);
+		break;
+	case GOTO_IF_TRUE_OP:
+		a = pop_opnd(&start);
+		compile_if(start, pc, next, a, num_opnd(1.0), in[1].id);
+		break;
+	case R_GOTO_IF_TRUE_OP:
+		compile_if(start, pc, next, var_opnd(in[1].id), num_opnd(1.0),
+			in[2].id);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Makes the step of an instruction that is not part of an expression. */
+static void compile_instr(int pc, int next)
+{
+	const union instruction *in;
+	struct step *st;
+
+	in = &code[pc];
+	switch (in->opcode) {
+	case END_OP:
+		new_step(pc, pc, next, end_step);
+		break;
+	case GOTO_OP:
+		st = new_step(pc, pc, next, goto_step);
+		st->target = in[1].id;
+		break;
+	case NEXT_INT_OP:
+		st = new_step(pc, pc, next, next_int_step);
+		st->target = in[1].id;
+		st->a = var_opnd(in[2].id).u;
+		st->dest = &s_ram[in[3].id];
+		st->id = in[4].id;
+		break;
+	default:
+		st = new_step(pc, pc, next, vm_step);
+		st->func = get_opcode_func(in->opcode);
+		break;
+	}
+}
+
+static void free_chunks(void)
+{
+	struct chunk *c;
+
+	while (s_chunks != NULL) {
+		c = s_chunks->next;
+		free(s_chunks);
+		s_chunks = c;
+	}
+}
+
+/*
+ * Compiles the code to closures that work on the state in 'vm'.
+ * Returns the function to call to run the program, or NULL if there is not
+ * enough memory. Call closure_free() when done.
+ */
+vm_func closure_compile(const struct jit_vm *vm)
+{
+	int size, pc, next;
+	unsigned char *targets;
+
+	assert(s_steps == NULL);
+
+	s_vm = vm;
+	s_stack = vm->stack;
+	s_ram = vm->ram;
+	s_sp = vm->sp;
+	s_no_mem = 0;
+	s_npend = 0;
+	s_npop = 0;
+	size = get_code_size();
+	targets = find_jump_targets();
+	s_steps = calloc(size + 1, sizeof *s_steps);
+	s_counts = calloc(size + 1, sizeof *s_counts);
+	s_pend = malloc((size + 1) * sizeof *s_pend);
+	if (targets == NULL || s_steps == NULL || s_counts == NULL ||
+	    s_pend == NULL)
+	{
+		s_no_mem = 1;
+		goto end;
+	}
+
+	for (pc = 0; pc < size; pc = next) {
+		next = pc + get_instr_size(&code[pc]);
+		if (targets[pc])
+			flush(pc);
+		if (compile_expr(pc, next) != 0) {
+			flush(pc);
+			compile_instr(pc, next);
+		}
+	}
+	flush(size);
+
+end:	free(targets);
+	free(s_pend);
+	s_pend = NULL;
+	if (s_no_mem) {
+		closure_free();
+		return NULL;
+	}
+
+	return run_program;
+}
+
+void closure_free(void)
+{
+	struct trace *t;
+
+	free(s_steps);
+	s_steps = NULL;
+	free(s_counts);
+	s_counts = NULL;
+	free_chunks();
+	while (s_traces != NULL) {
+		t = s_traces->next_trace;
+		free(s_traces->steps);
+		free(s_traces->nexts);
+		free(s_traces);
+		s_traces = t;
+	}
+}
+
+#endif
@@ -30,6 +30,9 @@ struct command {
 /* Debug mode. */
 int s_debug_mode = 0;
 
+/* Translate the program to register instructions (see reg.c). */
+int s_register_mode = 0;
+
 static int retry_q(const char *str)
 {
 	static char linebuf[LINE_MAX_CHARS + 1];
@@ -127,12 +130,29 @@ static void compile(void)
 		free_run_data();
 }
 
+/* Returns the number of instructions compiled to their debug variants. */
+static int count_debug_instrs(void)
+{
+	int pc, n;
+
+	n = 0;
+	for (pc = 0; pc < get_code_size(); pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode >= LET_VAR_DEBUG_OP)
+			n++;
+	}
+	return n;
+}
+
 static void compile_cmd(struct cmd_arg *args, int nargs)
 {
 	compile();
 	if (s_program_ok) {
-		fprintf(stderr, "Compiled %d instructions.\n",
-			get_code_size());
+		fprintf(stderr, "Compiled %d instructions", get_code_size());
+		if (s_debug_mode) {
+			fprintf(stderr, ", %d with debug checks",
+				count_debug_instrs());
+		}
+		fprintf(stderr, ".\n");
 	}
 }
 
@@ -142,7 +162,30 @@ void run_cmd(struct cmd_arg *args, int nargs)
 		compile();
 	if (s_program_ok)
 		run(get_parsed_ram_size(), get_parsed_base(),
-			get_parsed_stack_size());
+			get_parsed_stack_size(), get_parsed_gosub_stack_size());
+}
+
+/* Compiles the program if needed and writes it translated to C to 'f'.
+ * Returns 0 on success.
+ */
+int emit_c_cmd(FILE *f)
+{
+	enum error_code ecode;
+
+	if (!s_program_ok)
+		compile();
+	if (!s_program_ok)
+		return -1;
+
+	if ((ecode = emit_c(f, get_parsed_ram_size(), get_parsed_base(),
+		get_parsed_stack_size(), get_parsed_gosub_stack_size())) != 0)
+	{
+		eprint(ecode);
+		enl();
+		return -1;
+	}
+
+	return 0;
 }
 
 static void quit_cmd(struct cmd_arg *args, int nargs)
@@ -452,6 +495,9 @@ static const char *s_help[] = {
 "RENUM          Change the line numbers to be evenly spaces.",
 "DEBUG ON/OFF   Use DEBUG ON to enable debug mode, DEBUG OFF to disable it.",
 "SETGOSUB N     Allow for N GOSUB calls without RETURN.",
+"OPTIMIZE       Show the optimization level, the passes and what they did.",
+"OPTIMIZE N     Run the optimization passes of level N or lower (0 to 2).",
+"OPTIMIZE -P/+P Switch off/on the optimization pass P.",
 "QUIT           Quit the editor."
 };
 
@@ -524,6 +570,32 @@ static void debug_cmd(struct cmd_arg *args, int nargs)
 	}
 }
 
+static void optimize_cmd(struct cmd_arg *args, int nargs)
+{
+	int i;
+	const char *p;
+
+	if (nargs == 0) {
+		printf("OPTIMIZE LEVEL %d\n", s_opt_level);
+		print_passes(stdout);
+		return;
+	}
+
+	p = args[0].str;
+	if (args[0].len == 1 && p[0] >= '0' && p[0] <= '0' + MAX_OPT_LEVEL) {
+		s_opt_level = p[0] - '0';
+	} else if ((p[0] == '-' || p[0] == '+') &&
+		   (i = find_pass(p + 1, args[0].len - 1)) >= 0)
+	{
+		set_pass_on(i, p[0] == '+');
+	} else {
+		eprint(E_SYNTAX);
+		enl();
+		return;
+	}
+	s_program_ok = 0;
+}
+
 static const struct command s_commands[] = {
 	{ "COMPILE", compile_cmd, 0, 0 },
 	{ "C", compile_cmd, 0, 0 },
@@ -532,6 +604,7 @@ static const struct command s_commands[] = {
 	{ "LIST", list_cmd, 0, 1 },
 	{ "LOAD", load_cmd, 1, 0 },
 	{ "NEW", new_cmd, 0, 0 },
+	{ "OPTIMIZE", optimize_cmd, 0, 1 },
 	{ "QUIT", quit_cmd, 0, 0 },
 	{ "RENUM", renum_cmd, 0, 0 },
 	{ "RUN", run_cmd, 0, 0 },
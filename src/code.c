@@ -10,6 +10,7 @@
 #include "ecma55.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Code segment. */
 union instruction *code = NULL;
@@ -20,6 +21,21 @@ static int s_capacity  = 0;
 /* Current code size (number of instructions filled). */
 static int s_size = 0;
 
+/*
+ * Line table: the pc of the first instruction of each line, in increasing
+ * order. There is no instruction that marks the start of a line (LINE_OP is
+ * only compiled in debug mode); the messages look up here the line of the
+ * pc being executed.
+ */
+struct line_start {
+	int pc;
+	int line_num;
+};
+
+static struct line_start *s_lines = NULL;
+static int s_lines_capacity = 0;
+static int s_nlines = 0;
+
 /*
  * Adds an instruction to the end of 'code'.
  * Returns E_NO_MEM if not enough memory.
@@ -44,11 +60,7 @@ enum error_code add_code_instr(union instruction instr)
 	return 0;
 }
 
-/*
- * Frees the code segment memory.
- * The size of the code segment will be 0.
- */
-void free_code(void)
+static void free_code_segment(void)
 {
 	if (code == NULL)
 		return;
@@ -59,6 +71,19 @@ void free_code(void)
 	s_size = 0;
 }
 
+/*
+ * Frees the code segment memory and the line table.
+ * The size of the code segment will be 0.
+ */
+void free_code(void)
+{
+	free_code_segment();
+	free(s_lines);
+	s_lines = NULL;
+	s_lines_capacity = 0;
+	s_nlines = 0;
+}
+
 /* Returns the current size of the code segment. */
 int get_code_size(void)
 {
@@ -72,3 +97,167 @@ void set_id_instr(int i, int id)
 	code[i].id = id;
 }
 
+/* Removes the 'n' instructions that start at index i. */
+void delete_code(int i, int n)
+{
+	int k;
+
+	assert(i >= 0 && i + n <= s_size);
+	memmove(&code[i], &code[i + n], (s_size - i - n) * sizeof *code);
+	s_size -= n;
+	for (k = s_nlines - 1; k >= 0 && s_lines[k].pc > i; k--) {
+		s_lines[k].pc -= n;
+	}
+}
+
+/*
+ * Replaces the code segment by 'new_code', which has 'size' instructions and
+ * must have been allocated with malloc(). We take ownership of it.
+ */
+void replace_code(union instruction *new_code, int size)
+{
+	free_code_segment();
+	code = new_code;
+	s_capacity = size;
+	s_size = size;
+}
+
+/*
+ * Records that the line 'line_num' starts at 'pc', which must not be less than
+ * the pc of the last line added. If it is the same, the last line had no code
+ * and we replace it.
+ * Returns E_NO_MEM if not enough memory.
+ */
+enum error_code add_line_start(int pc, int line_num)
+{
+	struct line_start *new_lines;
+	int new_len;
+
+	assert(s_nlines == 0 || s_lines[s_nlines - 1].pc <= pc);
+	if (s_nlines > 0 && s_lines[s_nlines - 1].pc == pc) {
+		s_lines[s_nlines - 1].line_num = line_num;
+		return 0;
+	}
+
+	if (s_nlines == s_lines_capacity) {
+		grow_array((void *) s_lines, (int) sizeof *s_lines,
+			s_lines_capacity, 64, (void **) &new_lines, &new_len);
+
+		if (s_lines_capacity == new_len)
+			return E_NO_MEM;
+
+		s_lines = new_lines;
+		s_lines_capacity = new_len;
+	}
+
+	s_lines[s_nlines].pc = pc;
+	s_lines[s_nlines].line_num = line_num;
+	s_nlines++;
+	return 0;
+}
+
+/*
+ * Adds the line starts for a copy at 'dest' of the code from 'from' to 'to'
+ * (not included). 'dest' must be the end of the code.
+ * Returns E_NO_MEM if not enough memory.
+ */
+enum error_code copy_line_starts(int from, int to, int dest)
+{
+	int i, n;
+
+	if (add_line_start(dest, get_pc_line(from)) != 0)
+		return E_NO_MEM;
+
+	n = s_nlines;
+	for (i = 0; i < n; i++) {
+		if (s_lines[i].pc > from && s_lines[i].pc < to) {
+			if (add_line_start(s_lines[i].pc - from + dest,
+				s_lines[i].line_num) != 0)
+			{
+				return E_NO_MEM;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the number of the line that has the instruction at 'pc'. It is a
+ * binary search: use it only to print a message.
+ */
+int get_pc_line(int pc)
+{
+	int lo, hi, mid;
+
+	if (s_nlines == 0)
+		return 0;
+
+	/* The last line that starts at or before pc. */
+	lo = 0;
+	hi = s_nlines - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (s_lines[mid].pc <= pc) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return s_lines[lo].line_num;
+}
+
+/*
+ * After a transformation of the code, moves each line start at 'pc' to
+ * 'new_pcs[pc]'.
+ */
+void relocate_lines(const int *new_pcs)
+{
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < s_nlines; i++) {
+		s_lines[i].pc = new_pcs[s_lines[i].pc];
+		if (n > 0 && s_lines[n - 1].pc == s_lines[i].pc)
+			n--;
+		s_lines[n++] = s_lines[i];
+	}
+	s_nlines = n;
+}
+
+/*
+ * Empties the line table, to fill it again with add_line_start(), which will
+ * not fail for the first 'n' lines.
+ * Returns E_NO_MEM if not enough memory, and then the table is not changed.
+ */
+enum error_code reset_line_starts(int n)
+{
+	struct line_start *new_lines;
+
+	if (n > s_lines_capacity) {
+		new_lines = realloc(s_lines, n * sizeof *s_lines);
+		if (new_lines == NULL)
+			return E_NO_MEM;
+
+		s_lines = new_lines;
+		s_lines_capacity = n;
+	}
+
+	s_nlines = 0;
+	return 0;
+}
+
+/* Returns the number of entries in the line table. */
+int get_line_start_count(void)
+{
+	return s_nlines;
+}
+
+/* Gets the entry 'i' of the line table. */
+void get_line_start(int i, int *pc, int *line_num)
+{
+	assert(i >= 0 && i < s_nlines);
+	*pc = s_lines[i].pc;
+	*line_num = s_lines[i].line_num;
+}
@@ -44,6 +44,20 @@ void set_ram_var_pos(int rampos, int coded_var)
 	s_ram_var_map_len++;
 }
 
+/* Number of variables in the map. */
+int get_ram_var_count(void)
+{
+	return s_ram_var_map_len;
+}
+
+/* Gets the i-th ram position and variable of the map. */
+void get_ram_var(int i, int *rampos, int *coded_var)
+{
+	assert(i >= 0 && i < s_ram_var_map_len);
+	*rampos = s_ram_var_map[i].rampos;
+	*coded_var = s_ram_var_map[i].coded_var;
+}
+
 int alloc_inited_ram(int ramsize)
 {
 	int n;
@@ -10,6 +10,8 @@
 void reset_ram_var_map(void);
 void set_ram_var_pos(int rampos, int coded_var);
 int get_var_from_rampos(int rampos);
+int get_ram_var_count(void);
+void get_ram_var(int i, int *rampos, int *coded_var);
 
 int alloc_inited_ram(int ramsize);
 void free_inited_ram(void);
@@ -79,10 +79,23 @@ static void print_help(const char *argv0)
 "  -v, --version      Output version information and exit.\n"
 "  -g n, --gosub n    Allocate n bytes for the GOSUB stack.\n"
 "  -d, --debug        Enable debug mode.\n"
+"  -r, --registers    Translate the program to register instructions.\n"
+"  -c, --emit-c       Write the program translated to C to standard output.\n"
+"  -O n, --optimize n Run the optimization passes of level n or lower (0 to 2,\n"
+"                     2 by default).\n"
+"  -n PASS, --no-pass PASS\n"
+"                     Do not run the optimization pass PASS.\n"
+"  -t, --time-passes  Report the instructions and time of each optimization\n"
+"                     pass to standard error.\n"
 "\n"
 "Examples:\n"
 "  " PACKAGE "              Start in editor mode.\n"
 "  " PACKAGE " prog.bas     Run prog.bas .\n"
+"  " PACKAGE " -c prog.bas >prog.c && cc prog.c -lbas55 -lm\n"
+"                     Make a native program from prog.bas .\n"
+"  " PACKAGE " -O1 -n INIT -t prog.bas\n"
+"                     Run prog.bas with the passes of level 1 but INIT,\n"
+"                     and report what they did.\n"
 "\n"
 "Report bugs to: <" PACKAGE_BUGREPORT ">.\n"
 "Home page: <" PACKAGE_URL ">.\n";
@@ -122,9 +135,35 @@ error:	eprogname();
 	exit(EXIT_FAILURE);
 }
 
+static void read_opt_level(const char *optarg)
+{
+	if (optarg[0] < '0' || optarg[0] > '0' + MAX_OPT_LEVEL ||
+	    optarg[1] != '\0')
+	{
+		eprogname();
+		fprintf(stderr, "bad optimization level: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	}
+
+	s_opt_level = optarg[0] - '0';
+}
+
+static void switch_off_pass(const char *optarg)
+{
+	int i;
+
+	if ((i = find_pass(optarg, strlen(optarg))) < 0) {
+		eprogname();
+		fprintf(stderr, "unknown optimization pass: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	}
+
+	set_pass_on(i, 0);
+}
+
 int main(int argc, char *argv[])
 {
-	int c;
+	int c, emit;
 	struct ngetopt ngo;
 
 	static struct ngetopt_opt ops[] = {
@@ -132,12 +171,18 @@ int main(int argc, char *argv[])
 		{ "help", 0, 'h' },
 		{ "gosub", 1, 'g' },
 		{ "debug", 0, 'd' },
+		{ "registers", 0, 'r' },
+		{ "emit-c", 0, 'c' },
+		{ "optimize", 1, 'O' },
+		{ "no-pass", 1, 'n' },
+		{ "time-passes", 0, 't' },
 		{ NULL, 0, 0 },
 	};
 
 	/* This is required for all our assumptions about overflow to work. */
 	assert(((size_t) (-1)) >= INT_MAX);
 	
+	emit = 0;
 	ngetopt_init(&ngo, argc, argv, ops);
 	do {
 		c = ngetopt_next(&ngo);
@@ -156,6 +201,21 @@ int main(int argc, char *argv[])
 		case 'd':
 			s_debug_mode = 1;
 			break;
+		case 'r':
+			s_register_mode = 1;
+			break;
+		case 'c':
+			emit = 1;
+			break;
+		case 'O':
+			read_opt_level(ngo.optarg);
+			break;
+		case 'n':
+			switch_off_pass(ngo.optarg);
+			break;
+		case 't':
+			s_pass_report = 1;
+			break;
 		case '?':
 			eprogname();
 			fprintf(stderr, "unrecognized option %s\n",
@@ -188,9 +248,13 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (load(argv[ngo.optind], MAX_ERRORS, 1) == 0) {
+	if (load(argv[ngo.optind], MAX_ERRORS, 1) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (!emit) {
 		run_cmd(NULL, 0);
-	} else {
+	} else if (emit_c_cmd(stdout) != 0) {
 		exit(EXIT_FAILURE);
 	}
 
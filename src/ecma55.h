@@ -189,10 +189,12 @@ struct cmd_arg {
 };
 
 extern int s_debug_mode;
+extern int s_register_mode;
 
 void parse_n_run_cmd(const char *str);
 int load(const char *fname, int max_errors, int batch_mode);
 void run_cmd(struct cmd_arg *args, int nargs);
+int emit_c_cmd(FILE *f);
 
 /* str.c */
 
@@ -245,10 +247,14 @@ int get_ifun_nparams(int i);
 const char *get_ifun_name(int i);
 double call_ifun0(int i);
 double call_ifun1(int i, double d);
+int is_ifun_int(int i, int int_arg);
+int is_ifun_quiet(int i);
 void bas55_srand(unsigned int seed);
 
 /* vm.c */
 
+union instruction;
+
 enum vm_opcode {
 	PUSH_NUM_OP,
 	PUSH_STR_OP,
@@ -274,10 +280,19 @@ enum vm_opcode {
 	NEG_OP,
 	LINE_OP,
 	GOSUB_OP,
+	GOSUB_UNCHECKED_OP,
 	RETURN_OP,
 	GOTO_OP,
 	ON_GOTO_OP,
 	GOTO_IF_TRUE_OP,
+	IF_LESS_OP,
+	IF_GREATER_OP,
+	IF_LESS_EQ_OP,
+	IF_GREATER_EQ_OP,
+	IF_EQ_OP,
+	IF_NOT_EQ_OP,
+	IF_EQ_STR_OP,
+	IF_NOT_EQ_STR_OP,
 	LESS_OP,
 	GREATER_OP,
 	LESS_EQ_OP,
@@ -289,6 +304,13 @@ enum vm_opcode {
 	FOR_OP,
 	FOR_CMP_OP,
 	NEXT_OP,
+	FOR_INT_OP,
+	NEXT_INT_OP,
+	RANGE_CHECK_OP,
+	GET_LIST_UNCHECKED_OP,
+	GET_TABLE_UNCHECKED_OP,
+	LET_LIST_UNCHECKED_OP,
+	LET_TABLE_UNCHECKED_OP,
 	RESTORE_OP,
 	READ_VAR_OP,
 	READ_LIST_OP,
@@ -304,6 +326,74 @@ enum vm_opcode {
 	INPUT_LIST_OP,
 	INPUT_TABLE_OP,
 	END_OP,
+
+	/* Superinstructions, generated by opt.c */
+	ADD_CONST_OP,
+	ADD_VAR_CONST_OP,
+	ADD_VAR_VAR_OP,
+	SUB_VAR_VAR_OP,
+	GET_LIST_VAR_OP,
+	LET_VAR_CONST_OP,
+	LET_VAR_FROM_VAR_OP,
+	INC_VAR_OP,
+	IF_LESS_VAR_OP,
+	IF_GREATER_VAR_OP,
+	IF_LESS_EQ_VAR_OP,
+	IF_GREATER_EQ_VAR_OP,
+	IF_EQ_VAR_OP,
+	IF_NOT_EQ_VAR_OP,
+	IF_LESS_CONST_OP,
+	IF_GREATER_CONST_OP,
+	IF_LESS_EQ_CONST_OP,
+	IF_GREATER_EQ_CONST_OP,
+	IF_EQ_CONST_OP,
+	IF_NOT_EQ_CONST_OP,
+
+	/* Register instructions, generated by reg.c */
+	R_ADD_OP,
+	R_SUB_OP,
+	R_MUL_OP,
+	R_DIV_OP,
+	R_POW_OP,
+	R_NEG_OP,
+	R_MOV_OP,
+	R_IF_LESS_OP,
+	R_IF_GREATER_OP,
+	R_IF_LESS_EQ_OP,
+	R_IF_GREATER_EQ_OP,
+	R_IF_EQ_OP,
+	R_IF_NOT_EQ_OP,
+	R_GET_LIST_OP,
+	R_GET_TABLE_OP,
+	R_LET_LIST_OP,
+	R_LET_TABLE_OP,
+	R_GOTO_IF_TRUE_OP,
+	R_POW_INT_OP,
+
+	/* Integer variants, generated by intvar.c */
+	GET_LIST_INT_OP,
+	GET_TABLE_INT_OP,
+	LET_LIST_INT_OP,
+	LET_TABLE_INT_OP,
+	POW_INT_OP,
+
+	/* Debug mode variants, generated by the parser when DEBUG is ON */
+	LET_VAR_DEBUG_OP,
+	LET_LIST_DEBUG_OP,
+	LET_TABLE_DEBUG_OP,
+	LET_STRVAR_DEBUG_OP,
+	GET_VAR_DEBUG_OP,
+	GET_STRVAR_DEBUG_OP,
+	GET_LIST_DEBUG_OP,
+	GET_TABLE_DEBUG_OP,
+	FOR_DEBUG_OP,
+	FOR_INT_DEBUG_OP,
+	READ_VAR_DEBUG_OP,
+	READ_LIST_DEBUG_OP,
+	READ_TABLE_DEBUG_OP,
+	READ_STRVAR_DEBUG_OP,
+	INPUT_LIST_DEBUG_OP,
+	INPUT_TABLE_DEBUG_OP,
 	VM_NOPS
 };
 
@@ -315,14 +405,22 @@ int is_ram_too_big(int ramsize);
 void set_gosub_stack_capacity(int capacity);
 int get_opcode_stack_inc(int opcode);
 int get_opcode_stack_dec(int opcode);
-void run(int ramsize, int array_base_index, int stack_size);
+int get_instr_size(const union instruction *instr);
+int get_opcode_jump_arg(int opcode);
+void run(int ramsize, int array_base_index, int stack_size,
+    int gosub_stack_size);
 
 /* code.c */
 
+/* An instruction slot. When the virtual machine uses direct threaded code,
+ * it works on a copy of the program where each 'opcode' has been replaced by
+ * the 'label' of its handler.
+ */
 union instruction {
 	enum vm_opcode opcode;
 	int id;
 	double num;
+	const void *label;
 };
 
 extern union instruction *code;
@@ -331,6 +429,15 @@ void free_code(void);
 int get_code_size(void);
 enum error_code add_code_instr(union instruction instr);
 void set_id_instr(int i, int id);
+void delete_code(int i, int n);
+void replace_code(union instruction *new_code, int size);
+enum error_code add_line_start(int pc, int line_num);
+enum error_code copy_line_starts(int from, int to, int dest);
+int get_pc_line(int pc);
+void relocate_lines(const int *new_pcs);
+enum error_code reset_line_starts(int n);
+int get_line_start_count(void);
+void get_line_start(int i, int *pc, int *line_num);
 
 /* codedvar.c */
 
@@ -352,9 +459,11 @@ enum pstack_type {
 	PSTACK_STR,
 };
 
+/* 'pc' is, for an expression, where its code starts. */
 struct pstack_value {
 	int column;
 	enum pstack_type type;
+	int pc;
 	union {
 		int i;
 		struct {
@@ -382,15 +491,26 @@ enum var_type {
 	VARTYPE_STR
 };
 
+#define MAX_OPT_LEVEL	2
+
+extern int s_opt_level;
+extern int s_pass_report;
+
 int init_parser(void);
 void compile_line(int num, const char *str);
 void end_parsing(void);
+int find_pass(const char *name, size_t len);
+void set_pass_on(int i, int on);
+void print_passes(FILE *f);
 void free_parser(void);
 int get_parser_nerrors(void);
 
 int get_parsed_ram_size(void);
 int get_parsed_base(void);
 int get_parsed_stack_size(void);
+int get_parsed_gosub_stack_size(void);
+int is_usrfun_pc(int pc);
+int reserve_ram(int len);
 
 void cerror(int ecode, int nl);
 void cwarn(int ecode);
@@ -410,21 +530,59 @@ void numvar_dimensioned(int column, int idx1_col, int idx2_col, int coded_var,
 			int var_type, int max_idx1, int max_idx2);
 void option_decl(int column, int op_col, int base);
 void add_line_ref(int column, int line_num);
-void for_decl(int var_column, int coded_var);
+void for_decl(int var_column, int coded_var, YYSTYPE start, YYSTYPE limit,
+	YYSTYPE step);
 void next_decl(int var_column, int coded_var);
 void strvar_decl(int coded_var);
 int str_decl(const char *start, size_t len);
 void fun_decl(int column, int name, int nparams, int param, int pc);
 void numvar_expr(int column, int coded_var);
-void list_expr(int column, int coded_var);
-void table_expr(int column, int coded_var);
+void list_expr(int column, int coded_var, YYSTYPE i);
+void table_expr(int column, int coded_var, YYSTYPE i1, YYSTYPE i2);
+void array_elem_instr(int column, enum vm_opcode opcode, int nidx,
+		      int coded_var, YYSTYPE i1, YYSTYPE i2, int end);
 void check_type(YYSTYPE a, enum pstack_type t);
 int binary_expr(YYSTYPE a, YYSTYPE b, int op);
 void boolean_expr(YYSTYPE a, YYSTYPE relop, YYSTYPE b);
 void usrfun_call(int column, int name, int nparams);
-void ifun_call(int column, int ifun, int nparams);
+void neg_expr(YYSTYPE a);
+void ifun_call(int column, int ifun, int nparams, YYSTYPE a);
 void end_decl(void);
 
+/* opt.c */
+
+unsigned char *find_jump_targets(void);
+void relocate_jumps(union instruction *new_code, int size, const int *new_pcs);
+void optimize_code(void);
+void thread_jumps(void);
+
+/* init.c */
+
+void remove_init_checks(void);
+
+/* intvar.c */
+
+void use_int_vars(void);
+
+/* ir.c */
+
+void optimize_ir(void);
+
+/* gosub.c */
+
+void inline_gosubs(void);
+int gosub_stack_depth(void);
+void remove_gosub_checks(void);
+
+/* reg.c */
+
+void translate_to_registers(void);
+
+/* emitc.c */
+
+enum error_code emit_c(FILE *f, int ramsize, int array_base_index,
+    int stack_size, int gosub_stack_size);
+
 /* datalex.c */
 
 enum num_type {
@@ -0,0 +1,707 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Translation of the compiled program to C (--emit-c). */
+
+#include <config.h>
+#include "ecma55.h"
+#include "arraydsc.h"
+#include "dbg.h"
+#include <stdlib.h>
+
+/*
+ * We write a C file with the compiled program (code, strings, DATA, array
+ * descriptors) and a function with the native code for it. Compiled and
+ * linked with libbas55.a, its main() calls aot_main() (aot.c), which installs
+ * the program and runs the native code instead of interpreting.
+ *
+ * Each instruction is translated to a few lines of C, like jit.c does with
+ * machine code. The instructions that are not translated, and the cases
+ * that must print a warning, call the function of the virtual machine
+ * (the SLOW macro). If that function changes s_pc, we look up the new pc in
+ * a switch with the positions where execution can continue, that is, the
+ * jump targets.
+ */
+
+static const char *const s_preamble[] = {
+"#include <math.h>",
+"#include <signal.h>",
+"",
+"union instruction {",
+"	int opcode;",
+"	int id;",
+"	double num;",
+"	const void *label;",
+"};",
+"",
+"struct jit_vm {",
+"	int *pc;",
+"	int *sp;",
+"	int *line_num;",
+"	volatile sig_atomic_t *brk;",
+"	void *stack;",
+"	void *ram;",
+"};",
+"",
+"typedef void (*vm_func)(void);",
+"typedef void (*native_program)(const struct jit_vm *vm);",
+"",
+"struct aot_datum {",
+"	int type;",
+"	int i;",
+"};",
+"",
+"struct aot_array {",
+"	int rampos;",
+"	int dim1;",
+"	int dim2;",
+"};",
+"",
+"struct aot_var {",
+"	int rampos;",
+"	int coded_var;",
+"};",
+"",
+"struct aot_line {",
+"	int pc;",
+"	int line_num;",
+"};",
+"",
+"struct aot_program {",
+"	int nops;",
+"	const union instruction *code;",
+"	int code_size;",
+"	const char *const *strings;",
+"	int nstrings;",
+"	const struct aot_datum *data;",
+"	int ndata;",
+"	const struct aot_array *arrays;",
+"	const struct aot_var *vars;",
+"	int nvars;",
+"	const struct aot_line *lines;",
+"	int nlines;",
+"	int ram_size;",
+"	int base;",
+"	int stack_size;",
+"	int gosub_stack_size;",
+"	int debug;",
+"	native_program program;",
+"};",
+"",
+"vm_func get_opcode_func(int opcode);",
+"int aot_main(const struct aot_program *prog);",
+"",
+"#define NELEMS(v)	(sizeof(v) / sizeof(v[0]))",
+"",
+"static vm_func s_funcs[%d];",
+"",
+"/* Calls the function of the virtual machine for the instruction at 'p'.",
+" * Returns 1 if execution must continue at *vm->pc.",
+" */",
+"static int slow(const struct jit_vm *vm, int op, int p, int next, int *sp)",
+"{",
+"	*vm->pc = p + 1;",
+"	*vm->sp = *sp;",
+"	s_funcs[op]();",
+"	*sp = *vm->sp;",
+"	return *vm->pc != next;",
+"}",
+"",
+"#define SLOW(op, p, next)				\\",
+"	do {						\\",
+"		if (slow(vm, op, p, next, &sp))		\\",
+"			goto dispatch;			\\",
+"	} while (0)",
+"",
+"static double sign(double d)",
+"{",
+"	if (d < 0.0)",
+"		return -1.0;",
+"	else if (d > 0.0)",
+"		return 1.0;",
+"	else",
+"		return 0.0;",
+"}",
+};
+
+static void emit_num(FILE *f, double d)
+{
+	if (m_isnan(d)) {
+		fputs("NAN", f);
+	} else if (m_isinf(d)) {
+		fputs(d < 0 ? "-HUGE_VAL" : "HUGE_VAL", f);
+	} else {
+		fprintf(f, "%a", d);
+	}
+}
+
+/* Writes 's' as a C string literal. */
+static void emit_str(FILE *f, const char *s)
+{
+	putc('"', f);
+	for (; *s != '\0'; s++) {
+		/* '?' to avoid trigraphs */
+		if (*s == '"' || *s == '\\' || *s == '?') {
+			fprintf(f, "\\%c", *s);
+		} else if (*s < ' ' || *s > '~') {
+			fprintf(f, "\\%03o", (unsigned char) *s);
+		} else {
+			putc(*s, f);
+		}
+	}
+	putc('"', f);
+}
+
+static void emit_preamble(FILE *f)
+{
+	int i;
+
+	fputs("/* Generated by " PACKAGE " --emit-c. Build with:\n", f);
+	fputs(" *\tcc -O2 prog.c -lbas55 -lm\n */\n\n", f);
+	for (i = 0; i < NELEMS(s_preamble); i++) {
+		fprintf(f, s_preamble[i], VM_NOPS);
+		putc('\n', f);
+	}
+}
+
+/* Returns 1 if the operand 'i' (1 is the first) of 'opcode' is a number. */
+static int is_num_operand(enum vm_opcode opcode, int i)
+{
+	switch (opcode) {
+	case PUSH_NUM_OP:
+	case ADD_CONST_OP:
+	case LET_VAR_CONST_OP:
+		return i == 1;
+	case ADD_VAR_CONST_OP:
+	case INC_VAR_OP:
+		return i == 2;
+	default:
+		return 0;
+	}
+}
+
+static void emit_code(FILE *f)
+{
+	int pc, i, n, size;
+
+	size = get_code_size();
+	fputs("\nstatic const union instruction s_code[] = {\n", f);
+	for (pc = 0; pc < size; pc += n) {
+		n = get_instr_size(&code[pc]);
+		fprintf(f, "\t/* %d */ { .opcode = %d },", pc,
+			code[pc].opcode);
+		for (i = 1; i < n; i++) {
+			if (is_num_operand(code[pc].opcode, i)) {
+				fputs(" { .num = ", f);
+				emit_num(f, code[pc + i].num);
+				fputs(" },", f);
+			} else {
+				fprintf(f, " { .id = %d },", code[pc + i].id);
+			}
+		}
+		putc('\n', f);
+	}
+	fputs("};\n", f);
+}
+
+static void emit_strings(FILE *f)
+{
+	int i;
+
+	fputs("\nstatic const char *const s_strings[] = {\n", f);
+	for (i = 0; i < nstrings; i++) {
+		putc('\t', f);
+		emit_str(f, strings[i]->str);
+		fputs(",\n", f);
+	}
+	fputs("};\n", f);
+}
+
+static int emit_data(FILE *f)
+{
+	int i, n;
+	enum data_datum_type type;
+
+	/* C does not allow empty arrays */
+	fputs("\nstatic const struct aot_datum s_data[] = {\n", f);
+	fputs("\t{ 0, 0 },\n", f);
+	n = 0;
+	restore_data();
+	while (read_data_str(&i, &type) == 0) {
+		fprintf(f, "\t{ %d, %d },\n", type, i);
+		n++;
+	}
+	restore_data();
+	fputs("};\n", f);
+	return n;
+}
+
+static void emit_arrays(FILE *f)
+{
+	int i;
+
+	fputs("\nstatic const struct aot_array s_arrays[] = {\n", f);
+	for (i = 0; i < N_VARNAMES; i++) {
+		fprintf(f, "\t{ %d, %d, %d },\n", s_array_descs[i].rampos,
+			s_array_descs[i].dim1, s_array_descs[i].dim2);
+	}
+	fputs("};\n", f);
+}
+
+static void emit_vars(FILE *f)
+{
+	int i, rampos, coded_var;
+
+	fputs("\nstatic const struct aot_var s_vars[] = {\n", f);
+	fputs("\t{ 0, 0 },\n", f);
+	for (i = 0; i < get_ram_var_count(); i++) {
+		get_ram_var(i, &rampos, &coded_var);
+		fprintf(f, "\t{ %d, %d },\n", rampos, coded_var);
+	}
+	fputs("};\n", f);
+}
+
+static void emit_lines(FILE *f)
+{
+	int i, pc, line_num;
+
+	fputs("\nstatic const struct aot_line s_lines[] = {\n", f);
+	fputs("\t{ 0, 0 },\n", f);
+	for (i = 0; i < get_line_start_count(); i++) {
+		get_line_start(i, &pc, &line_num);
+		fprintf(f, "\t{ %d, %d },\n", pc, line_num);
+	}
+	fputs("};\n", f);
+}
+
+/* If the user pressed Ctrl+C, stops, with the break at the line of 'pc',
+ * where execution would continue.
+ */
+static void emit_check_break(FILE *f, int pc)
+{
+	fprintf(f, "\tif (*vm->brk) {\n\t\t*vm->line_num = %d;\n",
+		get_pc_line(pc));
+	fputs("\t\tgoto stop;\n\t}\n", f);
+}
+
+/* A backward jump to 'target' from 'pc' is a polling point for Ctrl+C. */
+static void emit_check_break_to(FILE *f, int pc, int target)
+{
+	if (target <= pc)
+		emit_check_break(f, target);
+}
+
+/* The C operator of the IF_*_OP instruction 'opcode', or of its variants. */
+static const char *compare_op(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case IF_LESS_OP:
+	case IF_LESS_VAR_OP:
+	case IF_LESS_CONST_OP:
+	case R_IF_LESS_OP:
+		return "<";
+	case IF_GREATER_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_GREATER_CONST_OP:
+	case R_IF_GREATER_OP:
+		return ">";
+	case IF_LESS_EQ_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case R_IF_LESS_EQ_OP:
+		return "<=";
+	case IF_GREATER_EQ_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case R_IF_GREATER_EQ_OP:
+		return ">=";
+	case IF_EQ_OP:
+	case IF_EQ_VAR_OP:
+	case IF_EQ_CONST_OP:
+	case R_IF_EQ_OP:
+		return "==";
+	default:
+		return "!=";
+	}
+}
+
+/* Returns 0 if the instruction at 'pc', one of those that have a debug
+ * variant or are made of them, could be translated.
+ */
+static int emit_checked_instr(FILE *f, int pc, int next)
+{
+	const union instruction *in;
+
+	in = &code[pc];
+	switch (in->opcode) {
+	case GET_VAR_OP:
+		fprintf(f, "\ts[sp++] = r[%d];\n", in[1].id);
+		break;
+	case LET_VAR_OP:
+		fprintf(f, "\tr[%d] = s[--sp];\n", in[1].id);
+		break;
+	case ADD_VAR_CONST_OP:
+		fprintf(f, "\ts[sp++] = r[%d] + ", in[1].id);
+		emit_num(f, in[2].num);
+		fputs(";\n", f);
+		break;
+	case ADD_VAR_VAR_OP:
+	case SUB_VAR_VAR_OP:
+		fprintf(f, "\ts[sp++] = r[%d] %c r[%d];\n", in[1].id,
+			in->opcode == ADD_VAR_VAR_OP ? '+' : '-', in[2].id);
+		break;
+	case FOR_INT_OP:
+		fprintf(f, "\tr[%d] = s[--sp];\n", in[1].id);
+		fprintf(f, "\tr[%d] = s[--sp];\n", in[2].id);
+		fprintf(f, "\tif (r[%d] %c r[%d])\n\t\tgoto L%d;\n", in[2].id,
+			in[3].id > 0 ? '>' : '<', in[1].id, in[4].id);
+		break;
+	case LET_VAR_CONST_OP:
+		fprintf(f, "\tr[%d] = ", in[2].id);
+		emit_num(f, in[1].num);
+		fputs(";\n", f);
+		break;
+	case LET_VAR_FROM_VAR_OP:
+		fprintf(f, "\tr[%d] = r[%d];\n", in[2].id, in[1].id);
+		break;
+	case INC_VAR_OP:
+		fprintf(f, "\tr[%d] += ", in[1].id);
+		emit_num(f, in[2].num);
+		fputs(";\n", f);
+		break;
+	case R_ADD_OP:
+	case R_SUB_OP:
+		fprintf(f, "\tr[%d] = r[%d] %c r[%d];\n", in[3].id, in[1].id,
+			in->opcode == R_ADD_OP ? '+' : '-', in[2].id);
+		break;
+	case R_MUL_OP:
+		fprintf(f, "\td = r[%d] * r[%d];\n", in[1].id, in[2].id);
+		fprintf(f, "\tif (isfinite(d))\n\t\tr[%d] = d;\n", in[3].id);
+		fprintf(f, "\telse\n\t\tSLOW(%d, %d, %d);\n", in->opcode, pc,
+			next);
+		break;
+	case R_DIV_OP:
+		fprintf(f, "\tif (r[%d] != 0.0)\n", in[2].id);
+		fprintf(f, "\t\tr[%d] = r[%d] / r[%d];\n", in[3].id, in[1].id,
+			in[2].id);
+		fprintf(f, "\telse\n\t\tSLOW(%d, %d, %d);\n", in->opcode, pc,
+			next);
+		break;
+	case R_NEG_OP:
+		fprintf(f, "\tr[%d] = -r[%d];\n", in[2].id, in[1].id);
+		break;
+	case R_MOV_OP:
+		fprintf(f, "\tr[%d] = r[%d];\n", in[2].id, in[1].id);
+		break;
+	case R_IF_LESS_OP:
+	case R_IF_GREATER_OP:
+	case R_IF_LESS_EQ_OP:
+	case R_IF_GREATER_EQ_OP:
+	case R_IF_EQ_OP:
+	case R_IF_NOT_EQ_OP:
+		emit_check_break_to(f, pc, in[3].id);
+		fprintf(f, "\tif (r[%d] %s r[%d])\n\t\tgoto L%d;\n", in[1].id,
+			compare_op(in->opcode), in[2].id, in[3].id);
+		break;
+	case R_GOTO_IF_TRUE_OP:
+		emit_check_break_to(f, pc, in[2].id);
+		fprintf(f, "\tif (r[%d] == 1.0)\n\t\tgoto L%d;\n", in[1].id,
+			in[2].id);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Prints the element of the array operand of the instruction 'in' whose
+ * 'nidx' indexes are on the stack, the first at s[sp - 'depth'].
+ */
+static void emit_elem(FILE *f, const union instruction *in, int nidx,
+	int depth)
+{
+	if (nidx == 1) {
+		fprintf(f, "r[%d + (int) s[sp - %d]]", in[2].id, depth);
+	} else {
+		fprintf(f, "r[%d + (int) s[sp - %d] * %d + (int) s[sp - %d]]",
+			in[2].id, depth, s_array_descs[in[1].id].dim2,
+			depth - 1);
+	}
+}
+
+/*
+ * Prints the test that the 'nidx' indexes of the array operand of the
+ * instruction 'in', the first at s[sp - 'depth'], are in range.
+ */
+static void emit_in_range(FILE *f, const union instruction *in, int nidx,
+	int depth)
+{
+	int i, base, dim;
+
+	base = get_parsed_base();
+	for (i = 0; i < nidx; i++) {
+		dim = i == 0 ? s_array_descs[in[1].id].dim1 :
+			s_array_descs[in[1].id].dim2;
+		fprintf(f, "%ss[sp - %d] >= %d && s[sp - %d] < %d",
+			i == 0 ? "" : " &&\n\t    ", depth - i, base,
+			depth - i, base + dim);
+	}
+}
+
+/*
+ * GET_LIST_INT_OP, GET_TABLE_INT_OP, LET_LIST_INT_OP or LET_TABLE_INT_OP at
+ * 'pc', that calls the virtual machine if an index is out of range.
+ */
+static void emit_int_elem(FILE *f, int pc, int next)
+{
+	const union instruction *in;
+	int nidx, is_let;
+
+	in = &code[pc];
+	nidx = in->opcode == GET_TABLE_INT_OP ||
+		in->opcode == LET_TABLE_INT_OP ? 2 : 1;
+	is_let = in->opcode == LET_LIST_INT_OP ||
+		in->opcode == LET_TABLE_INT_OP;
+	fputs("\tif (", f);
+	emit_in_range(f, in, nidx, nidx + is_let);
+	fputs(") {\n\t\t", f);
+	if (is_let) {
+		emit_elem(f, in, nidx, nidx + 1);
+		fprintf(f, " = s[sp - 1];\n\t\tsp -= %d;\n", nidx + 1);
+	} else {
+		fprintf(f, "s[sp - %d] = ", nidx);
+		emit_elem(f, in, nidx, nidx);
+		fputs(nidx == 2 ? ";\n\t\tsp--;\n" : ";\n", f);
+	}
+	fprintf(f, "\t} else {\n\t\tSLOW(%d, %d, %d);\n\t}\n", in->opcode,
+		pc, next);
+}
+
+static void emit_instr(FILE *f, int pc)
+{
+	const union instruction *in;
+	int next, cmp_pc;
+
+	in = &code[pc];
+	next = pc + get_instr_size(in);
+	switch (in->opcode) {
+	case PUSH_NUM_OP:
+		fputs("\ts[sp++] = ", f);
+		emit_num(f, in[1].num);
+		fputs(";\n", f);
+		break;
+	case GET_FN_VAR_OP:
+		fprintf(f, "\ts[sp++] = r[%d];\n", in[1].id);
+		break;
+	case ADD_OP:
+		fputs("\tsp--;\n\ts[sp - 1] += s[sp];\n", f);
+		break;
+	case SUB_OP:
+		fputs("\tsp--;\n\ts[sp - 1] -= s[sp];\n", f);
+		break;
+	case MUL_OP:
+		fputs("\td = s[sp - 2] * s[sp - 1];\n", f);
+		fputs("\tif (isfinite(d))\n\t\ts[--sp - 1] = d;\n", f);
+		fprintf(f, "\telse\n\t\tSLOW(%d, %d, %d);\n", in->opcode, pc,
+			next);
+		break;
+	case DIV_OP:
+		fputs("\tif (s[sp - 1] != 0.0) {\n", f);
+		fputs("\t\tsp--;\n\t\ts[sp - 1] /= s[sp];\n", f);
+		fprintf(f, "\t} else {\n\t\tSLOW(%d, %d, %d);\n\t}\n",
+			in->opcode, pc, next);
+		break;
+	case NEG_OP:
+		fputs("\ts[sp - 1] = -s[sp - 1];\n", f);
+		break;
+	case ADD_CONST_OP:
+		fputs("\ts[sp - 1] += ", f);
+		emit_num(f, in[1].num);
+		fputs(";\n", f);
+		break;
+	case IF_LESS_OP:
+	case IF_GREATER_OP:
+	case IF_LESS_EQ_OP:
+	case IF_GREATER_EQ_OP:
+	case IF_EQ_OP:
+	case IF_NOT_EQ_OP:
+		emit_check_break_to(f, pc, in[1].id);
+		fprintf(f, "\tsp -= 2;\n\tif (s[sp] %s s[sp + 1])\n",
+			compare_op(in->opcode));
+		fprintf(f, "\t\tgoto L%d;\n", in[1].id);
+		break;
+	case IF_LESS_VAR_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_EQ_VAR_OP:
+	case IF_NOT_EQ_VAR_OP:
+		emit_check_break_to(f, pc, in[2].id);
+		fprintf(f, "\tif (s[--sp] %s r[%d])\n\t\tgoto L%d;\n",
+			compare_op(in->opcode), in[1].id, in[2].id);
+		break;
+	case IF_LESS_CONST_OP:
+	case IF_GREATER_CONST_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case IF_EQ_CONST_OP:
+	case IF_NOT_EQ_CONST_OP:
+		emit_check_break_to(f, pc, in[2].id);
+		fprintf(f, "\tif (s[--sp] %s ", compare_op(in->opcode));
+		emit_num(f, in[1].num);
+		fprintf(f, ")\n\t\tgoto L%d;\n", in[2].id);
+		break;
+	case LINE_OP:
+		emit_check_break(f, pc);
+		break;
+	case GOTO_OP:
+		emit_check_break_to(f, pc, in[1].id);
+		fprintf(f, "\tgoto L%d;\n", in[1].id);
+		break;
+	case GOTO_IF_TRUE_OP:
+		emit_check_break_to(f, pc, in[1].id);
+		fprintf(f, "\tif (s[--sp] == 1.0)\n\t\tgoto L%d;\n", in[1].id);
+		break;
+	case FOR_CMP_OP:
+		fprintf(f, "\tif ((r[%d] - r[%d]) * sign(r[%d]) > 0.0)\n",
+			code[pc - 1].id, code[pc - 2].id, code[pc - 3].id);
+		fprintf(f, "\t\tgoto L%d;\n", in[1].id);
+		break;
+	case NEXT_OP:
+		cmp_pc = in[1].id;
+		emit_check_break(f, cmp_pc);
+		fprintf(f, "\tr[%d] += r[%d];\n", code[cmp_pc - 1].id,
+			code[cmp_pc - 3].id);
+		fprintf(f, "\tgoto L%d;\n", cmp_pc);
+		break;
+	case NEXT_INT_OP:
+		emit_check_break(f, in[1].id);
+		fprintf(f, "\tr[%d] += %d;\n", in[3].id, in[4].id);
+		fprintf(f, "\tif (!(r[%d] %c r[%d]))\n\t\tgoto L%d;\n", in[3].id,
+			in[4].id > 0 ? '>' : '<', in[2].id, in[1].id);
+		break;
+	case GET_LIST_UNCHECKED_OP:
+		fputs("\ts[sp - 1] = ", f);
+		emit_elem(f, in, 1, 1);
+		fputs(";\n", f);
+		break;
+	case GET_TABLE_UNCHECKED_OP:
+		fputs("\ts[sp - 2] = ", f);
+		emit_elem(f, in, 2, 2);
+		fputs(";\n\tsp--;\n", f);
+		break;
+	case LET_LIST_UNCHECKED_OP:
+		fputc('\t', f);
+		emit_elem(f, in, 1, 2);
+		fputs(" = s[sp - 1];\n\tsp -= 2;\n", f);
+		break;
+	case LET_TABLE_UNCHECKED_OP:
+		fputc('\t', f);
+		emit_elem(f, in, 2, 3);
+		fputs(" = s[sp - 1];\n\tsp -= 3;\n", f);
+		break;
+	case GET_LIST_INT_OP:
+	case GET_TABLE_INT_OP:
+	case LET_LIST_INT_OP:
+	case LET_TABLE_INT_OP:
+		emit_int_elem(f, pc, next);
+		break;
+	case END_OP:
+		fputs("\tgoto stop;\n", f);
+		break;
+	default:
+		if (emit_checked_instr(f, pc, next) != 0) {
+			fprintf(f, "\tSLOW(%d, %d, %d);\n", in->opcode, pc,
+				next);
+		}
+		break;
+	}
+}
+
+static void emit_program(FILE *f, const unsigned char *targets)
+{
+	int pc, size;
+
+	size = get_code_size();
+	fputs("\nstatic void program(const struct jit_vm *vm)\n{\n", f);
+	fputs("\tdouble *s, *r, d;\n\tint sp, i;\n\n", f);
+	fputs("\tfor (i = 0; i < NELEMS(s_funcs); i++)\n", f);
+	fputs("\t\ts_funcs[i] = get_opcode_func(i);\n", f);
+	fputs("\ts = vm->stack;\n\tr = vm->ram;\n\tsp = *vm->sp;\n", f);
+	fputs("\t(void) d;\n\tgoto dispatch;\n\n", f);
+
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (targets[pc]) {
+			fprintf(f, "L%d:\n", pc);
+		}
+		emit_instr(f, pc);
+	}
+
+	fputs("\nstop:\n\t*vm->sp = sp;\n\treturn;\n", f);
+	fputs("\ndispatch:\n\tswitch (*vm->pc) {\n", f);
+	for (pc = 0; pc < size; pc++) {
+		if (targets[pc]) {
+			fprintf(f, "\tcase %d: goto L%d;\n", pc, pc);
+		}
+	}
+	fputs("\tdefault: goto stop;\n\t}\n}\n", f);
+}
+
+static void emit_main(FILE *f, int ndata, int ramsize, int array_base_index,
+	int stack_size, int gosub_stack_size)
+{
+	fputs("\nint main(void)\n{\n", f);
+	fputs("\tstatic const struct aot_program prog = {\n", f);
+	fprintf(f, "\t\t.nops = %d,\n", VM_NOPS);
+	fputs("\t\t.code = s_code,\n", f);
+	fputs("\t\t.code_size = NELEMS(s_code),\n", f);
+	fputs("\t\t.strings = s_strings,\n", f);
+	fputs("\t\t.nstrings = NELEMS(s_strings),\n", f);
+	fputs("\t\t.data = s_data + 1,\n", f);
+	fprintf(f, "\t\t.ndata = %d,\n", ndata);
+	fputs("\t\t.arrays = s_arrays,\n", f);
+	fputs("\t\t.vars = s_vars + 1,\n", f);
+	fputs("\t\t.nvars = NELEMS(s_vars) - 1,\n", f);
+	fputs("\t\t.lines = s_lines + 1,\n", f);
+	fputs("\t\t.nlines = NELEMS(s_lines) - 1,\n", f);
+	fprintf(f, "\t\t.ram_size = %d,\n", ramsize);
+	fprintf(f, "\t\t.base = %d,\n", array_base_index);
+	fprintf(f, "\t\t.stack_size = %d,\n", stack_size);
+	fprintf(f, "\t\t.gosub_stack_size = %d,\n", gosub_stack_size);
+	fprintf(f, "\t\t.debug = %d,\n", s_debug_mode);
+	fputs("\t\t.program = program\n", f);
+	fputs("\t};\n\n\treturn aot_main(&prog);\n}\n", f);
+}
+
+/*
+ * Writes to 'f' the compiled program as a C file. The arguments are the
+ * ones that run() would take.
+ * Returns E_NO_MEM if there is not enough memory.
+ */
+enum error_code emit_c(FILE *f, int ramsize, int array_base_index,
+	int stack_size, int gosub_stack_size)
+{
+	unsigned char *targets;
+	int ndata;
+
+	if ((targets = find_jump_targets()) == NULL)
+		return E_NO_MEM;
+
+	emit_preamble(f);
+	emit_code(f);
+	emit_strings(f);
+	ndata = emit_data(f);
+	emit_arrays(f);
+	emit_vars(f);
+	emit_lines(f);
+	emit_program(f, targets);
+	emit_main(f, ndata, ramsize, array_base_index, stack_size,
+		gosub_stack_size);
+	free(targets);
+	return 0;
+}
@@ -0,0 +1,474 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Inlining of subroutines and size of the GOSUB stack. */
+
+#include <config.h>
+#include "ecma55.h"
+#include <stdlib.h>
+
+/*
+ * A GOSUB_OP to a subroutine that is only called from there, or that is
+ * small, is replaced by a copy of the subroutine where the RETURN_OPs are
+ * GOTO_OPs to the end of the copy. The subroutine stays where it was: it can
+ * have other calls, or be reached by a GOTO or by falling from the line
+ * before it.
+ *
+ * A subroutine goes from its first line to a RETURN_OP, and the jumps of the
+ * instructions in between must land in between. If it can go out in another
+ * way (a GOTO to another part of the program, the END), or if it is the body
+ * of a DEF FN, which is in line 0 and must find its caller in the GOSUB
+ * stack, it is not copied. A GOSUB_OP inside a copy is left as it is.
+ *
+ * A copy does not push its return point, so, if the GOSUB stack can
+ * overflow, the error would be given at another line. We don't copy anything
+ * when the depth of the stack has no limit (see below); else the stack is
+ * sized for the calls that are left, so it can't overflow.
+ *
+ * Then we find how many GOSUB_OPs can be waiting for their RETURN_OP while
+ * the program runs. For each instruction, we compute the maximum number of
+ * them there can be when it is executed: it is one more at the destination
+ * of a GOSUB_OP, and the same after it, where its RETURN_OP comes back. We
+ * start with 0 at the start of the program and propagate the maxima along the
+ * edges until nothing changes, as init.c does. A subroutine that can be
+ * called again before it returns (GOSUB 100 from line 100, or a loop made of
+ * GOSUBs) makes the depth grow without limit: then it grows over the number
+ * of GOSUB_OPs, and we give up. Else, the GOSUB stack is allocated with the
+ * maximum depth and the GOSUB_OPs are changed to GOSUB_UNCHECKED_OP, which
+ * doesn't check for overflow. The size set with SETGOSUB or --gosub is only
+ * used when we gave up.
+ */
+
+/* Max size of the body of a subroutine copied when it has several calls. */
+#define INLINE_SUB_SIZE	32
+
+/* The size of the code before inlining. */
+static int s_size;
+
+/* For each code position, the number of GOSUB_OPs that go there. */
+static int *s_ncalls;
+
+/*
+ * For each GOSUB_OP replaced by a copy, the end of the subroutine; else -1.
+ */
+static int *s_ends;
+
+/* For each code position (plus one), its new position. */
+static int *s_new_pcs;
+
+/* For each position of the subroutine being copied, its place in the copy. */
+static int *s_offs;
+
+/* The code with the copies. */
+static union instruction *s_new_code;
+
+/* For each code position (plus one), the maximum depth of the GOSUB stack. */
+static int *s_depths;
+
+/* If a depth changed in the last pass, and if it grew over the limit. */
+static int s_changed;
+static int s_overflow;
+
+/*
+ * Returns the end of the subroutine that starts at 'start', the position after
+ * its last RETURN_OP, or -1 if it cannot be copied or is longer than 'maxlen'.
+ */
+static int body_end(int start, int maxlen)
+{
+	int pc, i, n, jump, last, target;
+	enum vm_opcode opcode;
+
+	/* The last position where a jump from the body lands. */
+	last = start;
+	for (pc = start; pc < s_size && pc - start < maxlen;
+	     pc += get_instr_size(&code[pc]))
+	{
+		opcode = code[pc].opcode;
+		if (opcode == RETURN_OP && pc >= last)
+			return pc + 1;
+		if (opcode == END_OP)
+			return -1;
+
+		jump = get_opcode_jump_arg(opcode);
+		if (jump == 0 || opcode == GOSUB_OP)
+			continue;
+
+		n = 1;
+		if (opcode == ON_GOTO_OP) {
+			n = code[pc + 1].id;
+		}
+		for (i = 0; i < n; i++) {
+			target = code[pc + jump + i].id;
+			if (target < start)
+				return -1;
+			if (target > last)
+				last = target;
+		}
+	}
+
+	return -1;
+}
+
+/* Returns the end of the subroutine if we copy the GOSUB_OP at 'pc', or -1. */
+static int inlined_end(int pc)
+{
+	int start;
+
+	start = code[pc + 1].id;
+	if (is_usrfun_pc(start))
+		return -1;
+
+	if (s_ncalls[start] == 1)
+		return body_end(start, s_size);
+	else
+		return body_end(start, INLINE_SUB_SIZE);
+}
+
+/*
+ * Fills s_offs for the subroutine from 'start' to 'end'. Returns the size of
+ * the copy, where each RETURN_OP takes the two positions of a GOTO_OP.
+ */
+static int map_body(int start, int end)
+{
+	int pc, off;
+
+	off = 0;
+	for (pc = start; pc < end; pc += get_instr_size(&code[pc])) {
+		s_offs[pc] = off;
+		if (code[pc].opcode == RETURN_OP) {
+			off += 2;
+		} else {
+			off += get_instr_size(&code[pc]);
+		}
+	}
+
+	return off;
+}
+
+/*
+ * Copies the instruction at 'pc' to 'new_pc' in s_new_code. The jumps to the
+ * positions from 'start' to 'end' (not included) go to the copy at 'dest',
+ * except those of GOSUB_OP; the rest, to the new position of their
+ * destination.
+ */
+static void copy_instr(int pc, int new_pc, int start, int end, int dest)
+{
+	int i, n, jump, target;
+	union instruction *in;
+
+	n = get_instr_size(&code[pc]);
+	in = &s_new_code[new_pc];
+	for (i = 0; i < n; i++) {
+		in[i] = code[pc + i];
+	}
+
+	jump = get_opcode_jump_arg(in->opcode);
+	if (jump == 0)
+		return;
+
+	n = 1;
+	if (in->opcode == ON_GOTO_OP) {
+		n = in[1].id;
+	}
+	for (i = 0; i < n; i++) {
+		target = in[jump + i].id;
+		if (target >= start && target < end && in->opcode != GOSUB_OP) {
+			in[jump + i].id = dest + s_offs[target];
+		} else {
+			in[jump + i].id = s_new_pcs[target];
+		}
+	}
+}
+
+/* Copies the subroutine from 'start' to 'end' to 'dest' in s_new_code. */
+static void copy_body(int start, int end, int dest)
+{
+	int pc, size;
+
+	size = map_body(start, end);
+	for (pc = start; pc < end; pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode == RETURN_OP) {
+			s_new_code[dest + s_offs[pc]].opcode = GOTO_OP;
+			s_new_code[dest + s_offs[pc] + 1].id = dest + size;
+		} else {
+			copy_instr(pc, dest + s_offs[pc], start, end, dest);
+		}
+	}
+}
+
+/*
+ * Chooses the GOSUB_OPs to replace by a copy and fills s_ends and s_new_pcs.
+ * Returns the size of the new code, or 0 if there is nothing to copy.
+ */
+static int plan_copies(void)
+{
+	int pc, new_pc, end, ncopies;
+
+	for (pc = 0; pc < s_size; pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode == GOSUB_OP)
+			s_ncalls[code[pc + 1].id]++;
+	}
+
+	ncopies = 0;
+	new_pc = 0;
+	for (pc = 0; pc < s_size; pc += get_instr_size(&code[pc])) {
+		s_new_pcs[pc] = new_pc;
+		s_ends[pc] = -1;
+		if (code[pc].opcode == GOSUB_OP && (end = inlined_end(pc)) >= 0)
+		{
+			s_ends[pc] = end;
+			new_pc += map_body(code[pc + 1].id, end);
+			ncopies++;
+		} else {
+			new_pc += get_instr_size(&code[pc]);
+		}
+	}
+	s_new_pcs[s_size] = new_pc;
+
+	return ncopies > 0 ? new_pc : 0;
+}
+
+/* The line of 'pc' in the table of 'n' lines at 'pcs' and 'line_nums'. */
+static int line_at(int pc, const int *pcs, const int *line_nums, int n)
+{
+	int i;
+
+	for (i = 0; i < n - 1 && pcs[i + 1] <= pc; i++)
+		;
+	return n > 0 ? line_nums[i] : 0;
+}
+
+/*
+ * Makes the line table for the new code, where the lines of each subroutine
+ * are also at its copies, and after the copy we are back in the line of the
+ * call.
+ * Returns E_NO_MEM if not enough memory, and then the table is not changed.
+ */
+static enum error_code copy_lines(void)
+{
+	int i, j, n, pc, start, end, dest;
+	int *pcs, *line_nums;
+	enum error_code ecode;
+
+	n = get_line_start_count();
+	pcs = malloc((n + 1) * sizeof *pcs);
+	line_nums = malloc((n + 1) * sizeof *line_nums);
+	if (pcs == NULL || line_nums == NULL) {
+		ecode = E_NO_MEM;
+		goto end;
+	}
+
+	for (i = 0; i < n; i++) {
+		get_line_start(i, &pcs[i], &line_nums[i]);
+	}
+
+	/* Count the lines of the new table. */
+	j = n;
+	for (pc = 0; pc < s_size; pc += get_instr_size(&code[pc])) {
+		if (s_ends[pc] < 0)
+			continue;
+		start = code[pc + 1].id;
+		for (i = 0; i < n; i++) {
+			if (pcs[i] > start && pcs[i] < s_ends[pc])
+				j++;
+		}
+		j += 2;
+	}
+
+	if ((ecode = reset_line_starts(j)) != 0)
+		goto end;
+
+	/*
+	 * In order of position. If two lines start at the same one, the
+	 * last one added is kept: the start of a copy replaces the line of
+	 * the GOSUB_OP, and the line after it replaces its line at the end of
+	 * the copy.
+	 */
+	i = 0;
+	for (pc = 0; pc < s_size; pc += get_instr_size(&code[pc])) {
+		if (s_ends[pc] < 0)
+			continue;
+		for (; i < n && pcs[i] <= pc; i++) {
+			add_line_start(s_new_pcs[pcs[i]], line_nums[i]);
+		}
+
+		start = code[pc + 1].id;
+		end = s_ends[pc];
+		dest = s_new_pcs[pc];
+		map_body(start, end);
+		add_line_start(dest, line_at(start, pcs, line_nums, n));
+		for (j = 0; j < n; j++) {
+			if (pcs[j] > start && pcs[j] < end) {
+				add_line_start(dest + s_offs[pcs[j]],
+					line_nums[j]);
+			}
+		}
+		add_line_start(s_new_pcs[pc + 2],
+			line_at(pc, pcs, line_nums, n));
+	}
+	for (; i < n; i++) {
+		add_line_start(s_new_pcs[pcs[i]], line_nums[i]);
+	}
+
+end:	free(pcs);
+	free(line_nums);
+	return ecode;
+}
+
+/*
+ * Replaces the GOSUB_OPs to subroutines called from one place, or small, by
+ * a copy of the subroutine.
+ * If the depth of the GOSUB stack has no limit, or there is not enough
+ * memory, the code is left as it is.
+ */
+void inline_gosubs(void)
+{
+	int pc, new_size;
+
+	if (gosub_stack_depth() < 0)
+		return;
+
+	s_size = get_code_size();
+	s_new_code = NULL;
+	s_ncalls = calloc(s_size + 1, sizeof *s_ncalls);
+	s_ends = malloc((s_size + 1) * sizeof *s_ends);
+	s_new_pcs = malloc((s_size + 1) * sizeof *s_new_pcs);
+	s_offs = malloc((s_size + 1) * sizeof *s_offs);
+	if (s_ncalls == NULL || s_ends == NULL || s_new_pcs == NULL ||
+	    s_offs == NULL)
+	{
+		goto end;
+	}
+
+	if ((new_size = plan_copies()) == 0)
+		goto end;
+
+	if ((s_new_code = malloc(new_size * sizeof *s_new_code)) == NULL)
+		goto end;
+
+	for (pc = 0; pc < s_size; pc += get_instr_size(&code[pc])) {
+		if (s_ends[pc] >= 0) {
+			copy_body(code[pc + 1].id, s_ends[pc], s_new_pcs[pc]);
+		} else {
+			copy_instr(pc, s_new_pcs[pc], 0, 0, 0);
+		}
+	}
+
+	if (copy_lines() != 0)
+		goto end;
+
+	replace_code(s_new_code, new_size);
+	s_new_code = NULL;
+
+end:	free(s_ncalls);
+	free(s_ends);
+	free(s_new_pcs);
+	free(s_offs);
+	free(s_new_code);
+}
+
+/* The maximum depth at 'pc' is at least 'depth'. */
+static void raise_depth(int pc, int depth, int limit)
+{
+	if (depth > s_depths[pc]) {
+		s_depths[pc] = depth;
+		s_changed = 1;
+		if (depth > limit)
+			s_overflow = 1;
+	}
+}
+
+/* Propagates the depth at 'pc' to the instructions that can follow it. */
+static void visit(int pc, int limit)
+{
+	int i, n, jump, depth;
+	enum vm_opcode opcode;
+
+	depth = s_depths[pc];
+	opcode = code[pc].opcode;
+	jump = get_opcode_jump_arg(opcode);
+	if (opcode == ON_GOTO_OP) {
+		n = code[pc + 1].id;
+		for (i = 0; i < n; i++) {
+			raise_depth(code[pc + jump + i].id, depth, limit);
+		}
+	} else if (opcode == GOSUB_OP) {
+		raise_depth(code[pc + jump].id, depth + 1, limit);
+	} else if (jump != 0) {
+		raise_depth(code[pc + jump].id, depth, limit);
+	}
+
+	switch (opcode) {
+	case GOTO_OP:
+	case RETURN_OP:
+	case END_OP:
+		break;
+	default:
+		raise_depth(pc + get_instr_size(&code[pc]), depth, limit);
+		break;
+	}
+}
+
+/*
+ * Returns the maximum number of GOSUB_OPs that can be waiting for their
+ * RETURN_OP while the program runs, or -1 if it has no limit or there is not
+ * enough memory.
+ */
+int gosub_stack_depth(void)
+{
+	int size, pc, ngosubs, depth;
+
+	size = get_code_size();
+	if ((s_depths = malloc((size + 1) * sizeof *s_depths)) == NULL)
+		return -1;
+
+	ngosubs = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode == GOSUB_OP)
+			ngosubs++;
+	}
+
+	for (pc = 0; pc <= size; pc++) {
+		s_depths[pc] = -1;
+	}
+	s_depths[0] = 0;
+	s_overflow = 0;
+	do {
+		s_changed = 0;
+		for (pc = 0; pc < size && !s_overflow;
+		     pc += get_instr_size(&code[pc]))
+		{
+			if (s_depths[pc] >= 0)
+				visit(pc, ngosubs);
+		}
+	} while (s_changed && !s_overflow);
+
+	depth = 0;
+	for (pc = 0; pc < size && !s_overflow;
+	     pc += get_instr_size(&code[pc]))
+	{
+		if (code[pc].opcode == GOSUB_OP && s_depths[pc] >= depth)
+			depth = s_depths[pc] + 1;
+	}
+
+	free(s_depths);
+	return s_overflow ? -1 : depth;
+}
+
+/*
+ * Changes the GOSUB_OPs to GOSUB_UNCHECKED_OP. Call it when the GOSUB stack
+ * has the size given by gosub_stack_depth().
+ */
+void remove_gosub_checks(void)
+{
+	int size, pc;
+
+	size = get_code_size();
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode == GOSUB_OP)
+			code[pc].opcode = GOSUB_UNCHECKED_OP;
+	}
+}
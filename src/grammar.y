@@ -138,7 +138,6 @@ if_stmnt:
 	IF expr rel expr THEN INT
 		{
 			boolean_expr($2, $3, $4);
-			add_op_instr(GOTO_IF_TRUE_OP);
 			add_line_ref($6.column, $6.u.num.i);
 		}
 	;
@@ -146,18 +145,21 @@ if_stmnt:
 str_expr:
 	STR
 		{
+			$$.pc = get_code_size();
 			add_op_instr(PUSH_STR_OP);
 			add_id_instr(str_decl($1.u.str.start, $1.u.str.len));	
 			$$.type = PSTACK_STR;
 		}
 	| QUOTED_STR
 		{
+			$$.pc = get_code_size();
 			add_op_instr(PUSH_STR_OP);
 			add_id_instr(str_decl($1.u.str.start, $1.u.str.len));	
 			$$.type = PSTACK_STR;
 		}
 	| STRVAR
 		{
+			$$.pc = get_code_size();
 			strvar_decl($1.u.i);
 			add_op_instr(GET_STRVAR_OP);
 			add_id_instr(get_rampos($1.u.i));
@@ -183,19 +185,21 @@ for_stmnt:
 		{
 			check_type($4, PSTACK_NUM);
 			check_type($6, PSTACK_NUM);
-			for_decl($2.column, $2.u.i);
+			for_decl($2.column, $2.u.i, $4, $6, $7);
 		}
 	;
 	
 step:
 	/* empty */		
 		{
+			$$.pc = get_code_size();
 			add_op_instr(PUSH_NUM_OP);
 			add_num_instr(1.0);
 		}
 	| STEP expr
 		{
 			check_type($2, PSTACK_NUM);
+			$$.pc = $2.pc;
 		}
 					
 	;
@@ -478,8 +482,8 @@ let_stmnt:
 			check_type($4, PSTACK_NUM);
 			check_type($7, PSTACK_NUM);
 			numvar_declared($2.column, $2.u.i, VARTYPE_LIST);
-			add_op_instr(LET_LIST_OP);
-			add_id_instr(var_index1($2.u.i));
+			array_elem_instr($2.column, LET_LIST_OP, 1, $2.u.i,
+					 $4, $4, $7.pc);
 		}
 	| LET NUMVAR '(' expr ',' expr ')' '=' expr
 		{
@@ -487,8 +491,8 @@ let_stmnt:
 			check_type($6, PSTACK_NUM);
 			check_type($9, PSTACK_NUM);
 			numvar_declared($2.column, $2.u.i, VARTYPE_TABLE);
-			add_op_instr(LET_TABLE_OP);
-			add_id_instr(var_index1($2.u.i));
+			array_elem_instr($2.column, LET_TABLE_OP, 2, $2.u.i,
+					 $4, $6, $9.pc);
 		}
 	;
 	
@@ -499,36 +503,42 @@ expr:
 		}
 	| INT						
 		{
+			$$.pc = get_code_size();
 			add_op_instr(PUSH_NUM_OP);
 			add_num_instr($1.u.num.d);
 			$$.type = PSTACK_NUM;
 		}
 	| NUM
 		{
+			$$.pc = get_code_size();
 			add_op_instr(PUSH_NUM_OP);
 			add_num_instr($1.u.num.d);
 			$$.type = PSTACK_NUM;
 		}
 	| NUMVAR
 		{
+			$$.pc = get_code_size();
 			numvar_expr($1.column, $1.u.i);
 			$$.type = PSTACK_NUM;
 		}
 	| NUMVAR '(' expr ')'
 		{
 			check_type($3, PSTACK_NUM);
-			list_expr($1.column, $1.u.i);
+			list_expr($1.column, $1.u.i, $3);
+			$$.pc = $3.pc;
 			$$.type = PSTACK_NUM;
 		}
 	| NUMVAR '(' expr ',' expr ')'
 		{
 			check_type($3, PSTACK_NUM);
 			check_type($5, PSTACK_NUM);
-			table_expr($1.column, $1.u.i);
+			table_expr($1.column, $1.u.i, $3, $5);
+			$$.pc = $3.pc;
 			$$.type = PSTACK_NUM;
 		}
 	| USRFN
 		{
+			$$.pc = get_code_size();
 			usrfun_call($1.column, $1.u.i, 0);
 			$$.type = PSTACK_NUM;
 		}
@@ -536,17 +546,20 @@ expr:
 		{
 			check_type($3, PSTACK_NUM);
 			usrfun_call($1.column, $1.u.i, 1);
+			$$.pc = $3.pc;
 			$$.type = PSTACK_NUM;
 		}
 	| IFUN
 		{
-			ifun_call($1.column, $1.u.i, 0);
+			$$.pc = get_code_size();
+			ifun_call($1.column, $1.u.i, 0, $1);
 			$$.type = PSTACK_NUM;
 		}
 	| IFUN '(' expr ')'
 		{
 			check_type($3, PSTACK_NUM);
-			ifun_call($1.column, $1.u.i, 1);
+			ifun_call($1.column, $1.u.i, 1, $3);
+			$$.pc = $3.pc;
 			$$.type = PSTACK_NUM;
 		}
 	| expr '+' expr		{ $$.type = binary_expr($1, $3, ADD_OP); }
@@ -556,12 +569,13 @@ expr:
 	| '-' expr %prec NEG
 		{
 			check_type($2, PSTACK_NUM);
-			add_op_instr(NEG_OP);
+			neg_expr($2);
+			$$.pc = $2.pc;
 			$$.type = PSTACK_NUM;
 		}
-	| '+' expr %prec NEG	{ $$.type = $2.type; }
+	| '+' expr %prec NEG	{ $$.pc = $2.pc; $$.type = $2.type; }
 	| expr '^' expr		{ $$.type = binary_expr($1, $3, POW_OP); }
-	| '(' expr ')'		{ $$.type = $2.type; }
+	| '(' expr ')'		{ $$.pc = $2.pc; $$.type = $2.type; }
 	;
 
 %%
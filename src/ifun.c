@@ -169,6 +169,40 @@ const char *get_ifun_name(int i)
 	return s_ifuns[i].name;
 }
 
+/*
+ * Returns 1 if the function 'i' gives a number without fractional part, when
+ * its argument has none if 'int_arg' is 1.
+ */
+int is_ifun_int(int i, int int_arg)
+{
+	switch (s_ifuns[i].code) {
+	case INT:
+	case SGN:
+		return 1;
+	case ABS:
+		return int_arg;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns 1 if the function 'i' never gives an error or a warning, and gives
+ * always the same number for the same argument.
+ */
+int is_ifun_quiet(int i)
+{
+	switch (s_ifuns[i].code) {
+	case ABS:
+	case ATN:
+	case INT:
+	case SGN:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 double call_ifun0(int i)
 {
 	int ti;
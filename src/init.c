@@ -0,0 +1,253 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Removal of the checks of variables not initialized, in debug mode. */
+
+#include <config.h>
+#include "ecma55.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * In debug mode, GET_VAR_DEBUG_OP and GET_STRVAR_DEBUG_OP warn if the
+ * variable was not assigned. Where we can prove that it always was, we
+ * compile them back to GET_VAR_OP and GET_STRVAR_OP, which don't look at
+ * the bitmap of dbg.c, and can be fused into superinstructions and have a
+ * template in the native code.
+ *
+ * This is a dataflow analysis over the instructions: for each one, the set
+ * of scalar variables that are assigned in every path from the start of the
+ * program to it. The sets start full and we intersect them along the edges
+ * until nothing changes.
+ *
+ * The edges are the fall through to the next instruction, except after
+ * GOTO_OP, GOSUB_OP, RETURN_OP and END_OP, and the jump operands of the
+ * instructions (all the list of ON_GOTO_OP). GOSUB_OP goes to the
+ * subroutine (or to the DEF FN), and we don't track which RETURN_OP goes back
+ * to which GOSUB_OP: after a GOSUB_OP the variables assigned are those that
+ * were before it, plus those that are assigned at every RETURN_OP of the
+ * program.
+ *
+ * The arrays keep their checks: we don't know which element an index
+ * selects. The warnings are the same, as we only remove a check where the
+ * variable is always assigned and would never warn.
+ */
+
+/* Number of scalar variables and bytes for a set of them. */
+static int s_nvars;
+static int s_nbytes;
+
+/* Index of the scalar variable at each ram position, or -1. */
+static int *s_var_index;
+
+/* For each code position, the set of variables assigned before it. */
+static unsigned char *s_sets;
+
+/* Variables assigned at every RETURN_OP. */
+static unsigned char *s_ret_set;
+
+/* Set of variables after the instruction being visited. */
+static unsigned char *s_out;
+
+/* If any set changed in the last pass. */
+static int s_changed;
+
+/*
+ * Returns the position of the operand with the scalar variable assigned by
+ * the instruction at 'pc', or 0 if it doesn't assign one.
+ */
+static int assigned_var_arg(int pc)
+{
+	switch (code[pc].opcode) {
+	case LET_VAR_DEBUG_OP:
+	case LET_STRVAR_DEBUG_OP:
+	case READ_VAR_DEBUG_OP:
+	case READ_STRVAR_DEBUG_OP:
+		return 1;
+	case FOR_INT_DEBUG_OP:
+		return 2;
+	case FOR_DEBUG_OP:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+/* Returns 1 if the instruction at 'pc' reads a scalar variable. */
+static int is_checked_read(int pc)
+{
+	return code[pc].opcode == GET_VAR_DEBUG_OP ||
+		code[pc].opcode == GET_STRVAR_DEBUG_OP;
+}
+
+/*
+ * Numbers the scalar variables that are assigned or read with a check.
+ * Returns E_NO_MEM if no memory.
+ */
+static enum error_code index_vars(int size)
+{
+	int pc, arg, maxpos, rampos;
+
+	maxpos = -1;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if ((arg = assigned_var_arg(pc)) == 0 && is_checked_read(pc))
+			arg = 1;
+		if (arg != 0 && code[pc + arg].id > maxpos)
+			maxpos = code[pc + arg].id;
+	}
+
+	if ((s_var_index = malloc((maxpos + 1) * sizeof *s_var_index)) == NULL)
+		return E_NO_MEM;
+
+	for (rampos = 0; rampos <= maxpos; rampos++) {
+		s_var_index[rampos] = -1;
+	}
+
+	s_nvars = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if ((arg = assigned_var_arg(pc)) == 0 && is_checked_read(pc))
+			arg = 1;
+		if (arg != 0 && s_var_index[code[pc + arg].id] < 0)
+			s_var_index[code[pc + arg].id] = s_nvars++;
+	}
+
+	return 0;
+}
+
+static int has_var(const unsigned char *set, int rampos)
+{
+	int i;
+
+	i = s_var_index[rampos];
+	return (set[i / 8] >> (i % 8)) & 1;
+}
+
+static void add_var(unsigned char *set, int rampos)
+{
+	int i;
+
+	i = s_var_index[rampos];
+	set[i / 8] |= 1 << (i % 8);
+}
+
+/* Intersects 'set' with 'other'. */
+static void meet(unsigned char *set, const unsigned char *other)
+{
+	int i;
+	unsigned char b;
+
+	for (i = 0; i < s_nbytes; i++) {
+		b = set[i] & other[i];
+		if (b != set[i]) {
+			set[i] = b;
+			s_changed = 1;
+		}
+	}
+}
+
+static unsigned char *set_at(int pc)
+{
+	return &s_sets[(size_t) pc * s_nbytes];
+}
+
+/* Propagates s_out, the set after the instruction at 'pc', to the next. */
+static void visit(int pc)
+{
+	int i, n, jump, next, arg;
+	enum vm_opcode opcode;
+	unsigned char b;
+
+	memcpy(s_out, set_at(pc), s_nbytes);
+	if ((arg = assigned_var_arg(pc)) != 0) {
+		add_var(s_out, code[pc + arg].id);
+	}
+
+	opcode = code[pc].opcode;
+	next = pc + get_instr_size(&code[pc]);
+	jump = get_opcode_jump_arg(opcode);
+	if (opcode == ON_GOTO_OP) {
+		n = code[pc + 1].id;
+		for (i = 0; i < n; i++) {
+			meet(set_at(code[pc + jump + i].id), s_out);
+		}
+	} else if (jump != 0) {
+		meet(set_at(code[pc + jump].id), s_out);
+	}
+
+	switch (opcode) {
+	case GOTO_OP:
+	case END_OP:
+		break;
+	case RETURN_OP:
+		meet(s_ret_set, s_out);
+		break;
+	case GOSUB_OP:
+	case GOSUB_UNCHECKED_OP:
+		for (i = 0; i < s_nbytes; i++) {
+			b = set_at(next)[i] & (s_out[i] | s_ret_set[i]);
+			if (b != set_at(next)[i]) {
+				set_at(next)[i] = b;
+				s_changed = 1;
+			}
+		}
+		break;
+	default:
+		meet(set_at(next), s_out);
+		break;
+	}
+}
+
+/*
+ * Replaces GET_VAR_DEBUG_OP and GET_STRVAR_DEBUG_OP by GET_VAR_OP and
+ * GET_STRVAR_OP where the variable is always assigned.
+ * If there is not enough memory, the code is left as it is.
+ */
+void remove_init_checks(void)
+{
+	int size, pc;
+
+	if (!s_debug_mode)
+		return;
+
+	size = get_code_size();
+	s_sets = s_ret_set = s_out = NULL;
+	if (index_vars(size) != 0)
+		return;
+
+	if (s_nvars == 0)
+		goto end;
+
+	s_nbytes = (s_nvars + 7) / 8;
+	s_sets = malloc((size_t) (size + 1) * s_nbytes);
+	s_ret_set = malloc(s_nbytes);
+	s_out = malloc(s_nbytes);
+	if (s_sets == NULL || s_ret_set == NULL || s_out == NULL)
+		goto end;
+
+	memset(s_sets, 0xff, (size_t) (size + 1) * s_nbytes);
+	memset(s_sets, 0, s_nbytes);
+	memset(s_ret_set, 0xff, s_nbytes);
+	do {
+		s_changed = 0;
+		for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+			visit(pc);
+		}
+	} while (s_changed);
+
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (is_checked_read(pc) &&
+			has_var(set_at(pc), code[pc + 1].id))
+		{
+			code[pc].opcode = code[pc].opcode == GET_VAR_DEBUG_OP ?
+				GET_VAR_OP : GET_STRVAR_OP;
+		}
+	}
+
+end:	free(s_var_index);
+	free(s_sets);
+	free(s_ret_set);
+	free(s_out);
+}
@@ -0,0 +1,288 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Inference of the variables that only hold integers. */
+
+#include <config.h>
+#include "ecma55.h"
+#include "arraydsc.h"
+#include <stdlib.h>
+
+/*
+ * All the numbers are doubles. But many variables (counters, indexes, the
+ * variables of FOR loops with integer bounds) only ever hold integers, and
+ * some instructions have faster versions for integer operands:
+ *
+ *	GET_LIST_OP ...		GET_LIST_INT_OP, and the same for GET_TABLE_OP,
+ *				LET_LIST_OP and LET_TABLE_OP: if the indexes
+ *				are integers in range, the element is accessed
+ *				without rounding them, and jit.c and emitc.c
+ *				don't go to the virtual machine.
+ *	POW_OP			POW_INT_OP: an integer raised to a small
+ *				positive integer is computed by multiplying,
+ *				instead of with exp() and log().
+ *
+ * Here 'integer' means a number without fractional part, that is, an
+ * integer, an infinity or a NaN: adding, subtracting and multiplying
+ * integers gives an integer, but it can overflow. So the integer versions
+ * of the instructions still check the value of their operands at run time,
+ * and do what the normal version would if it is not what they expect.
+ *
+ * A variable is an integer if every instruction that assigns it assigns an
+ * integer expression. We start supposing that all are, and remove those
+ * that have an assignment that is not until nothing changes. The expression
+ * of an assignment is found going back from it, for the instructions that
+ * can be in an expression; if there is another one (a call to a DEF FN, an
+ * INPUT), it is not an integer. The elements of the arrays are never
+ * integers, as we don't know which element an index selects.
+ *
+ * This runs on the stack code generated by the parser, before reg.c and
+ * opt.c.
+ */
+
+/* The code position of each instruction, and their number. */
+static int *s_pcs;
+static int s_ninstrs;
+
+/* For each ram position, if it is a variable that is an integer. */
+static unsigned char *s_int_vars;
+
+/* If a variable stopped being an integer in the last pass. */
+static int s_changed;
+
+static int is_int_num(double d)
+{
+	return d == m_floor(d);
+}
+
+/*
+ * Finds the expression that ends with the instruction 'i' (an index in
+ * s_pcs). Returns the index of its first instruction, or -1 if it has
+ * instructions we don't follow. Puts in 'is_int' if it is an integer.
+ */
+static int expr_start(int i, int *is_int)
+{
+	int j, a, b;
+	const union instruction *in;
+
+	*is_int = 0;
+	if (i < 0)
+		return -1;
+
+	in = &code[s_pcs[i]];
+	switch (in->opcode) {
+	case PUSH_NUM_OP:
+		*is_int = is_int_num(in[1].num);
+		return i;
+	case GET_VAR_OP:
+	case GET_VAR_DEBUG_OP:
+		*is_int = s_int_vars[in[1].id];
+		return i;
+	case GET_FN_VAR_OP:
+	case IFUN0_OP:
+		return i;
+	case NEG_OP:
+		return expr_start(i - 1, is_int);
+	case IFUN1_OP:
+		j = expr_start(i - 1, &a);
+		*is_int = is_ifun_int(in[1].id, a);
+		return j;
+	case GET_LIST_OP:
+	case GET_LIST_INT_OP:
+	case GET_LIST_UNCHECKED_OP:
+	case GET_LIST_DEBUG_OP:
+		return expr_start(i - 1, &a);
+	case GET_TABLE_OP:
+	case GET_TABLE_INT_OP:
+	case GET_TABLE_UNCHECKED_OP:
+	case GET_TABLE_DEBUG_OP:
+		j = expr_start(i - 1, &b);
+		return expr_start(j - 1, &a);
+	case ADD_OP:
+	case SUB_OP:
+	case MUL_OP:
+	case DIV_OP:
+	case POW_OP:
+	case POW_INT_OP:
+		j = expr_start(i - 1, &b);
+		if (j < 0)
+			return -1;
+		if (in->opcode == POW_OP || in->opcode == POW_INT_OP) {
+			/* bm_pow() rounds integer ^ positive integer */
+			b = b && j == i - 1 && code[s_pcs[j]].opcode ==
+				PUSH_NUM_OP && code[s_pcs[j] + 1].num >= 0;
+		} else if (in->opcode == DIV_OP) {
+			b = 0;
+		}
+		j = expr_start(j - 1, &a);
+		*is_int = a && b;
+		return j;
+	default:
+		return -1;
+	}
+}
+
+/* If the expression that ends with the instruction 'i' is an integer. */
+static int is_int_expr(int i)
+{
+	int is_int;
+
+	return expr_start(i, &is_int) >= 0 && is_int;
+}
+
+/*
+ * Going back from the instruction 'i', skips 'nskip' expressions and returns
+ * 1 if the 'n' before them are integers.
+ */
+static int are_int_exprs(int i, int nskip, int n)
+{
+	int is_int;
+
+	for (; nskip > 0; nskip--) {
+		if ((i = expr_start(i, &is_int)) < 0)
+			return 0;
+		i--;
+	}
+
+	for (; n > 0; n--) {
+		if ((i = expr_start(i, &is_int)) < 0 || !is_int)
+			return 0;
+		i--;
+	}
+
+	return 1;
+}
+
+/*
+ * If the instruction 'i' assigns a variable, returns its ram position and
+ * puts in 'is_int' if the value is an integer. Else, returns -1.
+ */
+static int assigned_var(int i, int *is_int)
+{
+	int j;
+	const union instruction *in;
+
+	in = &code[s_pcs[i]];
+	switch (in->opcode) {
+	case LET_VAR_OP:
+	case LET_VAR_DEBUG_OP:
+		*is_int = is_int_expr(i - 1);
+		return in[1].id;
+	case READ_VAR_OP:
+	case READ_VAR_DEBUG_OP:
+		*is_int = 0;
+		return in[1].id;
+	case FOR_OP:
+	case FOR_DEBUG_OP:
+		/* start, limit, step */
+		*is_int = 0;
+		if ((j = expr_start(i - 1, is_int)) >= 0 && *is_int &&
+		    (j = expr_start(j - 1, is_int)) >= 0)
+		{
+			*is_int = is_int_expr(j - 1);
+		}
+		return in[3].id;
+	case FOR_INT_OP:
+	case FOR_INT_DEBUG_OP:
+		/* start, limit; the step is an integer constant */
+		*is_int = 0;
+		if ((j = expr_start(i - 1, is_int)) >= 0)
+			*is_int = is_int_expr(j - 1);
+		return in[2].id;
+	default:
+		return -1;
+	}
+}
+
+/* Removes the variables assigned something that is not an integer. */
+static void visit(int i)
+{
+	int rampos, is_int;
+
+	if ((rampos = assigned_var(i, &is_int)) >= 0 && !is_int &&
+	    s_int_vars[rampos])
+	{
+		s_int_vars[rampos] = 0;
+		s_changed = 1;
+	}
+}
+
+/* The integer version of the instruction 'i', or the same opcode. */
+static enum vm_opcode int_opcode(int i)
+{
+	switch (code[s_pcs[i]].opcode) {
+	case GET_LIST_OP:
+		return is_int_expr(i - 1) ? GET_LIST_INT_OP : GET_LIST_OP;
+	case GET_TABLE_OP:
+		return are_int_exprs(i - 1, 0, 2) ? GET_TABLE_INT_OP :
+			GET_TABLE_OP;
+	case LET_LIST_OP:
+		/* after the index, the value */
+		return are_int_exprs(i - 1, 1, 1) ? LET_LIST_INT_OP :
+			LET_LIST_OP;
+	case LET_TABLE_OP:
+		return are_int_exprs(i - 1, 1, 2) ? LET_TABLE_INT_OP :
+			LET_TABLE_OP;
+	case POW_OP:
+		return are_int_exprs(i - 1, 0, 2) ? POW_INT_OP : POW_OP;
+	default:
+		return code[s_pcs[i]].opcode;
+	}
+}
+
+/* Marks the ram positions of the variables that can be integers. */
+static void init_int_vars(int ramsize)
+{
+	int i, j, n;
+
+	for (i = 0; i < ramsize; i++) {
+		s_int_vars[i] = 1;
+	}
+
+	for (i = 0; i < N_VARNAMES; i++) {
+		n = s_array_descs[i].dim1 * s_array_descs[i].dim2;
+		for (j = 0; j < n; j++) {
+			s_int_vars[s_array_descs[i].rampos + j] = 0;
+		}
+	}
+}
+
+/*
+ * Finds the variables that only hold integers and changes the instructions
+ * that use them to their integer versions.
+ * If there is not enough memory, the code is left as it is.
+ */
+void use_int_vars(void)
+{
+	int size, pc, i, ramsize;
+
+	size = get_code_size();
+	ramsize = get_parsed_ram_size();
+	s_pcs = malloc((size + 1) * sizeof *s_pcs);
+	s_int_vars = malloc(ramsize + 1);
+	if (s_pcs == NULL || s_int_vars == NULL)
+		goto end;
+
+	s_ninstrs = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		s_pcs[s_ninstrs++] = pc;
+	}
+
+	init_int_vars(ramsize);
+	do {
+		s_changed = 0;
+		for (i = 0; i < s_ninstrs; i++) {
+			visit(i);
+		}
+	} while (s_changed);
+
+	for (i = 0; i < s_ninstrs; i++) {
+		code[s_pcs[i]].opcode = int_opcode(i);
+	}
+
+end:	free(s_pcs);
+	free(s_int_vars);
+}
@@ -0,0 +1,1204 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Intermediate representation: basic blocks and SSA values. */
+
+#include <config.h>
+#include "ecma55.h"
+#include "arraydsc.h"
+#include "ir.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The parser writes the stack code of each statement directly in code.c.
+ * For the optimizations that need to know how the values flow through the
+ * program, we build over that code:
+ *
+ * - The basic blocks. The code is split before each position where
+ *   execution can continue other than falling from the previous instruction
+ *   (see find_jump_targets(): the lines referenced by GOTO, GOSUB, ON GOTO
+ *   and IF, the return points of GOSUB, the FOR_CMP_OP where NEXT_OP goes
+ *   back, the end of the FOR loops, the INPUT_OP and the position after it),
+ *   and after each instruction that can jump or doesn't fall to the next one.
+ *
+ * - The control flow graph, with the edges of the jumps and of the falls to
+ *   the next instruction. GOSUB_OP has an edge to the subroutine and another
+ *   one to its return point, and RETURN_OP has none. The instructions of an
+ *   INPUT statement have an edge back to the INPUT_OP, where they go to ask
+ *   again if the input is wrong, and INPUT_END_OP another one to the position
+ *   after the INPUT_OP, where it goes to assign the values.
+ *
+ * - The dominator tree of the blocks reachable from the start (with the
+ *   iterative algorithm of Cooper, Harvey and Kennedy), and SSA values for the
+ *   scalar numeric variables that the program reads. Each assignment makes a
+ *   new value, and a phi merges the values at the start of the blocks in the
+ *   iterated dominance frontier of those with assignments. At the start of the
+ *   first block (which can be the target of a GOTO) and of the return points
+ *   of GOSUB, where the subroutine could have changed any variable, all the
+ *   variables have an unknown value, IR_ENTRY. The value of a variable at an
+ *   instruction is the nearest one that dominates it.
+ *
+ * The passes change the instructions of the blocks in place, and lower_ir()
+ * writes back the code of the reachable blocks in the same order, relocating
+ * the jumps and the line table. The blocks are never reordered: FOR_CMP_OP
+ * and NEXT_OP find the operands of the loop in the FOR_OP before them. The
+ * last block is always kept, as the END_OP where the errors stop the program.
+ *
+ * This runs on the stack code generated by the parser, after check_jumps()
+ * and the inlining of subroutines, and before intvar.c, reg.c and opt.c.
+ */
+
+/* A phi to place: the variable 'var' at the start of 'block'. */
+struct phi_place {
+	int block;
+	int var;
+};
+
+static struct phi_place *s_places;
+static int s_nplaces;
+static int s_places_capacity;
+
+static int s_no_mem;
+
+/* Returns 1 if after 'opcode' execution can go on at the next instruction. */
+static int falls_through(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case GOTO_OP:
+	case ON_GOTO_OP:
+	case RETURN_OP:
+	case END_OP:
+	case NEXT_OP:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* Returns 1 if the instruction 'opcode' is the last one of its block. */
+static int ends_block(enum vm_opcode opcode)
+{
+	return get_opcode_jump_arg(opcode) != 0 || !falls_through(opcode) ||
+		opcode == INPUT_END_OP;
+}
+
+/* Returns 1 if 'opcode' goes back to the INPUT_OP when the input is wrong. */
+static int is_input_retry(enum vm_opcode opcode)
+{
+	return opcode == INPUT_NUM_OP || opcode == INPUT_STR_OP ||
+		opcode == INPUT_END_OP;
+}
+
+static int is_gosub(enum vm_opcode opcode)
+{
+	return opcode == GOSUB_OP || opcode == GOSUB_UNCHECKED_OP;
+}
+
+/* Returns 1 if the instruction at 'pc' reads a scalar numeric variable. */
+static int is_var_read(int pc)
+{
+	switch (code[pc].opcode) {
+	case GET_VAR_OP:
+	case GET_VAR_DEBUG_OP:
+	case GET_FN_VAR_OP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Puts in 'rampos' the scalar numeric variables that the instruction at 'pc'
+ * assigns and returns how many.
+ */
+static int assigned_vars(int pc, int rampos[3])
+{
+	switch (code[pc].opcode) {
+	case LET_VAR_OP:
+	case LET_VAR_DEBUG_OP:
+	case READ_VAR_OP:
+	case READ_VAR_DEBUG_OP:
+		rampos[0] = code[pc + 1].id;
+		return 1;
+	case FOR_OP:
+	case FOR_DEBUG_OP:
+		/* step, limit, var */
+		rampos[0] = code[pc + 1].id;
+		rampos[1] = code[pc + 2].id;
+		rampos[2] = code[pc + 3].id;
+		return 3;
+	case FOR_INT_OP:
+	case FOR_INT_DEBUG_OP:
+		/* limit, var */
+		rampos[0] = code[pc + 1].id;
+		rampos[1] = code[pc + 2].id;
+		return 2;
+	case NEXT_OP:
+		/* the variable is before the FOR_CMP_OP it goes to */
+		rampos[0] = code[code[pc + 1].id - 1].id;
+		return 1;
+	case NEXT_INT_OP:
+		rampos[0] = code[pc + 3].id;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Splits the code in blocks. */
+static enum error_code split_blocks(struct ir *ir, int size)
+{
+	int pc, n, b;
+	unsigned char *starts;
+
+	if ((starts = find_jump_targets()) == NULL)
+		return E_NO_MEM;
+
+	n = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (ends_block(code[pc].opcode))
+			starts[pc + get_instr_size(&code[pc])] = 1;
+		if (starts[pc])
+			n++;
+	}
+
+	ir->block_of = malloc((size + 1) * sizeof *ir->block_of);
+	ir->blocks = calloc(n, sizeof *ir->blocks);
+	if (ir->block_of == NULL || ir->blocks == NULL) {
+		free(starts);
+		return E_NO_MEM;
+	}
+
+	for (pc = 0; pc <= size; pc++) {
+		ir->block_of[pc] = -1;
+	}
+
+	b = -1;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (starts[pc]) {
+			if (b >= 0)
+				ir->blocks[b].end = pc;
+			ir->blocks[++b].start = pc;
+		}
+		ir->blocks[b].last = pc;
+		ir->block_of[pc] = b;
+	}
+	ir->blocks[b].end = size;
+	ir->nblocks = n;
+
+	free(starts);
+	return 0;
+}
+
+/*
+ * Puts in 'to' the positions where execution can go after the block 'b',
+ * if 'to' is not NULL, and returns how many. '*input_pc' is the INPUT_OP
+ * of the last INPUT statement before the block.
+ */
+static int block_exits(const struct ir *ir, int b, int *input_pc, int *to)
+{
+	int pc, jump, i, n, nexits;
+	enum vm_opcode opcode;
+	const struct ir_block *blk;
+
+	blk = &ir->blocks[b];
+	for (pc = blk->start; pc < blk->end; pc += get_instr_size(&code[pc])) {
+		if (code[pc].opcode == INPUT_OP)
+			*input_pc = pc;
+	}
+
+	nexits = 0;
+	opcode = code[blk->last].opcode;
+	jump = get_opcode_jump_arg(opcode);
+	n = opcode == ON_GOTO_OP ? code[blk->last + 1].id : jump != 0;
+	for (i = 0; i < n; i++, nexits++) {
+		if (to != NULL)
+			to[nexits] = code[blk->last + jump + i].id;
+	}
+	if (falls_through(opcode)) {
+		if (to != NULL)
+			to[nexits] = blk->end;
+		nexits++;
+	}
+	if (is_input_retry(opcode) && *input_pc >= 0) {
+		if (to != NULL) {
+			to[nexits] = *input_pc;
+			if (opcode == INPUT_END_OP)
+				to[nexits + 1] = *input_pc + 1;
+		}
+		nexits += opcode == INPUT_END_OP ? 2 : 1;
+	}
+
+	return nexits;
+}
+
+/*
+ * Puts in 'list' the 'to' of the edges sorted by their 'from', and fills
+ * 'first_succ' and 'nsuccs' of the blocks if 'succs' is 1, or 'first_pred'
+ * and 'npreds' if it is 0.
+ */
+static void sort_edges(struct ir *ir, const int *from, const int *to,
+	int nedges, int *list, int succs)
+{
+	int b, i, *first, *count;
+	struct ir_block *blk;
+
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		first = succs ? &blk->first_succ : &blk->first_pred;
+		count = succs ? &blk->nsuccs : &blk->npreds;
+		*first = 0;
+		*count = 0;
+	}
+	for (i = 0; i < nedges; i++) {
+		blk = &ir->blocks[from[i]];
+		if (succs)
+			blk->nsuccs++;
+		else
+			blk->npreds++;
+	}
+
+	i = 0;
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		if (succs) {
+			blk->first_succ = i;
+			i += blk->nsuccs;
+			blk->nsuccs = 0;
+		} else {
+			blk->first_pred = i;
+			i += blk->npreds;
+			blk->npreds = 0;
+		}
+	}
+	for (i = 0; i < nedges; i++) {
+		blk = &ir->blocks[from[i]];
+		if (succs)
+			list[blk->first_succ + blk->nsuccs++] = to[i];
+		else
+			list[blk->first_pred + blk->npreds++] = to[i];
+	}
+}
+
+/* Makes the control flow graph. */
+static enum error_code link_blocks(struct ir *ir, int size)
+{
+	int b, i, n, pc, first, nedges, input_pc;
+	int *from, *to;
+	enum error_code ecode;
+
+	input_pc = -1;
+	nedges = 0;
+	for (b = 0; b < ir->nblocks; b++) {
+		nedges += block_exits(ir, b, &input_pc, NULL);
+	}
+
+	ecode = E_NO_MEM;
+	from = malloc((nedges + 1) * sizeof *from);
+	to = malloc((nedges + 1) * sizeof *to);
+	ir->succs = malloc((nedges + 1) * sizeof *ir->succs);
+	ir->preds = malloc((nedges + 1) * sizeof *ir->preds);
+	if (from == NULL || to == NULL || ir->succs == NULL ||
+		ir->preds == NULL)
+	{
+		goto end;
+	}
+
+	input_pc = -1;
+	nedges = 0;
+	for (b = 0; b < ir->nblocks; b++) {
+		first = nedges;
+		n = block_exits(ir, b, &input_pc, &to[first]);
+		for (i = 0; i < n; i++) {
+			pc = to[first + i];
+			if (pc >= size)
+				continue;
+			from[nedges] = b;
+			to[nedges] = ir->block_of[pc];
+			assert(to[nedges] >= 0);
+			nedges++;
+		}
+		if (is_gosub(code[ir->blocks[b].last].opcode) &&
+			ir->blocks[b].end < size)
+		{
+			ir->blocks[b + 1].clobbered = 1;
+		}
+	}
+
+	sort_edges(ir, from, to, nedges, ir->succs, 1);
+	sort_edges(ir, to, from, nedges, ir->preds, 0);
+	ecode = 0;
+
+end:	free(from);
+	free(to);
+	return ecode;
+}
+
+/* Finds the reachable blocks and puts them in reverse postorder. */
+static enum error_code order_blocks(struct ir *ir)
+{
+	int b, s, sp, post;
+	int *stack, *next;
+	struct ir_block *blk;
+
+	stack = malloc(ir->nblocks * sizeof *stack);
+	next = calloc(ir->nblocks, sizeof *next);
+	ir->rpo = malloc(ir->nblocks * sizeof *ir->rpo);
+	if (stack == NULL || next == NULL || ir->rpo == NULL) {
+		free(stack);
+		free(next);
+		return E_NO_MEM;
+	}
+
+	post = ir->nblocks;
+	sp = 0;
+	ir->blocks[0].reachable = 1;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		b = stack[sp - 1];
+		blk = &ir->blocks[b];
+		if (next[b] < blk->nsuccs) {
+			s = ir->succs[blk->first_succ + next[b]++];
+			if (!ir->blocks[s].reachable) {
+				ir->blocks[s].reachable = 1;
+				stack[sp++] = s;
+			}
+		} else {
+			sp--;
+			ir->rpo[--post] = b;
+		}
+	}
+
+	ir->nrpo = ir->nblocks - post;
+	memmove(ir->rpo, ir->rpo + post, ir->nrpo * sizeof *ir->rpo);
+	free(stack);
+	free(next);
+	return 0;
+}
+
+/* The nearest common dominator of 'a' and 'b'. */
+static int intersect(const struct ir *ir, const int *order, int a, int b)
+{
+	while (a != b) {
+		while (order[a] > order[b])
+			a = ir->blocks[a].idom;
+		while (order[b] > order[a])
+			b = ir->blocks[b].idom;
+	}
+
+	return a;
+}
+
+/* Finds the immediate dominator of each reachable block. */
+static enum error_code find_dominators(struct ir *ir)
+{
+	int i, j, b, p, idom, changed;
+	int *order;
+	struct ir_block *blk;
+
+	if ((order = malloc(ir->nblocks * sizeof *order)) == NULL)
+		return E_NO_MEM;
+
+	for (b = 0; b < ir->nblocks; b++) {
+		ir->blocks[b].idom = -1;
+	}
+	for (i = 0; i < ir->nrpo; i++) {
+		order[ir->rpo[i]] = i;
+	}
+
+	ir->blocks[0].idom = 0;
+	do {
+		changed = 0;
+		for (i = 1; i < ir->nrpo; i++) {
+			blk = &ir->blocks[ir->rpo[i]];
+			idom = -1;
+			for (j = 0; j < blk->npreds; j++) {
+				p = ir->preds[blk->first_pred + j];
+				if (ir->blocks[p].idom < 0)
+					continue;
+				idom = idom < 0 ? p : intersect(ir, order, p, idom);
+			}
+			if (idom != blk->idom) {
+				blk->idom = idom;
+				changed = 1;
+			}
+		}
+	} while (changed);
+	ir->blocks[0].idom = -1;
+
+	free(order);
+	return 0;
+}
+
+/* Returns 1 if the block 'a' dominates the block 'b'. */
+int ir_dominates(const struct ir *ir, int a, int b)
+{
+	for (; b >= 0; b = ir->blocks[b].idom) {
+		if (b == a)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Calls f(r, d) for each block r that has the block 'd' in its dominance
+ * frontier: those that dominate a predecessor of d and don't strictly
+ * dominate d. The same r can come several times.
+ */
+static void for_frontier(const struct ir *ir, int d, void (*f)(int, int))
+{
+	int i, r, idom;
+	const struct ir_block *blk;
+
+	blk = &ir->blocks[d];
+	if (blk->npreds < 2)
+		return;
+
+	idom = blk->idom;
+	for (i = 0; i < blk->npreds; i++) {
+		r = ir->preds[blk->first_pred + i];
+		if (!ir->blocks[r].reachable)
+			continue;
+		for (; r >= 0 && r != idom; r = ir->blocks[r].idom) {
+			f(r, d);
+		}
+	}
+}
+
+/* Dominance frontiers, 'frontier[first_df[b]]' ... for each block b. */
+static int *s_frontier;
+static int *s_first_df;
+static int *s_ndf;
+
+static void add_frontier(int r, int d)
+{
+	s_frontier[s_first_df[r] + s_ndf[r]++] = d;
+}
+
+static void count_frontier(int r, int d)
+{
+	s_ndf[r]++;
+}
+
+static enum error_code find_frontiers(const struct ir *ir)
+{
+	int i, n, b;
+
+	s_first_df = malloc((ir->nblocks + 1) * sizeof *s_first_df);
+	s_ndf = calloc(ir->nblocks + 1, sizeof *s_ndf);
+	if (s_first_df == NULL || s_ndf == NULL)
+		return E_NO_MEM;
+
+	for (i = 0; i < ir->nrpo; i++) {
+		for_frontier(ir, ir->rpo[i], count_frontier);
+	}
+
+	n = 0;
+	for (b = 0; b < ir->nblocks; b++) {
+		s_first_df[b] = n;
+		n += s_ndf[b];
+		s_ndf[b] = 0;
+	}
+
+	if ((s_frontier = malloc((n + 1) * sizeof *s_frontier)) == NULL)
+		return E_NO_MEM;
+
+	for (i = 0; i < ir->nrpo; i++) {
+		for_frontier(ir, ir->rpo[i], add_frontier);
+	}
+
+	return 0;
+}
+
+/*
+ * Numbers the variables that the program reads. The elements of the arrays
+ * are not variables, even if GET_VAR_OP reads those with constant indexes:
+ * the other instructions can assign them with any index.
+ */
+static enum error_code index_vars(struct ir *ir, int size)
+{
+	int i, j, n, pc, ramsize, rampos;
+
+	ramsize = get_parsed_ram_size();
+	ir->var_index = malloc((ramsize + 1) * sizeof *ir->var_index);
+	ir->vars = malloc((ramsize + 1) * sizeof *ir->vars);
+	if (ir->var_index == NULL || ir->vars == NULL)
+		return E_NO_MEM;
+
+	for (rampos = 0; rampos < ramsize; rampos++) {
+		ir->var_index[rampos] = -1;
+	}
+	for (i = 0; i < N_VARNAMES; i++) {
+		n = s_array_descs[i].dim1 * s_array_descs[i].dim2;
+		for (j = 0; j < n; j++) {
+			ir->var_index[s_array_descs[i].rampos + j] = -2;
+		}
+	}
+
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		rampos = code[pc + 1].id;
+		if (is_var_read(pc) && ir->var_index[rampos] == -1) {
+			ir->var_index[rampos] = ir->nvars;
+			ir->vars[ir->nvars++] = rampos;
+		}
+	}
+	for (rampos = 0; rampos < ramsize; rampos++) {
+		if (ir->var_index[rampos] == -2)
+			ir->var_index[rampos] = -1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if all the variables have an IR_ENTRY at the start of 'b'. */
+static int is_entry_block(const struct ir *ir, int b)
+{
+	return b == 0 || ir->blocks[b].clobbered;
+}
+
+/*
+ * Calls 'f' for each assignment of a variable that has SSA values in the
+ * reachable blocks, in order, with the position of the instruction before it
+ * in the block or -1.
+ */
+static void for_defs(struct ir *ir, void (*f)(struct ir *, int, int, int, int))
+{
+	int b, pc, prev, i, n, var, rampos[3];
+	const struct ir_block *blk;
+
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		if (!blk->reachable)
+			continue;
+		prev = -1;
+		for (pc = blk->start; pc < blk->end;
+			pc += get_instr_size(&code[pc]))
+		{
+			n = assigned_vars(pc, rampos);
+			for (i = 0; i < n; i++) {
+				var = ir->var_index[rampos[i]];
+				if (var >= 0)
+					f(ir, b, pc, prev, var);
+			}
+			prev = pc;
+		}
+	}
+}
+
+/* Blocks with assignments, 'def_blocks[first_def[v]]' ... for each var. */
+static int *s_def_blocks;
+static int *s_first_def;
+static int *s_ndefs;
+
+static void count_def(struct ir *ir, int b, int pc, int prev, int var)
+{
+	s_ndefs[var]++;
+}
+
+static void add_def_block(struct ir *ir, int b, int pc, int prev, int var)
+{
+	s_def_blocks[s_first_def[var] + s_ndefs[var]++] = b;
+}
+
+static void add_place(int b, int var)
+{
+	struct phi_place *new_places;
+	int new_len;
+
+	if (s_nplaces == s_places_capacity) {
+		grow_array((void *) s_places, (int) sizeof *s_places,
+			s_places_capacity, 256, (void **) &new_places,
+			&new_len);
+
+		if (s_places_capacity == new_len) {
+			s_no_mem = 1;
+			return;
+		}
+
+		s_places = new_places;
+		s_places_capacity = new_len;
+	}
+
+	s_places[s_nplaces].block = b;
+	s_places[s_nplaces].var = var;
+	s_nplaces++;
+}
+
+/*
+ * Finds where the phis of each variable go: the iterated dominance frontier
+ * of the blocks that assign it and of the entry blocks.
+ * Returns E_NO_MEM if not enough memory.
+ */
+static enum error_code place_phis(struct ir *ir)
+{
+	int i, n, b, d, v, sp, nentries, total;
+	int *stack, *has_phi, *pushed, *entries;
+	enum error_code ecode;
+
+	ecode = E_NO_MEM;
+	s_first_def = malloc((ir->nvars + 1) * sizeof *s_first_def);
+	s_ndefs = calloc(ir->nvars + 1, sizeof *s_ndefs);
+	stack = malloc((ir->nblocks + 1) * sizeof *stack);
+	has_phi = calloc(ir->nblocks + 1, sizeof *has_phi);
+	pushed = calloc(ir->nblocks + 1, sizeof *pushed);
+	entries = malloc((ir->nblocks + 1) * sizeof *entries);
+	if (s_first_def == NULL || s_ndefs == NULL || stack == NULL ||
+		has_phi == NULL || pushed == NULL || entries == NULL)
+	{
+		goto end;
+	}
+
+	for_defs(ir, count_def);
+	total = 0;
+	for (v = 0; v < ir->nvars; v++) {
+		s_first_def[v] = total;
+		total += s_ndefs[v];
+		s_ndefs[v] = 0;
+	}
+	if ((s_def_blocks = malloc((total + 1) * sizeof *s_def_blocks)) == NULL)
+		goto end;
+	for_defs(ir, add_def_block);
+
+	nentries = 0;
+	for (i = 0; i < ir->nrpo; i++) {
+		if (is_entry_block(ir, ir->rpo[i]))
+			entries[nentries++] = ir->rpo[i];
+	}
+
+	/* has_phi and pushed are v + 1 when done for the variable v */
+	for (v = 0; v < ir->nvars; v++) {
+		sp = 0;
+		for (i = 0; i < s_ndefs[v] + nentries; i++) {
+			b = i < s_ndefs[v] ? s_def_blocks[s_first_def[v] + i] :
+				entries[i - s_ndefs[v]];
+			if (pushed[b] != v + 1) {
+				pushed[b] = v + 1;
+				stack[sp++] = b;
+			}
+		}
+		while (sp > 0) {
+			b = stack[--sp];
+			n = s_ndf[b];
+			for (i = 0; i < n; i++) {
+				d = s_frontier[s_first_df[b] + i];
+				if (has_phi[d] == v + 1)
+					continue;
+				has_phi[d] = v + 1;
+				if (!is_entry_block(ir, d))
+					add_place(d, v);
+				if (pushed[d] != v + 1) {
+					pushed[d] = v + 1;
+					stack[sp++] = d;
+				}
+			}
+		}
+	}
+
+	if (!s_no_mem)
+		ecode = 0;
+
+end:	free(stack);
+	free(has_phi);
+	free(pushed);
+	free(entries);
+	return ecode;
+}
+
+static void add_def_value(struct ir *ir, int b, int pc, int prev, int var)
+{
+	struct ir_value *v;
+	struct ir_block *blk;
+
+	blk = &ir->blocks[b];
+	if (blk->ndefs == 0)
+		blk->first_def = ir->nvalues;
+	blk->ndefs++;
+
+	v = &ir->values[ir->nvalues++];
+	v->kind = IR_DEF;
+	if (code[pc].opcode == LET_VAR_OP || code[pc].opcode == LET_VAR_DEBUG_OP)
+		v->kind = IR_LET;
+	v->var = var;
+	v->block = b;
+	v->pc = pc;
+	v->src = v->kind == IR_LET ? prev : -1;
+	v->first_arg = -1;
+}
+
+/*
+ * Makes the SSA values: the heads of the blocks, then the assignments, and
+ * fills the arguments of the phis.
+ */
+static enum error_code make_values(struct ir *ir)
+{
+	int i, j, b, nvalues, nargs, ndefs;
+	int *counts;
+	struct ir_value *v;
+	struct ir_block *blk;
+
+	if ((counts = calloc(ir->nblocks + 1, sizeof *counts)) == NULL)
+		return E_NO_MEM;
+
+	ndefs = 0;
+	for (i = 0; i < ir->nvars; i++) {
+		ndefs += s_ndefs[i];
+	}
+	nvalues = s_nplaces + ndefs;
+	nargs = 0;
+	for (i = 0; i < s_nplaces; i++) {
+		counts[s_places[i].block]++;
+		nargs += ir->blocks[s_places[i].block].npreds;
+	}
+	for (i = 0; i < ir->nrpo; i++) {
+		if (is_entry_block(ir, ir->rpo[i]))
+			nvalues++;
+	}
+
+	ir->values = malloc((nvalues + 1) * sizeof *ir->values);
+	ir->args = malloc((nargs + 1) * sizeof *ir->args);
+	if (ir->values == NULL || ir->args == NULL) {
+		free(counts);
+		return E_NO_MEM;
+	}
+
+	/* The heads, in the order of the blocks. */
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		blk->first_head = ir->nvalues;
+		if (!blk->reachable)
+			continue;
+		if (is_entry_block(ir, b)) {
+			v = &ir->values[ir->nvalues++];
+			v->kind = IR_ENTRY;
+			v->var = -1;
+		} else {
+			ir->nvalues += counts[b];
+		}
+		blk->nheads = ir->nvalues - blk->first_head;
+		counts[b] = 0;
+	}
+
+	nargs = 0;
+	for (i = 0; i < s_nplaces; i++) {
+		blk = &ir->blocks[s_places[i].block];
+		v = &ir->values[blk->first_head + counts[s_places[i].block]++];
+		v->kind = IR_PHI;
+		v->var = s_places[i].var;
+		v->first_arg = nargs;
+		nargs += blk->npreds;
+	}
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		for (i = 0; i < blk->nheads; i++) {
+			v = &ir->values[blk->first_head + i];
+			v->block = b;
+			v->pc = blk->start;
+			v->src = -1;
+			if (v->kind == IR_ENTRY)
+				v->first_arg = -1;
+		}
+	}
+
+	for_defs(ir, add_def_value);
+
+	/* The arguments of the phis need all the values. */
+	for (i = 0; i < ir->nvalues; i++) {
+		v = &ir->values[i];
+		if (v->kind != IR_PHI)
+			continue;
+		blk = &ir->blocks[v->block];
+		for (j = 0; j < blk->npreds; j++) {
+			b = ir->preds[blk->first_pred + j];
+			ir->args[v->first_arg + j] = ir->blocks[b].reachable ?
+				ir_value_at_end(ir, b, v->var) : -1;
+		}
+	}
+
+	free(counts);
+	return 0;
+}
+
+/* Returns the value of 'var' at the start of the block 'b', or -1. */
+static int find_head(const struct ir *ir, int b, int var)
+{
+	int i;
+	const struct ir_block *blk;
+	const struct ir_value *v;
+
+	blk = &ir->blocks[b];
+	for (i = 0; i < blk->nheads; i++) {
+		v = &ir->values[blk->first_head + i];
+		if (v->kind == IR_ENTRY || v->var == var)
+			return blk->first_head + i;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the last value assigned to 'var' in the block 'b' by an instruction
+ * before 'pc', or -1.
+ */
+static int find_def(const struct ir *ir, int b, int var, int pc)
+{
+	int i;
+	const struct ir_block *blk;
+	const struct ir_value *v;
+
+	blk = &ir->blocks[b];
+	for (i = blk->ndefs - 1; i >= 0; i--) {
+		v = &ir->values[blk->first_def + i];
+		if (v->var == var && v->pc < pc)
+			return blk->first_def + i;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the value of 'var' at the start of the reachable block 'b': the
+ * one there, or at the end of its immediate dominator.
+ */
+static int value_at_start(const struct ir *ir, int b, int var)
+{
+	int v;
+
+	assert(ir->blocks[b].reachable);
+	for (;;) {
+		if ((v = find_head(ir, b, var)) >= 0)
+			return v;
+		b = ir->blocks[b].idom;
+		if ((v = find_def(ir, b, var, INT_MAX)) >= 0)
+			return v;
+	}
+}
+
+/* Returns the value of 'var' at the end of the reachable block 'b'. */
+int ir_value_at_end(const struct ir *ir, int b, int var)
+{
+	int v;
+
+	if ((v = find_def(ir, b, var, INT_MAX)) >= 0)
+		return v;
+
+	return value_at_start(ir, b, var);
+}
+
+/*
+ * Returns the value of 'var' when the instruction at 'pc', in a reachable
+ * block, is executed.
+ */
+int ir_value_at(const struct ir *ir, int pc, int var)
+{
+	int b, v;
+
+	b = ir->block_of[pc];
+	if ((v = find_def(ir, b, var, pc)) >= 0)
+		return v;
+
+	return value_at_start(ir, b, var);
+}
+
+/*
+ * Returns 1 if the block 'b' is written back: if it is reachable, if it is the
+ * last one, or if the next one is a reachable FOR_CMP_OP, that needs the
+ * FOR_OP before it.
+ */
+static int is_block_kept(const struct ir *ir, int b)
+{
+	const struct ir_block *next;
+
+	if (ir->blocks[b].reachable || b == ir->nblocks - 1)
+		return 1;
+
+	next = &ir->blocks[b + 1];
+	return next->reachable && code[next->start].opcode == FOR_CMP_OP;
+}
+
+/*
+ * Returns 1 if the block 'b' ends with a GOTO_OP to the next block that is
+ * kept, which is not needed once the blocks in between are dropped.
+ */
+static int is_goto_dropped(const struct ir *ir, int b)
+{
+	int next;
+	const struct ir_block *blk;
+
+	blk = &ir->blocks[b];
+	if (code[blk->last].opcode != GOTO_OP)
+		return 0;
+
+	/* the last block is kept, and it is not this one: it has the END_OP */
+	for (next = b + 1; !is_block_kept(ir, next); next++)
+		;
+
+	return ir->blocks[next].start == code[blk->last + 1].id;
+}
+
+/*
+ * Replaces the code by the code of the blocks that are kept, relocating the
+ * jumps and the line table. The GOTO_OPs that would go to the next
+ * instruction are removed.
+ * Returns E_NO_MEM if not enough memory, and then the code is not changed.
+ */
+enum error_code lower_ir(const struct ir *ir)
+{
+	int b, pc, size, new_pc, keep, end;
+	int *new_pcs;
+	union instruction *new_code;
+	const struct ir_block *blk;
+
+	size = get_code_size();
+	new_pcs = malloc((size + 1) * sizeof *new_pcs);
+	new_code = malloc(size * sizeof *new_code);
+	if (new_pcs == NULL || new_code == NULL) {
+		free(new_pcs);
+		free(new_code);
+		return E_NO_MEM;
+	}
+
+	new_pc = 0;
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		keep = is_block_kept(ir, b);
+		end = keep && is_goto_dropped(ir, b) ? blk->last : blk->end;
+		for (pc = blk->start; pc < blk->end; pc++) {
+			new_pcs[pc] = new_pc;
+			if (keep && pc < end)
+				new_code[new_pc++] = code[pc];
+		}
+	}
+	new_pcs[size] = new_pc;
+
+	relocate_jumps(new_code, new_pc, new_pcs);
+	relocate_lines(new_pcs);
+	replace_code(new_code, new_pc);
+	free(new_pcs);
+	return 0;
+}
+
+static void free_build(void)
+{
+	free(s_places);
+	free(s_frontier);
+	free(s_first_df);
+	free(s_ndf);
+	free(s_def_blocks);
+	free(s_first_def);
+	free(s_ndefs);
+	s_places = NULL;
+	s_frontier = s_first_df = s_ndf = NULL;
+	s_def_blocks = s_first_def = s_ndefs = NULL;
+}
+
+/*
+ * Builds the intermediate representation of the code in 'ir'. Free it with
+ * free_ir(), even if this fails.
+ * Returns E_NO_MEM if not enough memory.
+ */
+enum error_code build_ir(struct ir *ir)
+{
+	int size;
+	enum error_code ecode;
+
+	memset(ir, 0, sizeof *ir);
+	s_nplaces = 0;
+	s_places_capacity = 0;
+	s_no_mem = 0;
+
+	size = get_code_size();
+	if ((ecode = split_blocks(ir, size)) != 0)
+		goto end;
+	if ((ecode = link_blocks(ir, size)) != 0)
+		goto end;
+	if ((ecode = order_blocks(ir)) != 0)
+		goto end;
+	if ((ecode = find_dominators(ir)) != 0)
+		goto end;
+	if ((ecode = find_frontiers(ir)) != 0)
+		goto end;
+	if ((ecode = index_vars(ir, size)) != 0)
+		goto end;
+	if ((ecode = place_phis(ir)) != 0)
+		goto end;
+	ecode = make_values(ir);
+
+end:	free_build();
+	return ecode;
+}
+
+void free_ir(struct ir *ir)
+{
+	free(ir->blocks);
+	free(ir->block_of);
+	free(ir->succs);
+	free(ir->preds);
+	free(ir->rpo);
+	free(ir->vars);
+	free(ir->var_index);
+	free(ir->values);
+	free(ir->args);
+	memset(ir, 0, sizeof *ir);
+}
+
+/*
+ * Propagation of constants.
+ *
+ * A GET_VAR_OP or GET_FN_VAR_OP whose value is always the same number
+ * becomes a PUSH_NUM_OP of it, that opt.c can fuse with the instructions that
+ * use it. The values start unknown, and we go through them until nothing
+ * changes: an assignment of a PUSH_NUM_OP, or of a variable whose value is a
+ * constant, is a constant; any other assignment, and IR_ENTRY, are not; a phi
+ * is a constant if all its known arguments are the same one.
+ */
+
+enum cp_kind {
+	CP_UNKNOWN,
+	CP_CONST,
+	CP_VARIES
+};
+
+struct cp_state {
+	enum cp_kind kind;
+	double num;
+};
+
+static struct cp_state *s_cp;
+
+/* Compares the bits, so -0 is not the same constant as 0. */
+static int is_same_state(const struct cp_state *a, const struct cp_state *b)
+{
+	return a->kind == b->kind && (a->kind != CP_CONST ||
+		memcmp(&a->num, &b->num, sizeof a->num) == 0);
+}
+
+/* Merges in 'st' the state of the value 'v', which can be -1. */
+static void meet(struct cp_state *st, int v)
+{
+	if (v < 0 || s_cp[v].kind == CP_UNKNOWN || st->kind == CP_VARIES)
+		return;
+
+	if (st->kind == CP_UNKNOWN)
+		*st = s_cp[v];
+	else if (!is_same_state(st, &s_cp[v]))
+		st->kind = CP_VARIES;
+}
+
+/*
+ * The state of the variable read by the instruction at 'pc', if it has SSA
+ * values.
+ */
+static struct cp_state read_state(const struct ir *ir, int pc)
+{
+	int var;
+	struct cp_state st;
+
+	if ((var = ir->var_index[code[pc + 1].id]) >= 0)
+		return s_cp[ir_value_at(ir, pc, var)];
+
+	st.kind = CP_VARIES;
+	st.num = 0;
+	return st;
+}
+
+/* The state of the value 'i'. */
+static struct cp_state value_state(const struct ir *ir, int i)
+{
+	int j, src, nargs;
+	struct cp_state st;
+	const struct ir_value *v;
+
+	v = &ir->values[i];
+	st.kind = CP_VARIES;
+	st.num = 0;
+	switch (v->kind) {
+	case IR_PHI:
+		st.kind = CP_UNKNOWN;
+		nargs = ir->blocks[v->block].npreds;
+		for (j = 0; j < nargs; j++) {
+			meet(&st, ir->args[v->first_arg + j]);
+		}
+		break;
+	case IR_LET:
+		if ((src = v->src) < 0)
+			break;
+		if (code[src].opcode == PUSH_NUM_OP) {
+			st.kind = CP_CONST;
+			st.num = code[src + 1].num;
+		} else if (is_var_read(src)) {
+			st = read_state(ir, src);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return st;
+}
+
+static void propagate_consts(const struct ir *ir)
+{
+	int i, b, pc, changed;
+	struct cp_state st;
+	const struct ir_block *blk;
+
+	if ((s_cp = calloc(ir->nvalues + 1, sizeof *s_cp)) == NULL)
+		return;
+
+	do {
+		changed = 0;
+		for (i = 0; i < ir->nvalues; i++) {
+			st = value_state(ir, i);
+			if (!is_same_state(&st, &s_cp[i])) {
+				s_cp[i] = st;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	for (b = 0; b < ir->nblocks; b++) {
+		blk = &ir->blocks[b];
+		if (!blk->reachable)
+			continue;
+		for (pc = blk->start; pc < blk->end;
+			pc += get_instr_size(&code[pc]))
+		{
+			if (code[pc].opcode != GET_VAR_OP &&
+				code[pc].opcode != GET_FN_VAR_OP)
+			{
+				continue;
+			}
+			st = read_state(ir, pc);
+			if (st.kind == CP_CONST) {
+				code[pc].opcode = PUSH_NUM_OP;
+				code[pc + 1].num = st.num;
+			}
+		}
+	}
+
+	free(s_cp);
+	s_cp = NULL;
+}
+
+/*
+ * Builds the intermediate representation of the code, propagates the
+ * constants and lowers it, without the blocks that are never reached.
+ * If there is not enough memory, the code is left as it is.
+ */
+void optimize_ir(void)
+{
+	struct ir ir;
+
+	if (build_ir(&ir) == 0) {
+		propagate_consts(&ir);
+		lower_ir(&ir);
+	}
+	free_ir(&ir);
+}
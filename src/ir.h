@@ -0,0 +1,88 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef IR_H
+#define IR_H
+
+/*
+ * A basic block: the instructions of 'code' from 'start' to 'end' (not
+ * included); 'last' is the position of its last instruction. Its
+ * successors are 'succs[first_succ]' ... and its predecessors
+ * 'preds[first_pred]' ... in struct ir. 'idom' is its immediate dominator,
+ * -1 for the first block and the blocks that are not reachable. Its SSA
+ * values are 'values[first_head]' ..., 'nheads' for the start of the block
+ * (phis, or an IR_ENTRY), and 'values[first_def]' ..., 'ndefs' for its
+ * assignments, in order. 'clobbered' is 1 if it is the return point of a
+ * GOSUB_OP.
+ */
+struct ir_block {
+	int start;
+	int end;
+	int last;
+	int first_succ;
+	int nsuccs;
+	int first_pred;
+	int npreds;
+	int idom;
+	int first_head;
+	int nheads;
+	int first_def;
+	int ndefs;
+	unsigned char reachable;
+	unsigned char clobbered;
+};
+
+enum ir_value_kind {
+	IR_ENTRY,	/* any value, for all the variables */
+	IR_PHI,		/* one of 'args[first_arg]' ..., one per predecessor */
+	IR_LET,		/* assigned by the LET_VAR_OP at 'pc' */
+	IR_DEF		/* assigned otherwise by the instruction at 'pc' */
+};
+
+/*
+ * An SSA value of the variable 'var' (an index in 'vars' of struct ir), made
+ * in 'block'. For IR_LET, 'src' is the instruction before the LET_VAR_OP in
+ * the block, or -1.
+ */
+struct ir_value {
+	enum ir_value_kind kind;
+	int var;
+	int block;
+	int pc;
+	int src;
+	int first_arg;
+};
+
+/*
+ * 'block_of' has, for each code position where an instruction starts, its
+ * block; -1 for the other positions. 'rpo' has the reachable blocks in
+ * reverse postorder. 'vars' has the ram positions of the variables that have
+ * SSA values, and 'var_index', for each ram position, its index there or -1.
+ */
+struct ir {
+	struct ir_block *blocks;
+	int nblocks;
+	int *block_of;
+	int *succs;
+	int *preds;
+	int *rpo;
+	int nrpo;
+	int *vars;
+	int nvars;
+	int *var_index;
+	struct ir_value *values;
+	int nvalues;
+	int *args;
+};
+
+enum error_code build_ir(struct ir *ir);
+void free_ir(struct ir *ir);
+int ir_dominates(const struct ir *ir, int a, int b);
+int ir_value_at_end(const struct ir *ir, int b, int var);
+int ir_value_at(const struct ir *ir, int pc, int var);
+enum error_code lower_ir(const struct ir *ir);
+
+#endif
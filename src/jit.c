@@ -0,0 +1,1114 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Translation of the bytecode to x86-64 native code. */
+
+#include <config.h>
+
+#if defined(JIT)
+
+#include "ecma55.h"
+#include "arraydsc.h"
+#include "jit.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Each instruction is translated with a fixed template of machine code.
+ *
+ * The native code keeps in registers:
+ *
+ *	rbx	s_sp
+ *	rbp	&s_pc
+ *	r12	s_stack
+ *	r13	s_ram
+ *	r14	table with the native address of each code position
+ *	r15	&s_sp
+ *
+ * Numbers on the stack and in ram are addressed directly: [r12 + rbx*8 - 8]
+ * is the top of the stack and [r13 + rampos*8] a variable.
+ *
+ * The instructions without a template (PRINT, INPUT, READ, GOSUB...), and
+ * the cases that must print a warning or an error, call the C function of
+ * the virtual machine (the slow path): we set s_pc and s_sp as the function
+ * expects them, call it, and then jump through the table in r14 if it changed
+ * s_pc to somewhere else than the next instruction. After a fatal error, or a
+ * break seen by the function, s_pc is the END_OP of the program.
+ *
+ * FOR_CMP_OP and NEXT_OP do the loop test in XMM registers; NEXT_OP adds the
+ * step and tests the limit without reloading the variable. FOR_INT_OP and
+ * NEXT_INT_OP have the step in the code, so the direction of the test is
+ * chosen here.
+ *
+ * The IF_*_OP instructions compare with ucomisd and jump with a Jcc, without
+ * materializing the result of the comparison.
+ *
+ * The unchecked array accesses compute the index in rax (and rcx for the
+ * second index of a table) and address the element as [r13 + rax*8 + disp32].
+ * The integer versions of the array instructions do the same after checking
+ * the range of the indexes, and take the slow path if it fails.
+ *
+ * In debug mode, the instructions that must check if a variable was
+ * initialized are compiled to their debug variants, which have no template
+ * and take the slow path.
+ */
+
+enum {
+	XMM0,
+	XMM1,
+	XMM2
+};
+
+/* Condition codes, for Jcc (0x0F 0x80 + cc) and SETcc (0x0F 0x90 + cc). */
+enum {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_P = 0xA,
+	CC_NP = 0xB
+};
+
+/* SSE2 scalar double opcodes (after 0xF2 0x0F). */
+enum {
+	SD_LOAD = 0x10,
+	SD_STORE = 0x11,
+	SD_ADD = 0x58,
+	SD_MUL = 0x59,
+	SD_SUB = 0x5C,
+	SD_DIV = 0x5E
+};
+
+/* Jump destinations that are not code positions. */
+enum {
+	TO_EXIT = -1,
+	TO_DISPATCH = -2
+};
+
+/* A rel32 to fill when we know the position of everything. */
+struct fixup {
+	int off;
+	int target;
+};
+
+static const struct jit_vm *s_vm;
+
+static unsigned char *s_buf;
+static int s_len;
+static int s_cap;
+
+static struct fixup *s_fixups;
+static int s_nfixups;
+static int s_fixups_cap;
+
+/* Offset in s_buf of the code for each code position. */
+static int *s_offs;
+
+static int s_exit_off;
+static int s_dispatch_off;
+
+static int s_no_mem;
+
+/* The native code and its size. */
+static unsigned char *s_native = NULL;
+static size_t s_native_size;
+
+/* Native address of each code position. */
+static void **s_table = NULL;
+
+static void emit1(int b)
+{
+	unsigned char *p;
+	int n;
+
+	if (s_len == s_cap) {
+		n = s_cap == 0 ? 4096 : s_cap * 2;
+		if (n <= s_cap || (p = realloc(s_buf, n)) == NULL) {
+			s_no_mem = 1;
+			s_len = 0;
+			return;
+		}
+		s_buf = p;
+		s_cap = n;
+	}
+	s_buf[s_len++] = (unsigned char) b;
+}
+
+static void emit4(int n)
+{
+	unsigned int u;
+
+	u = (unsigned int) n;
+	emit1(u & 0xff);
+	emit1((u >> 8) & 0xff);
+	emit1((u >> 16) & 0xff);
+	emit1((u >> 24) & 0xff);
+}
+
+static void emit8(const void *p)
+{
+	unsigned char b[8];
+	int i;
+
+	memcpy(b, p, 8);
+	for (i = 0; i < 8; i++)
+		emit1(b[i]);
+}
+
+static void add_fixup(int target)
+{
+	struct fixup *p;
+	int n;
+
+	if (s_nfixups == s_fixups_cap) {
+		n = s_fixups_cap == 0 ? 256 : s_fixups_cap * 2;
+		if (n <= s_fixups_cap ||
+			(p = realloc(s_fixups, n * sizeof *p)) == NULL)
+		{
+			s_no_mem = 1;
+			return;
+		}
+		s_fixups = p;
+		s_fixups_cap = n;
+	}
+	s_fixups[s_nfixups].off = s_len;
+	s_fixups[s_nfixups].target = target;
+	s_nfixups++;
+	emit4(0);
+}
+
+/* jmp target */
+static void emit_jmp(int target)
+{
+	emit1(0xe9);
+	add_fixup(target);
+}
+
+/* jcc target */
+static void emit_jcc(int cc, int target)
+{
+	emit1(0x0f);
+	emit1(0x80 + cc);
+	add_fixup(target);
+}
+
+/* Forward jcc inside a template; returns the position to pass to
+ * patch_here().
+ */
+static int emit_jcc_fwd(int cc)
+{
+	emit1(0x0f);
+	emit1(0x80 + cc);
+	emit4(0);
+	return s_len - 4;
+}
+
+static int emit_jmp_fwd(void)
+{
+	emit1(0xe9);
+	emit4(0);
+	return s_len - 4;
+}
+
+/* Makes the forward jump at 'off' land here. */
+static void patch_here(int off)
+{
+	int rel;
+
+	if (s_no_mem)
+		return;
+
+	rel = s_len - (off + 4);
+	memcpy(s_buf + off, &rel, 4);
+}
+
+/* mov rax, imm64 */
+static void emit_mov_rax_ptr(const void *p)
+{
+	emit1(0x48);
+	emit1(0xb8);
+	emit8(&p);
+}
+
+/* mov rax, imm64 */
+static void emit_mov_rax_func(vm_func f)
+{
+	emit1(0x48);
+	emit1(0xb8);
+	emit8(&f);
+}
+
+/* mov rax, imm64 (bits of num); movq xmm, rax */
+static void emit_load_num(int xmm, double num)
+{
+	emit1(0x48);
+	emit1(0xb8);
+	emit8(&num);
+	emit1(0x66);
+	emit1(0x48);
+	emit1(0x0f);
+	emit1(0x6e);
+	emit1(0xc0 | (xmm << 3));
+}
+
+/* SSE op with [r12 + rbx*8 + disp8] (the stack). */
+static void emit_sd_stack(int op, int xmm, int disp8)
+{
+	emit1(0xf2);
+	emit1(0x41);
+	emit1(0x0f);
+	emit1(op);
+	emit1(0x44 | (xmm << 3));
+	emit1(0xdc);
+	emit1(disp8 & 0xff);
+}
+
+/* SSE op with [r13 + rampos*8] (the ram). */
+static void emit_sd_ram(int op, int xmm, int rampos)
+{
+	emit1(0xf2);
+	emit1(0x41);
+	emit1(0x0f);
+	emit1(op);
+	emit1(0x85 | (xmm << 3));
+	emit4(rampos * 8);
+}
+
+/* SSE op between registers. */
+static void emit_sd_reg(int op, int xmm1, int xmm2)
+{
+	emit1(0xf2);
+	emit1(0x0f);
+	emit1(op);
+	emit1(0xc0 | (xmm1 << 3) | xmm2);
+}
+
+/* ucomisd xmm1, xmm2 */
+static void emit_ucomisd(int xmm1, int xmm2)
+{
+	emit1(0x66);
+	emit1(0x0f);
+	emit1(0x2e);
+	emit1(0xc0 | (xmm1 << 3) | xmm2);
+}
+
+/* xorpd xmm, xmm */
+static void emit_zero(int xmm)
+{
+	emit1(0x66);
+	emit1(0x0f);
+	emit1(0x57);
+	emit1(0xc0 | (xmm << 3) | xmm);
+}
+
+/* inc rbx */
+static void emit_push(void)
+{
+	emit1(0x48);
+	emit1(0xff);
+	emit1(0xc3);
+}
+
+/* dec rbx */
+static void emit_pop(void)
+{
+	emit1(0x48);
+	emit1(0xff);
+	emit1(0xcb);
+}
+
+/* mov rax, [r13 + rampos*8] */
+static void emit_load_rax_ram(int rampos)
+{
+	emit1(0x49);
+	emit1(0x8b);
+	emit1(0x85);
+	emit4(rampos * 8);
+}
+
+/* mov [r13 + rampos*8], rax */
+static void emit_store_rax_ram(int rampos)
+{
+	emit1(0x49);
+	emit1(0x89);
+	emit1(0x85);
+	emit4(rampos * 8);
+}
+
+/*
+ * Computes in rax the offset of the element of the array 'vindex1' whose
+ * 'nidx' indexes are on the stack, the first at [r12 + rbx*8 + disp8], from
+ * the element with all the indexes 0.
+ */
+static void emit_elem_index(int vindex1, int nidx, int disp8)
+{
+	/* cvttsd2si rax, xmm0 */
+	emit_sd_stack(SD_LOAD, XMM0, disp8);
+	emit1(0xf2); emit1(0x48); emit1(0x0f); emit1(0x2c); emit1(0xc0);
+	if (nidx == 1)
+		return;
+
+	/* imul rax, rax, dim2 */
+	emit1(0x48); emit1(0x69); emit1(0xc0);
+	emit4(s_array_descs[vindex1].dim2);
+	/* cvttsd2si rcx, xmm1; add rax, rcx */
+	emit_sd_stack(SD_LOAD, XMM1, disp8 + 8);
+	emit1(0xf2); emit1(0x48); emit1(0x0f); emit1(0x2c); emit1(0xc9);
+	emit1(0x48); emit1(0x01); emit1(0xc8);
+}
+
+/*
+ * Like emit_elem_index(), for the integer versions of the array instructions,
+ * whose indexes have no fractional part: jumps to the slow path if an index
+ * is not in range, and puts in 'slow' the positions to patch.
+ */
+static void emit_int_elem_index(int vindex1, int nidx, int disp8, int *slow)
+{
+	int i, dim;
+
+	for (i = 0; i < nidx; i++) {
+		dim = i == 0 ? s_array_descs[vindex1].dim1 :
+			s_array_descs[vindex1].dim2;
+		emit_sd_stack(SD_LOAD, XMM0 + i, disp8 + 8 * i);
+		if (i == 0) {
+			/* cvttsd2si rax, xmm0; mov rdx, rax */
+			emit1(0xf2); emit1(0x48); emit1(0x0f); emit1(0x2c);
+			emit1(0xc0);
+			emit1(0x48); emit1(0x89); emit1(0xc2);
+		} else {
+			/* cvttsd2si rcx, xmm1; mov rdx, rcx */
+			emit1(0xf2); emit1(0x48); emit1(0x0f); emit1(0x2c);
+			emit1(0xc9);
+			emit1(0x48); emit1(0x89); emit1(0xca);
+		}
+		/* sub rdx, base; cmp rdx, dim; jae slow */
+		emit1(0x48); emit1(0x83); emit1(0xea); emit1(get_parsed_base());
+		emit1(0x48); emit1(0x81); emit1(0xfa); emit4(dim);
+		slow[i] = emit_jcc_fwd(CC_AE);
+	}
+
+	if (nidx == 2) {
+		/* imul rax, rax, dim2; add rax, rcx */
+		emit1(0x48); emit1(0x69); emit1(0xc0);
+		emit4(s_array_descs[vindex1].dim2);
+		emit1(0x48); emit1(0x01); emit1(0xc8);
+	}
+}
+
+/* SSE op with [r13 + rax*8 + disp32] (an array element). */
+static void emit_sd_elem(int op, int xmm, int disp32)
+{
+	emit1(0xf2);
+	emit1(0x41);
+	emit1(0x0f);
+	emit1(op);
+	emit1(0x84 | (xmm << 3));
+	emit1(0xc5);
+	emit4(disp32);
+}
+
+/* Pushes the variable at 'rampos'. */
+static void emit_get_var(int rampos)
+{
+	emit_load_rax_ram(rampos);
+	/* mov [r12 + rbx*8], rax */
+	emit1(0x49); emit1(0x89); emit1(0x04); emit1(0xdc);
+	emit_push();
+}
+
+/* If the user pressed Ctrl+C, stops, with the break at the line of 'pc',
+ * where execution would continue.
+ */
+static void emit_check_break(int pc)
+{
+	int skip;
+
+	emit_mov_rax_ptr((const void *) s_vm->brk);
+	/* cmp dword [rax], 0 */
+	emit1(0x83); emit1(0x38); emit1(0x00);
+	skip = emit_jcc_fwd(CC_E);
+	emit_mov_rax_ptr(s_vm->line_num);
+	/* mov dword [rax], imm32 */
+	emit1(0xc7); emit1(0x00); emit4(get_pc_line(pc));
+	emit_jmp(TO_EXIT);
+	patch_here(skip);
+}
+
+/* A backward jump to 'target' from 'pc' is a polling point for Ctrl+C. */
+static void emit_check_break_to(int pc, int target)
+{
+	if (target <= pc)
+		emit_check_break(target);
+}
+
+/* Jumps to the slow path if xmm0 is an infinity or a NaN, where we will
+ * print the warning. Returns the position to patch.
+ */
+static int emit_jmp_if_not_finite(void)
+{
+	unsigned long long inf_bits;
+
+	inf_bits = 0x7ff0000000000000ULL;
+
+	/* movq rax, xmm0 */
+	emit1(0x66); emit1(0x48); emit1(0x0f); emit1(0x7e); emit1(0xc0);
+	/* btr rax, 63 */
+	emit1(0x48); emit1(0x0f); emit1(0xba); emit1(0xf0); emit1(63);
+	/* mov rcx, imm64 */
+	emit1(0x48); emit1(0xb9); emit8(&inf_bits);
+	/* cmp rax, rcx */
+	emit1(0x48); emit1(0x39); emit1(0xc8);
+	return emit_jcc_fwd(CC_AE);
+}
+
+/* Slow path: calls the function of the virtual machine for the
+ * instruction at 'pc'.
+ */
+static void emit_slow(int pc)
+{
+	int next;
+
+	next = pc + get_instr_size(&code[pc]);
+
+	/* mov dword [rbp], pc + 1 */
+	emit1(0xc7); emit1(0x45); emit1(0x00); emit4(pc + 1);
+	/* mov [r15], ebx */
+	emit1(0x41); emit1(0x89); emit1(0x1f);
+	emit_mov_rax_func(get_opcode_func(code[pc].opcode));
+	/* call rax */
+	emit1(0xff); emit1(0xd0);
+	/* mov ebx, [r15] */
+	emit1(0x41); emit1(0x8b); emit1(0x1f);
+	/* cmp dword [rbp], next */
+	emit1(0x81); emit1(0x7d); emit1(0x00); emit4(next);
+	emit_jcc(CC_NE, TO_DISPATCH);
+}
+
+/*
+ * Jumps to 'target' if the comparison of xmm0 (left operand) with xmm1 (right
+ * operand) for the IF_*_OP instruction 'opcode', or any of its variants, is
+ * true as the C operator would give it. ucomisd sets CF, ZF and PF if an
+ * operand is a NaN: only != is true then.
+ */
+static void emit_branch(enum vm_opcode opcode, int target)
+{
+	int skip;
+
+	switch (opcode) {
+	case IF_LESS_OP:
+	case IF_LESS_VAR_OP:
+	case IF_LESS_CONST_OP:
+	case R_IF_LESS_OP:
+		emit_ucomisd(XMM1, XMM0);
+		emit_jcc(CC_A, target);
+		break;
+	case IF_LESS_EQ_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case R_IF_LESS_EQ_OP:
+		emit_ucomisd(XMM1, XMM0);
+		emit_jcc(CC_AE, target);
+		break;
+	case IF_GREATER_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_GREATER_CONST_OP:
+	case R_IF_GREATER_OP:
+		emit_ucomisd(XMM0, XMM1);
+		emit_jcc(CC_A, target);
+		break;
+	case IF_GREATER_EQ_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case R_IF_GREATER_EQ_OP:
+		emit_ucomisd(XMM0, XMM1);
+		emit_jcc(CC_AE, target);
+		break;
+	case IF_EQ_OP:
+	case IF_EQ_VAR_OP:
+	case IF_EQ_CONST_OP:
+	case R_IF_EQ_OP:
+		emit_ucomisd(XMM0, XMM1);
+		skip = emit_jcc_fwd(CC_P);
+		emit_jcc(CC_E, target);
+		patch_here(skip);
+		break;
+	default:
+		emit_ucomisd(XMM0, XMM1);
+		emit_jcc(CC_P, target);
+		emit_jcc(CC_NE, target);
+		break;
+	}
+}
+
+/* If xmm0 equals 1, jumps to 'target'. */
+static void emit_goto_if_one(int target)
+{
+	int skip;
+
+	emit_load_num(XMM1, 1.0);
+	emit_ucomisd(XMM0, XMM1);
+	skip = emit_jcc_fwd(CC_P);
+	emit_jcc(CC_E, target);
+	patch_here(skip);
+}
+
+/*
+ * The test of the FOR loop that starts at 'cmp_pc', with the value of the
+ * variable in xmm0: jumps to the end of the loop if
+ * (var - limit) * sign(step) > 0 .
+ */
+static void emit_for_test(int cmp_pc)
+{
+	int step_pos, limit_pos, endpc;
+	int nan, pos, zero, neg_done;
+
+	step_pos = code[cmp_pc - 3].id;
+	limit_pos = code[cmp_pc - 2].id;
+	endpc = code[cmp_pc + 1].id;
+
+	emit_sd_ram(SD_SUB, XMM0, limit_pos);
+	emit_sd_ram(SD_LOAD, XMM1, step_pos);
+	emit_zero(XMM2);
+	emit_ucomisd(XMM1, XMM2);
+	nan = emit_jcc_fwd(CC_P);
+	pos = emit_jcc_fwd(CC_A);
+	zero = emit_jcc_fwd(CC_E);
+
+	/* Negative step: exit if var - limit < 0 */
+	emit_ucomisd(XMM2, XMM0);
+	emit_jcc(CC_A, endpc);
+	neg_done = emit_jmp_fwd();
+
+	/* Positive step: exit if var - limit > 0 */
+	patch_here(pos);
+	emit_ucomisd(XMM0, XMM2);
+	emit_jcc(CC_A, endpc);
+
+	patch_here(nan);
+	patch_here(zero);
+	patch_here(neg_done);
+}
+
+/*
+ * Compares the variable in xmm0 with the limit in xmm1 of a FOR_INT_OP loop
+ * with 'step', so that CC_A means that the loop is done.
+ */
+static void emit_for_int_cmp(int step)
+{
+	if (step > 0)
+		emit_ucomisd(XMM0, XMM1);
+	else
+		emit_ucomisd(XMM1, XMM0);
+}
+
+/* Binary operation on the two numbers on top of the stack. */
+static void emit_stack_binary(int op)
+{
+	emit_sd_stack(SD_LOAD, XMM0, -16);
+	emit_sd_stack(op, XMM0, -8);
+	emit_pop();
+	emit_sd_stack(SD_STORE, XMM0, -8);
+}
+
+/* Multiplication or division on the stack, that goes to the slow path if
+ * the result needs a warning.
+ */
+static void emit_stack_mul_div(int pc, int op)
+{
+	int slow, done;
+
+	emit_sd_stack(SD_LOAD, XMM0, -16);
+	if (op == SD_DIV) {
+		emit_sd_stack(SD_LOAD, XMM1, -8);
+		emit_zero(XMM2);
+		emit_ucomisd(XMM1, XMM2);
+		slow = emit_jcc_fwd(CC_E);
+		emit_sd_reg(SD_DIV, XMM0, XMM1);
+	} else {
+		emit_sd_stack(SD_MUL, XMM0, -8);
+		slow = emit_jmp_if_not_finite();
+	}
+	emit_pop();
+	emit_sd_stack(SD_STORE, XMM0, -8);
+	done = emit_jmp_fwd();
+	patch_here(slow);
+	emit_slow(pc);
+	patch_here(done);
+}
+
+/* Register multiplication or division, like emit_stack_mul_div(). */
+static void emit_ram_mul_div(int pc, int op)
+{
+	int slow, done;
+
+	emit_sd_ram(SD_LOAD, XMM0, code[pc + 1].id);
+	if (op == SD_DIV) {
+		emit_sd_ram(SD_LOAD, XMM1, code[pc + 2].id);
+		emit_zero(XMM2);
+		emit_ucomisd(XMM1, XMM2);
+		slow = emit_jcc_fwd(CC_E);
+		emit_sd_reg(SD_DIV, XMM0, XMM1);
+	} else {
+		emit_sd_ram(SD_MUL, XMM0, code[pc + 2].id);
+		slow = emit_jmp_if_not_finite();
+	}
+	emit_sd_ram(SD_STORE, XMM0, code[pc + 3].id);
+	done = emit_jmp_fwd();
+	patch_here(slow);
+	emit_slow(pc);
+	patch_here(done);
+}
+
+/*
+ * GET_LIST_INT_OP, GET_TABLE_INT_OP, LET_LIST_INT_OP or LET_TABLE_INT_OP at
+ * 'pc', that goes to the slow path if an index is out of range.
+ */
+static void emit_int_elem(int pc)
+{
+	const union instruction *in;
+	int nidx, is_let, slow[2], done, i;
+
+	in = &code[pc];
+	nidx = in->opcode == GET_TABLE_INT_OP ||
+		in->opcode == LET_TABLE_INT_OP ? 2 : 1;
+	is_let = in->opcode == LET_LIST_INT_OP ||
+		in->opcode == LET_TABLE_INT_OP;
+	emit_int_elem_index(in[1].id, nidx, -8 * (nidx + is_let), slow);
+	if (is_let) {
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_sd_elem(SD_STORE, XMM0, in[2].id * 8);
+		for (i = 0; i <= nidx; i++) {
+			emit_pop();
+		}
+	} else {
+		emit_sd_elem(SD_LOAD, XMM0, in[2].id * 8);
+		if (nidx == 2)
+			emit_pop();
+		emit_sd_stack(SD_STORE, XMM0, -8);
+	}
+	done = emit_jmp_fwd();
+	for (i = 0; i < nidx; i++) {
+		patch_here(slow[i]);
+	}
+	emit_slow(pc);
+	patch_here(done);
+}
+
+/* Returns 0 if there is a template for the instruction at 'pc', one of those
+ * that have a debug variant or are made of them.
+ */
+static int emit_checked_instr(int pc)
+{
+	const union instruction *in;
+
+	in = &code[pc];
+	switch (in->opcode) {
+	case GET_VAR_OP:
+		emit_get_var(in[1].id);
+		break;
+	case LET_VAR_OP:
+		emit_pop();
+		/* mov rax, [r12 + rbx*8] */
+		emit1(0x49); emit1(0x8b); emit1(0x04); emit1(0xdc);
+		emit_store_rax_ram(in[1].id);
+		break;
+	case ADD_VAR_CONST_OP:
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_load_num(XMM1, in[2].num);
+		emit_sd_reg(SD_ADD, XMM0, XMM1);
+		emit_sd_stack(SD_STORE, XMM0, 0);
+		emit_push();
+		break;
+	case ADD_VAR_VAR_OP:
+	case SUB_VAR_VAR_OP:
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_sd_ram(in->opcode == ADD_VAR_VAR_OP ? SD_ADD : SD_SUB,
+			XMM0, in[2].id);
+		emit_sd_stack(SD_STORE, XMM0, 0);
+		emit_push();
+		break;
+	case FOR_INT_OP:
+		/* limit, var */
+		emit_sd_stack(SD_LOAD, XMM1, -8);
+		emit_sd_stack(SD_LOAD, XMM0, -16);
+		emit_pop();
+		emit_pop();
+		emit_sd_ram(SD_STORE, XMM1, in[1].id);
+		emit_sd_ram(SD_STORE, XMM0, in[2].id);
+		emit_for_int_cmp(in[3].id);
+		emit_jcc(CC_A, in[4].id);
+		break;
+	case LET_VAR_CONST_OP:
+		emit_load_num(XMM0, in[1].num);
+		emit_sd_ram(SD_STORE, XMM0, in[2].id);
+		break;
+	case LET_VAR_FROM_VAR_OP:
+		emit_load_rax_ram(in[1].id);
+		emit_store_rax_ram(in[2].id);
+		break;
+	case INC_VAR_OP:
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_load_num(XMM1, in[2].num);
+		emit_sd_reg(SD_ADD, XMM0, XMM1);
+		emit_sd_ram(SD_STORE, XMM0, in[1].id);
+		break;
+	case R_ADD_OP:
+	case R_SUB_OP:
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_sd_ram(in->opcode == R_ADD_OP ? SD_ADD : SD_SUB,
+			XMM0, in[2].id);
+		emit_sd_ram(SD_STORE, XMM0, in[3].id);
+		break;
+	case R_MUL_OP:
+		emit_ram_mul_div(pc, SD_MUL);
+		break;
+	case R_DIV_OP:
+		emit_ram_mul_div(pc, SD_DIV);
+		break;
+	case R_NEG_OP:
+		emit_load_rax_ram(in[1].id);
+		/* btc rax, 63 */
+		emit1(0x48); emit1(0x0f); emit1(0xba); emit1(0xf8); emit1(63);
+		emit_store_rax_ram(in[2].id);
+		break;
+	case R_MOV_OP:
+		emit_load_rax_ram(in[1].id);
+		emit_store_rax_ram(in[2].id);
+		break;
+	case R_IF_LESS_OP:
+	case R_IF_GREATER_OP:
+	case R_IF_LESS_EQ_OP:
+	case R_IF_GREATER_EQ_OP:
+	case R_IF_EQ_OP:
+	case R_IF_NOT_EQ_OP:
+		emit_check_break_to(pc, in[3].id);
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_sd_ram(SD_LOAD, XMM1, in[2].id);
+		emit_branch(in->opcode, in[3].id);
+		break;
+	case R_GOTO_IF_TRUE_OP:
+		emit_check_break_to(pc, in[2].id);
+		emit_sd_ram(SD_LOAD, XMM0, in[1].id);
+		emit_goto_if_one(in[2].id);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static void emit_instr(int pc)
+{
+	const union instruction *in;
+
+	in = &code[pc];
+	switch (in->opcode) {
+	case PUSH_NUM_OP:
+		emit_load_num(XMM0, in[1].num);
+		emit_sd_stack(SD_STORE, XMM0, 0);
+		emit_push();
+		break;
+	case GET_FN_VAR_OP:
+		emit_get_var(in[1].id);
+		break;
+	case ADD_OP:
+		emit_stack_binary(SD_ADD);
+		break;
+	case SUB_OP:
+		emit_stack_binary(SD_SUB);
+		break;
+	case MUL_OP:
+		emit_stack_mul_div(pc, SD_MUL);
+		break;
+	case DIV_OP:
+		emit_stack_mul_div(pc, SD_DIV);
+		break;
+	case NEG_OP:
+		/* mov rax, [r12 + rbx*8 - 8]; btc rax, 63; mov back */
+		emit1(0x49); emit1(0x8b); emit1(0x44); emit1(0xdc); emit1(0xf8);
+		emit1(0x48); emit1(0x0f); emit1(0xba); emit1(0xf8); emit1(63);
+		emit1(0x49); emit1(0x89); emit1(0x44); emit1(0xdc); emit1(0xf8);
+		break;
+	case ADD_CONST_OP:
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_load_num(XMM1, in[1].num);
+		emit_sd_reg(SD_ADD, XMM0, XMM1);
+		emit_sd_stack(SD_STORE, XMM0, -8);
+		break;
+	case IF_LESS_OP:
+	case IF_GREATER_OP:
+	case IF_LESS_EQ_OP:
+	case IF_GREATER_EQ_OP:
+	case IF_EQ_OP:
+	case IF_NOT_EQ_OP:
+		emit_check_break_to(pc, in[1].id);
+		emit_sd_stack(SD_LOAD, XMM0, -16);
+		emit_sd_stack(SD_LOAD, XMM1, -8);
+		emit_pop();
+		emit_pop();
+		emit_branch(in->opcode, in[1].id);
+		break;
+	case IF_LESS_VAR_OP:
+	case IF_GREATER_VAR_OP:
+	case IF_LESS_EQ_VAR_OP:
+	case IF_GREATER_EQ_VAR_OP:
+	case IF_EQ_VAR_OP:
+	case IF_NOT_EQ_VAR_OP:
+		emit_check_break_to(pc, in[2].id);
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_pop();
+		emit_sd_ram(SD_LOAD, XMM1, in[1].id);
+		emit_branch(in->opcode, in[2].id);
+		break;
+	case IF_LESS_CONST_OP:
+	case IF_GREATER_CONST_OP:
+	case IF_LESS_EQ_CONST_OP:
+	case IF_GREATER_EQ_CONST_OP:
+	case IF_EQ_CONST_OP:
+	case IF_NOT_EQ_CONST_OP:
+		emit_check_break_to(pc, in[2].id);
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_pop();
+		emit_load_num(XMM1, in[1].num);
+		emit_branch(in->opcode, in[2].id);
+		break;
+	case LINE_OP:
+		emit_check_break(pc);
+		break;
+	case GOTO_OP:
+		emit_check_break_to(pc, in[1].id);
+		emit_jmp(in[1].id);
+		break;
+	case GOTO_IF_TRUE_OP:
+		emit_check_break_to(pc, in[1].id);
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_pop();
+		emit_goto_if_one(in[1].id);
+		break;
+	case FOR_CMP_OP:
+		emit_sd_ram(SD_LOAD, XMM0, code[pc - 1].id);
+		emit_for_test(pc);
+		break;
+	case NEXT_OP:
+		emit_check_break(in[1].id);
+		/* var = var + step, then test with var in xmm0 */
+		emit_sd_ram(SD_LOAD, XMM0, code[in[1].id - 1].id);
+		emit_sd_ram(SD_ADD, XMM0, code[in[1].id - 3].id);
+		emit_sd_ram(SD_STORE, XMM0, code[in[1].id - 1].id);
+		emit_for_test(in[1].id);
+		emit_jmp(in[1].id + get_instr_size(&code[in[1].id]));
+		break;
+	case NEXT_INT_OP:
+		/* var = var + step; continue at the start of the loop if the
+		 * limit was not passed */
+		emit_check_break(in[1].id);
+		emit_sd_ram(SD_LOAD, XMM0, in[3].id);
+		emit_load_num(XMM1, in[4].id);
+		emit_sd_reg(SD_ADD, XMM0, XMM1);
+		emit_sd_ram(SD_STORE, XMM0, in[3].id);
+		emit_sd_ram(SD_LOAD, XMM1, in[2].id);
+		emit_for_int_cmp(in[4].id);
+		emit_jcc(CC_BE, in[1].id);
+		break;
+	case GET_LIST_UNCHECKED_OP:
+		emit_elem_index(in[1].id, 1, -8);
+		emit_sd_elem(SD_LOAD, XMM0, in[2].id * 8);
+		emit_sd_stack(SD_STORE, XMM0, -8);
+		break;
+	case GET_TABLE_UNCHECKED_OP:
+		emit_elem_index(in[1].id, 2, -16);
+		emit_sd_elem(SD_LOAD, XMM0, in[2].id * 8);
+		emit_pop();
+		emit_sd_stack(SD_STORE, XMM0, -8);
+		break;
+	case LET_LIST_UNCHECKED_OP:
+		emit_elem_index(in[1].id, 1, -16);
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_sd_elem(SD_STORE, XMM0, in[2].id * 8);
+		emit_pop();
+		emit_pop();
+		break;
+	case LET_TABLE_UNCHECKED_OP:
+		emit_elem_index(in[1].id, 2, -24);
+		emit_sd_stack(SD_LOAD, XMM0, -8);
+		emit_sd_elem(SD_STORE, XMM0, in[2].id * 8);
+		emit_pop();
+		emit_pop();
+		emit_pop();
+		break;
+	case GET_LIST_INT_OP:
+	case GET_TABLE_INT_OP:
+	case LET_LIST_INT_OP:
+	case LET_TABLE_INT_OP:
+		emit_int_elem(pc);
+		break;
+	case END_OP:
+		emit_jmp(TO_EXIT);
+		break;
+	default:
+		if (emit_checked_instr(pc) != 0) {
+			emit_slow(pc);
+		}
+		break;
+	}
+}
+
+/* Function entry: saves the registers, loads the state and jumps to the
+ * start of the program.
+ */
+static void emit_prologue(void)
+{
+	/* push rbx, rbp, r12, r13, r14, r15 */
+	emit1(0x53); emit1(0x55);
+	emit1(0x41); emit1(0x54); emit1(0x41); emit1(0x55);
+	emit1(0x41); emit1(0x56); emit1(0x41); emit1(0x57);
+	/* sub rsp, 8 (align the stack for calls) */
+	emit1(0x48); emit1(0x83); emit1(0xec); emit1(0x08);
+
+	/* mov rbp, &s_pc */
+	emit1(0x48); emit1(0xbd); emit8(&s_vm->pc);
+	/* mov r15, &s_sp */
+	emit1(0x49); emit1(0xbf); emit8(&s_vm->sp);
+	/* mov r12, s_stack */
+	emit1(0x49); emit1(0xbc); emit8(&s_vm->stack);
+	/* mov r13, s_ram */
+	emit1(0x49); emit1(0xbd); emit8(&s_vm->ram);
+	/* mov r14, s_table */
+	emit1(0x49); emit1(0xbe); emit8(&s_table);
+	/* mov ebx, [r15] */
+	emit1(0x41); emit1(0x8b); emit1(0x1f);
+	emit_jmp(TO_DISPATCH);
+}
+
+static void emit_exit_and_dispatch(void)
+{
+	s_exit_off = s_len;
+	/* mov [r15], ebx */
+	emit1(0x41); emit1(0x89); emit1(0x1f);
+	/* add rsp, 8 */
+	emit1(0x48); emit1(0x83); emit1(0xc4); emit1(0x08);
+	/* pop r15, r14, r13, r12, rbp, rbx */
+	emit1(0x41); emit1(0x5f); emit1(0x41); emit1(0x5e);
+	emit1(0x41); emit1(0x5d); emit1(0x41); emit1(0x5c);
+	emit1(0x5d); emit1(0x5b);
+	/* ret */
+	emit1(0xc3);
+
+	s_dispatch_off = s_len;
+	/* movsxd rax, dword [rbp] */
+	emit1(0x48); emit1(0x63); emit1(0x45); emit1(0x00);
+	/* jmp [r14 + rax*8] */
+	emit1(0x41); emit1(0xff); emit1(0x24); emit1(0xc6);
+}
+
+static void resolve_fixups(void)
+{
+	int i, dest, rel;
+
+	for (i = 0; i < s_nfixups; i++) {
+		switch (s_fixups[i].target) {
+		case TO_EXIT:
+			dest = s_exit_off;
+			break;
+		case TO_DISPATCH:
+			dest = s_dispatch_off;
+			break;
+		default:
+			dest = s_offs[s_fixups[i].target];
+			break;
+		}
+		rel = dest - (s_fixups[i].off + 4);
+		memcpy(s_buf + s_fixups[i].off, &rel, 4);
+	}
+}
+
+static void free_buffers(void)
+{
+	free(s_buf);
+	free(s_fixups);
+	free(s_offs);
+	s_buf = NULL;
+	s_fixups = NULL;
+	s_offs = NULL;
+	s_len = s_cap = 0;
+	s_nfixups = s_fixups_cap = 0;
+}
+
+/*
+ * Translates the code to native code, that will work on the state in 'vm'.
+ * Returns the function to call to run the program, or NULL if there is not
+ * enough memory. Call jit_free() when done.
+ */
+vm_func jit_compile(const struct jit_vm *vm)
+{
+	int size, pc;
+	void *p;
+	vm_func f;
+
+	assert(s_native == NULL);
+	assert(sizeof(sig_atomic_t) == sizeof(int));
+
+	s_vm = vm;
+	s_no_mem = 0;
+	size = get_code_size();
+	s_offs = malloc((size + 1) * sizeof *s_offs);
+	s_table = malloc((size + 1) * sizeof *s_table);
+	if (s_offs == NULL || s_table == NULL)
+		goto error;
+
+	emit_prologue();
+	for (pc = 0; pc < size && !s_no_mem;
+		pc += get_instr_size(&code[pc]))
+	{
+		s_offs[pc] = s_len;
+		emit_instr(pc);
+	}
+	emit_exit_and_dispatch();
+	if (s_no_mem)
+		goto error;
+
+	resolve_fixups();
+
+	s_native_size = s_len;
+	p = mmap(NULL, s_native_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		goto error;
+
+	s_native = p;
+	memcpy(s_native, s_buf, s_native_size);
+	if (mprotect(s_native, s_native_size, PROT_READ | PROT_EXEC) != 0)
+		goto error;
+
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		s_table[pc] = s_native + s_offs[pc];
+	}
+
+	free_buffers();
+	memcpy(&f, &p, sizeof f);
+	return f;
+
+error:	free_buffers();
+	jit_free();
+	return NULL;
+}
+
+void jit_free(void)
+{
+	if (s_native != NULL) {
+		munmap(s_native, s_native_size);
+		s_native = NULL;
+	}
+	free(s_table);
+	s_table = NULL;
+}
+
+#endif
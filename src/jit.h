@@ -0,0 +1,41 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <signal.h>
+
+/* The state of the virtual machine that the native code uses. Filled by
+ * vm.c . emitc.c writes a copy of it in the C programs it makes.
+ */
+struct jit_vm {
+	int *pc;
+	int *sp;
+	int *line_num;
+	volatile sig_atomic_t *brk;
+	void *stack;
+	void *ram;
+};
+
+typedef void (*vm_func)(void);
+
+/* The native code of a program translated to C (see emitc.c). */
+typedef void (*native_program)(const struct jit_vm *vm);
+
+/* vm.c */
+vm_func get_opcode_func(int opcode);
+void set_native_program(native_program f);
+
+/* jit.c */
+vm_func jit_compile(const struct jit_vm *vm);
+void jit_free(void);
+
+/* closure.c */
+vm_func closure_compile(const struct jit_vm *vm);
+void closure_free(void);
+
+#endif
@@ -0,0 +1,420 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Bytecode optimizer. */
+
+#include <config.h>
+#include "ecma55.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Superinstructions.
+ *
+ * We replace some frequent sequences of opcodes by a single opcode that does
+ * the same work, so the virtual machine dispatches fewer instructions.
+ *
+ * The sequences were chosen by counting, while running tests/P*.BAS (the
+ * NBS test programs), how many times each opcode was executed immediately
+ * after another one (pairs across taken jumps were not counted). Of the
+ * 15262603 pairs seen, these are the most frequent:
+ *
+ *	LINE_OP		GET_VAR_OP		12.6%
+ *	GET_VAR_OP	PUSH_NUM_OP		 6.0%
+ *	FOR_CMP_OP	LINE_OP			 5.3%
+ *	GET_VAR_OP	GET_VAR_OP		 5.3%
+ *	LINE_OP		NEXT_OP			 5.2%
+ *	PUSH_NUM_OP	ADD_OP			 5.2%
+ *	LET_VAR_OP	LINE_OP			 4.9%
+ *	GET_VAR_OP	GET_LIST_OP		 4.9%
+ *	LET_LIST_OP	LINE_OP			 3.2%
+ *	ADD_OP		GET_LIST_OP		 3.0%
+ *	GOTO_IF_TRUE_OP	LINE_OP			 2.9%
+ *	GET_LIST_OP	PUSH_NUM_OP		 2.8%
+ *	GET_LIST_OP	GET_VAR_OP		 2.2%
+ *	LESS_EQ_OP	GOTO_IF_TRUE_OP		 2.0%
+ *	GET_LIST_OP	LESS_EQ_OP		 2.0%
+ *	ADD_OP		LET_VAR_OP		 1.9%
+ *
+ * and among the longer sequences, GET_VAR_OP PUSH_NUM_OP ADD_OP (582582),
+ * PUSH_NUM_OP ADD_OP LET_VAR_OP (256342), GET_VAR_OP GET_VAR_OP ADD_OP
+ * (180697), GET_VAR_OP GET_VAR_OP SUB_OP (180052) and
+ * GET_VAR_OP PUSH_NUM_OP ADD_OP LET_VAR_OP (129765).
+ *
+ * The counts are from when every line started with a LINE_OP. Pairs that
+ * start or end with it couldn't be fused, because a line can be the target
+ * of a jump. Now LINE_OP is only compiled in debug mode, but a sequence still
+ * can't cross the start of a line: they all begin with an instruction that
+ * pushes a value, and no statement ends with one.
+ *
+ * The pairs of a comparison and GOTO_IF_TRUE_OP are now compiled by the
+ * parser as a single IF_*_OP, that compares and jumps. Here we fuse it with
+ * the instruction that pushes its right operand when it is a variable or a
+ * constant, the usual IF I < N THEN or IF A = 0 THEN.
+ */
+
+/* A sequence of opcodes and the superinstruction that replaces it.
+ * The operands of the superinstruction are the operands of the instructions
+ * of the sequence, in order, up to the number of operands it takes.
+ */
+struct fusion {
+	enum vm_opcode fused;
+	int len;
+	enum vm_opcode seq[4];
+};
+
+/* The longest sequences go first. */
+static const struct fusion s_fusions[] = {
+	{ INC_VAR_OP, 4, { GET_VAR_OP, PUSH_NUM_OP, ADD_OP, LET_VAR_OP } },
+	{ ADD_VAR_CONST_OP, 3, { GET_VAR_OP, PUSH_NUM_OP, ADD_OP } },
+	{ ADD_VAR_VAR_OP, 3, { GET_VAR_OP, GET_VAR_OP, ADD_OP } },
+	{ SUB_VAR_VAR_OP, 3, { GET_VAR_OP, GET_VAR_OP, SUB_OP } },
+	{ GET_LIST_VAR_OP, 2, { GET_VAR_OP, GET_LIST_OP } },
+	{ LET_VAR_FROM_VAR_OP, 2, { GET_VAR_OP, LET_VAR_OP } },
+	{ LET_VAR_CONST_OP, 2, { PUSH_NUM_OP, LET_VAR_OP } },
+	{ ADD_CONST_OP, 2, { PUSH_NUM_OP, ADD_OP } },
+	{ IF_LESS_VAR_OP, 2, { GET_VAR_OP, IF_LESS_OP } },
+	{ IF_GREATER_VAR_OP, 2, { GET_VAR_OP, IF_GREATER_OP } },
+	{ IF_LESS_EQ_VAR_OP, 2, { GET_VAR_OP, IF_LESS_EQ_OP } },
+	{ IF_GREATER_EQ_VAR_OP, 2, { GET_VAR_OP, IF_GREATER_EQ_OP } },
+	{ IF_EQ_VAR_OP, 2, { GET_VAR_OP, IF_EQ_OP } },
+	{ IF_NOT_EQ_VAR_OP, 2, { GET_VAR_OP, IF_NOT_EQ_OP } },
+	{ IF_LESS_CONST_OP, 2, { PUSH_NUM_OP, IF_LESS_OP } },
+	{ IF_GREATER_CONST_OP, 2, { PUSH_NUM_OP, IF_GREATER_OP } },
+	{ IF_LESS_EQ_CONST_OP, 2, { PUSH_NUM_OP, IF_LESS_EQ_OP } },
+	{ IF_GREATER_EQ_CONST_OP, 2, { PUSH_NUM_OP, IF_GREATER_EQ_OP } },
+	{ IF_EQ_CONST_OP, 2, { PUSH_NUM_OP, IF_EQ_OP } },
+	{ IF_NOT_EQ_CONST_OP, 2, { PUSH_NUM_OP, IF_NOT_EQ_OP } },
+};
+
+/*
+ * Returns an array with an element for each code position plus one, set to
+ * 1 if execution can continue there other than falling from the previous
+ * instruction: the destination of the jumps, the return address of GOSUB_OP,
+ * INPUT_OP, where the input instructions go back if the input must be
+ * repeated, and the position after it, where INPUT_END_OP goes back to assign
+ * the values.
+ * Returns NULL if no memory. The caller must free() the array.
+ */
+unsigned char *find_jump_targets(void)
+{
+	int pc, i, n, jump, size;
+	enum vm_opcode opcode;
+	unsigned char *targets;
+
+	size = get_code_size();
+	if ((targets = calloc(size + 1, sizeof *targets)) == NULL) {
+		return NULL;
+	}
+
+	targets[0] = 1;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		opcode = code[pc].opcode;
+		jump = get_opcode_jump_arg(opcode);
+		if (opcode == ON_GOTO_OP) {
+			n = code[pc + 1].id;
+			for (i = 0; i < n; i++) {
+				targets[code[pc + jump + i].id] = 1;
+			}
+		} else if (jump != 0) {
+			targets[code[pc + jump].id] = 1;
+		}
+		if (opcode == INPUT_OP) {
+			targets[pc] = 1;
+		}
+		if (opcode == GOSUB_OP || opcode == GOSUB_UNCHECKED_OP ||
+		    opcode == INPUT_OP)
+		{
+			targets[pc + get_instr_size(&code[pc])] = 1;
+		}
+	}
+
+	return targets;
+}
+
+/*
+ * Changes the jump addresses in 'new_code', which has 'size' instructions,
+ * from positions in 'code' to positions in 'new_code'. 'new_pcs' gives for
+ * each position in 'code' (plus one) its new position.
+ */
+void relocate_jumps(union instruction *new_code, int size, const int *new_pcs)
+{
+	int pc, i, n, jump;
+
+	for (pc = 0; pc < size; pc += get_instr_size(&new_code[pc])) {
+		jump = get_opcode_jump_arg(new_code[pc].opcode);
+		if (jump == 0)
+			continue;
+
+		n = 1;
+		if (new_code[pc].opcode == ON_GOTO_OP) {
+			n = new_code[pc + 1].id;
+		}
+		for (i = 0; i < n; i++) {
+			new_code[pc + jump + i].id =
+				new_pcs[new_code[pc + jump + i].id];
+		}
+	}
+}
+
+/*
+ * Returns the fusion that can be applied at 'pc', or NULL.
+ * No instruction of the sequence but the first one can be a jump target.
+ */
+static const struct fusion *find_fusion(int pc, int size,
+	const unsigned char *targets)
+{
+	int i, j, k;
+	const struct fusion *f;
+
+	for (i = 0; i < NELEMS(s_fusions); i++) {
+		f = &s_fusions[i];
+		k = pc;
+		for (j = 0; j < f->len; j++) {
+			if (k >= size || code[k].opcode != f->seq[j])
+				break;
+			if (j > 0 && targets[k])
+				break;
+			k += get_instr_size(&code[k]);
+		}
+		if (j < f->len)
+			continue;
+
+		/* GET_VAR x, PUSH_NUM c, ADD, LET_VAR x */
+		if (f->fused == INC_VAR_OP && code[pc + 1].id != code[pc + 6].id)
+			continue;
+
+		return f;
+	}
+
+	return NULL;
+}
+
+/*
+ * Replaces the frequent sequences of opcodes by superinstructions and
+ * relocates the jumps.
+ * If there is not enough memory, the code is left as it is.
+ */
+void optimize_code(void)
+{
+	int size, pc, new_pc, n, i, j, len;
+	unsigned char *targets;
+	int *new_pcs;
+	union instruction *new_code;
+	const struct fusion *f;
+
+	size = get_code_size();
+	targets = find_jump_targets();
+	new_pcs = malloc((size + 1) * sizeof *new_pcs);
+	new_code = malloc(size * sizeof *new_code);
+	if (targets == NULL || new_pcs == NULL || new_code == NULL) {
+		free(targets);
+		free(new_pcs);
+		free(new_code);
+		return;
+	}
+
+	pc = 0;
+	new_pc = 0;
+	while (pc < size) {
+		f = find_fusion(pc, size, targets);
+		if (f == NULL) {
+			new_pcs[pc] = new_pc;
+			n = get_instr_size(&code[pc]);
+			for (i = 0; i < n; i++) {
+				new_code[new_pc++] = code[pc++];
+			}
+			continue;
+		}
+
+		new_code[new_pc].opcode = f->fused;
+		n = get_instr_size(&new_code[new_pc]);
+		j = 1;
+		for (i = 0; i < f->len; i++) {
+			new_pcs[pc] = new_pc;
+			len = get_instr_size(&code[pc]);
+			pc++;
+			while (--len > 0) {
+				if (j < n) {
+					new_code[new_pc + j++] = code[pc];
+				}
+				pc++;
+			}
+		}
+		new_pc += n;
+	}
+	new_pcs[size] = new_pc;
+
+	relocate_jumps(new_code, new_pc, new_pcs);
+	relocate_lines(new_pcs);
+	free(targets);
+	free(new_pcs);
+	replace_code(new_code, new_pc);
+}
+
+/*
+ * Jump threading.
+ *
+ * Jumps that land on a GOTO_OP go directly to where the chain of GOTO_OPs
+ * ends: GOTO to a line that is a GOTO, the GOTO_OP that skips the body of a
+ * DEF followed by another DEF, an IF that jumps to a GOTO. Then a GOTO_OP that
+ * goes to a RETURN_OP is replaced by the RETURN_OP, and a GOTO_OP that goes
+ * to where execution would fall anyway is removed (as the GOTO_OP after
+ * FOR_INT_OP when the loop has no RANGE_CHECK_OP).
+ *
+ * Only the jumps of GOTO, GOSUB, ON GOTO and IF are changed: the FOR and NEXT
+ * instructions find the operands of their loop from their jump addresses.
+ * The checks of jumps into a FOR block are done before, on the line numbers,
+ * and don't see this.
+ */
+
+/* s_final[pc] while following the chain of GOTO_OPs at pc. */
+#define VISITING	-2
+
+/* For each code position with a GOTO_OP, where its chain ends, or -1. */
+static int *s_final;
+
+/* Returns 1 if we can change where the instruction 'opcode' jumps to. */
+static int is_threadable(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case GOTO_OP:
+	case GOSUB_OP:
+	case GOSUB_UNCHECKED_OP:
+	case ON_GOTO_OP:
+	case GOTO_IF_TRUE_OP:
+	case IF_LESS_OP:
+	case IF_GREATER_OP:
+	case IF_LESS_EQ_OP:
+	case IF_GREATER_EQ_OP:
+	case IF_EQ_OP:
+	case IF_NOT_EQ_OP:
+	case IF_EQ_STR_OP:
+	case IF_NOT_EQ_STR_OP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns where execution goes on after a jump to 'pc', following the
+ * GOTO_OPs. If they make a loop, the result is a GOTO_OP of the loop.
+ */
+static int final_target(int pc)
+{
+	int t, final;
+
+	t = pc;
+	while (code[t].opcode == GOTO_OP && s_final[t] == -1) {
+		s_final[t] = VISITING;
+		t = code[t + 1].id;
+	}
+
+	if (code[t].opcode == GOTO_OP && s_final[t] != VISITING)
+		final = s_final[t];
+	else
+		final = t;
+
+	for (t = pc; code[t].opcode == GOTO_OP && s_final[t] == VISITING;
+		t = code[t + 1].id)
+	{
+		s_final[t] = final;
+	}
+
+	return final;
+}
+
+/* Makes the jumps of the instruction at 'pc' go to the end of the chains. */
+static void thread_instr(int pc)
+{
+	int i, n, jump;
+
+	if (!is_threadable(code[pc].opcode))
+		return;
+
+	jump = get_opcode_jump_arg(code[pc].opcode);
+	n = 1;
+	if (code[pc].opcode == ON_GOTO_OP) {
+		n = code[pc + 1].id;
+	}
+	for (i = 0; i < n; i++) {
+		code[pc + jump + i].id = final_target(code[pc + jump + i].id);
+	}
+}
+
+/*
+ * Threads the jumps, removes the GOTO_OPs that are not needed and replaces
+ * the GOTO_OPs to a RETURN_OP by RETURN_OP.
+ * If there is not enough memory, the code is left as it is.
+ */
+void thread_jumps(void)
+{
+	int size, pc, fall, new_pc, i, n, ninstrs;
+	int *pcs, *new_pcs;
+	unsigned char *dropped;
+	union instruction *new_code;
+
+	size = get_code_size();
+	s_final = malloc((size + 1) * sizeof *s_final);
+	pcs = malloc((size + 1) * sizeof *pcs);
+	new_pcs = malloc((size + 1) * sizeof *new_pcs);
+	dropped = calloc(size + 1, sizeof *dropped);
+	new_code = malloc(size * sizeof *new_code);
+	if (s_final == NULL || pcs == NULL || new_pcs == NULL ||
+		dropped == NULL || new_code == NULL)
+	{
+		free(new_code);
+		goto end;
+	}
+
+	ninstrs = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		s_final[pc] = -1;
+		pcs[ninstrs++] = pc;
+	}
+	for (i = 0; i < ninstrs; i++) {
+		thread_instr(pcs[i]);
+	}
+
+	/* Going back, 'fall' is where execution goes on after pcs[i]. */
+	fall = size;
+	for (i = ninstrs - 1; i >= 0; i--) {
+		pc = pcs[i];
+		if (code[pc].opcode == GOTO_OP && code[pc + 1].id == fall)
+			dropped[pc] = 1;
+		else
+			fall = pc;
+	}
+
+	new_pc = 0;
+	for (i = 0; i < ninstrs; i++) {
+		pc = pcs[i];
+		new_pcs[pc] = new_pc;
+		if (dropped[pc])
+			continue;
+		if (code[pc].opcode == GOTO_OP &&
+			code[code[pc + 1].id].opcode == RETURN_OP)
+		{
+			new_code[new_pc++].opcode = RETURN_OP;
+			continue;
+		}
+		n = get_instr_size(&code[pc]);
+		memcpy(&new_code[new_pc], &code[pc], n * sizeof *new_code);
+		new_pc += n;
+	}
+	new_pcs[size] = new_pc;
+
+	relocate_jumps(new_code, new_pc, new_pcs);
+	relocate_lines(new_pcs);
+	replace_code(new_code, new_pc);
+
+end:	free(s_final);
+	free(pcs);
+	free(new_pcs);
+	free(dropped);
+	s_final = NULL;
+}
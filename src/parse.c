@@ -16,9 +16,11 @@
 #include "grammar.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* Type of variables: VARTYPE_UNDEF, VARTYPE_NUM, etc... */
 static enum var_type s_vartype[N_VARNAMES][N_SUBVARS];
@@ -105,12 +107,61 @@ static struct usrfun *usrfun_list = NULL;
 static int s_in_fun_def = 0;
 static struct usrfun *s_cur_fun = NULL;
 
+/*
+ * The indexes of the optimization passes in s_passes. The first ones are done
+ * by the parser while it compiles the code they apply to.
+ */
+enum pass_index {
+	FOLD_PASS,
+	FORINT_PASS,
+	BOUNDS_PASS,
+	CONSTIX_PASS,
+	IFCMP_PASS,
+	FNINLINE_PASS,
+	LICM_PASS,
+	INLINE_PASS,
+	GOSUB_PASS,
+	THREAD_PASS,
+	INIT_PASS,
+	IR_PASS,
+	INTVAR_PASS,
+	REGISTER_PASS,
+	FUSE_PASS
+};
+
+static int pass_runs(int i);
+static void count_rewrite(int i);
+
+/* An access to an array element in the body of a FOR with FOR_INT_OP, whose
+ * indexes are a variable plus a constant integer.
+ * pc:		pc of the GET_LIST_OP, LET_TABLE_OP, etc.
+ * nidx:	1 for a list, 2 for a table.
+ * var:		ram position of the variable of each index.
+ * off:		the constant added to it.
+ */
+struct array_ref {
+	struct array_ref *next;
+	int pc;
+	int nidx;
+	int var[2];
+	int off[2];
+};
+
 /* This is basically the structure of the program in terms of for blocks,
  * so we can check if there are jumps into for blocks, which is forbidden.
+ * For the FOR_INT_OP loops, we keep what we need to remove the checks of the
+ * array indexes.
  */
 struct for_block {
 	int coded_var;		/* variable for this FOR */
-	int cmp_pc;		/* PC of the FOR_CMP_OP for this for */
+	int pre_pc;		/* PC where the code of the FOR starts */
+	int cmp_pc;		/* PC of the FOR_CMP_OP or FOR_INT_OP */
+	int for_int;		/* if FOR_INT_OP */
+	int const_bounds;	/* if the start and limit are constants */
+	double start, limit;	/* the constants */
+	int next_pc;		/* PC of the NEXT_OP or NEXT_INT_OP */
+	int copy_pc;		/* if not 0, PC of the unchecked body copy */
+	struct array_ref *array_refs;	/* accesses we could leave unchecked */
 	int start_line_num;	/* includes FOR */
 	int end_line_num;	/* includes NEXT */
 	struct for_block *parent;	/* Block that includes us */
@@ -141,6 +192,9 @@ static int s_nerrors = 0;
 static int s_stack_max;
 static int s_stack_size;
 
+/* The number of GOSUB calls that can be pending, or -1 if we don't know. */
+static int s_gosub_stack_size;
+
 /* Returns the number of errors. Set to 0 when init_parser() is called.
  * At max will be INT_MAX.
  */
@@ -225,10 +279,40 @@ static void add_to_stack_size(int delta)
 	}
 }
 
+/*
+ * In debug mode, the instructions that assign or read variables are compiled
+ * to their variants that mark them as assigned, or warn if they were not.
+ */
+static enum vm_opcode debug_opcode(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case LET_VAR_OP: return LET_VAR_DEBUG_OP;
+	case LET_LIST_OP: return LET_LIST_DEBUG_OP;
+	case LET_TABLE_OP: return LET_TABLE_DEBUG_OP;
+	case LET_STRVAR_OP: return LET_STRVAR_DEBUG_OP;
+	case GET_VAR_OP: return GET_VAR_DEBUG_OP;
+	case GET_STRVAR_OP: return GET_STRVAR_DEBUG_OP;
+	case GET_LIST_OP: return GET_LIST_DEBUG_OP;
+	case GET_TABLE_OP: return GET_TABLE_DEBUG_OP;
+	case FOR_OP: return FOR_DEBUG_OP;
+	case FOR_INT_OP: return FOR_INT_DEBUG_OP;
+	case READ_VAR_OP: return READ_VAR_DEBUG_OP;
+	case READ_LIST_OP: return READ_LIST_DEBUG_OP;
+	case READ_TABLE_OP: return READ_TABLE_DEBUG_OP;
+	case READ_STRVAR_OP: return READ_STRVAR_DEBUG_OP;
+	case INPUT_LIST_OP: return INPUT_LIST_DEBUG_OP;
+	case INPUT_TABLE_OP: return INPUT_TABLE_DEBUG_OP;
+	default: return opcode;
+	}
+}
+
 void add_op_instr(enum vm_opcode opcode)
 {
 	union instruction instr;
 
+	if (s_debug_mode)
+		opcode = debug_opcode(opcode);
+
 	instr.opcode = opcode;
 	add_instr(instr);
 
@@ -258,8 +342,13 @@ void compile_line(int num, const char *str)
 	s_cur_fun = NULL;
 	s_cur_line_num = num;
 	s_line_pc[s_line_pc_top++].pc = get_code_size();
-	add_op_instr(LINE_OP);
-	add_id_instr(num);
+	if (add_line_start(get_code_size(), num) != 0) {
+		cerrorln(E_NO_MEM, -1, 1);
+	}
+	if (s_debug_mode) {
+		add_op_instr(LINE_OP);
+		add_id_instr(num);
+	}
 	set_lex_input(str);
 
 	if (s_end_seen) {
@@ -332,6 +421,25 @@ static void add_size_to_ram(int len)
 	}
 }
 
+/* Reserves 'len' more ram positions after the ones of the variables, for the
+ * use of the optimizers. Returns the first position, or -1 if the ram would be
+ * too big.
+ */
+int reserve_ram(int len)
+{
+	int pos;
+
+	if (iadd_overflows_int(s_ramsize, len) ||
+		is_ram_too_big(s_ramsize + len))
+	{
+		return -1;
+	}
+
+	pos = s_ramsize;
+	s_ramsize += len;
+	return pos;
+}
+
 static void add_list_size_to_ram(int len1)
 {
 	add_size_to_ram(len1);
@@ -674,12 +782,32 @@ void fun_decl(int column, int name, int nparams, int param, int pc)
 	s_cur_fun = p;
 	list_add(usrfun_list, (struct usrfun *) NULL, p);
 
+	/* The body is executed in the line of the call (line 0 in the line
+	 * table). The next line starts after its RETURN_OP.
+	 */
+	if (add_line_start(pc, 0) != 0) {
+		cerrorln(E_NO_MEM, -1, 1);
+	}
+
 	/*
 	printf("defined fun %c (%d, %c) %d\n", name, nparams,
 		get_var_letter(param), pc);
 	*/
 }
 
+/*
+ * If the code from 'pc' to 'end' is only a PUSH_NUM_OP, returns 1 and puts
+ * its number in 'd'.
+ */
+static int is_const_expr(int pc, int end, double *d)
+{
+	if (s_nerrors > 0 || end - pc != 2 || code[pc].opcode != PUSH_NUM_OP)
+		return 0;
+
+	*d = code[pc + 1].num;
+	return 1;
+}
+
 void numvar_expr(int column, int coded_var)
 {
 	if (s_in_fun_def && s_cur_fun != NULL && s_cur_fun->nparams > 0 &&
@@ -693,7 +821,207 @@ void numvar_expr(int column, int coded_var)
 	}
 }
 
-void list_expr(int column, int coded_var)
+/*
+ * If the index expression from 'pc' to 'end' is a variable, or a variable
+ * plus or minus a constant integer, returns 1 and puts in 'var' the ram
+ * position of the variable and in 'off' the constant.
+ */
+static int is_var_index(int pc, int end, int *var, int *off)
+{
+	double d;
+
+	if (end - pc != 2 && end - pc != 5)
+		return 0;
+
+	if (code[pc].opcode == GET_VAR_OP) {
+		*var = code[pc + 1].id;
+		if (end - pc == 2) {
+			*off = 0;
+			return 1;
+		}
+		if (!is_const_expr(pc + 2, pc + 4, &d))
+			return 0;
+		if (code[pc + 4].opcode == SUB_OP)
+			d = -d;
+		else if (code[pc + 4].opcode != ADD_OP)
+			return 0;
+	} else if (end - pc == 5 && is_const_expr(pc, pc + 2, &d) &&
+		   code[pc + 2].opcode == GET_VAR_OP &&
+		   code[pc + 4].opcode == ADD_OP)
+	{
+		*var = code[pc + 3].id;
+	} else {
+		return 0;
+	}
+
+	/* Small enough for any index computation not to overflow. */
+	if (d != m_floor(d) || d < -SHRT_MAX || d > SHRT_MAX)
+		return 0;
+
+	*off = (int) d;
+	return 1;
+}
+
+/*
+ * Called before adding the instruction that accesses an array element, with
+ * the index expressions i1 and, for a table, i2, which end at 'end'.
+ * Inside a FOR with FOR_INT_OP, notes the access if we could leave it
+ * unchecked, when the BOUNDS pass runs.
+ */
+static void array_access(int nidx, YYSTYPE i1, YYSTYPE i2, int end)
+{
+	struct array_ref *ref;
+	int var[2], off[2];
+
+	if (s_nerrors > 0 || s_in_fun_def || s_debug_mode ||
+	    s_cur_block == s_main_block || !s_cur_block->for_int ||
+	    !pass_runs(BOUNDS_PASS))
+	{
+		return;
+	}
+
+	if (nidx == 1) {
+		if (!is_var_index(i1.pc, end, &var[0], &off[0]))
+			return;
+		var[1] = off[1] = 0;
+	} else if (!is_var_index(i1.pc, i2.pc, &var[0], &off[0]) ||
+		   !is_var_index(i2.pc, end, &var[1], &off[1]))
+	{
+		return;
+	}
+
+	if ((ref = malloc(sizeof *ref)) == NULL) {
+		cerrorln(E_NO_MEM, -1, 1);
+		return;
+	}
+
+	ref->pc = get_code_size();
+	ref->nidx = nidx;
+	memcpy(ref->var, var, sizeof ref->var);
+	memcpy(ref->off, off, sizeof ref->off);
+	list_add(s_cur_block->array_refs, (struct array_ref *) NULL, ref);
+}
+
+/*
+ * Adds the array instruction 'opcode' for the array 'coded_var', with 'nidx'
+ * indexes. Its operands are the letter of the array and the ram position its
+ * element with all the indexes 0 would have.
+ */
+static void add_array_instr(enum vm_opcode opcode, int nidx, int coded_var)
+{
+	int vindex1;
+	const struct array_desc *desc;
+
+	vindex1 = var_index1(coded_var);
+	desc = &s_array_descs[vindex1];
+	add_op_instr(opcode);
+	add_id_instr(vindex1);
+	if (nidx == 1) {
+		add_id_instr(desc->rampos - s_base_index);
+	} else {
+		add_id_instr(desc->rampos - s_base_index * desc->dim2 -
+			s_base_index);
+	}
+}
+
+/*
+ * Deletes the 'n' instructions at 'pc' of the statement being parsed, and
+ * moves back the accesses noted after them in the current FOR block.
+ */
+static void delete_parsed_code(int pc, int n)
+{
+	struct array_ref *ref;
+
+	delete_code(pc, n);
+	if (s_cur_block == NULL)
+		return;
+
+	for (ref = s_cur_block->array_refs; ref != NULL; ref = ref->next) {
+		if (ref->pc > pc)
+			ref->pc -= n;
+	}
+}
+
+/*
+ * If the indexes of an access to the array 'coded_var', the expressions i1
+ * and, for a table, i2, which end at 'end', are constants, returns 1 and puts
+ * in 'pos' the ram position of the element. If they are out of range, puts -1
+ * and warns: the error is given at run time, if the access is done.
+ */
+static int const_elem_pos(int column, int nidx, int coded_var, YYSTYPE i1,
+			  YYSTYPE i2, int end, int *pos)
+{
+	int vindex1;
+	double d1, d2;
+	const struct array_desc *desc;
+
+	if (nidx == 1) {
+		if (!is_const_expr(i1.pc, end, &d1))
+			return 0;
+		d2 = s_base_index;
+	} else if (!is_const_expr(i1.pc, i2.pc, &d1) ||
+		   !is_const_expr(i2.pc, end, &d2))
+	{
+		return 0;
+	}
+
+	vindex1 = var_index1(coded_var);
+	desc = &s_array_descs[vindex1];
+	d1 = m_round(d1) - s_base_index;
+	d2 = m_round(d2) - s_base_index;
+	if (d1 < 0 || d1 >= desc->dim1 || d2 < 0 || d2 >= desc->dim2) {
+		cwarn(E_INDEX_RANGE);
+		putc(vindex1 + 'A', stderr);
+		if (nidx == 1) {
+			fprintf(stderr, "(%G)", d1 + s_base_index);
+		} else {
+			fprintf(stderr, "(%G,%G)", d1 + s_base_index,
+				d2 + s_base_index);
+		}
+		enl();
+		print_lex_context(column);
+		*pos = -1;
+		return 1;
+	}
+
+	*pos = desc->rampos + (int) d1 * desc->dim2 + (int) d2;
+	return 1;
+}
+
+/*
+ * Adds the instruction 'opcode', GET_LIST_OP, GET_TABLE_OP, LET_LIST_OP or
+ * LET_TABLE_OP, for the array 'coded_var' with 'nidx' indexes, the
+ * expressions i1 and, for a table, i2, which end at 'end'. If the indexes are
+ * constants in range and the CONSTIX pass runs, removes their code and adds
+ * instead a GET_VAR_OP or LET_VAR_OP of the element. Not in debug mode, where
+ * the warnings about the elements not assigned show the indexes.
+ */
+void array_elem_instr(int column, enum vm_opcode opcode, int nidx,
+		      int coded_var, YYSTYPE i1, YYSTYPE i2, int end)
+{
+	int pos;
+
+	if (pass_runs(CONSTIX_PASS) &&
+	    const_elem_pos(column, nidx, coded_var, i1, i2, end, &pos) &&
+	    pos >= 0 && !s_debug_mode)
+	{
+		count_rewrite(CONSTIX_PASS);
+		delete_parsed_code(i1.pc, 2 * nidx);
+		add_to_stack_size(-nidx);
+		if (opcode == GET_LIST_OP || opcode == GET_TABLE_OP) {
+			add_op_instr(GET_VAR_OP);
+		} else {
+			add_op_instr(LET_VAR_OP);
+		}
+		add_id_instr(pos);
+		return;
+	}
+
+	array_access(nidx, i1, i2, end);
+	add_array_instr(opcode, nidx, coded_var);
+}
+
+void list_expr(int column, int coded_var, YYSTYPE i)
 {
 	if (s_in_fun_def && s_cur_fun != NULL && s_cur_fun->nparams > 0 &&
 		coded_var == s_cur_fun->param)
@@ -702,12 +1030,12 @@ void list_expr(int column, int coded_var)
 		print_lex_context(column);
 	} else {
 		numvar_declared(column, coded_var, VARTYPE_LIST);
-		add_op_instr(GET_LIST_OP);
-		add_id_instr(var_index1(coded_var));
+		array_elem_instr(column, GET_LIST_OP, 1, coded_var, i, i,
+				 get_code_size());
 	}
 }
 
-void table_expr(int column, int coded_var)
+void table_expr(int column, int coded_var, YYSTYPE i1, YYSTYPE i2)
 {
 	if (s_in_fun_def &&s_cur_fun != NULL && s_cur_fun->nparams > 0 &&
 		coded_var == s_cur_fun->param)
@@ -716,8 +1044,8 @@ void table_expr(int column, int coded_var)
 		print_lex_context(column);
 	} else {
 		numvar_declared(column, coded_var, VARTYPE_TABLE);
-		add_op_instr(GET_TABLE_OP);
-		add_id_instr(var_index1(coded_var));
+		array_elem_instr(column, GET_TABLE_OP, 2, coded_var, i1, i2,
+				 get_code_size());
 	}
 }
 
@@ -734,40 +1062,242 @@ void check_type(YYSTYPE a, enum pstack_type t)
 	}
 }
 
+/* Returns 1 if d is +0 and not -0. */
+static int is_pos_zero(double d)
+{
+	return d == 0.0 && 1.0 / d > 0.0;
+}
+
+/*
+ * Computes 'a op b' as the virtual machine would and puts the result in 'r'.
+ * Returns 0 if the operation would give a warning or error when run, so it
+ * must be done then.
+ */
+static int fold_op(int op, double a, double b, double *r)
+{
+	switch (op) {
+	case ADD_OP: *r = a + b; break;
+	case SUB_OP: *r = a - b; break;
+	case MUL_OP:
+		*r = a * b;
+		if (m_isinf(*r) && (!m_isinf(a) || !m_isinf(b)))
+			return 0;
+		break;
+	case DIV_OP:
+		if (b == 0.0)
+			return 0;
+		*r = a / b;
+		break;
+	case POW_OP:
+		if ((a == 0.0 && b < 0.0) || (a < 0 && b != m_floor(b)))
+			return 0;
+		errno = 0;
+		*r = m_pow(a, b);
+		if (errno == ERANGE)
+			return 0;
+		break;
+	case IF_LESS_OP: *r = a < b; break;
+	case IF_GREATER_OP: *r = a > b; break;
+	case IF_LESS_EQ_OP: *r = a <= b; break;
+	case IF_GREATER_EQ_OP: *r = a >= b; break;
+	case IF_EQ_OP: *r = a == b; break;
+	case IF_NOT_EQ_OP: *r = a != b; break;
+	default: return 0;
+	}
+	return 1;
+}
+
+/*
+ * For 'a op b', where a and b are number expressions whose code has just been
+ * added: if both are constant, replaces them by the result. Removes the
+ * constant operand in x / 1, x - 0 and x + -0, which give x for any x without
+ * a warning. x + 0 gives 0 for x = -0, and x * 1 warns of an overflow for an
+ * infinite x, so they are left. Only if the FOLD pass runs.
+ * Returns 1 if done, 0 if the instruction for 'op' must still be added.
+ */
+static int fold_num_op(YYSTYPE a, YYSTYPE b, int op)
+{
+	double da, db, r;
+	int aconst, bconst, end;
+
+	if (!pass_runs(FOLD_PASS))
+		return 0;
+
+	da = db = 0;
+	end = get_code_size();
+	aconst = is_const_expr(a.pc, b.pc, &da);
+	bconst = is_const_expr(b.pc, end, &db);
+	if (aconst && bconst && fold_op(op, da, db, &r)) {
+		code[a.pc + 1].num = r;
+		delete_code(b.pc, 2);
+		add_to_stack_size(-1);
+	} else if (bconst && ((op == DIV_OP && db == 1.0) ||
+		(op == SUB_OP && is_pos_zero(db)) ||
+		(op == ADD_OP && db == 0.0 && !is_pos_zero(db))))
+	{
+		delete_code(b.pc, 2);
+		add_to_stack_size(-1);
+	} else {
+		return 0;
+	}
+
+	count_rewrite(FOLD_PASS);
+	return 1;
+}
+
+/* Adds the instruction for 'a op b', see fold_num_op(). */
+static void add_num_op_instr(YYSTYPE a, YYSTYPE b, int op)
+{
+	if (!fold_num_op(a, b, op))
+		add_op_instr(op);
+}
+
 int binary_expr(YYSTYPE a, YYSTYPE b, int op)
 {
 	check_type(a, PSTACK_NUM);
 	check_type(b, PSTACK_NUM);		
-	add_op_instr(op);
+	add_num_op_instr(a, b, op);
 	return PSTACK_NUM;
 }
 
+void neg_expr(YYSTYPE a)
+{
+	double d;
+
+	if (pass_runs(FOLD_PASS) && is_const_expr(a.pc, get_code_size(), &d)) {
+		code[a.pc + 1].num = -d;
+		count_rewrite(FOLD_PASS);
+	} else {
+		add_op_instr(NEG_OP);
+	}
+}
+
+/*
+ * Returns the opcode that compares as the IF_*_OP 'op' and pushes 1 if true,
+ * else 0.
+ */
+static enum vm_opcode cmp_opcode(enum vm_opcode op)
+{
+	switch (op) {
+	case IF_LESS_OP: return LESS_OP;
+	case IF_GREATER_OP: return GREATER_OP;
+	case IF_LESS_EQ_OP: return LESS_EQ_OP;
+	case IF_GREATER_EQ_OP: return GREATER_EQ_OP;
+	case IF_EQ_OP: return EQ_OP;
+	case IF_NOT_EQ_OP: return NOT_EQ_OP;
+	case IF_EQ_STR_OP: return EQ_STR_OP;
+	case IF_NOT_EQ_STR_OP: return NOT_EQ_STR_OP;
+	default: assert(0); return op;
+	}
+}
+
+/*
+ * Adds the branch of IF 'a relop b' THEN, without the line to jump to: an
+ * IF_*_OP that compares the two values and jumps in one instruction. If both
+ * are constant, the result is pushed and tested with GOTO_IF_TRUE_OP. If the
+ * IFCMP pass is off, the comparison pushes its result, 1 or 0, for
+ * GOTO_IF_TRUE_OP.
+ */
 void boolean_expr(YYSTYPE a, YYSTYPE relop, YYSTYPE b)
 {
+	int op;
+
 	if (a.type == PSTACK_NUM) {
 		check_type(b, PSTACK_NUM);
 		switch (relop.u.i) {
-		case '<': add_op_instr(LESS_OP); break;
-		case '>': add_op_instr(GREATER_OP); break;
-		case '=': add_op_instr(EQ_OP); break;
-		case LESS_EQ: add_op_instr(LESS_EQ_OP); break;
-		case GREATER_EQ: add_op_instr(GREATER_EQ_OP); break;
-		case NOT_EQ: add_op_instr(NOT_EQ_OP); break;
+		case '<': op = IF_LESS_OP; break;
+		case '>': op = IF_GREATER_OP; break;
+		case '=': op = IF_EQ_OP; break;
+		case LESS_EQ: op = IF_LESS_EQ_OP; break;
+		case GREATER_EQ: op = IF_GREATER_EQ_OP; break;
+		default: op = IF_NOT_EQ_OP; break;
+		}
+		if (fold_num_op(a, b, op)) {
+			add_op_instr(GOTO_IF_TRUE_OP);
+			return;
 		}
 	} else {
 		check_type(b, PSTACK_STR);
 		switch (relop.u.i) {
-		case '=': add_op_instr(EQ_STR_OP); break;
-		case NOT_EQ: add_op_instr(NOT_EQ_STR_OP); break;
+		case '=': op = IF_EQ_STR_OP; break;
+		case NOT_EQ: op = IF_NOT_EQ_STR_OP; break;
 		default:
+			op = IF_NOT_EQ_STR_OP;
 			cerror(E_STR_REL_EQ, 1);
 			print_lex_context(relop.column);
 		}
 	}
+
+	if (pass_runs(IFCMP_PASS)) {
+		add_op_instr(op);
+		count_rewrite(IFCMP_PASS);
+	} else {
+		add_op_instr(cmp_opcode(op));
+		add_op_instr(GOTO_IF_TRUE_OP);
+	}
+}
+
+/* Maximum size of the body of a DEF FN, in slots, to be copied into the
+ * calls.
+ */
+#define INLINE_FUN_SIZE	32
+
+/*
+ * Returns the size of the body of the function 'p', without its RETURN_OP,
+ * if it is small enough to be copied into the calls; else, -1.
+ */
+static int inline_fun_size(const struct usrfun *p)
+{
+	int pc;
+
+	if (s_nerrors > 0)
+		return -1;
+
+	for (pc = p->pc; code[pc].opcode != RETURN_OP;
+	     pc += get_instr_size(&code[pc]))
+	{
+		if (pc - p->pc > INLINE_FUN_SIZE)
+			return -1;
+	}
+
+	return pc - p->pc > INLINE_FUN_SIZE ? -1 : pc - p->pc;
+}
+
+/*
+ * Copies the body of the function 'p', of 'size' slots, at the end of the
+ * code. The parameter is read from its ram position with GET_VAR_OP, as any
+ * variable, so the copy can be fused and translated to registers with the
+ * expression around it.
+ */
+static void inline_fun(const struct usrfun *p, int size)
+{
+	int pc, i, n;
+	union instruction instr;
+
+	for (pc = p->pc; pc < p->pc + size; pc += n) {
+		n = get_instr_size(&code[pc]);
+		for (i = 0; i < n; i++) {
+			instr = code[pc + i];
+			if (i == 0 && instr.opcode == GET_FN_VAR_OP)
+				instr.opcode = GET_VAR_OP;
+			add_instr(instr);
+		}
+	}
 }
 
+/*
+ * A call to a DEF FN assigns the argument to the parameter, whose ram position
+ * is only used by the function, and does a GOSUB_OP to the body, that ends
+ * with a RETURN_OP. If the body is small and the FNINLINE pass runs, we copy
+ * it instead, which saves the GOSUB_OP and RETURN_OP, and lets the rest of
+ * the compiler see the expression. A function can only call those defined
+ * before it, so the body never contains a call to itself; it can contain
+ * copies of others. The copies don't use the GOSUB stack, so only the calls
+ * that are not copied can give E_STACK_OFLOW.
+ */
 void usrfun_call(int column, int name, int nparams)
 {
+	int size;
 	struct usrfun *p;
 
 	p = find_usrfun(name);
@@ -790,15 +1320,23 @@ void usrfun_call(int column, int name, int nparams)
 		add_id_instr(p->vrampos);
 	}
 
-	add_op_instr(GOSUB_OP);
-	add_id_instr(p->pc);
+	if (pass_runs(FNINLINE_PASS) && (size = inline_fun_size(p)) >= 0) {
+		inline_fun(p, size);
+		count_rewrite(FNINLINE_PASS);
+	} else {
+		add_op_instr(GOSUB_OP);
+		add_id_instr(p->pc);
+	}
 
 	add_to_stack_size(p->stack_inc);
 	add_to_stack_size(p->stack_dec);
 }
 
-void ifun_call(int column, int ifun, int nparams)
+/* 'a' is the argument expression, if nparams is 1. */
+void ifun_call(int column, int ifun, int nparams, YYSTYPE a)
 {
+	double d, r;
+
 	if (get_ifun_nparams(ifun) != nparams) {
 		cerror(E_BAD_NPARAMS, 0);
 		fprintf(stderr, "%s\n", get_ifun_name(ifun));
@@ -806,6 +1344,18 @@ void ifun_call(int column, int ifun, int nparams)
 		return;
 	}
 
+	if (nparams == 1 && pass_runs(FOLD_PASS) &&
+	    is_const_expr(a.pc, get_code_size(), &d))
+	{
+		/* Leave it for run time if it gives an error or warning. */
+		r = call_ifun1(ifun, d);
+		if (errno == 0) {
+			code[a.pc + 1].num = r;
+			count_rewrite(FOLD_PASS);
+			return;
+		}
+	}
+
 	if (nparams == 0) {
 		add_op_instr(IFUN0_OP);
 	} else {
@@ -874,6 +1424,7 @@ static void free_block(struct for_block *b)
 		q = p->next;
 		free_block(p);
 	}
+	list_free_all(b->array_refs);
 	free(b);
 }
 
@@ -948,9 +1499,16 @@ static void check_same_outer_for(int var_column, int coded_var)
 	}
 }
 
-void for_decl(int var_column, int coded_var)
+/*
+ * If 'step' is a constant integer, not 0, and the FORINT pass runs, we compile
+ * FOR_INT_OP with the step in it, followed by a GOTO_OP to the start of the
+ * loop; else FOR_OP and FOR_CMP_OP.
+ */
+void for_decl(int var_column, int coded_var, YYSTYPE start, YYSTYPE limit,
+	YYSTYPE step)
 {
-	int pc;
+	int pc, for_int;
+	double d;
 	
 	/* Check if there is a parent FOR with the same var */
 	check_same_outer_for(var_column, coded_var);
@@ -961,58 +1519,901 @@ void for_decl(int var_column, int coded_var)
 	}
 	
 	numvar_declared(var_column, coded_var, VARTYPE_NUM);
-	add_op_instr(FOR_OP);
 
-	/* own2, step */
-	add_id_instr(s_ramsize);
-	add_size_to_ram(1);
+	s_cur_block->pre_pc = start.pc;
+	for_int = pass_runs(FORINT_PASS) &&
+		is_const_expr(step.pc, get_code_size(), &d) &&
+		d != 0 && d >= -INT_MAX && d <= INT_MAX && d == (int) d;
+	if (for_int) {
+		count_rewrite(FORINT_PASS);
+		s_cur_block->const_bounds =
+			is_const_expr(start.pc, limit.pc, &s_cur_block->start) &&
+			is_const_expr(limit.pc, step.pc, &s_cur_block->limit);
+		delete_code(step.pc, 2);
+		add_to_stack_size(-1);
+		pc = get_code_size();
+		add_op_instr(FOR_INT_OP);
+
+		/* own1, limit */
+		add_id_instr(s_ramsize);
+		add_size_to_ram(1);
 
-	/* own1, limit */
-	add_id_instr(s_ramsize);
-	add_size_to_ram(1);
+		/* var, step, end of loop */
+		add_id_instr(get_rampos(coded_var));
+		add_id_instr((int) d);
+		add_id_instr(0);
+
+		/* next_decl() can change it to go to a RANGE_CHECK_OP */
+		add_op_instr(GOTO_OP);
+		add_id_instr(get_code_size() + 1);
+	} else {
+		add_op_instr(FOR_OP);
 
-	/* var */
-	add_id_instr(get_rampos(coded_var));
+		/* own2, step */
+		add_id_instr(s_ramsize);
+		add_size_to_ram(1);
 
-	pc = get_code_size();
-	add_op_instr(FOR_CMP_OP);
-	add_id_instr(0);
+		/* own1, limit */
+		add_id_instr(s_ramsize);
+		add_size_to_ram(1);
+
+		/* var */
+		add_id_instr(get_rampos(coded_var));
+
+		pc = get_code_size();
+		add_op_instr(FOR_CMP_OP);
+		add_id_instr(0);
+	}
 
 	s_cur_block->coded_var = coded_var;
 	s_cur_block->cmp_pc = pc;
+	s_cur_block->for_int = for_int;
 }
 
-void next_decl(int var_column, int coded_var)
+/* Adds the NEXT_INT_OP of the loop 'p' that goes to 'body_pc'. */
+static void add_next_int(struct for_block *p, int body_pc)
 {
-	struct for_block *p;
+	int i;
 
-	p = s_cur_block;
-	if (p == s_main_block || p->coded_var != coded_var) {
-		cerrorln(E_NEXT_WOUT_FOR, s_cur_line_num, 1);
-		return;
-	}
+	add_op_instr(NEXT_INT_OP);
+	add_id_instr(body_pc);
 
-	numvar_declared(var_column, coded_var, VARTYPE_NUM);
-	add_op_instr(NEXT_OP);
-	add_id_instr(p->cmp_pc);
-	set_id_instr(p->cmp_pc + 1, get_code_size());
-	end_for_block(s_cur_line_num);
+	/* limit, var, step */
+	for (i = 1; i <= 3; i++) {
+		add_id_instr(code[p->cmp_pc + i].id);
+	}
 }
 
-void add_line_ref(int column, int line_num)
+/* Returns 1 if 'pc' is the start of the body of a DEF FN. */
+int is_usrfun_pc(int pc)
 {
-	struct line_pc *lpc;
-	struct line_ref *lrp;
+	struct usrfun *p;
 
-	add_jump(s_cur_line_num, line_num);
+	for (p = usrfun_list; p != NULL; p = p->next)
+		if (p->pc == pc)
+			return 1;
 
-	if ((lpc = find_line(line_num)) == NULL) {
-		cerror(E_NO_LINE, 1);
-		print_lex_context(column);
-		return;
+	return 0;
+}
+
+/*
+ * Returns 1 if the body of the loop 'p' can change the variable at 'rampos':
+ * if it assigns to it, or calls a subroutine.
+ */
+static int body_changes_var(struct for_block *p, int rampos)
+{
+	int pc;
+	enum vm_opcode opcode;
+
+	for (pc = p->cmp_pc + 7; pc < p->next_pc;
+	     pc += get_instr_size(&code[pc]))
+	{
+		opcode = code[pc].opcode;
+		if ((opcode == LET_VAR_OP || opcode == READ_VAR_OP) &&
+		    code[pc + 1].id == rampos)
+		{
+			return 1;
+		}
+		if (opcode == GOSUB_OP && !is_usrfun_pc(code[pc + 1].id))
+			return 1;
 	}
 
-	if (lpc->pc >= 0) {
+	return 0;
+}
+
+/*
+ * Returns 1 if we know, from the constant bounds of the loop 'p', that the
+ * indexes of 'ref' are integers in range.
+ */
+static int is_ref_in_range(struct for_block *p, struct array_ref *ref)
+{
+	int i, var_pos, step, dim;
+	double lo, hi;
+	const struct array_desc *desc;
+
+	if (!p->const_bounds || p->start != m_floor(p->start))
+		return 0;
+
+	var_pos = code[p->cmp_pc + 2].id;
+	step = code[p->cmp_pc + 3].id;
+	lo = step > 0 ? p->start : p->limit;
+	hi = step > 0 ? p->limit : p->start;
+	desc = &s_array_descs[code[ref->pc + 1].id];
+	for (i = 0; i < ref->nidx; i++) {
+		dim = i == 0 ? desc->dim1 : desc->dim2;
+		if (ref->var[i] != var_pos ||
+		    !(lo + ref->off[i] - s_base_index >= 0 &&
+		      hi + ref->off[i] - s_base_index < dim))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static enum vm_opcode unchecked_opcode(enum vm_opcode opcode)
+{
+	switch (opcode) {
+	case GET_LIST_OP: return GET_LIST_UNCHECKED_OP;
+	case GET_TABLE_OP: return GET_TABLE_UNCHECKED_OP;
+	case LET_LIST_OP: return LET_LIST_UNCHECKED_OP;
+	case LET_TABLE_OP: return LET_TABLE_UNCHECKED_OP;
+	default: assert(0); return opcode;
+	}
+}
+
+/*
+ * Adds, after the loop 'p', a copy of its body where the accesses in
+ * 'array_refs' that are still checked are not, and a NEXT_INT_OP that goes
+ * back to the copy. Before it, a RANGE_CHECK_OP, with the 'ncheck' index
+ * checks, that goes to the copy if all the indexes will be in range in the
+ * loop, or to the original body if not. The loop starts now at the
+ * RANGE_CHECK_OP.
+ * The jumps in the copy still go to the original body: we change them when
+ * the line references are resolved, in relocate_copy_jumps().
+ */
+static void add_unchecked_copy(struct for_block *p, int ncheck)
+{
+	int body_pc, goto_pc, check_pc, i, size;
+	struct array_ref *ref;
+	struct line_ref *lr, *new_lr;
+
+	body_pc = p->cmp_pc + 7;
+	goto_pc = get_code_size();
+	add_op_instr(GOTO_OP);
+	add_id_instr(0);
+
+	check_pc = get_code_size();
+	add_op_instr(RANGE_CHECK_OP);
+	add_id_instr(body_pc);
+
+	/* limit, var, step */
+	for (i = 1; i <= 3; i++) {
+		add_id_instr(code[p->cmp_pc + i].id);
+	}
+
+	add_id_instr(ncheck);
+	for (ref = p->array_refs; ref != NULL; ref = ref->next) {
+		if (ref->pc < 0)
+			continue;
+		for (i = 0; i < ref->nidx; i++) {
+			add_id_instr(code[ref->pc + 1].id);
+			add_id_instr(i + 1);
+			add_id_instr(ref->var[i]);
+			add_id_instr(ref->off[i]);
+		}
+	}
+
+	p->copy_pc = get_code_size();
+	if (copy_line_starts(body_pc, p->next_pc, p->copy_pc) != 0) {
+		cerrorln(E_NO_MEM, -1, 1);
+		return;
+	}
+	size = p->next_pc - body_pc;
+	for (i = 0; i < size; i++) {
+		add_instr(code[body_pc + i]);
+	}
+	if (s_nerrors > 0)
+		return;
+
+	for (ref = p->array_refs; ref != NULL; ref = ref->next) {
+		if (ref->pc < 0)
+			continue;
+		i = ref->pc - body_pc + p->copy_pc;
+		code[i].opcode = unchecked_opcode(code[i].opcode);
+	}
+
+	/* The copy has the same references to lines not yet known. */
+	for (lr = line_ref_list; lr != NULL; lr = lr->next) {
+		if (lr->pc < body_pc || lr->pc >= p->next_pc)
+			continue;
+		if ((new_lr = malloc(sizeof *new_lr)) == NULL) {
+			cerrorln(E_NO_MEM, -1, 1);
+			return;
+		}
+		new_lr->line_pc = lr->line_pc;
+		new_lr->pc = lr->pc - body_pc + p->copy_pc;
+		new_lr->next = line_ref_list;
+		line_ref_list = new_lr;
+	}
+
+	if (add_line_start(get_code_size(), s_cur_line_num) != 0) {
+		cerrorln(E_NO_MEM, -1, 1);
+		return;
+	}
+	add_next_int(p, p->copy_pc);
+	set_id_instr(goto_pc + 1, get_code_size());
+	set_id_instr(p->cmp_pc + 4, get_code_size());
+	set_id_instr(p->cmp_pc + 6, check_pc);
+}
+
+/*
+ * Called at the NEXT of the FOR_INT_OP loop 'p'. If it is an inner loop, and
+ * it does not change the variables of the indexes in 'array_refs', makes
+ * unchecked the accesses that we know are in range, and, if there remain
+ * others, adds an unchecked copy of the loop for when they are in range.
+ */
+static void remove_index_checks(struct for_block *p)
+{
+	struct array_ref *ref;
+	int i, ncheck;
+
+	if (s_nerrors > 0 || p->children != NULL || p->array_refs == NULL)
+		return;
+
+	for (ref = p->array_refs; ref != NULL; ref = ref->next) {
+		for (i = 0; i < ref->nidx; i++) {
+			if (body_changes_var(p, ref->var[i]))
+				return;
+		}
+	}
+
+	ncheck = 0;
+	for (ref = p->array_refs; ref != NULL; ref = ref->next) {
+		count_rewrite(BOUNDS_PASS);
+		if (is_ref_in_range(p, ref)) {
+			code[ref->pc].opcode = unchecked_opcode(
+				code[ref->pc].opcode);
+			ref->pc = -1;
+		} else {
+			ncheck += ref->nidx;
+		}
+	}
+
+	if (ncheck > 0)
+		add_unchecked_copy(p, ncheck);
+}
+
+/*
+ * Makes the jumps in the unchecked copies of the loops in 'b' to the
+ * original body go to the copy.
+ */
+static void relocate_copy_jumps(struct for_block *b)
+{
+	struct for_block *p;
+	int pc, end, body_pc, jump, n, i, target;
+
+	for (p = b->children; p != NULL; p = p->next) {
+		relocate_copy_jumps(p);
+	}
+
+	if (b->copy_pc == 0)
+		return;
+
+	body_pc = b->cmp_pc + 7;
+	end = b->copy_pc + b->next_pc - body_pc;
+	for (pc = b->copy_pc; pc < end; pc += get_instr_size(&code[pc])) {
+		jump = get_opcode_jump_arg(code[pc].opcode);
+		if (jump == 0)
+			continue;
+
+		n = 1;
+		if (code[pc].opcode == ON_GOTO_OP) {
+			n = code[pc + 1].id;
+		}
+		for (i = 0; i < n; i++) {
+			target = code[pc + jump + i].id;
+			if (target >= body_pc && target <= b->next_pc) {
+				set_id_instr(pc + jump + i,
+					target - body_pc + b->copy_pc);
+			}
+		}
+	}
+}
+
+/*
+ * Loop invariant code motion.
+ *
+ * An expression in the body of a FOR loop, or in its unchecked copy, that
+ * only adds, subtracts or negates numbers and variables not assigned in the
+ * loop, or takes their ABS, ATN, INT or SGN, gives the same number in every
+ * iteration and never warns. We compute it once, before the code of the FOR,
+ * into a ram position of our own, that the body reads instead. The
+ * multiplications, divisions, powers and the other functions can warn, and
+ * the array accesses can stop the program: they stay where they are, so that
+ * the warnings and errors come as many times and in the same order as before.
+ *
+ * The loops are visited from the outside in, and each expression goes before
+ * the outermost loop where it is invariant; for the loops inside it, it is
+ * then like a variable. We leave alone a loop that calls a subroutine, which
+ * could assign any variable, or that has the body of a DEF FN, which is also
+ * called from outside. The array elements with constant indexes are read as
+ * variables, but an array access with other indexes can assign them: they
+ * are never invariant.
+ */
+
+/*
+ * An expression moved out of the loop s_loops[loop]: the code from 'start' to
+ * 'end', whose number is kept at the ram position 'temp'. 'inner' is the one
+ * moved out of an outer loop that starts at the same position, or -1.
+ * 'copied' is 1 for the one whose code goes before the loop; the others have
+ * the same code and use its ram position.
+ */
+struct hoist {
+	int start;
+	int end;
+	int temp;
+	int loop;
+	int inner;
+	int copied;
+};
+
+/* A FOR loop, and its expressions in s_hoists. */
+struct hoist_loop {
+	struct for_block *block;
+	int first;
+	int n;
+};
+
+/*
+ * A number that an instruction from 'start' to 'end' leaves on the stack.
+ * 'leaf' is 1 if it is a PUSH_NUM_OP, a GET_VAR_OP or an expression moved
+ * out of an outer loop.
+ */
+struct hoist_node {
+	int start;
+	int end;
+	int invariant;
+	int leaf;
+};
+
+static struct hoist *s_hoists;
+static int s_nhoists;
+static int s_hoists_capacity;
+
+static struct hoist_loop *s_hoist_loops;
+static int s_nhoist_loops;
+
+/* For each code position, the largest expression moved out that starts
+ * there, or -1.
+ */
+static int *s_hoist_at;
+
+/* For each ram position, the last loop in s_hoist_loops that assigns it. */
+static int *s_assigner;
+
+static unsigned char *s_hoist_targets;
+
+/* The numbers on the stack that we follow, and their capacity. */
+static struct hoist_node *s_nodes;
+static int s_nnodes;
+static int s_max_nodes;
+
+static int count_loops(const struct for_block *b)
+{
+	int n;
+	const struct for_block *p;
+
+	n = 0;
+	for (p = b->children; p != NULL; p = p->next) {
+		n += 1 + count_loops(p);
+	}
+
+	return n;
+}
+
+/* Puts the loops in 'b' in s_hoist_loops, each one before those inside it. */
+static void collect_loops(struct for_block *b)
+{
+	struct for_block *p;
+
+	for (p = b->children; p != NULL; p = p->next) {
+		s_hoist_loops[s_nhoist_loops++].block = p;
+		collect_loops(p);
+	}
+}
+
+/*
+ * Puts in 'start' and 'end' the ranges of code of the loop 'p', its body and
+ * its unchecked copy, and returns how many.
+ */
+static int loop_ranges(const struct for_block *p, int start[2], int end[2])
+{
+	start[0] = p->for_int ? p->cmp_pc + 7 : p->cmp_pc + 2;
+	end[0] = p->next_pc;
+	if (p->copy_pc == 0)
+		return 1;
+
+	start[1] = p->copy_pc;
+	end[1] = p->copy_pc + end[0] - start[0];
+	return 2;
+}
+
+/*
+ * Puts in 'rampos' the scalar numeric variables that the instruction at 'pc'
+ * assigns and returns how many.
+ */
+static int assigned_vars(int pc, int rampos[3])
+{
+	switch (code[pc].opcode) {
+	case LET_VAR_OP:
+	case LET_VAR_DEBUG_OP:
+	case READ_VAR_OP:
+	case READ_VAR_DEBUG_OP:
+		rampos[0] = code[pc + 1].id;
+		return 1;
+	case FOR_OP:
+	case FOR_DEBUG_OP:
+		/* step, limit, var */
+		rampos[0] = code[pc + 1].id;
+		rampos[1] = code[pc + 2].id;
+		rampos[2] = code[pc + 3].id;
+		return 3;
+	case FOR_INT_OP:
+	case FOR_INT_DEBUG_OP:
+		/* limit, var */
+		rampos[0] = code[pc + 1].id;
+		rampos[1] = code[pc + 2].id;
+		return 2;
+	case NEXT_OP:
+		/* the variable is before the FOR_CMP_OP it goes to */
+		rampos[0] = code[code[pc + 1].id - 1].id;
+		return 1;
+	case NEXT_INT_OP:
+		rampos[0] = code[pc + 3].id;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Takes note in s_assigner of the variables that the loop 'li' assigns, its
+ * own variable included. Returns 0 if we must not move code out of it.
+ */
+static int mark_assigned(int li)
+{
+	int start[2], end[2], nranges, r, pc, i, n;
+	int rampos[3];
+	const struct for_block *p;
+
+	p = s_hoist_loops[li].block;
+	if (p->for_int)
+		s_assigner[code[p->cmp_pc + 2].id] = li;
+	else
+		s_assigner[code[p->cmp_pc - 1].id] = li;
+
+	nranges = loop_ranges(p, start, end);
+	for (r = 0; r < nranges; r++) {
+		for (pc = start[r]; pc < end[r];
+		     pc += get_instr_size(&code[pc]))
+		{
+			if (is_usrfun_pc(pc))
+				return 0;
+			if (code[pc].opcode == GOSUB_OP &&
+			    !is_usrfun_pc(code[pc + 1].id))
+			{
+				return 0;
+			}
+			n = assigned_vars(pc, rampos);
+			for (i = 0; i < n; i++) {
+				s_assigner[rampos[i]] = li;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the variable at 'rampos' is not changed by the loop 'li'. */
+static int is_invariant_var(int li, int rampos)
+{
+	int i;
+	const struct array_desc *desc;
+
+	if (s_assigner[rampos] == li)
+		return 0;
+
+	for (i = 0; i < N_VARNAMES; i++) {
+		desc = &s_array_descs[i];
+		if (rampos >= desc->rampos &&
+		    rampos < desc->rampos + desc->dim1 * desc->dim2)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the code at 'a' and 'b', of 'len' elements, is the same. */
+static int is_same_code(int a, int b, int len)
+{
+	int i, n;
+
+	for (i = 0; i < len; i += n) {
+		if (code[a + i].opcode != code[b + i].opcode)
+			return 0;
+		n = get_instr_size(&code[a + i]);
+		if (code[a + i].opcode == PUSH_NUM_OP) {
+			if (memcmp(&code[a + i + 1].num, &code[b + i + 1].num,
+				sizeof code[a].num) != 0)
+			{
+				return 0;
+			}
+		} else if (n > 1 && code[a + i + 1].id != code[b + i + 1].id) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Moves out of the loop 'li' the expression of 'node'. */
+static void add_hoist(int li, const struct hoist_node *node)
+{
+	int i, temp, copied, len, new_len;
+	struct hoist *new_hoists;
+
+	if (!node->invariant || node->leaf)
+		return;
+
+	len = node->end - node->start;
+	copied = 1;
+	for (i = s_hoist_loops[li].first; i < s_nhoists; i++) {
+		if (s_hoists[i].copied && s_hoists[i].end - s_hoists[i].start ==
+		    len && is_same_code(s_hoists[i].start, node->start, len))
+		{
+			copied = 0;
+			break;
+		}
+	}
+
+	if (copied) {
+		if ((temp = reserve_ram(1)) < 0)
+			return;
+	} else {
+		temp = s_hoists[i].temp;
+	}
+
+	if (s_nhoists == s_hoists_capacity) {
+		grow_array((void *) s_hoists, (int) sizeof *s_hoists,
+			s_hoists_capacity, 16, (void **) &new_hoists,
+			&new_len);
+		if (s_hoists_capacity == new_len)
+			return;
+		s_hoists = new_hoists;
+		s_hoists_capacity = new_len;
+	}
+
+	s_hoists[s_nhoists].start = node->start;
+	s_hoists[s_nhoists].end = node->end;
+	s_hoists[s_nhoists].temp = temp;
+	s_hoists[s_nhoists].loop = li;
+	s_hoists[s_nhoists].inner = s_hoist_at[node->start];
+	s_hoists[s_nhoists].copied = copied;
+	s_hoist_at[node->start] = s_nhoists;
+	s_nhoists++;
+}
+
+/* Moves out of the loop 'li' the expressions on the stack, and empties it. */
+static void flush_nodes(int li)
+{
+	int i;
+
+	for (i = 0; i < s_nnodes; i++) {
+		add_hoist(li, &s_nodes[i]);
+	}
+	s_nnodes = 0;
+}
+
+static void push_node(int li, int start, int end, int invariant, int leaf)
+{
+	if (s_nnodes == s_max_nodes)
+		flush_nodes(li);
+
+	s_nodes[s_nnodes].start = start;
+	s_nodes[s_nnodes].end = end;
+	s_nodes[s_nnodes].invariant = invariant;
+	s_nodes[s_nnodes].leaf = leaf;
+	s_nnodes++;
+}
+
+/*
+ * Follows the instruction at 'pc', which ends at 'end', in the loop 'li', if
+ * it is one of an expression that can be invariant. Returns 0 if not.
+ */
+static int follow_instr(int li, int pc, int end)
+{
+	struct hoist_node a, b;
+
+	switch (code[pc].opcode) {
+	case PUSH_NUM_OP:
+		push_node(li, pc, end, 1, 1);
+		return 1;
+	case GET_VAR_OP:
+		push_node(li, pc, end, is_invariant_var(li, code[pc + 1].id),
+			1);
+		return 1;
+	case IFUN1_OP:
+		if (!is_ifun_quiet(code[pc + 1].id))
+			return 0;
+		/* fall through */
+	case NEG_OP:
+		if (s_nnodes < 1)
+			return 0;
+		a = s_nodes[--s_nnodes];
+		push_node(li, a.start, end, a.invariant, 0);
+		return 1;
+	case ADD_OP:
+	case SUB_OP:
+		if (s_nnodes < 2)
+			return 0;
+		b = s_nodes[--s_nnodes];
+		a = s_nodes[--s_nnodes];
+		if (!a.invariant || !b.invariant) {
+			add_hoist(li, &a);
+			add_hoist(li, &b);
+		}
+		push_node(li, a.start, end, a.invariant && b.invariant, 0);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Moves out of the loop 'li' the largest invariant expressions in the code
+ * from 'start' to 'end'. The stack is empty at the jump targets.
+ */
+static void find_invariants(int li, int start, int end)
+{
+	int pc, next, h;
+
+	s_nnodes = 0;
+	for (pc = start; pc < end; pc = next) {
+		if (s_hoist_targets[pc])
+			flush_nodes(li);
+
+		if ((h = s_hoist_at[pc]) >= 0) {
+			next = s_hoists[h].end;
+			push_node(li, pc, next, 1, 1);
+			continue;
+		}
+
+		next = pc + get_instr_size(&code[pc]);
+		if (!follow_instr(li, pc, next))
+			flush_nodes(li);
+	}
+	flush_nodes(li);
+}
+
+/*
+ * Copies to 'new_code' at '*new_pc' the code of the expression 'h', reading
+ * the expressions moved out of outer loops from their ram positions.
+ */
+static void copy_hoist(union instruction *new_code, int *new_pc, int h)
+{
+	int pc, i, n;
+
+	pc = s_hoists[h].start;
+	i = s_hoists[h].inner;
+	while (pc < s_hoists[h].end) {
+		if (i >= 0) {
+			new_code[(*new_pc)++].opcode = GET_VAR_OP;
+			new_code[(*new_pc)++].id = s_hoists[i].temp;
+			pc = s_hoists[i].end;
+		} else {
+			n = get_instr_size(&code[pc]);
+			memcpy(&new_code[*new_pc], &code[pc], n * sizeof *code);
+			*new_pc += n;
+			pc += n;
+		}
+		i = s_hoist_at[pc];
+	}
+}
+
+/*
+ * Writes the code with the expressions in s_hoists before their loops, and
+ * read from their ram positions in the loops. A jump to the FOR goes to the
+ * code moved before it.
+ * Returns E_NO_MEM if not enough memory, and then the code is not changed.
+ */
+static enum error_code write_hoists(void)
+{
+	int size, new_size, pc, end, first, new_pc, h, li;
+	int *new_pcs, *loop_at;
+	union instruction *new_code;
+	struct usrfun *p;
+
+	size = get_code_size();
+	new_size = size;
+	for (h = 0; h < s_nhoists; h++) {
+		if (s_hoists[h].copied)
+			new_size += s_hoists[h].end - s_hoists[h].start + 2;
+	}
+
+	new_pcs = malloc((size + 1) * sizeof *new_pcs);
+	loop_at = malloc(size * sizeof *loop_at);
+	new_code = malloc(new_size * sizeof *new_code);
+	if (new_pcs == NULL || loop_at == NULL || new_code == NULL) {
+		free(new_pcs);
+		free(loop_at);
+		free(new_code);
+		return E_NO_MEM;
+	}
+
+	for (pc = 0; pc < size; pc++) {
+		loop_at[pc] = -1;
+	}
+	for (li = 0; li < s_nhoist_loops; li++) {
+		if (s_hoist_loops[li].n > 0)
+			loop_at[s_hoist_loops[li].block->pre_pc] = li;
+	}
+
+	new_pc = 0;
+	for (pc = 0; pc < size; ) {
+		first = new_pc;
+		if ((li = loop_at[pc]) >= 0) {
+			end = s_hoist_loops[li].first + s_hoist_loops[li].n;
+			for (h = s_hoist_loops[li].first; h < end; h++) {
+				if (!s_hoists[h].copied)
+					continue;
+				copy_hoist(new_code, &new_pc, h);
+				new_code[new_pc++].opcode = LET_VAR_OP;
+				new_code[new_pc++].id = s_hoists[h].temp;
+			}
+		}
+
+		if ((h = s_hoist_at[pc]) >= 0) {
+			new_code[new_pc++].opcode = GET_VAR_OP;
+			new_code[new_pc++].id = s_hoists[h].temp;
+			end = s_hoists[h].end;
+		} else {
+			end = pc + get_instr_size(&code[pc]);
+			memcpy(&new_code[new_pc], &code[pc],
+				(end - pc) * sizeof *code);
+			new_pc += end - pc;
+		}
+
+		for (; pc < end; pc++) {
+			new_pcs[pc] = first;
+		}
+	}
+	new_pcs[size] = new_pc;
+
+	relocate_jumps(new_code, new_pc, new_pcs);
+	relocate_lines(new_pcs);
+	replace_code(new_code, new_pc);
+	for (p = usrfun_list; p != NULL; p = p->next) {
+		p->pc = new_pcs[p->pc];
+	}
+
+	free(new_pcs);
+	free(loop_at);
+	return 0;
+}
+
+static void free_hoisting(void)
+{
+	free(s_hoists);
+	free(s_hoist_loops);
+	free(s_hoist_at);
+	free(s_assigner);
+	free(s_hoist_targets);
+	free(s_nodes);
+	s_hoists = NULL;
+	s_hoist_loops = NULL;
+	s_hoist_at = s_assigner = NULL;
+	s_hoist_targets = NULL;
+	s_nodes = NULL;
+	s_nhoists = 0;
+	s_hoists_capacity = 0;
+	s_nhoist_loops = 0;
+}
+
+/*
+ * Moves the invariant expressions out of the FOR loops. It uses the positions
+ * noted in the for blocks while parsing: it must run before any other pass
+ * changes the code.
+ */
+static void hoist_invariants(void)
+{
+	int size, pc, rampos, li, r, nranges, nloops;
+	int start[2], end[2];
+
+	if ((nloops = count_loops(s_main_block)) == 0)
+		return;
+
+	size = get_code_size();
+	s_max_nodes = s_stack_max + 1;
+	s_hoist_loops = malloc(nloops * sizeof *s_hoist_loops);
+	s_hoist_at = malloc((size + 1) * sizeof *s_hoist_at);
+	s_assigner = malloc(s_ramsize * sizeof *s_assigner);
+	s_nodes = malloc(s_max_nodes * sizeof *s_nodes);
+	s_hoist_targets = find_jump_targets();
+	if (s_hoist_loops == NULL || s_hoist_at == NULL ||
+	    s_assigner == NULL || s_nodes == NULL || s_hoist_targets == NULL)
+	{
+		free_hoisting();
+		return;
+	}
+
+	for (pc = 0; pc <= size; pc++) {
+		s_hoist_at[pc] = -1;
+	}
+	for (rampos = 0; rampos < s_ramsize; rampos++) {
+		s_assigner[rampos] = -1;
+	}
+
+	collect_loops(s_main_block);
+	for (li = 0; li < s_nhoist_loops; li++) {
+		s_hoist_loops[li].first = s_nhoists;
+		if (mark_assigned(li)) {
+			nranges = loop_ranges(s_hoist_loops[li].block, start,
+				end);
+			for (r = 0; r < nranges; r++) {
+				find_invariants(li, start[r], end[r]);
+			}
+		}
+		s_hoist_loops[li].n = s_nhoists - s_hoist_loops[li].first;
+	}
+
+	if (s_nhoists > 0)
+		write_hoists();
+	free_hoisting();
+}
+
+void next_decl(int var_column, int coded_var)
+{
+	struct for_block *p;
+
+	p = s_cur_block;
+	if (p == s_main_block || p->coded_var != coded_var) {
+		cerrorln(E_NEXT_WOUT_FOR, s_cur_line_num, 1);
+		return;
+	}
+
+	numvar_declared(var_column, coded_var, VARTYPE_NUM);
+	if (p->for_int) {
+		p->next_pc = get_code_size();
+		add_next_int(p, p->cmp_pc + 7);
+		set_id_instr(p->cmp_pc + 4, get_code_size());
+		remove_index_checks(p);
+	} else {
+		p->next_pc = get_code_size();
+		add_op_instr(NEXT_OP);
+		add_id_instr(p->cmp_pc);
+		set_id_instr(p->cmp_pc + 1, get_code_size());
+	}
+	end_for_block(s_cur_line_num);
+}
+
+void add_line_ref(int column, int line_num)
+{
+	struct line_pc *lpc;
+	struct line_ref *lrp;
+
+	add_jump(s_cur_line_num, line_num);
+
+	if ((lpc = find_line(line_num)) == NULL) {
+		cerror(E_NO_LINE, 1);
+		print_lex_context(column);
+		return;
+	}
+
+	if (lpc->pc >= 0) {
 		/* We know the jump address. */
 		add_id_instr(lpc->pc);
 		return;
@@ -1045,6 +2446,275 @@ int get_parsed_stack_size(void)
 	return s_stack_max;
 }
 
+int get_parsed_gosub_stack_size(void)
+{
+	return s_gosub_stack_size;
+}
+
+/* The optimization level, from 0 to MAX_OPT_LEVEL. */
+int s_opt_level = MAX_OPT_LEVEL;
+
+/* If 1, end_parsing() prints what each pass did to stderr. */
+int s_pass_report = 0;
+
+/*
+ * Copies the subroutines into their calls. As the copies don't push their
+ * return point, the GOSUB stack must be sized for the calls that are left,
+ * so that it doesn't overflow at another line.
+ */
+static void inline_subroutines(void)
+{
+	if (pass_runs(GOSUB_PASS))
+		inline_gosubs();
+}
+
+/*
+ * Sizes the GOSUB stack for the calls that can be pending and, if they are
+ * bounded, removes the checks of GOSUB_OP.
+ */
+static void size_gosub_stack(void)
+{
+	s_gosub_stack_size = gosub_stack_depth();
+	if (s_gosub_stack_size >= 0)
+		remove_gosub_checks();
+}
+
+/*
+ * The optimization passes, in the order they run. A pass runs if s_opt_level
+ * is at least its 'level' and it has not been switched off with
+ * set_pass_on(). Those without 'run' are done by the parser, each time it
+ * compiles code they apply to; the rest transform the code once it is parsed
+ * and its jumps checked.
+ */
+struct pass {
+	const char *name;
+	int level;
+	void (*run)(void);
+};
+
+static const struct pass s_passes[] = {
+	{ "FOLD", 1, NULL },
+	{ "FORINT", 1, NULL },
+	{ "BOUNDS", 2, NULL },
+	{ "CONSTIX", 1, NULL },
+	{ "IFCMP", 1, NULL },
+	{ "FNINLINE", 2, NULL },
+	{ "LICM", 2, hoist_invariants },
+	{ "INLINE", 2, inline_subroutines },
+	{ "GOSUB", 1, size_gosub_stack },
+	{ "THREAD", 1, thread_jumps },
+	{ "INIT", 1, remove_init_checks },
+	{ "IR", 2, optimize_ir },
+	{ "INTVAR", 1, use_int_vars },
+	{ "REGISTER", 1, translate_to_registers },
+	{ "FUSE", 1, optimize_code },
+};
+
+/*
+ * What a pass did the last time it ran: the number of instructions before and
+ * after, how many of them it rewrote (-1 if we don't know) and the time it
+ * took. For the passes done by the parser, only the number of times they
+ * rewrote the code; 'ninstrs_in' is -1.
+ */
+struct pass_stats {
+	int ran;
+	int ninstrs_in;
+	int ninstrs_out;
+	int nrewritten;
+	double secs;
+};
+
+/* 1 for the passes switched off. */
+static unsigned char s_pass_off[NELEMS(s_passes)];
+
+static struct pass_stats s_pass_stats[NELEMS(s_passes)];
+
+/*
+ * Returns the index of the pass called as the 'len' characters of 'name',
+ * ignoring case, or -1.
+ */
+int find_pass(const char *name, size_t len)
+{
+	int i;
+	size_t j;
+	const char *p;
+
+	for (i = 0; i < NELEMS(s_passes); i++) {
+		p = s_passes[i].name;
+		for (j = 0; j < len && p[j] != '\0'; j++) {
+			if (toupper(name[j]) != p[j])
+				break;
+		}
+		if (j == len && p[j] == '\0')
+			return i;
+	}
+
+	return -1;
+}
+
+/* Switches on or off the pass 'i' (see find_pass()). */
+void set_pass_on(int i, int on)
+{
+	s_pass_off[i] = !on;
+}
+
+/*
+ * Returns 1 if the pass 'i' runs at s_opt_level. REGISTER only runs with -r
+ * and not in debug mode.
+ */
+static int pass_runs(int i)
+{
+	if (i == REGISTER_PASS && (!s_register_mode || s_debug_mode))
+		return 0;
+	return s_passes[i].level <= s_opt_level && !s_pass_off[i];
+}
+
+/* The pass 'i', done by the parser, has rewritten some code. */
+static void count_rewrite(int i)
+{
+	s_pass_stats[i].nrewritten++;
+}
+
+/* Clears the statistics of the passes, and notes those done by the parser. */
+static void reset_pass_stats(void)
+{
+	int i;
+
+	memset(s_pass_stats, 0, sizeof s_pass_stats);
+	for (i = 0; i < NELEMS(s_passes); i++) {
+		if (s_passes[i].run == NULL && pass_runs(i)) {
+			s_pass_stats[i].ran = 1;
+			s_pass_stats[i].ninstrs_in = -1;
+		}
+	}
+}
+
+/* Returns the number of instructions in the code 'c' of 'size' elements. */
+static int count_instrs(const union instruction *c, int size)
+{
+	int pc, n;
+
+	n = 0;
+	for (pc = 0; pc < size; pc += get_instr_size(&c[pc]))
+		n++;
+
+	return n;
+}
+
+/*
+ * Returns how many instructions a pass rewrote, given the code 'old' of
+ * 'old_size' elements that it had at the start. If the size has not changed,
+ * these are the instructions that are different in place; else, for each
+ * opcode, the instructions with it beyond the number there were in 'old'.
+ */
+static int count_rewritten(const union instruction *old, int old_size)
+{
+	static int counts[VM_NOPS];
+	int pc, i, n, size;
+
+	size = get_code_size();
+	n = 0;
+	if (size == old_size) {
+		for (pc = 0; pc < size; pc += i) {
+			i = get_instr_size(&code[pc]);
+			if (memcmp(&code[pc], &old[pc], i * sizeof *code) != 0)
+				n++;
+		}
+		return n;
+	}
+
+	memset(counts, 0, sizeof counts);
+	for (pc = 0; pc < old_size; pc += get_instr_size(&old[pc]))
+		counts[old[pc].opcode]++;
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (counts[code[pc].opcode] > 0)
+			counts[code[pc].opcode]--;
+		else
+			n++;
+	}
+
+	return n;
+}
+
+/* Runs the pass 'i' and takes note of what it did in s_pass_stats[i]. */
+static void run_pass(int i)
+{
+	struct pass_stats *stats;
+	union instruction *old;
+	int old_size;
+	clock_t t;
+
+	stats = &s_pass_stats[i];
+	old_size = get_code_size();
+	if ((old = malloc(old_size * sizeof *code)) != NULL)
+		memcpy(old, code, old_size * sizeof *code);
+
+	stats->ran = 1;
+	stats->ninstrs_in = count_instrs(code, old_size);
+	t = clock();
+	s_passes[i].run();
+	stats->secs = (double) (clock() - t) / CLOCKS_PER_SEC;
+	stats->ninstrs_out = count_instrs(code, get_code_size());
+	stats->nrewritten = -1;
+	if (old != NULL) {
+		stats->nrewritten = count_rewritten(old, old_size);
+		free(old);
+	}
+}
+
+/* Runs the passes for s_opt_level that are not switched off. */
+static void run_passes(void)
+{
+	int i;
+
+	for (i = 0; i < NELEMS(s_passes); i++) {
+		if (s_passes[i].run != NULL && pass_runs(i))
+			run_pass(i);
+	}
+}
+
+/*
+ * Prints the passes, if they run (ON), are switched off (OFF) or don't run
+ * for other reasons (SKIP), and what they did the last time the program was
+ * compiled.
+ */
+void print_passes(FILE *f)
+{
+	int i;
+	const char *state;
+	const struct pass_stats *stats;
+
+	fprintf(f, "%-8s %5s %-4s %6s %6s %9s %8s\n", "PASS", "LEVEL", "ON",
+		"IN", "OUT", "REWRITTEN", "MS");
+	for (i = 0; i < NELEMS(s_passes); i++) {
+		if (pass_runs(i))
+			state = "ON";
+		else if (s_pass_off[i])
+			state = "OFF";
+		else
+			state = "SKIP";
+		fprintf(f, "%-8s %5d %s", s_passes[i].name,
+			s_passes[i].level, state);
+		stats = &s_pass_stats[i];
+		if (!stats->ran) {
+			fprintf(f, "\n");
+			continue;
+		}
+		fprintf(f, "%*s", 5 - (int) strlen(state), "");
+		if (stats->ninstrs_in < 0) {
+			fprintf(f, "%6s %6s %9d %8s\n", "-", "-",
+				stats->nrewritten, "-");
+			continue;
+		}
+		fprintf(f, "%6d %6d", stats->ninstrs_in, stats->ninstrs_out);
+		if (stats->nrewritten < 0)
+			fprintf(f, " %9s", "?");
+		else
+			fprintf(f, " %9d", stats->nrewritten);
+		fprintf(f, " %8.3f\n", stats->secs * 1000);
+	}
+}
+
 void end_parsing(void)
 {
 	s_main_block->end_line_num = s_cur_line_num;
@@ -1058,11 +2728,18 @@ void end_parsing(void)
 
 	if (s_nerrors == 0) {
 		patch_line_references();
+		relocate_copy_jumps(s_main_block);
 	}
 
 	if (s_nerrors == 0) {
 		check_jumps();
 	}
+
+	if (s_nerrors == 0) {
+		run_passes();
+		if (s_pass_report)
+			print_passes(stderr);
+	}
 }
 
 /* Inits the parser, to call before yyparse().
@@ -1081,6 +2758,8 @@ int init_parser(void)
 	s_end_seen = 0;
 	s_stack_size = 0;
 	s_stack_max = 0;
+	s_gosub_stack_size = -1;
+	reset_pass_stats();
 	reset_array_descriptors();
 	reset_ram_var_map();
 	for (i = 0; i < N_VARNAMES; i++) {
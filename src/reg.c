@@ -0,0 +1,496 @@
+/* --------------------------------------------------------------------------
+ * Copyright (C) 2023 Jorge Giner Cordero
+ * License: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>
+ * --------------------------------------------------------------------------
+ */
+
+/* Translation of the stack bytecode to register instructions. */
+
+#include <config.h>
+#include "ecma55.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The compiler generates code for a stack machine. LET A = B + C is:
+ *
+ *	GET_VAR_OP B, GET_VAR_OP C, ADD_OP, LET_VAR_OP A
+ *
+ * which here becomes the register instruction R_ADD_OP B C A .
+ *
+ * We go through the code keeping a symbolic stack: GET_VAR_OP and
+ * PUSH_NUM_OP don't generate code, they only push their operand (a variable
+ * or a constant) on the symbolic stack. An instruction whose operands are all
+ * in the symbolic stack becomes a register instruction that leaves its result
+ * in a temporary: there is one temporary for each depth of the stack.
+ * LET_VAR_OP then simply changes the destination of that instruction to the
+ * variable.
+ *
+ * Any other instruction needs its operands on the real stack, so first we
+ * push there the contents of the symbolic stack (flush), using GET_VAR_OP
+ * and PUSH_NUM_OP, and then copy the instruction as it is. We flush too
+ * before any jump target, because the code that jumps there leaves its
+ * operands on the real stack.
+ *
+ * The temporaries, and the constants used by register instructions, take
+ * ram positions after the variables. The constants are set by a prologue of
+ * LET_VAR_CONST_OP instructions at the start of the program.
+ *
+ * As a variable is read by the register instruction that uses it, and not
+ * where it was pushed, in debug mode the warnings about variables not
+ * initialized could be printed in another order. So we don't translate in
+ * debug mode.
+ */
+
+enum entry_kind {
+	ENTRY_VAR,
+	ENTRY_CONST,
+	ENTRY_TEMP
+};
+
+/* An element of the symbolic stack. */
+struct entry {
+	enum entry_kind kind;
+	int rampos;
+	double num;
+};
+
+/* Symbolic stack. */
+static struct entry *s_entries;
+static int s_nentries;
+static int s_entries_capacity;
+
+/* Translated code, without the prologue. */
+static union instruction *s_rcode;
+static int s_rsize;
+static int s_rcapacity;
+
+/* Constants, they go in ram from s_const_base. */
+static double *s_consts;
+static int s_nconsts;
+static int s_consts_capacity;
+
+/* Ram position of the first temporary and of the first constant. */
+static int s_temp_base;
+static int s_const_base;
+
+/* Position in s_rcode of the destination of the last register instruction
+ * generated, or -1.
+ */
+static int s_last_dst;
+
+static int s_no_mem;
+
+static void emit(union instruction instr)
+{
+	union instruction *new_code;
+	int new_len;
+
+	if (s_rsize == s_rcapacity) {
+		grow_array((void *) s_rcode, (int) sizeof *s_rcode,
+			s_rcapacity, 256, (void **) &new_code, &new_len);
+
+		if (s_rcapacity == new_len) {
+			s_no_mem = 1;
+			return;
+		}
+
+		s_rcode = new_code;
+		s_rcapacity = new_len;
+	}
+
+	s_rcode[s_rsize++] = instr;
+}
+
+static void emit_opcode(enum vm_opcode opcode)
+{
+	union instruction instr;
+
+	instr.opcode = opcode;
+	emit(instr);
+}
+
+static void emit_id(int id)
+{
+	union instruction instr;
+
+	instr.id = id;
+	emit(instr);
+}
+
+static void emit_num(double num)
+{
+	union instruction instr;
+
+	instr.num = num;
+	emit(instr);
+}
+
+/*
+ * Returns the ram position for the constant 'num'. Compares the bits, so -0
+ * does not share the position of 0.
+ */
+static int const_rampos(double num)
+{
+	int i, new_len;
+	double *new_consts;
+
+	for (i = 0; i < s_nconsts; i++) {
+		if (memcmp(&s_consts[i], &num, sizeof num) == 0)
+			return s_const_base + i;
+	}
+
+	if (s_nconsts == s_consts_capacity) {
+		grow_array((void *) s_consts, (int) sizeof *s_consts,
+			s_consts_capacity, 32, (void **) &new_consts, &new_len);
+
+		if (s_consts_capacity == new_len) {
+			s_no_mem = 1;
+			return s_const_base;
+		}
+
+		s_consts = new_consts;
+		s_consts_capacity = new_len;
+	}
+
+	s_consts[s_nconsts] = num;
+	return s_const_base + s_nconsts++;
+}
+
+/* Returns the ram position of the value of the entry 'i'. */
+static int entry_rampos(int i)
+{
+	if (s_entries[i].kind == ENTRY_CONST)
+		return const_rampos(s_entries[i].num);
+	else
+		return s_entries[i].rampos;
+}
+
+/* Pushes the symbolic stack on the real stack. */
+static void flush(void)
+{
+	int i;
+
+	for (i = 0; i < s_nentries; i++) {
+		if (s_entries[i].kind == ENTRY_CONST) {
+			emit_opcode(PUSH_NUM_OP);
+			emit_num(s_entries[i].num);
+		} else {
+			emit_opcode(GET_VAR_OP);
+			emit_id(s_entries[i].rampos);
+		}
+	}
+
+	s_nentries = 0;
+	s_last_dst = -1;
+}
+
+static void push_entry(enum entry_kind kind, int rampos, double num)
+{
+	assert(s_nentries < s_entries_capacity);
+	s_entries[s_nentries].kind = kind;
+	s_entries[s_nentries].rampos = rampos;
+	s_entries[s_nentries].num = num;
+	s_nentries++;
+}
+
+/*
+ * Generates 'opcode' (with the list or table 'vindex1' and its 'addr' as
+ * first operands if 'vindex1' is not -1) taking as operands the top 'nargs'
+ * entries of the symbolic stack. If 'result' is not 0, the instruction leaves
+ * its result in the temporary for the first of these entries, and that entry
+ * is replaced by the temporary.
+ */
+static void emit_register_instr(enum vm_opcode opcode, int vindex1,
+	int addr, int nargs, int result)
+{
+	int i, base;
+
+	base = s_nentries - nargs;
+	emit_opcode(opcode);
+	if (vindex1 >= 0) {
+		emit_id(vindex1);
+		emit_id(addr);
+	}
+	for (i = base; i < s_nentries; i++) {
+		emit_id(entry_rampos(i));
+	}
+
+	s_nentries = base;
+	s_last_dst = -1;
+	if (result) {
+		emit_id(s_temp_base + base);
+		s_last_dst = s_rsize - 1;
+		push_entry(ENTRY_TEMP, s_temp_base + base, 0);
+	}
+}
+
+/* Returns 1 if any entry under the top of the symbolic stack reads the
+ * variable at 'rampos'.
+ */
+static int is_var_pending(int rampos)
+{
+	int i;
+
+	for (i = 0; i < s_nentries - 1; i++) {
+		if (s_entries[i].kind == ENTRY_VAR &&
+			s_entries[i].rampos == rampos)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* LET_VAR_OP rampos */
+static void translate_let_var(int rampos)
+{
+	struct entry e;
+
+	/* If the value was just computed, compute it directly in the variable,
+	 * unless someone still has to read the old value.
+	 */
+	if (!is_var_pending(rampos) && s_entries[s_nentries - 1].kind ==
+		ENTRY_TEMP && s_last_dst == s_rsize - 1)
+	{
+		s_rcode[s_last_dst].id = rampos;
+		s_nentries--;
+		s_last_dst = -1;
+		return;
+	}
+
+	e = s_entries[--s_nentries];
+	if (is_var_pending(rampos)) {
+		flush();
+	}
+	s_entries[s_nentries++] = e;
+	emit_register_instr(R_MOV_OP, -1, 0, 1, 0);
+	emit_id(rampos);
+}
+
+/*
+ * GOTO_IF_TRUE_OP pc, and IF_LESS_OP pc ... IF_NOT_EQ_OP pc, as 'ropcode'
+ * with the top 'nargs' entries of the symbolic stack and 'pc'. The rest of
+ * the symbolic stack is flushed before, as the code at 'pc' expects it on the
+ * real stack.
+ */
+static void translate_branch(enum vm_opcode ropcode, int nargs, int pc)
+{
+	int i, rampos[2];
+
+	s_nentries -= nargs;
+	for (i = 0; i < nargs; i++) {
+		rampos[i] = entry_rampos(s_nentries + i);
+	}
+	flush();
+	emit_opcode(ropcode);
+	for (i = 0; i < nargs; i++) {
+		emit_id(rampos[i]);
+	}
+	emit_id(pc);
+}
+
+/*
+ * Translates the instruction at 'pc' if all its operands are on the symbolic
+ * stack. Returns 0 if translated.
+ */
+static int translate_instr(int pc)
+{
+	enum vm_opcode ropcode;
+	int nargs, vindex1, addr, result;
+
+	vindex1 = -1;
+	addr = 0;
+	result = 1;
+	switch (code[pc].opcode) {
+	case PUSH_NUM_OP:
+		if (s_nentries == s_entries_capacity)
+			return -1;
+		push_entry(ENTRY_CONST, 0, code[pc + 1].num);
+		return 0;
+	case GET_VAR_OP:
+	case GET_FN_VAR_OP:
+		if (s_nentries == s_entries_capacity)
+			return -1;
+		push_entry(ENTRY_VAR, code[pc + 1].id, 0);
+		return 0;
+	case LET_VAR_OP:
+		if (s_nentries < 1)
+			return -1;
+		translate_let_var(code[pc + 1].id);
+		return 0;
+	case GOTO_IF_TRUE_OP: ropcode = R_GOTO_IF_TRUE_OP; nargs = 1; break;
+	case IF_LESS_OP: ropcode = R_IF_LESS_OP; nargs = 2; break;
+	case IF_GREATER_OP: ropcode = R_IF_GREATER_OP; nargs = 2; break;
+	case IF_LESS_EQ_OP: ropcode = R_IF_LESS_EQ_OP; nargs = 2; break;
+	case IF_GREATER_EQ_OP: ropcode = R_IF_GREATER_EQ_OP; nargs = 2; break;
+	case IF_EQ_OP: ropcode = R_IF_EQ_OP; nargs = 2; break;
+	case IF_NOT_EQ_OP: ropcode = R_IF_NOT_EQ_OP; nargs = 2; break;
+	case ADD_OP: ropcode = R_ADD_OP; nargs = 2; break;
+	case SUB_OP: ropcode = R_SUB_OP; nargs = 2; break;
+	case MUL_OP: ropcode = R_MUL_OP; nargs = 2; break;
+	case DIV_OP: ropcode = R_DIV_OP; nargs = 2; break;
+	case POW_OP: ropcode = R_POW_OP; nargs = 2; break;
+	case POW_INT_OP: ropcode = R_POW_INT_OP; nargs = 2; break;
+	case NEG_OP: ropcode = R_NEG_OP; nargs = 1; break;
+	case GET_LIST_OP:
+	case GET_LIST_INT_OP:
+		ropcode = R_GET_LIST_OP;
+		nargs = 1;
+		vindex1 = code[pc + 1].id;
+		addr = code[pc + 2].id;
+		break;
+	case GET_TABLE_OP:
+	case GET_TABLE_INT_OP:
+		ropcode = R_GET_TABLE_OP;
+		nargs = 2;
+		vindex1 = code[pc + 1].id;
+		addr = code[pc + 2].id;
+		break;
+	case LET_LIST_OP:
+	case LET_LIST_INT_OP:
+		ropcode = R_LET_LIST_OP;
+		nargs = 2;
+		vindex1 = code[pc + 1].id;
+		addr = code[pc + 2].id;
+		result = 0;
+		break;
+	case LET_TABLE_OP:
+	case LET_TABLE_INT_OP:
+		ropcode = R_LET_TABLE_OP;
+		nargs = 3;
+		vindex1 = code[pc + 1].id;
+		addr = code[pc + 2].id;
+		result = 0;
+		break;
+	default:
+		return -1;
+	}
+
+	if (s_nentries < nargs)
+		return -1;
+
+	if (get_opcode_jump_arg(code[pc].opcode) != 0)
+		translate_branch(ropcode, nargs, code[pc + 1].id);
+	else
+		emit_register_instr(ropcode, vindex1, addr, nargs, result);
+	return 0;
+}
+
+/* Copies the instruction at 'pc'. */
+static void copy_instr(int pc)
+{
+	int i, n;
+
+	n = get_instr_size(&code[pc]);
+	for (i = 0; i < n; i++) {
+		emit(code[pc + i]);
+	}
+}
+
+static void free_translation(void)
+{
+	free(s_entries);
+	free(s_rcode);
+	free(s_consts);
+	s_entries = NULL;
+	s_rcode = NULL;
+	s_consts = NULL;
+}
+
+/*
+ * Translates the code to register instructions if s_register_mode is set and
+ * we are not in debug mode.
+ * If there is not enough memory, or ram for the temporaries and constants,
+ * the code is left as it is.
+ */
+void translate_to_registers(void)
+{
+	int size, pc, i, ntemps, prologue_size, first;
+	unsigned char *targets;
+	int *new_pcs;
+	union instruction *new_code;
+
+	if (!s_register_mode || s_debug_mode)
+		return;
+
+	size = get_code_size();
+	ntemps = get_parsed_stack_size();
+	s_temp_base = get_parsed_ram_size();
+	s_const_base = s_temp_base + ntemps;
+	if (iadd_overflows_int(s_temp_base, ntemps))
+		return;
+
+	s_nentries = 0;
+	s_entries_capacity = ntemps;
+	s_rsize = 0;
+	s_rcapacity = 0;
+	s_nconsts = 0;
+	s_consts_capacity = 0;
+	s_last_dst = -1;
+	s_no_mem = 0;
+
+	targets = find_jump_targets();
+	new_pcs = calloc(size + 1, sizeof *new_pcs);
+	s_entries = malloc((ntemps + 1) * sizeof *s_entries);
+	if (targets == NULL || new_pcs == NULL || s_entries == NULL) {
+		goto end;
+	}
+
+	for (pc = 0; pc < size; pc += get_instr_size(&code[pc])) {
+		if (targets[pc]) {
+			flush();
+		}
+		new_pcs[pc] = s_rsize;
+		if (translate_instr(pc) != 0) {
+			flush();
+			copy_instr(pc);
+		}
+	}
+	flush();
+	new_pcs[size] = s_rsize;
+
+	if (s_no_mem)
+		goto end;
+
+	if (iadd_overflows_int(ntemps, s_nconsts))
+		goto end;
+
+	first = reserve_ram(ntemps + s_nconsts);
+	if (first < 0)
+		goto end;
+
+	assert(first == s_temp_base);
+
+	/* Prologue to set the constants. */
+	prologue_size = s_nconsts * 3;
+	if (iadd_overflows_int(prologue_size, s_rsize))
+		goto end;
+
+	new_code = malloc((prologue_size + s_rsize) * sizeof *new_code);
+	if (new_code == NULL)
+		goto end;
+
+	for (i = 0; i < s_nconsts; i++) {
+		new_code[i * 3].opcode = LET_VAR_CONST_OP;
+		new_code[i * 3 + 1].num = s_consts[i];
+		new_code[i * 3 + 2].id = s_const_base + i;
+	}
+	for (i = 0; i < s_rsize; i++) {
+		new_code[prologue_size + i] = s_rcode[i];
+	}
+	for (i = 0; i <= size; i++) {
+		new_pcs[i] += prologue_size;
+	}
+
+	relocate_jumps(new_code, prologue_size + s_rsize, new_pcs);
+	relocate_lines(new_pcs);
+	replace_code(new_code, prologue_size + s_rsize);
+
+end:	free(targets);
+	free(new_pcs);
+	free_translation();
+}
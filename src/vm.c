@@ -12,6 +12,7 @@
 #include "ecma55.h"
 #include "arraydsc.h"
 #include "dbg.h"
+#include "jit.h"
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
@@ -41,6 +42,9 @@ union ram_value {
 
 static union ram_value *s_ram = NULL;
 
+/* The code being executed: 'code' itself or its threaded copy. */
+static union instruction *s_code = NULL;
+
 /* Program counter. */
 static int s_pc;
 
@@ -49,11 +53,8 @@ static union ram_value *s_stack = NULL;
 static int s_stack_capacity = 0;
 static int s_sp;
 
-/* Fatal error occurred. */
-static int s_fatal;
-
-/* Current running line. */
-static int s_cur_line_num;
+/* Line where a break stopped the program. */
+static int s_break_line_num;
 
 /* The GOSUB s_stack */
 static int *s_gosub_stack = NULL;
@@ -77,6 +78,78 @@ static void sigint_handler(int sig)
 	s_break = 1;
 }
 
+/*
+ * Returns the line of the instruction at 'pc'. The code of a DEF FN is in
+ * line 0: then it is the line of the call, the GOSUB_OP before the return
+ * address.
+ */
+static int pc_line(int pc)
+{
+	int line_num, i;
+
+	i = s_gosub_sp;
+	while ((line_num = get_pc_line(pc)) == 0 && i > 0) {
+		pc = s_gosub_stack[--i] - 1;
+	}
+	return line_num;
+}
+
+/* The pc of the END_OP at the end of the program. */
+static int s_end_pc;
+
+/*
+ * Makes execution go on at the END_OP at the end of the program, which stops
+ * it: the interpreters only check for END_OP. Called after a fatal error, and
+ * on a break.
+ */
+static void stop_program(void)
+{
+	s_pc = s_end_pc;
+}
+
+/*
+ * Polling point for Ctrl+C, called by the instructions that can close a loop
+ * (backward jumps, GOSUB, NEXT) and by LINE_OP. The break is at the line
+ * where execution would continue.
+ */
+static void check_break(void)
+{
+	if (s_break) {
+		s_break_line_num = pc_line(s_pc);
+		stop_program();
+	}
+}
+
+/*
+ * Returns the line of the instruction being executed, for the messages. The
+ * handlers call it after reading the opcode, so s_pc - 1 is inside the
+ * instruction.
+ */
+static int cur_line_num(void)
+{
+	return pc_line(s_pc - 1);
+}
+
+/* Continues at 'pc'. A backward jump is a polling point. */
+static void jump_to(int pc)
+{
+	if (pc < s_pc) {
+		s_pc = pc;
+		check_break();
+	} else {
+		s_pc = pc;
+	}
+}
+
+/* Continues at the address operand if 'cond' is true, else after it. */
+static void branch(int cond)
+{
+	if (cond)
+		jump_to(s_code[s_pc].id);
+	else
+		s_pc++;
+}
+
 static void free_stack(void)
 {
 	if (s_stack != NULL) {
@@ -96,16 +169,16 @@ static void free_gosub_stack(void)
 	}
 }
 
-static enum error_code alloc_gosub_stack(void)
+static enum error_code alloc_gosub_stack(int capacity)
 {
 	assert(s_gosub_stack == NULL);
 
-	if ((s_gosub_stack = calloc(s_default_gosub_stack_capacity,
+	if (capacity > 0 && (s_gosub_stack = calloc(capacity,
 		sizeof *s_gosub_stack)) == NULL)
 	{
 		return E_NO_MEM;
 	} else {
-		s_gosub_stack_capacity = s_default_gosub_stack_capacity;
+		s_gosub_stack_capacity = capacity;
 		return 0;
 	}
 }
@@ -129,7 +202,7 @@ static void check_rampos_inited(int rampos)
 		/* Do not issue the warning again. */
 		set_rampos_inited(rampos);
 
-		wprintln(E_INIT_VAR, s_cur_line_num);
+		wprintln(E_INIT_VAR, cur_line_num());
 		coded_var = get_var_from_rampos(rampos);
 		print_var(stderr, coded_var);
 		enl();
@@ -144,7 +217,7 @@ static void check_list_rampos_inited(int rampos, int index)
 		/* Do not issue the warning again. */
 		set_rampos_inited(rampos);
 
-		wprintln(E_INIT_ARRAY, s_cur_line_num);
+		wprintln(E_INIT_ARRAY, cur_line_num());
 		coded_var = get_var_from_rampos(rampos);
 		print_var(stderr, coded_var);
 		index += s_base_ix;
@@ -160,7 +233,7 @@ static void check_table_rampos_inited(int rampos, int index1, int index2)
 		/* Do not issue the warning again. */
 		set_rampos_inited(rampos);
 
-		wprintln(E_INIT_ARRAY, s_cur_line_num);
+		wprintln(E_INIT_ARRAY, cur_line_num());
 		coded_var = get_var_from_rampos(rampos);
 		print_var(stderr, coded_var);
 		index1 += s_base_ix;
@@ -328,12 +401,12 @@ static int print_num_trim(FILE *f, double d)
 
 static void push_num_op(void)
 {
-	s_stack[s_sp++].d = code[s_pc++].num;
+	s_stack[s_sp++].d = s_code[s_pc++].num;
 }
 
 static void push_str_op(void)
 {
-	s_stack[s_sp++].i = code[s_pc++].id;
+	s_stack[s_sp++].i = s_code[s_pc++].id;
 }
 
 static void print_nl_op(void)
@@ -365,7 +438,7 @@ static void print_tab_op(void)
 	d = s_stack[--s_sp].d;
 	n = round_to_int(d);
 	if (n <= 0) {
-		wprintln(E_INVAL_TAB, s_cur_line_num);
+		wprintln(E_INVAL_TAB, cur_line_num());
 		putc('(', stderr);
 		print_num_trim(stderr, n);
 		putc(')', stderr);
@@ -438,31 +511,31 @@ static void print_str_op(void)
 		s_print_column += printf("%s", str);
 }
 
+/* Assigns 'd' to the numeric variable at 'rampos'. */
+static void set_var(int rampos, double d)
+{
+	s_ram[rampos].d = d;
+}
+
 static void let_var_op(void)
 {
 	int rampos;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
-	s_ram[rampos].d = s_stack[--s_sp].d;
+	rampos = s_code[s_pc++].id;
+	set_var(rampos, s_stack[--s_sp].d);
 }
 
 static void let_strvar_op(void)
 {
 	int rampos, stri, oldi;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
+	rampos = s_code[s_pc++].id;
 	stri = s_stack[--s_sp].i;
 
 	if (strlen(strings[stri]->str) > STR_VAR_MAX_CHARS) {
-		eprintln(E_STR_DATUM_TOO_LONG, s_cur_line_num);
+		eprintln(E_STR_DATUM_TOO_LONG, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return;
 	}
 
@@ -478,13 +551,13 @@ static void let_strvar_op(void)
 static int check_list_index(int vindex1, double index, int dim)
 {
 	if (index < 0 || index >= dim) {
-		eprintln(E_INDEX_RANGE, s_cur_line_num);
+		eprintln(E_INDEX_RANGE, cur_line_num());
 		putc(vindex1 + 'A', stderr);
 		putc('(', stderr);
 		print_num_trim(stderr, index + s_base_ix);
 		putc(')', stderr);
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return E_INDEX_RANGE;
 	}
 
@@ -495,119 +568,153 @@ static int check_table_index(int vindex1, double index1, int dim1,
                              double index2, int dim2)
 {
 	if (index1 < 0 || index1 >= dim1) {
-		eprintln(E_INDEX_RANGE, s_cur_line_num);
+		eprintln(E_INDEX_RANGE, cur_line_num());
 		putc(vindex1 + 'A', stderr);
 		putc('(', stderr);
 		print_num_trim(stderr, index1 + s_base_ix);
 		fputs(",...)\n", stderr);
-		s_fatal = 1;
+		stop_program();
 		return E_INDEX_RANGE;
 	} else if (index2 < 0 || index2 >= dim2) {
-		eprintln(E_INDEX_RANGE, s_cur_line_num);
+		eprintln(E_INDEX_RANGE, cur_line_num());
 		putc(vindex1 + 'A', stderr);
 		fputs("(...,", stderr);
 		print_num_trim(stderr, index2 + s_base_ix);
 		putc(')', stderr);
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return E_INDEX_RANGE;
 	}
 
 	return 0;
 }
 
-static void let_list_op(void)
+/*
+ * The array instructions have as operands the letter of the array, 'vindex1',
+ * and the ram position that its element with all the indexes 0 would have,
+ * 'addr', where the compiler has put together the OPTION BASE and the ram
+ * position of the array. When the indexes are integers in range, the position
+ * of the element is computed without rounding them.
+ */
+
+/*
+ * Returns the ram position of the element at index 'd' (before rounding) of
+ * the list 'vindex1', or -1 if the index is out of range.
+ */
+static int list_elem_pos(int vindex1, int addr, double d)
 {
-	double value, dindex;
-	int vindex1, rampos, index, dim;
+	int dim;
+	double dindex;
 
-	vindex1 = code[s_pc++].id;
 	dim = s_array_descs[vindex1].dim1;
-	value = s_stack[--s_sp].d;
-	dindex = m_round(s_stack[--s_sp].d) - s_base_ix;
+	if (d >= s_base_ix && d < s_base_ix + dim && d == (int) d)
+		return addr + (int) d;
+
+	dindex = m_round(d) - s_base_ix;
 	if (check_list_index(vindex1, dindex, dim) != 0) {
-		return;
+		return -1;
 	}
 
-	index = (int) dindex;
-	rampos = s_array_descs[vindex1].rampos + index;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
-	s_ram[rampos].d = value;
+	return addr + s_base_ix + (int) dindex;
 }
 
-static void let_table_op(void)
+/*
+ * Returns the ram position of the element at indexes 'd1', 'd2' (before
+ * rounding) of the table 'vindex1', or -1 if an index is out of range.
+ */
+static int table_elem_pos(int vindex1, int addr, double d1, double d2)
 {
-	double value;
-	int vindex1, rampos, index1, index2, dim1, dim2;
+	int dim1, dim2;
 	double dindex1, dindex2;
 
-	vindex1 = code[s_pc++].id;
 	dim1 = s_array_descs[vindex1].dim1;
 	dim2 = s_array_descs[vindex1].dim2;
-	value = s_stack[--s_sp].d;
-	dindex2 = m_round(s_stack[--s_sp].d) - s_base_ix;
-	dindex1 = m_round(s_stack[--s_sp].d) - s_base_ix;
+	if (d1 >= s_base_ix && d1 < s_base_ix + dim1 && d1 == (int) d1 &&
+	    d2 >= s_base_ix && d2 < s_base_ix + dim2 && d2 == (int) d2)
+	{
+		return addr + (int) d1 * dim2 + (int) d2;
+	}
 
+	dindex2 = m_round(d2) - s_base_ix;
+	dindex1 = m_round(d1) - s_base_ix;
 	if (check_table_index(vindex1, dindex1, dim1, dindex2, dim2) != 0) {
-		return;
+		return -1;
 	}
 
-	index1 = (int) dindex1;
-	index2 = (int) dindex2;
-	rampos = s_array_descs[vindex1].rampos + index1 * dim2 + index2;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
-	s_ram[rampos].d = value;
+	return addr + ((int) dindex1 + s_base_ix) * dim2 + (int) dindex2 +
+		s_base_ix;
 }
 
-static void input_list_op(void)
+/* The 'addr' of the list 'vindex1', for the instructions without it. */
+static int list_addr(int vindex1)
 {
-	double value, dindex;
-	int vindex1, rampos, index, dim;
+	return s_array_descs[vindex1].rampos - s_base_ix;
+}
 
-	vindex1 = code[s_pc++].id;
-	dim = s_array_descs[vindex1].dim1;
-	dindex = m_round(s_stack[--s_sp].d) - s_base_ix;
-	value = s_stack[--s_sp].d;
+/* The 'addr' of the table 'vindex1', for the instructions without it. */
+static int table_addr(int vindex1)
+{
+	const struct array_desc *desc;
 
-	if (check_list_index(vindex1, dindex, dim) != 0) {
+	desc = &s_array_descs[vindex1];
+	return desc->rampos - s_base_ix * desc->dim2 - s_base_ix;
+}
+
+/* Assigns 'value' to the element at 'rampos', if it is not -1. */
+static void set_elem(int rampos, double value)
+{
+	if (rampos < 0)
 		return;
-	}
 
-	index = (int) dindex;
-	rampos = s_array_descs[vindex1].rampos + index;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
 	s_ram[rampos].d = value;
 }
 
-static void input_table_op(void)
+static void let_list_op(void)
 {
-	double value, dindex1, dindex2;
-	int vindex1, rampos, index1, index2, dim1, dim2;
+	double value, d;
+	int vindex1, addr;
 
-	vindex1 = code[s_pc++].id;
-	dim1 = s_array_descs[vindex1].dim1;
-	dim2 = s_array_descs[vindex1].dim2;
-	dindex2 = m_round(s_stack[--s_sp].d) - s_base_ix;
-	dindex1 = m_round(s_stack[--s_sp].d) - s_base_ix;
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
 	value = s_stack[--s_sp].d;
+	d = s_stack[--s_sp].d;
+	set_elem(list_elem_pos(vindex1, addr, d), value);
+}
 
-	if (check_table_index(vindex1, dindex1, dim1, dindex2, dim2) != 0) {
-		return;
-	}
+static void let_table_op(void)
+{
+	double value, d1, d2;
+	int vindex1, addr;
 
-	index1 = (int) dindex1;
-	index2 = (int) dindex2;
-	rampos = s_array_descs[vindex1].rampos + index1 * dim2 + index2;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
-	s_ram[rampos].d = value;
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	value = s_stack[--s_sp].d;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	set_elem(table_elem_pos(vindex1, addr, d1, d2), value);
+}
+
+static void input_list_op(void)
+{
+	double value, d;
+	int vindex1;
+
+	vindex1 = s_code[s_pc++].id;
+	d = s_stack[--s_sp].d;
+	value = s_stack[--s_sp].d;
+	set_elem(list_elem_pos(vindex1, list_addr(vindex1), d), value);
+}
+
+static void input_table_op(void)
+{
+	double value, d1, d2;
+	int vindex1;
+
+	vindex1 = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	value = s_stack[--s_sp].d;
+	set_elem(table_elem_pos(vindex1, table_addr(vindex1), d1, d2), value);
 }
 
 static double read_double(void)
@@ -622,16 +729,16 @@ static double read_double(void)
 	int serrno;
 
 	if ((ecode = read_data_str(&stri, &datum_type)) != 0) {
-		eprintln(E_READ_OFLOW, s_cur_line_num);
+		eprintln(E_READ_OFLOW, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return 0.0;
 	}
 
 	if (datum_type == DATA_DATUM_QUOTED_STR) {
-		eprintln(E_READ_STR, s_cur_line_num);
+		eprintln(E_READ_STR, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return 0.0;
 	}
 
@@ -640,24 +747,24 @@ static double read_double(void)
 	serrno = errno;
 	d = delem.num;
 	if (t != DATA_ELEM_NUM) {
-		eprintln(E_READ_STR, s_cur_line_num);
+		eprintln(E_READ_STR, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return 0.0;
 	}
 
 	str += len;
 	t = parse_data_elem(&delem, str, &len, DATA_ELEM_AS_IS);
 	if (t != DATA_ELEM_EOF) {
-		eprintln(E_READ_STR, s_cur_line_num);
+		eprintln(E_READ_STR, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return 0.0;
 	}
 
 	if (serrno == ERANGE)
 	{
-		wprintln(E_CONST_OVERFLOW, s_cur_line_num);
+		wprintln(E_CONST_OVERFLOW, cur_line_num());
 		enl();
 	}
 
@@ -668,56 +775,34 @@ static void read_var_op(void)
 {
 	int rampos;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
+	rampos = s_code[s_pc++].id;
 	s_ram[rampos].d = read_double();
 }
 
 static void read_list_op(void)
 {
-	double dindex;
-	int vindex1, rampos, index, dim;
-
-	vindex1 = code[s_pc++].id;
-	dim = s_array_descs[vindex1].dim1;	
-	dindex = m_round(s_stack[--s_sp].d) - s_base_ix;
-
-	if (check_list_index(vindex1, dindex, dim) != 0) {
-		return;
-	}
+	int vindex1, rampos;
 
-	index = (int) dindex;
-	rampos = s_array_descs[vindex1].rampos + index;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
+	vindex1 = s_code[s_pc++].id;
+	rampos = list_elem_pos(vindex1, list_addr(vindex1),
+		s_stack[--s_sp].d);
+	if (rampos >= 0) {
+		set_elem(rampos, read_double());
 	}
-	s_ram[rampos].d = read_double();
 }
 
 static void read_table_op(void)
 {
-	double dindex1, dindex2;
-	int vindex1, rampos, index1, index2, dim1, dim2;
-
-	vindex1 = code[s_pc++].id;
-	dim1 = s_array_descs[vindex1].dim1;
-	dim2 = s_array_descs[vindex1].dim2;
-	dindex2 = m_round(s_stack[--s_sp].d) - s_base_ix;
-	dindex1 = m_round(s_stack[--s_sp].d) - s_base_ix;
-
-	if (check_table_index(vindex1, dindex1, dim1, dindex2, dim2) != 0) {
-		return;
-	}
+	double d1, d2;
+	int vindex1, rampos;
 
-	index1 = (int) dindex1;
-	index2 = (int) dindex2;
-	rampos = s_array_descs[vindex1].rampos + index1 * dim2 + index2;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
+	vindex1 = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	rampos = table_elem_pos(vindex1, table_addr(vindex1), d1, d2);
+	if (rampos >= 0) {
+		set_elem(rampos, read_double());
 	}
-	s_ram[rampos].d = read_double();
 }
 
 static void read_strvar_op(void)
@@ -725,22 +810,18 @@ static void read_strvar_op(void)
 	int rampos, stri, oldi;
 	enum error_code ecode;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
-
+	rampos = s_code[s_pc++].id;
 	if ((ecode = read_data_str(&stri, NULL)) != 0) {
-		eprintln(ecode, s_cur_line_num);
+		eprintln(ecode, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return;
 	}
 
 	if (strlen(strings[stri]->str) > STR_VAR_MAX_CHARS) {
-		eprintln(E_STR_DATUM_TOO_LONG, s_cur_line_num);
+		eprintln(E_STR_DATUM_TOO_LONG, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return;
 	}
 
@@ -752,22 +833,25 @@ static void read_strvar_op(void)
 	}
 }
 
+/* Returns the value of the numeric variable at 'rampos'. */
+static double get_var(int rampos)
+{
+	return s_ram[rampos].d;
+}
+
 static void get_var_op(void)
 {
 	int rampos;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		check_rampos_inited(rampos);
-	}
-	s_stack[s_sp++].d = s_ram[rampos].d;
+	rampos = s_code[s_pc++].id;
+	s_stack[s_sp++].d = get_var(rampos);
 }
 
 static void get_fn_var_op(void)
 {
 	int rampos;
 
-	rampos = code[s_pc++].id;
+	rampos = s_code[s_pc++].id;
 	s_stack[s_sp++].d = s_ram[rampos].d;
 }
 
@@ -775,56 +859,76 @@ static void get_strvar_op(void)
 {
 	int rampos;
 
-	rampos = code[s_pc++].id;
-	if (s_debug_mode) {
-		check_rampos_inited(rampos);
-	}	
+	rampos = s_code[s_pc++].id;
 	s_stack[s_sp++].i = s_ram[rampos].i;
 }
 
-static void get_list_op(void)
+/*
+ * Gets in 'value' the element at index 'd' (before rounding) of the list
+ * 'vindex1'.
+ * Returns E_INDEX_RANGE if the index is out of range.
+ */
+static int get_list_elem(int vindex1, int addr, double d, double *value)
 {
-	int vindex1, rampos, index, dim;
-	double dindex;
-
-	vindex1 = code[s_pc++].id;
-	dim = s_array_descs[vindex1].dim1;
-	dindex = m_round(s_stack[--s_sp].d) - s_base_ix;
+	int rampos;
 
-	if (check_list_index(vindex1, dindex, dim) != 0) {
-		return;
+	if ((rampos = list_elem_pos(vindex1, addr, d)) < 0) {
+		return E_INDEX_RANGE;
 	}
 
-	index = (int) dindex;
-	rampos = s_array_descs[vindex1].rampos + index;
-	if (s_debug_mode) {
-		check_list_rampos_inited(rampos, index);
+	*value = s_ram[rampos].d;
+	return 0;
+}
+
+/* Pushes the element at index 'd' (before rounding) of the list 'vindex1'. */
+static void push_list_elem(int vindex1, int addr, double d)
+{
+	double value;
+
+	if (get_list_elem(vindex1, addr, d, &value) == 0) {
+		s_stack[s_sp++].d = value;
 	}
-	s_stack[s_sp++].d = s_ram[rampos].d;
 }
 
-static void get_table_op(void)
+static void get_list_op(void)
 {
-	double dindex1, dindex2;
-	int vindex1, rampos, index1, index2, dim1, dim2;
+	int vindex1, addr;
 
-	vindex1 = code[s_pc++].id;
-	dim1 = s_array_descs[vindex1].dim1;
-	dim2 = s_array_descs[vindex1].dim2;
-	dindex2 = m_round(s_stack[--s_sp].d) - s_base_ix;
-	dindex1 = m_round(s_stack[--s_sp].d) - s_base_ix;
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	push_list_elem(vindex1, addr, s_stack[--s_sp].d);
+}
 
-	if (check_table_index(vindex1, dindex1, dim1, dindex2, dim2) != 0) {
-		return;
+/*
+ * Gets in 'value' the element at indexes 'd1', 'd2' (before rounding) of the
+ * table 'vindex1'.
+ * Returns E_INDEX_RANGE if an index is out of range.
+ */
+static int get_table_elem(int vindex1, int addr, double d1, double d2,
+	double *value)
+{
+	int rampos;
+
+	if ((rampos = table_elem_pos(vindex1, addr, d1, d2)) < 0) {
+		return E_INDEX_RANGE;
 	}
 
-	index1 = (int) dindex1;
-	index2 = (int) dindex2;
-	rampos = s_array_descs[vindex1].rampos + index1 * dim2 + index2;
-	if (s_debug_mode) {
-		check_table_rampos_inited(rampos, index1, index2);
+	*value = s_ram[rampos].d;
+	return 0;
+}
+
+static void get_table_op(void)
+{
+	double d1, d2, value;
+	int vindex1, addr;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	if (get_table_elem(vindex1, addr, d1, d2, &value) == 0) {
+		s_stack[s_sp++].d = value;
 	}
-	s_stack[s_sp++].d = s_ram[rampos].d;
 }
 
 static void add_op(void)
@@ -845,44 +949,41 @@ static void sub_op(void)
 	s_stack[s_sp++].d = d1 - d2;
 }
 
-static void mul_op(void)
+/* d1 * d2, warning on overflow. */
+static double mul_num(double d1, double d2)
 {
-	double d1, d2, d;
+	double d;
 
-	d2 = s_stack[--s_sp].d;
-	d1 = s_stack[--s_sp].d;
 	d = d1 * d2;
 	if (m_isinf(d) && (!m_isinf(d1) || !m_isinf(d2))) {
-		wprintln(E_OP_OVERFLOW, s_cur_line_num);
+		wprintln(E_OP_OVERFLOW, cur_line_num());
 		fputs("(*)\n", stderr);
 	}
-	s_stack[s_sp++].d = d;
+	return d;
 }
 
-static void div_op(void)
+/* d1 / d2, warning on division by zero. */
+static double div_num(double d1, double d2)
 {
-	double d2, d1;
-
-	d2 = s_stack[--s_sp].d;
-	d1 = s_stack[--s_sp].d;
 	if (d2 == 0.0) {
-		wprintln(E_DIV_BY_ZERO, s_cur_line_num);
+		wprintln(E_DIV_BY_ZERO, cur_line_num());
 		enl();
 	}
-	s_stack[s_sp++].d = d1 / d2;
+	return d1 / d2;
 }
 
-static void pow_op(void)
+/* d1 ^ d2. Warns on overflow or 0 ^ negative; a negative number raised to a
+ * non integer is a fatal error.
+ */
+static double pow_num(double d1, double d2)
 {
-	double d1, d2;
+	double d;
 	int err;
 
 	err = 0;
-	d2 = s_stack[--s_sp].d;
-	d1 = s_stack[--s_sp].d;
 	if (d1 == 0.0 && d2 < 0.0) {
 		err = 1;
-		wprintln(E_ZERO_POW_NEG, s_cur_line_num);
+		wprintln(E_ZERO_POW_NEG, cur_line_num());
 		fputs("(0 ^ ", stderr);
 		print_num_trim(stderr, d2);
 		putc(')', stderr);
@@ -890,59 +991,137 @@ static void pow_op(void)
 	}
 	if (d1 < 0 && d2 != m_floor(d2)) {
 		err = 1;
-		eprintln(E_NEG_POW_REAL, s_cur_line_num);
+		eprintln(E_NEG_POW_REAL, cur_line_num());
 		putc('(', stderr);
 		print_num_trim(stderr, d1);
 		fputs(" ^ ", stderr);
 		print_num_trim(stderr, d2);
 		putc(')', stderr);
 		enl();
-		s_fatal = 1;
+		stop_program();
 	}
 	errno = 0;
-	s_stack[s_sp++].d = m_pow(d1, d2);
+	d = m_pow(d1, d2);
 	if (!err && errno == ERANGE) {
-		wprintln(E_OP_OVERFLOW, s_cur_line_num);
+		wprintln(E_OP_OVERFLOW, cur_line_num());
 		enl();
 	}
+	return d;
 }
 
-static void neg_op(void)
+static void mul_op(void)
 {
-	s_stack[s_sp - 1].d = -s_stack[s_sp - 1].d;
+	double d1, d2;
+
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	s_stack[s_sp++].d = mul_num(d1, d2);
 }
 
-static void gosub_op(void)
+static void div_op(void)
 {
-	int gopc;
-
-	gopc = code[s_pc++].id;
-	if (s_gosub_sp >= s_gosub_stack_capacity) {
-		eprintln(E_STACK_OFLOW, s_cur_line_num);
-		enl();
-		s_fatal = 1;
-		return;
-	}
+	double d2, d1;
 
-	s_gosub_stack[s_gosub_sp++] = s_pc;
-	s_pc = gopc;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	s_stack[s_sp++].d = div_num(d1, d2);
 }
 
-static void return_op(void)
+static void pow_op(void)
 {
-	if (s_gosub_sp == 0) {
-		eprintln(E_STACK_UFLOW, s_cur_line_num);
-		enl();
-		s_fatal = 1;
-		return;
-	}
+	double d1, d2;
 
-	s_pc = s_gosub_stack[--s_gosub_sp];
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	s_stack[s_sp++].d = pow_num(d1, d2);
 }
 
-static void goto_op(void)
+/* The largest result of pow_int(); bm_pow() is exact up to it. */
+#define POW_INT_MAX	2147483648.0
+
+/*
+ * d1 ^ d2, where d1 and d2 have no fractional part. If d2 is a small positive
+ * integer and the result is not too big, it is computed by multiplying,
+ * which gives the same as pow_num().
+ */
+static double pow_int(double d1, double d2)
 {
-	s_pc = code[s_pc].id;
+	double d;
+	int n;
+
+	if (d1 == 0.0 || !(m_fabs(d1) <= POW_INT_MAX) ||
+	    !(d2 >= 0 && d2 <= 64))
+	{
+		return pow_num(d1, d2);
+	}
+
+	d = 1.0;
+	for (n = (int) d2; n > 0; n--) {
+		d *= d1;
+		if (m_fabs(d) > POW_INT_MAX)
+			return pow_num(d1, d2);
+	}
+
+	return d;
+}
+
+static void pow_int_op(void)
+{
+	double d1, d2;
+
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	s_stack[s_sp++].d = pow_int(d1, d2);
+}
+
+static void neg_op(void)
+{
+	s_stack[s_sp - 1].d = -s_stack[s_sp - 1].d;
+}
+
+static void gosub_op(void)
+{
+	int gopc;
+
+	gopc = s_code[s_pc++].id;
+	if (s_gosub_sp >= s_gosub_stack_capacity) {
+		eprintln(E_STACK_OFLOW, cur_line_num());
+		enl();
+		stop_program();
+		return;
+	}
+
+	s_gosub_stack[s_gosub_sp++] = s_pc;
+	s_pc = gopc;
+	check_break();
+}
+
+/* GOSUB_OP in a program where the GOSUB stack can't overflow. */
+static void gosub_unchecked_op(void)
+{
+	int gopc;
+
+	gopc = s_code[s_pc++].id;
+	s_gosub_stack[s_gosub_sp++] = s_pc;
+	s_pc = gopc;
+	check_break();
+}
+
+static void return_op(void)
+{
+	if (s_gosub_sp == 0) {
+		eprintln(E_STACK_UFLOW, cur_line_num());
+		enl();
+		stop_program();
+		return;
+	}
+
+	s_pc = s_gosub_stack[--s_gosub_sp];
+}
+
+static void goto_op(void)
+{
+	jump_to(s_code[s_pc].id);
 }
 
 static void on_goto_op(void)
@@ -950,36 +1129,113 @@ static void on_goto_op(void)
 	int nlines;
 	int i;
 	
-	nlines = code[s_pc++].id;
+	nlines = s_code[s_pc++].id;
 	i = round_to_int(s_stack[--s_sp].d);
 	if (i < 1 || i > nlines) {
-		eprintln(E_INDEX_RANGE, s_cur_line_num);
+		eprintln(E_INDEX_RANGE, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return;
 	}
 
 	i--;
-	s_pc = code[s_pc + i].id;
+	jump_to(s_code[s_pc + i].id);
 }
 
 static void goto_if_true_op(void)
 {
-	int i;
+	branch(s_stack[--s_sp].d == 1.0);
+}
 
-	i = s_stack[--s_sp].d == 1.0;
-	if (i == 1)
-		s_pc = code[s_pc].id;
-	else
-		s_pc++;
+/*
+ * IF_LESS_OP pc ... IF_NOT_EQ_STR_OP pc compare the two values on top of the
+ * stack and jump if the comparison is true.
+ */
+
+/* Pops the two operands of a numeric comparison. */
+static void pop_cmp_args(double *a, double *b)
+{
+	*b = s_stack[--s_sp].d;
+	*a = s_stack[--s_sp].d;
+}
+
+static void if_less_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a < b);
+}
+
+static void if_greater_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a > b);
 }
 
+static void if_less_eq_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a <= b);
+}
+
+static void if_greater_eq_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a >= b);
+}
+
+static void if_eq_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a == b);
+}
+
+static void if_not_eq_op(void)
+{
+	double a, b;
+
+	pop_cmp_args(&a, &b);
+	branch(a != b);
+}
+
+static void if_eq_str_op(void)
+{
+	int a, b;
+
+	b = s_stack[--s_sp].i;
+	a = s_stack[--s_sp].i;
+	branch(a == b);
+}
+
+static void if_not_eq_str_op(void)
+{
+	int a, b;
+
+	b = s_stack[--s_sp].i;
+	a = s_stack[--s_sp].i;
+	branch(a != b);
+}
+
+/*
+ * LESS_OP ... NOT_EQ_STR_OP compare the two values on top of the stack and
+ * push 1 if the comparison is true, else 0. They are only compiled, followed
+ * by GOTO_IF_TRUE_OP, when the IFCMP pass is switched off.
+ */
+
 static void less_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a < b;
 }
 
@@ -987,8 +1243,7 @@ static void greater_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a > b;
 }
 
@@ -996,8 +1251,7 @@ static void less_eq_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a <= b;
 }
 
@@ -1005,8 +1259,7 @@ static void greater_eq_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a >= b;
 }
 
@@ -1014,8 +1267,7 @@ static void eq_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a == b;
 }
 
@@ -1023,8 +1275,7 @@ static void not_eq_op(void)
 {
 	double a, b;
 
-	b = s_stack[--s_sp].d;
-	a = s_stack[--s_sp].d;
+	pop_cmp_args(&a, &b);
 	s_stack[s_sp++].d = a != b;
 }
 
@@ -1090,7 +1341,7 @@ static void ifun0_op(void)
 {
 	int ifun;
 
-	ifun = code[s_pc++].id;
+	ifun = s_code[s_pc++].id;
 	s_stack[s_sp++].d = call_ifun0(ifun);
 }
 
@@ -1099,17 +1350,17 @@ static void ifun1_op(void)
 	int ifun;
 	double d;
 
-	ifun = code[s_pc++].id;
+	ifun = s_code[s_pc++].id;
 	d = s_stack[s_sp - 1].d;
 	s_stack[s_sp - 1].d = call_ifun1(ifun, d);
 	if (errno == EDOM) {
-		eprintln(E_DOM, s_cur_line_num);
+		eprintln(E_DOM, cur_line_num());
 		fprintf(stderr, "%s(", get_ifun_name(ifun));
 		print_num_trim(stderr, d);
 		fprintf(stderr, ")\n");
-		s_fatal = 1;
+		stop_program();
 	} else if (errno == ERANGE) {
-		wprintln(E_OP_OVERFLOW, s_cur_line_num);
+		wprintln(E_OP_OVERFLOW, cur_line_num());
 		fprintf(stderr, "%s(", get_ifun_name(ifun));
 		print_num_trim(stderr, d);
 		fprintf(stderr, ")\n");
@@ -1123,15 +1374,10 @@ static void for_op(void)
 
 	/* step, limit, var */
 	for (i = 0; i < 3; i++) {
-		rampos = code[s_pc++].id;
+		rampos = s_code[s_pc++].id;
 		val = s_stack[--s_sp].d;
 		s_ram[rampos].d = val;
 	}
-
-	/* rampos is the ram position of the FOR variable */
-	if (s_debug_mode) {
-		set_rampos_inited(rampos);
-	}
 }
 
 static double sign(double d)
@@ -1149,10 +1395,10 @@ static void for_cmp_op(void)
 	int var_pos, step_pos, limit_pos, endpc;
 	double step, limit;
 
-	var_pos = code[s_pc - 2].id;
-	limit_pos = code[s_pc - 3].id;
-	step_pos = code[s_pc - 4].id;
-	endpc = code[s_pc++].id;
+	var_pos = s_code[s_pc - 2].id;
+	limit_pos = s_code[s_pc - 3].id;
+	step_pos = s_code[s_pc - 4].id;
+	endpc = s_code[s_pc++].id;
 
 	step = s_ram[step_pos].d;
 	limit = s_ram[limit_pos].d;
@@ -1167,12 +1413,251 @@ static void next_op(void)
 	double step;
 
 	/* go to for_cmp_op */
-	s_pc = code[s_pc].id;
+	s_pc = s_code[s_pc].id;
 
-	step_pos = code[s_pc - 3].id;
+	step_pos = s_code[s_pc - 3].id;
 	step = s_ram[step_pos].d;
-	var_pos = code[s_pc - 1].id;
+	var_pos = s_code[s_pc - 1].id;
 	s_ram[var_pos].d += step;
+	check_break();
+}
+
+/*
+ * FOR with a constant integer step, which is a slot of the instruction:
+ * limit, var, step, end of loop. We know which way the loop goes without
+ * looking at the sign of the step.
+ */
+static int for_int_done(double var, double limit, int step)
+{
+	if (step > 0)
+		return var > limit;
+	else
+		return var < limit;
+}
+
+static void for_int_op(void)
+{
+	int var_pos, limit_pos, step;
+
+	limit_pos = s_code[s_pc].id;
+	var_pos = s_code[s_pc + 1].id;
+	step = s_code[s_pc + 2].id;
+	s_ram[limit_pos].d = s_stack[--s_sp].d;
+	s_ram[var_pos].d = s_stack[--s_sp].d;
+
+	if (for_int_done(s_ram[var_pos].d, s_ram[limit_pos].d, step))
+		s_pc = s_code[s_pc + 3].id;
+	else
+		s_pc += 4;
+}
+
+/*
+ * NEXT_INT_OP start of the loop, limit, var, step: adds the step and goes to
+ * the start of the loop, unless we are done.
+ */
+static void next_int_op(void)
+{
+	int body_pc, var_pos, limit_pos, step;
+	double var;
+
+	body_pc = s_code[s_pc].id;
+	limit_pos = s_code[s_pc + 1].id;
+	var_pos = s_code[s_pc + 2].id;
+	step = s_code[s_pc + 3].id;
+	var = s_ram[var_pos].d + step;
+	s_ram[var_pos].d = var;
+	if (for_int_done(var, s_ram[limit_pos].d, step)) {
+		s_pc += 4;
+	} else {
+		s_pc = body_pc;
+		check_break();
+	}
+}
+
+/* Returns 1 if 'd' is an integer number. */
+static int is_integer(double d)
+{
+	return d == m_floor(d);
+}
+
+/*
+ * RANGE_CHECK_OP fail, limit, var, step, n, and then n times: array, number
+ * of index (1 or 2), variable, offset.
+ * It is at the start of a FOR loop with FOR_INT_OP. Checks that each index
+ * variable + offset is an integer in range for all the values that the
+ * variable can take in the loop; the variables other than the loop variable
+ * don't change in the loop. If so, we go on with the version of the loop that
+ * doesn't check the indexes; else, to 'fail', the version that does.
+ */
+static void range_check_op(void)
+{
+	int i, n, var_pos, step, dim;
+	double lo, hi, start, limit;
+	const union instruction *p;
+	const struct array_desc *desc;
+
+	var_pos = s_code[s_pc + 2].id;
+	step = s_code[s_pc + 3].id;
+	n = s_code[s_pc + 4].id;
+	start = s_ram[var_pos].d;
+	limit = s_ram[s_code[s_pc + 1].id].d;
+	p = &s_code[s_pc + 5];
+	for (i = 0; i < n; i++, p += 4) {
+		if (p[2].id == var_pos) {
+			lo = step > 0 ? start : limit;
+			hi = step > 0 ? limit : start;
+			if (!is_integer(start))
+				goto fail;
+		} else {
+			lo = hi = s_ram[p[2].id].d;
+			if (!is_integer(lo))
+				goto fail;
+		}
+
+		desc = &s_array_descs[p[0].id];
+		dim = p[1].id == 1 ? desc->dim1 : desc->dim2;
+		lo += p[3].id - s_base_ix;
+		hi += p[3].id - s_base_ix;
+		if (!(lo >= 0 && hi < dim))
+			goto fail;
+	}
+
+	s_pc += 5 + 4 * n;
+	return;
+
+fail:	s_pc = s_code[s_pc].id;
+}
+
+/*
+ * The unchecked versions of GET_LIST_OP, GET_TABLE_OP, LET_LIST_OP and
+ * LET_TABLE_OP. The parser only generates them when it knows that the indexes
+ * are integers in range. Never in debug mode.
+ */
+
+static void get_list_unchecked_op(void)
+{
+	int addr;
+
+	addr = s_code[s_pc + 1].id;
+	s_pc += 2;
+	s_stack[s_sp - 1].d = s_ram[addr + (int) s_stack[s_sp - 1].d].d;
+}
+
+static void get_table_unchecked_op(void)
+{
+	int dim2, addr;
+	double d2;
+
+	dim2 = s_array_descs[s_code[s_pc].id].dim2;
+	addr = s_code[s_pc + 1].id;
+	s_pc += 2;
+	d2 = s_stack[--s_sp].d;
+	s_stack[s_sp - 1].d =
+		s_ram[addr + (int) s_stack[s_sp - 1].d * dim2 + (int) d2].d;
+}
+
+static void let_list_unchecked_op(void)
+{
+	double value, d;
+	int addr;
+
+	addr = s_code[s_pc + 1].id;
+	s_pc += 2;
+	value = s_stack[--s_sp].d;
+	d = s_stack[--s_sp].d;
+	s_ram[addr + (int) d].d = value;
+}
+
+static void let_table_unchecked_op(void)
+{
+	double value, d1, d2;
+	int dim2, addr;
+
+	dim2 = s_array_descs[s_code[s_pc].id].dim2;
+	addr = s_code[s_pc + 1].id;
+	s_pc += 2;
+	value = s_stack[--s_sp].d;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	s_ram[addr + (int) d1 * dim2 + (int) d2].d = value;
+}
+
+/*
+ * The integer versions of GET_LIST_OP, GET_TABLE_OP, LET_LIST_OP and
+ * LET_TABLE_OP, generated by intvar.c when the indexes have no fractional
+ * part. If they are in range, they are used without rounding them.
+ */
+
+static int list_int_elem_pos(int vindex1, int addr, double d)
+{
+	if (d >= s_base_ix && d < s_base_ix + s_array_descs[vindex1].dim1)
+		return addr + (int) d;
+
+	return list_elem_pos(vindex1, addr, d);
+}
+
+static int table_int_elem_pos(int vindex1, int addr, double d1, double d2)
+{
+	const struct array_desc *desc;
+
+	desc = &s_array_descs[vindex1];
+	if (d1 >= s_base_ix && d1 < s_base_ix + desc->dim1 &&
+	    d2 >= s_base_ix && d2 < s_base_ix + desc->dim2)
+	{
+		return addr + (int) d1 * desc->dim2 + (int) d2;
+	}
+
+	return table_elem_pos(vindex1, addr, d1, d2);
+}
+
+static void get_list_int_op(void)
+{
+	int vindex1, addr, rampos;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	rampos = list_int_elem_pos(vindex1, addr, s_stack[s_sp - 1].d);
+	if (rampos >= 0)
+		s_stack[s_sp - 1].d = s_ram[rampos].d;
+}
+
+static void get_table_int_op(void)
+{
+	double d1, d2;
+	int vindex1, addr, rampos;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[s_sp - 1].d;
+	rampos = table_int_elem_pos(vindex1, addr, d1, d2);
+	if (rampos >= 0)
+		s_stack[s_sp - 1].d = s_ram[rampos].d;
+}
+
+static void let_list_int_op(void)
+{
+	double value, d;
+	int vindex1, addr;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	value = s_stack[--s_sp].d;
+	d = s_stack[--s_sp].d;
+	set_elem(list_int_elem_pos(vindex1, addr, d), value);
+}
+
+static void let_table_int_op(void)
+{
+	double value, d1, d2;
+	int vindex1, addr;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	value = s_stack[--s_sp].d;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	set_elem(table_int_elem_pos(vindex1, addr, d1, d2), value);
 }
 
 static void restore_op(void)
@@ -1200,7 +1685,7 @@ retry:	r = get_line("? ", s_input_line, sizeof s_input_line, stdin);
 	if (r == E_EOF) {
 		eprint(E_VOID_INPUT);
 		enl();
-		s_fatal = 1;
+		stop_program();
 	} else if (r == E_LINE_TOO_LONG) {
 		eprint(r);
 		enl();
@@ -1252,7 +1737,7 @@ static void input_num_op_pass1(void)
 			s_input_comma = (t == DATA_ELEM_COMMA);
 			s_input_p += len;
 			/* jump to the next input op */
-			s_pc = code[s_pc].id;				
+			s_pc = s_code[s_pc].id;				
 		} else {
 			retry_input(E_SYNTAX);
 		}
@@ -1322,7 +1807,7 @@ static void input_str_op_pass1(void)
 				s_input_comma = (t == DATA_ELEM_COMMA);
 				s_input_p += len;
 				/* jump to the next input op */
-				s_pc = code[s_pc].id;				
+				s_pc = s_code[s_pc].id;				
 			} else {
 				retry_input(E_SYNTAX);
 			}
@@ -1348,9 +1833,9 @@ static void input_str_op_pass2(void)
 
 	/* Add the string */
 	if (add_string(delem.str.start, delem.str.len, &pos) != 0) {
-		eprintln(E_NO_MEM, s_cur_line_num);
+		eprintln(E_NO_MEM, cur_line_num());
 		enl();
-		s_fatal = 1;
+		stop_program();
 		return;
 	}
 
@@ -1397,126 +1882,1740 @@ static void end_op(void)
 
 static void line_op(void)
 {
-	s_cur_line_num = code[s_pc++].id;
+	s_pc++;
+	check_break();
 }
 
-struct vm_op {
-	void (*func)(void);
-	signed char stack_inc;
-	signed char stack_dec;
-};
+/* Superinstructions. Each one does the work of the sequence of opcodes that
+ * opt.c replaces with it, with the same checks and warnings.
+ */
 
-static struct vm_op vm_ops[] = {
-	{ push_num_op, 1, 0 },
-	{ push_str_op, 1, 0 },
-	{ print_nl_op, 0, 0 },
-	{ print_comma_op, 0, 0 },
-	{ print_tab_op, 0, -1 },
-	{ print_num_op, 0, -1 },
-	{ print_str_op, 0, -1 },
-	{ let_var_op, 0, -1 },
-	{ let_list_op, 0, -2 },
-	{ let_table_op, 0, -3 },
-	{ let_strvar_op, 0, -1 },
-	{ get_var_op, 1, 0 },
-	{ get_fn_var_op, 1, 0 },
-	{ get_strvar_op, 1, 0 },
-	{ get_list_op, 0, 0 },
-	{ get_table_op, 0, -1 },
-	{ add_op, 0, -1 },
-	{ sub_op, 0, -1 },
-	{ mul_op, 0, -1 },
-	{ div_op, 0, -1 },
-	{ pow_op, 0, -1 },
-	{ neg_op, 0, 0 },
-	{ line_op, 0, 0 },
-	{ gosub_op, 0, 0 },
-	{ return_op, 0, 0 },
-	{ goto_op, 0, 0 },
-	{ on_goto_op, 0, -1 },
-	{ goto_if_true_op, 0, -1 },
-	{ less_op, 0, -1 },
-	{ greater_op, 0, -1 },
-	{ less_eq_op, 0, -1 },
-	{ greater_eq_op, 0, -1 },
-	{ eq_op, 0, -1 },
-	{ not_eq_op, 0, -1 },
-	{ eq_str_op, 0, -1 },
-	{ not_eq_str_op, 0, -1 },
-	{ for_op, 0, -3 },
-	{ for_cmp_op, 0, 0 },
-	{ next_op, 0, 0 },
-	{ restore_op, 0, 0 },
-	{ read_var_op, 0, 0 },
-	{ read_list_op, 0, -1 },
-	{ read_table_op, 0, -2 },
-	{ read_strvar_op, 0, 0 },
-	{ ifun0_op, 1, 0 },
-	{ ifun1_op, 0, 0 },
-	{ randomize_op, 0, 0 },
-	{ input_op, 0, 0 },
-	{ input_num_op, 1, 0 },
-	{ input_str_op, 1, 0 },
-	{ input_end_op, 0, 0 },
-	{ input_list_op, 0, -2 },
-	{ input_table_op, 0, -3 },
-	{ end_op, 0, 0 },
-};
+/* PUSH_NUM_OP c, ADD_OP */
+static void add_const_op(void)
+{
+	s_stack[s_sp - 1].d += s_code[s_pc++].num;
+}
 
-int get_opcode_stack_inc(int opcode)
+/* GET_VAR_OP x, PUSH_NUM_OP c, ADD_OP */
+static void add_var_const_op(void)
 {
-	return vm_ops[opcode].stack_inc;
+	int rampos;
+
+	rampos = s_code[s_pc++].id;
+	s_stack[s_sp++].d = get_var(rampos) + s_code[s_pc++].num;
 }
 
-int get_opcode_stack_dec(int opcode)
+/* GET_VAR_OP x, GET_VAR_OP y, ADD_OP */
+static void add_var_var_op(void)
 {
-	return vm_ops[opcode].stack_dec;
+	double d1, d2;
+
+	d1 = get_var(s_code[s_pc++].id);
+	d2 = get_var(s_code[s_pc++].id);
+	s_stack[s_sp++].d = d1 + d2;
 }
 
-static void free_ram(void)
+/* GET_VAR_OP x, GET_VAR_OP y, SUB_OP */
+static void sub_var_var_op(void)
 {
-	if (s_ram != NULL) {
-		free(s_ram);
-		s_ram = NULL;
-	}
+	double d1, d2;
+
+	d1 = get_var(s_code[s_pc++].id);
+	d2 = get_var(s_code[s_pc++].id);
+	s_stack[s_sp++].d = d1 - d2;
 }
 
-/**
- * Runs the current program stored in 'code' which needs an s_ram of size
- * 'ramsize' and the string constants stored in 'strings'.
- *
- * 'array_base_index' is the base index for arrays declared in the program
- * through OPTION BASE 0 or 1. Must be 0 or 1.
- * 
- * Caller must guarantee that 'ramsize * sizeof *s_ram' does not overflow a
- * signed int (use is_ram_too_big()).
- */
-void run(int ramsize, int array_base_index, int stack_size)
+/* GET_VAR_OP x, GET_LIST_OP v addr */
+static void get_list_var_op(void)
 {
-	int ir;
-	struct vm_op *vmop;
+	double d;
+	int vindex1;
 
-	assert(ramsize >= 0);
-	assert(array_base_index == 0 || array_base_index == 1);
-	assert(stack_size >= 0);
+	d = get_var(s_code[s_pc++].id);
+	vindex1 = s_code[s_pc++].id;
+	push_list_elem(vindex1, s_code[s_pc++].id, d);
+}
 
-	reset_strings();
-	restore_data();
+/* PUSH_NUM_OP c, LET_VAR_OP y */
+static void let_var_const_op(void)
+{
+	double d;
 
-#if 0
-	fprintf(stderr, "Allocating GOSUB stack (%d).\n",
-		s_default_gosub_stack_capacity);
-#endif
-	if (alloc_gosub_stack() != 0) {
-		eprint(E_NO_MEM);
-		enl();
-		return;
-	}
+	d = s_code[s_pc++].num;
+	set_var(s_code[s_pc++].id, d);
+}
 
-#if 0
-	fprintf(stderr, "Allocating stack (%d).\n", stack_size);
-#endif
-	if (alloc_stack(stack_size) != 0) {
+/* GET_VAR_OP x, LET_VAR_OP y */
+static void let_var_from_var_op(void)
+{
+	double d;
+
+	d = get_var(s_code[s_pc++].id);
+	set_var(s_code[s_pc++].id, d);
+}
+
+/* GET_VAR_OP x, PUSH_NUM_OP c, ADD_OP, LET_VAR_OP x */
+static void inc_var_op(void)
+{
+	int rampos;
+
+	rampos = s_code[s_pc++].id;
+	set_var(rampos, get_var(rampos) + s_code[s_pc++].num);
+}
+
+/* Pops the left operand of a comparison and reads the variable operand. */
+static void get_cmp_var_args(double *a, double *b)
+{
+	*a = s_stack[--s_sp].d;
+	*b = get_var(s_code[s_pc++].id);
+}
+
+/* Pops the left operand of a comparison and reads the constant operand. */
+static void get_cmp_const_args(double *a, double *b)
+{
+	*a = s_stack[--s_sp].d;
+	*b = s_code[s_pc++].num;
+}
+
+/* GET_VAR_OP x, IF_LESS_OP pc */
+static void if_less_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a < b);
+}
+
+/* GET_VAR_OP x, IF_GREATER_OP pc */
+static void if_greater_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a > b);
+}
+
+/* GET_VAR_OP x, IF_LESS_EQ_OP pc */
+static void if_less_eq_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a <= b);
+}
+
+/* GET_VAR_OP x, IF_GREATER_EQ_OP pc */
+static void if_greater_eq_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a >= b);
+}
+
+/* GET_VAR_OP x, IF_EQ_OP pc */
+static void if_eq_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a == b);
+}
+
+/* GET_VAR_OP x, IF_NOT_EQ_OP pc */
+static void if_not_eq_var_op(void)
+{
+	double a, b;
+
+	get_cmp_var_args(&a, &b);
+	branch(a != b);
+}
+
+/* PUSH_NUM_OP c, IF_LESS_OP pc */
+static void if_less_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a < b);
+}
+
+/* PUSH_NUM_OP c, IF_GREATER_OP pc */
+static void if_greater_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a > b);
+}
+
+/* PUSH_NUM_OP c, IF_LESS_EQ_OP pc */
+static void if_less_eq_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a <= b);
+}
+
+/* PUSH_NUM_OP c, IF_GREATER_EQ_OP pc */
+static void if_greater_eq_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a >= b);
+}
+
+/* PUSH_NUM_OP c, IF_EQ_OP pc */
+static void if_eq_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a == b);
+}
+
+/* PUSH_NUM_OP c, IF_NOT_EQ_OP pc */
+static void if_not_eq_const_op(void)
+{
+	double a, b;
+
+	get_cmp_const_args(&a, &b);
+	branch(a != b);
+}
+
+/*
+ * Register instructions, generated by reg.c .
+ * Their operands are ram positions (variables, and constants and
+ * temporaries allocated by reg.c) instead of stack entries. The last operand
+ * is the destination: R_ADD_OP a b c does ram[c] = ram[a] + ram[b] .
+ */
+
+/* Reads the two source operands of a register instruction. */
+static void get_r_args(double *d1, double *d2)
+{
+	*d1 = get_var(s_code[s_pc++].id);
+	*d2 = get_var(s_code[s_pc++].id);
+}
+
+static void r_add_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	set_var(s_code[s_pc++].id, d1 + d2);
+}
+
+static void r_sub_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	set_var(s_code[s_pc++].id, d1 - d2);
+}
+
+static void r_mul_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	set_var(s_code[s_pc++].id, mul_num(d1, d2));
+}
+
+static void r_div_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	set_var(s_code[s_pc++].id, div_num(d1, d2));
+}
+
+static void r_pow_op(void)
+{
+	double d1, d2;
+	int rampos;
+
+	/* pow_num() can stop the program, changing s_pc */
+	get_r_args(&d1, &d2);
+	rampos = s_code[s_pc++].id;
+	set_var(rampos, pow_num(d1, d2));
+}
+
+static void r_pow_int_op(void)
+{
+	double d1, d2;
+	int rampos;
+
+	get_r_args(&d1, &d2);
+	rampos = s_code[s_pc++].id;
+	set_var(rampos, pow_int(d1, d2));
+}
+
+static void r_neg_op(void)
+{
+	double d;
+
+	d = get_var(s_code[s_pc++].id);
+	set_var(s_code[s_pc++].id, -d);
+}
+
+static void r_mov_op(void)
+{
+	double d;
+
+	d = get_var(s_code[s_pc++].id);
+	set_var(s_code[s_pc++].id, d);
+}
+
+/* R_IF_LESS_OP a b pc: if ram[a] < ram[b], continues at pc. And the same
+ * for the other comparisons.
+ */
+static void r_if_less_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 < d2);
+}
+
+static void r_if_greater_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 > d2);
+}
+
+static void r_if_less_eq_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 <= d2);
+}
+
+static void r_if_greater_eq_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 >= d2);
+}
+
+static void r_if_eq_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 == d2);
+}
+
+static void r_if_not_eq_op(void)
+{
+	double d1, d2;
+
+	get_r_args(&d1, &d2);
+	branch(d1 != d2);
+}
+
+/* R_GET_LIST_OP v addr a c: ram[c] = v(ram[a]) */
+static void r_get_list_op(void)
+{
+	int vindex1, addr;
+	double d, value;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	d = get_var(s_code[s_pc++].id);
+	if (get_list_elem(vindex1, addr, d, &value) == 0) {
+		set_var(s_code[s_pc++].id, value);
+	}
+}
+
+/* R_GET_TABLE_OP v addr a b c: ram[c] = v(ram[a], ram[b]) */
+static void r_get_table_op(void)
+{
+	int vindex1, addr;
+	double d1, d2, value;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	get_r_args(&d1, &d2);
+	if (get_table_elem(vindex1, addr, d1, d2, &value) == 0) {
+		set_var(s_code[s_pc++].id, value);
+	}
+}
+
+/* R_LET_LIST_OP v addr a b: v(ram[a]) = ram[b] */
+static void r_let_list_op(void)
+{
+	int vindex1, addr;
+	double d, value;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	get_r_args(&d, &value);
+	set_elem(list_elem_pos(vindex1, addr, d), value);
+}
+
+/* R_LET_TABLE_OP v addr a b c: v(ram[a], ram[b]) = ram[c] */
+static void r_let_table_op(void)
+{
+	int vindex1, addr;
+	double d1, d2, value;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	get_r_args(&d1, &d2);
+	value = get_var(s_code[s_pc++].id);
+	set_elem(table_elem_pos(vindex1, addr, d1, d2), value);
+}
+
+/* R_GOTO_IF_TRUE_OP a pc */
+static void r_goto_if_true_op(void)
+{
+	double d;
+
+	d = get_var(s_code[s_pc++].id);
+	branch(d == 1.0);
+}
+
+/*
+ * Debug mode variants. When DEBUG is ON, the parser compiles them instead of
+ * the instructions that assign or read variables: they do the same, and also
+ * mark the variables assigned, or warn if they were not. The other handlers
+ * don't need to test s_debug_mode.
+ */
+
+static void let_var_debug_op(void)
+{
+	set_rampos_inited(s_code[s_pc].id);
+	let_var_op();
+}
+
+/* Marks the element at 'rampos', if it is not -1, and assigns 'value'. */
+static void set_elem_debug(int rampos, double value)
+{
+	if (rampos >= 0) {
+		set_rampos_inited(rampos);
+	}
+	set_elem(rampos, value);
+}
+
+static void let_list_debug_op(void)
+{
+	double value, d;
+	int vindex1, addr;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	value = s_stack[--s_sp].d;
+	d = s_stack[--s_sp].d;
+	set_elem_debug(list_elem_pos(vindex1, addr, d), value);
+}
+
+static void let_table_debug_op(void)
+{
+	double value, d1, d2;
+	int vindex1, addr;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	value = s_stack[--s_sp].d;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	set_elem_debug(table_elem_pos(vindex1, addr, d1, d2), value);
+}
+
+static void let_strvar_debug_op(void)
+{
+	set_rampos_inited(s_code[s_pc].id);
+	let_strvar_op();
+}
+
+static void get_var_debug_op(void)
+{
+	check_rampos_inited(s_code[s_pc].id);
+	get_var_op();
+}
+
+static void get_strvar_debug_op(void)
+{
+	check_rampos_inited(s_code[s_pc].id);
+	get_strvar_op();
+}
+
+static void get_list_debug_op(void)
+{
+	int vindex1, addr, rampos;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	rampos = list_elem_pos(vindex1, addr, s_stack[--s_sp].d);
+	if (rampos < 0)
+		return;
+
+	check_list_rampos_inited(rampos,
+		rampos - s_array_descs[vindex1].rampos);
+	s_stack[s_sp++].d = s_ram[rampos].d;
+}
+
+static void get_table_debug_op(void)
+{
+	double d1, d2;
+	int vindex1, addr, rampos, index, dim2;
+
+	vindex1 = s_code[s_pc++].id;
+	addr = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	rampos = table_elem_pos(vindex1, addr, d1, d2);
+	if (rampos < 0)
+		return;
+
+	index = rampos - s_array_descs[vindex1].rampos;
+	dim2 = s_array_descs[vindex1].dim2;
+	check_table_rampos_inited(rampos, index / dim2, index % dim2);
+	s_stack[s_sp++].d = s_ram[rampos].d;
+}
+
+static void for_debug_op(void)
+{
+	/* step, limit, var */
+	set_rampos_inited(s_code[s_pc + 2].id);
+	for_op();
+}
+
+static void for_int_debug_op(void)
+{
+	/* limit, var, step, endpc */
+	set_rampos_inited(s_code[s_pc + 1].id);
+	for_int_op();
+}
+
+static void read_var_debug_op(void)
+{
+	set_rampos_inited(s_code[s_pc].id);
+	read_var_op();
+}
+
+static void read_list_debug_op(void)
+{
+	int vindex1, rampos;
+
+	vindex1 = s_code[s_pc++].id;
+	rampos = list_elem_pos(vindex1, list_addr(vindex1),
+		s_stack[--s_sp].d);
+	if (rampos >= 0) {
+		set_elem_debug(rampos, read_double());
+	}
+}
+
+static void read_table_debug_op(void)
+{
+	double d1, d2;
+	int vindex1, rampos;
+
+	vindex1 = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	rampos = table_elem_pos(vindex1, table_addr(vindex1), d1, d2);
+	if (rampos >= 0) {
+		set_elem_debug(rampos, read_double());
+	}
+}
+
+static void read_strvar_debug_op(void)
+{
+	set_rampos_inited(s_code[s_pc].id);
+	read_strvar_op();
+}
+
+static void input_list_debug_op(void)
+{
+	double value, d;
+	int vindex1;
+
+	vindex1 = s_code[s_pc++].id;
+	d = s_stack[--s_sp].d;
+	value = s_stack[--s_sp].d;
+	set_elem_debug(list_elem_pos(vindex1, list_addr(vindex1), d), value);
+}
+
+static void input_table_debug_op(void)
+{
+	double value, d1, d2;
+	int vindex1;
+
+	vindex1 = s_code[s_pc++].id;
+	d2 = s_stack[--s_sp].d;
+	d1 = s_stack[--s_sp].d;
+	value = s_stack[--s_sp].d;
+	set_elem_debug(table_elem_pos(vindex1, table_addr(vindex1), d1, d2),
+		value);
+}
+
+/* 'nargs' is the number of slots that follow the opcode. ON_GOTO_OP has, in
+ * addition, as many slots as the number stored in its first one, and
+ * RANGE_CHECK_OP four times the number stored in its fifth one.
+ * 'jump' is the index of the slot, counting the opcode as 0, that holds a code
+ * address to jump to; 0 if none. For ON_GOTO_OP, this is the first of the
+ * list of addresses.
+ */
+struct vm_op {
+	void (*func)(void);
+	signed char stack_inc;
+	signed char stack_dec;
+	signed char nargs;
+	signed char jump;
+};
+
+static struct vm_op vm_ops[] = {
+	{ push_num_op, 1, 0, 1, 0 },
+	{ push_str_op, 1, 0, 1, 0 },
+	{ print_nl_op, 0, 0, 0, 0 },
+	{ print_comma_op, 0, 0, 0, 0 },
+	{ print_tab_op, 0, -1, 0, 0 },
+	{ print_num_op, 0, -1, 0, 0 },
+	{ print_str_op, 0, -1, 0, 0 },
+	{ let_var_op, 0, -1, 1, 0 },
+	{ let_list_op, 0, -2, 2, 0 },
+	{ let_table_op, 0, -3, 2, 0 },
+	{ let_strvar_op, 0, -1, 1, 0 },
+	{ get_var_op, 1, 0, 1, 0 },
+	{ get_fn_var_op, 1, 0, 1, 0 },
+	{ get_strvar_op, 1, 0, 1, 0 },
+	{ get_list_op, 0, 0, 2, 0 },
+	{ get_table_op, 0, -1, 2, 0 },
+	{ add_op, 0, -1, 0, 0 },
+	{ sub_op, 0, -1, 0, 0 },
+	{ mul_op, 0, -1, 0, 0 },
+	{ div_op, 0, -1, 0, 0 },
+	{ pow_op, 0, -1, 0, 0 },
+	{ neg_op, 0, 0, 0, 0 },
+	{ line_op, 0, 0, 1, 0 },
+	{ gosub_op, 0, 0, 1, 1 },
+	{ gosub_unchecked_op, 0, 0, 1, 1 },
+	{ return_op, 0, 0, 0, 0 },
+	{ goto_op, 0, 0, 1, 1 },
+	{ on_goto_op, 0, -1, 1, 2 },
+	{ goto_if_true_op, 0, -1, 1, 1 },
+	{ if_less_op, 0, -2, 1, 1 },
+	{ if_greater_op, 0, -2, 1, 1 },
+	{ if_less_eq_op, 0, -2, 1, 1 },
+	{ if_greater_eq_op, 0, -2, 1, 1 },
+	{ if_eq_op, 0, -2, 1, 1 },
+	{ if_not_eq_op, 0, -2, 1, 1 },
+	{ if_eq_str_op, 0, -2, 1, 1 },
+	{ if_not_eq_str_op, 0, -2, 1, 1 },
+	{ less_op, 0, -1, 0, 0 },
+	{ greater_op, 0, -1, 0, 0 },
+	{ less_eq_op, 0, -1, 0, 0 },
+	{ greater_eq_op, 0, -1, 0, 0 },
+	{ eq_op, 0, -1, 0, 0 },
+	{ not_eq_op, 0, -1, 0, 0 },
+	{ eq_str_op, 0, -1, 0, 0 },
+	{ not_eq_str_op, 0, -1, 0, 0 },
+	{ for_op, 0, -3, 3, 0 },
+	{ for_cmp_op, 0, 0, 1, 1 },
+	{ next_op, 0, 0, 1, 1 },
+	{ for_int_op, 0, -2, 4, 4 },
+	{ next_int_op, 0, 0, 4, 1 },
+	{ range_check_op, 0, 0, 5, 1 },
+	{ get_list_unchecked_op, 0, 0, 2, 0 },
+	{ get_table_unchecked_op, 0, -1, 2, 0 },
+	{ let_list_unchecked_op, 0, -2, 2, 0 },
+	{ let_table_unchecked_op, 0, -3, 2, 0 },
+	{ restore_op, 0, 0, 0, 0 },
+	{ read_var_op, 0, 0, 1, 0 },
+	{ read_list_op, 0, -1, 1, 0 },
+	{ read_table_op, 0, -2, 1, 0 },
+	{ read_strvar_op, 0, 0, 1, 0 },
+	{ ifun0_op, 1, 0, 1, 0 },
+	{ ifun1_op, 0, 0, 1, 0 },
+	{ randomize_op, 0, 0, 0, 0 },
+	{ input_op, 0, 0, 0, 0 },
+	{ input_num_op, 1, 0, 1, 1 },
+	{ input_str_op, 1, 0, 1, 1 },
+	{ input_end_op, 0, 0, 0, 0 },
+	{ input_list_op, 0, -2, 1, 0 },
+	{ input_table_op, 0, -3, 1, 0 },
+	{ end_op, 0, 0, 0, 0 },
+	{ add_const_op, 0, 0, 1, 0 },
+	{ add_var_const_op, 1, 0, 2, 0 },
+	{ add_var_var_op, 1, 0, 2, 0 },
+	{ sub_var_var_op, 1, 0, 2, 0 },
+	{ get_list_var_op, 1, 0, 3, 0 },
+	{ let_var_const_op, 0, 0, 2, 0 },
+	{ let_var_from_var_op, 0, 0, 2, 0 },
+	{ inc_var_op, 0, 0, 2, 0 },
+	{ if_less_var_op, 0, -1, 2, 2 },
+	{ if_greater_var_op, 0, -1, 2, 2 },
+	{ if_less_eq_var_op, 0, -1, 2, 2 },
+	{ if_greater_eq_var_op, 0, -1, 2, 2 },
+	{ if_eq_var_op, 0, -1, 2, 2 },
+	{ if_not_eq_var_op, 0, -1, 2, 2 },
+	{ if_less_const_op, 0, -1, 2, 2 },
+	{ if_greater_const_op, 0, -1, 2, 2 },
+	{ if_less_eq_const_op, 0, -1, 2, 2 },
+	{ if_greater_eq_const_op, 0, -1, 2, 2 },
+	{ if_eq_const_op, 0, -1, 2, 2 },
+	{ if_not_eq_const_op, 0, -1, 2, 2 },
+	{ r_add_op, 0, 0, 3, 0 },
+	{ r_sub_op, 0, 0, 3, 0 },
+	{ r_mul_op, 0, 0, 3, 0 },
+	{ r_div_op, 0, 0, 3, 0 },
+	{ r_pow_op, 0, 0, 3, 0 },
+	{ r_neg_op, 0, 0, 2, 0 },
+	{ r_mov_op, 0, 0, 2, 0 },
+	{ r_if_less_op, 0, 0, 3, 3 },
+	{ r_if_greater_op, 0, 0, 3, 3 },
+	{ r_if_less_eq_op, 0, 0, 3, 3 },
+	{ r_if_greater_eq_op, 0, 0, 3, 3 },
+	{ r_if_eq_op, 0, 0, 3, 3 },
+	{ r_if_not_eq_op, 0, 0, 3, 3 },
+	{ r_get_list_op, 0, 0, 4, 0 },
+	{ r_get_table_op, 0, 0, 5, 0 },
+	{ r_let_list_op, 0, 0, 4, 0 },
+	{ r_let_table_op, 0, 0, 5, 0 },
+	{ r_goto_if_true_op, 0, 0, 2, 2 },
+	{ r_pow_int_op, 0, 0, 3, 0 },
+	{ get_list_int_op, 0, 0, 2, 0 },
+	{ get_table_int_op, 0, -1, 2, 0 },
+	{ let_list_int_op, 0, -2, 2, 0 },
+	{ let_table_int_op, 0, -3, 2, 0 },
+	{ pow_int_op, 0, -1, 0, 0 },
+	{ let_var_debug_op, 0, -1, 1, 0 },
+	{ let_list_debug_op, 0, -2, 2, 0 },
+	{ let_table_debug_op, 0, -3, 2, 0 },
+	{ let_strvar_debug_op, 0, -1, 1, 0 },
+	{ get_var_debug_op, 1, 0, 1, 0 },
+	{ get_strvar_debug_op, 1, 0, 1, 0 },
+	{ get_list_debug_op, 0, 0, 2, 0 },
+	{ get_table_debug_op, 0, -1, 2, 0 },
+	{ for_debug_op, 0, -3, 3, 0 },
+	{ for_int_debug_op, 0, -2, 4, 4 },
+	{ read_var_debug_op, 0, 0, 1, 0 },
+	{ read_list_debug_op, 0, -1, 1, 0 },
+	{ read_table_debug_op, 0, -2, 1, 0 },
+	{ read_strvar_debug_op, 0, 0, 1, 0 },
+	{ input_list_debug_op, 0, -2, 1, 0 },
+	{ input_table_debug_op, 0, -3, 1, 0 },
+};
+
+int get_opcode_stack_inc(int opcode)
+{
+	return vm_ops[opcode].stack_inc;
+}
+
+int get_opcode_stack_dec(int opcode)
+{
+	return vm_ops[opcode].stack_dec;
+}
+
+/* Returns the number of slots used by the instruction 'instr', including the
+ * opcode.
+ */
+int get_instr_size(const union instruction *instr)
+{
+	if (instr->opcode == ON_GOTO_OP) {
+		return 2 + instr[1].id;
+	} else if (instr->opcode == RANGE_CHECK_OP) {
+		return 6 + 4 * instr[5].id;
+	}
+
+	return 1 + vm_ops[instr->opcode].nargs;
+}
+
+/* See 'jump' in struct vm_op. */
+int get_opcode_jump_arg(int opcode)
+{
+	return vm_ops[opcode].jump;
+}
+
+/* Returns the function that executes 'opcode'. Used by the native code for
+ * the instructions it doesn't translate.
+ */
+vm_func get_opcode_func(int opcode)
+{
+	return vm_ops[opcode].func;
+}
+
+static void free_ram(void)
+{
+	if (s_ram != NULL) {
+		free(s_ram);
+		s_ram = NULL;
+	}
+}
+
+/*
+ * Executes instructions from s_pc until END_OP. On a fatal error or a break,
+ * the handlers go to the last END_OP (see stop_program()).
+ */
+static void exec_loop(void)
+{
+	enum vm_opcode opcode;
+
+	s_code = code;
+	while ((opcode = s_code[s_pc++].opcode) != END_OP) {
+		assert(vm_ops[opcode].stack_inc + s_sp <= s_stack_capacity);
+		vm_ops[opcode].func();
+	}
+}
+
+#if defined(THREADED_CODE)
+
+/*
+ * Direct threaded code. We work on a copy of 'code' where each opcode has been
+ * replaced by the address of a label in exec_threaded(). At that label, we
+ * call the handler for the opcode and then jump directly to the label of the
+ * next instruction, without going through vm_ops[] or a central loop.
+ */
+
+/* Builds in s_code a copy of 'code', where each opcode is replaced by its
+ * label in 'labels'.
+ * Returns E_NO_MEM if there is no memory.
+ */
+static enum error_code thread_code(const void *const labels[])
+{
+	int pc, size, n;
+
+	size = get_code_size();
+	if ((s_code = malloc(size * sizeof *s_code)) == NULL) {
+		return E_NO_MEM;
+	}
+
+	for (pc = 0; pc < size; pc += n) {
+		n = get_instr_size(&code[pc]);
+		assert(labels[code[pc].opcode] != NULL);
+		s_code[pc].label = labels[code[pc].opcode];
+		memcpy(&s_code[pc + 1], &code[pc + 1], (n - 1) * sizeof *s_code);
+	}
+
+	return 0;
+}
+
+#define DISPATCH()	goto *s_code[s_pc++].label
+
+#define OP(name)	name##_l: name(); DISPATCH()
+
+/* Executes instructions from s_pc until END_OP; see exec_loop().
+ * Returns E_NO_MEM, without executing anything, if there is no memory to
+ * thread the code.
+ */
+static enum error_code exec_threaded(void)
+{
+	static const void *const labels[VM_NOPS] = {
+		[PUSH_NUM_OP] = &&push_num_op_l,
+		[PUSH_STR_OP] = &&push_str_op_l,
+		[PRINT_NL_OP] = &&print_nl_op_l,
+		[PRINT_COMMA_OP] = &&print_comma_op_l,
+		[PRINT_TAB_OP] = &&print_tab_op_l,
+		[PRINT_NUM_OP] = &&print_num_op_l,
+		[PRINT_STR_OP] = &&print_str_op_l,
+		[LET_VAR_OP] = &&let_var_op_l,
+		[LET_LIST_OP] = &&let_list_op_l,
+		[LET_TABLE_OP] = &&let_table_op_l,
+		[LET_STRVAR_OP] = &&let_strvar_op_l,
+		[GET_VAR_OP] = &&get_var_op_l,
+		[GET_FN_VAR_OP] = &&get_fn_var_op_l,
+		[GET_STRVAR_OP] = &&get_strvar_op_l,
+		[GET_LIST_OP] = &&get_list_op_l,
+		[GET_TABLE_OP] = &&get_table_op_l,
+		[ADD_OP] = &&add_op_l,
+		[SUB_OP] = &&sub_op_l,
+		[MUL_OP] = &&mul_op_l,
+		[DIV_OP] = &&div_op_l,
+		[POW_OP] = &&pow_op_l,
+		[NEG_OP] = &&neg_op_l,
+		[LINE_OP] = &&line_op_l,
+		[GOSUB_OP] = &&gosub_op_l,
+		[GOSUB_UNCHECKED_OP] = &&gosub_unchecked_op_l,
+		[RETURN_OP] = &&return_op_l,
+		[GOTO_OP] = &&goto_op_l,
+		[ON_GOTO_OP] = &&on_goto_op_l,
+		[GOTO_IF_TRUE_OP] = &&goto_if_true_op_l,
+		[IF_LESS_OP] = &&if_less_op_l,
+		[IF_GREATER_OP] = &&if_greater_op_l,
+		[IF_LESS_EQ_OP] = &&if_less_eq_op_l,
+		[IF_GREATER_EQ_OP] = &&if_greater_eq_op_l,
+		[IF_EQ_OP] = &&if_eq_op_l,
+		[IF_NOT_EQ_OP] = &&if_not_eq_op_l,
+		[IF_EQ_STR_OP] = &&if_eq_str_op_l,
+		[IF_NOT_EQ_STR_OP] = &&if_not_eq_str_op_l,
+		[LESS_OP] = &&less_op_l,
+		[GREATER_OP] = &&greater_op_l,
+		[LESS_EQ_OP] = &&less_eq_op_l,
+		[GREATER_EQ_OP] = &&greater_eq_op_l,
+		[EQ_OP] = &&eq_op_l,
+		[NOT_EQ_OP] = &&not_eq_op_l,
+		[EQ_STR_OP] = &&eq_str_op_l,
+		[NOT_EQ_STR_OP] = &&not_eq_str_op_l,
+		[FOR_OP] = &&for_op_l,
+		[FOR_CMP_OP] = &&for_cmp_op_l,
+		[NEXT_OP] = &&next_op_l,
+		[FOR_INT_OP] = &&for_int_op_l,
+		[NEXT_INT_OP] = &&next_int_op_l,
+		[RANGE_CHECK_OP] = &&range_check_op_l,
+		[GET_LIST_UNCHECKED_OP] = &&get_list_unchecked_op_l,
+		[GET_TABLE_UNCHECKED_OP] = &&get_table_unchecked_op_l,
+		[LET_LIST_UNCHECKED_OP] = &&let_list_unchecked_op_l,
+		[LET_TABLE_UNCHECKED_OP] = &&let_table_unchecked_op_l,
+		[RESTORE_OP] = &&restore_op_l,
+		[READ_VAR_OP] = &&read_var_op_l,
+		[READ_LIST_OP] = &&read_list_op_l,
+		[READ_TABLE_OP] = &&read_table_op_l,
+		[READ_STRVAR_OP] = &&read_strvar_op_l,
+		[IFUN0_OP] = &&ifun0_op_l,
+		[IFUN1_OP] = &&ifun1_op_l,
+		[RANDOMIZE_OP] = &&randomize_op_l,
+		[INPUT_OP] = &&input_op_l,
+		[INPUT_NUM_OP] = &&input_num_op_l,
+		[INPUT_STR_OP] = &&input_str_op_l,
+		[INPUT_END_OP] = &&input_end_op_l,
+		[INPUT_LIST_OP] = &&input_list_op_l,
+		[INPUT_TABLE_OP] = &&input_table_op_l,
+		[END_OP] = &&end_op_l,
+		[ADD_CONST_OP] = &&add_const_op_l,
+		[ADD_VAR_CONST_OP] = &&add_var_const_op_l,
+		[ADD_VAR_VAR_OP] = &&add_var_var_op_l,
+		[SUB_VAR_VAR_OP] = &&sub_var_var_op_l,
+		[GET_LIST_VAR_OP] = &&get_list_var_op_l,
+		[LET_VAR_CONST_OP] = &&let_var_const_op_l,
+		[LET_VAR_FROM_VAR_OP] = &&let_var_from_var_op_l,
+		[INC_VAR_OP] = &&inc_var_op_l,
+		[IF_LESS_VAR_OP] = &&if_less_var_op_l,
+		[IF_GREATER_VAR_OP] = &&if_greater_var_op_l,
+		[IF_LESS_EQ_VAR_OP] = &&if_less_eq_var_op_l,
+		[IF_GREATER_EQ_VAR_OP] = &&if_greater_eq_var_op_l,
+		[IF_EQ_VAR_OP] = &&if_eq_var_op_l,
+		[IF_NOT_EQ_VAR_OP] = &&if_not_eq_var_op_l,
+		[IF_LESS_CONST_OP] = &&if_less_const_op_l,
+		[IF_GREATER_CONST_OP] = &&if_greater_const_op_l,
+		[IF_LESS_EQ_CONST_OP] = &&if_less_eq_const_op_l,
+		[IF_GREATER_EQ_CONST_OP] = &&if_greater_eq_const_op_l,
+		[IF_EQ_CONST_OP] = &&if_eq_const_op_l,
+		[IF_NOT_EQ_CONST_OP] = &&if_not_eq_const_op_l,
+		[R_ADD_OP] = &&r_add_op_l,
+		[R_SUB_OP] = &&r_sub_op_l,
+		[R_MUL_OP] = &&r_mul_op_l,
+		[R_DIV_OP] = &&r_div_op_l,
+		[R_POW_OP] = &&r_pow_op_l,
+		[R_NEG_OP] = &&r_neg_op_l,
+		[R_MOV_OP] = &&r_mov_op_l,
+		[R_IF_LESS_OP] = &&r_if_less_op_l,
+		[R_IF_GREATER_OP] = &&r_if_greater_op_l,
+		[R_IF_LESS_EQ_OP] = &&r_if_less_eq_op_l,
+		[R_IF_GREATER_EQ_OP] = &&r_if_greater_eq_op_l,
+		[R_IF_EQ_OP] = &&r_if_eq_op_l,
+		[R_IF_NOT_EQ_OP] = &&r_if_not_eq_op_l,
+		[R_GET_LIST_OP] = &&r_get_list_op_l,
+		[R_GET_TABLE_OP] = &&r_get_table_op_l,
+		[R_LET_LIST_OP] = &&r_let_list_op_l,
+		[R_LET_TABLE_OP] = &&r_let_table_op_l,
+		[R_GOTO_IF_TRUE_OP] = &&r_goto_if_true_op_l,
+		[R_POW_INT_OP] = &&r_pow_int_op_l,
+		[GET_LIST_INT_OP] = &&get_list_int_op_l,
+		[GET_TABLE_INT_OP] = &&get_table_int_op_l,
+		[LET_LIST_INT_OP] = &&let_list_int_op_l,
+		[LET_TABLE_INT_OP] = &&let_table_int_op_l,
+		[POW_INT_OP] = &&pow_int_op_l,
+		[LET_VAR_DEBUG_OP] = &&let_var_debug_op_l,
+		[LET_LIST_DEBUG_OP] = &&let_list_debug_op_l,
+		[LET_TABLE_DEBUG_OP] = &&let_table_debug_op_l,
+		[LET_STRVAR_DEBUG_OP] = &&let_strvar_debug_op_l,
+		[GET_VAR_DEBUG_OP] = &&get_var_debug_op_l,
+		[GET_STRVAR_DEBUG_OP] = &&get_strvar_debug_op_l,
+		[GET_LIST_DEBUG_OP] = &&get_list_debug_op_l,
+		[GET_TABLE_DEBUG_OP] = &&get_table_debug_op_l,
+		[FOR_DEBUG_OP] = &&for_debug_op_l,
+		[FOR_INT_DEBUG_OP] = &&for_int_debug_op_l,
+		[READ_VAR_DEBUG_OP] = &&read_var_debug_op_l,
+		[READ_LIST_DEBUG_OP] = &&read_list_debug_op_l,
+		[READ_TABLE_DEBUG_OP] = &&read_table_debug_op_l,
+		[READ_STRVAR_DEBUG_OP] = &&read_strvar_debug_op_l,
+		[INPUT_LIST_DEBUG_OP] = &&input_list_debug_op_l,
+		[INPUT_TABLE_DEBUG_OP] = &&input_table_debug_op_l,
+	};
+
+	if (thread_code(labels) != 0) {
+		s_code = NULL;
+		return E_NO_MEM;
+	}
+
+	DISPATCH();
+
+	OP(push_num_op);
+	OP(push_str_op);
+	OP(print_nl_op);
+	OP(print_comma_op);
+	OP(print_tab_op);
+	OP(print_num_op);
+	OP(print_str_op);
+	OP(let_var_op);
+	OP(let_list_op);
+	OP(let_table_op);
+	OP(let_strvar_op);
+	OP(get_var_op);
+	OP(get_fn_var_op);
+	OP(get_strvar_op);
+	OP(get_list_op);
+	OP(get_table_op);
+	OP(add_op);
+	OP(sub_op);
+	OP(mul_op);
+	OP(div_op);
+	OP(pow_op);
+	OP(neg_op);
+	OP(line_op);
+	OP(gosub_op);
+	OP(gosub_unchecked_op);
+	OP(return_op);
+	OP(goto_op);
+	OP(on_goto_op);
+	OP(goto_if_true_op);
+	OP(if_less_op);
+	OP(if_greater_op);
+	OP(if_less_eq_op);
+	OP(if_greater_eq_op);
+	OP(if_eq_op);
+	OP(if_not_eq_op);
+	OP(if_eq_str_op);
+	OP(if_not_eq_str_op);
+	OP(less_op);
+	OP(greater_op);
+	OP(less_eq_op);
+	OP(greater_eq_op);
+	OP(eq_op);
+	OP(not_eq_op);
+	OP(eq_str_op);
+	OP(not_eq_str_op);
+	OP(for_op);
+	OP(for_cmp_op);
+	OP(next_op);
+	OP(for_int_op);
+	OP(next_int_op);
+	OP(range_check_op);
+	OP(get_list_unchecked_op);
+	OP(get_table_unchecked_op);
+	OP(let_list_unchecked_op);
+	OP(let_table_unchecked_op);
+	OP(restore_op);
+	OP(read_var_op);
+	OP(read_list_op);
+	OP(read_table_op);
+	OP(read_strvar_op);
+	OP(ifun0_op);
+	OP(ifun1_op);
+	OP(randomize_op);
+	OP(input_op);
+	OP(input_num_op);
+	OP(input_str_op);
+	OP(input_end_op);
+	OP(input_list_op);
+	OP(input_table_op);
+	OP(add_const_op);
+	OP(add_var_const_op);
+	OP(add_var_var_op);
+	OP(sub_var_var_op);
+	OP(get_list_var_op);
+	OP(let_var_const_op);
+	OP(let_var_from_var_op);
+	OP(inc_var_op);
+	OP(if_less_var_op);
+	OP(if_greater_var_op);
+	OP(if_less_eq_var_op);
+	OP(if_greater_eq_var_op);
+	OP(if_eq_var_op);
+	OP(if_not_eq_var_op);
+	OP(if_less_const_op);
+	OP(if_greater_const_op);
+	OP(if_less_eq_const_op);
+	OP(if_greater_eq_const_op);
+	OP(if_eq_const_op);
+	OP(if_not_eq_const_op);
+	OP(r_add_op);
+	OP(r_sub_op);
+	OP(r_mul_op);
+	OP(r_div_op);
+	OP(r_pow_op);
+	OP(r_neg_op);
+	OP(r_mov_op);
+	OP(r_if_less_op);
+	OP(r_if_greater_op);
+	OP(r_if_less_eq_op);
+	OP(r_if_greater_eq_op);
+	OP(r_if_eq_op);
+	OP(r_if_not_eq_op);
+	OP(r_get_list_op);
+	OP(r_get_table_op);
+	OP(r_let_list_op);
+	OP(r_let_table_op);
+	OP(r_goto_if_true_op);
+	OP(r_pow_int_op);
+	OP(get_list_int_op);
+	OP(get_table_int_op);
+	OP(let_list_int_op);
+	OP(let_table_int_op);
+	OP(pow_int_op);
+	OP(let_var_debug_op);
+	OP(let_list_debug_op);
+	OP(let_table_debug_op);
+	OP(let_strvar_debug_op);
+	OP(get_var_debug_op);
+	OP(get_strvar_debug_op);
+	OP(get_list_debug_op);
+	OP(get_table_debug_op);
+	OP(for_debug_op);
+	OP(for_int_debug_op);
+	OP(read_var_debug_op);
+	OP(read_list_debug_op);
+	OP(read_table_debug_op);
+	OP(read_strvar_debug_op);
+	OP(input_list_debug_op);
+	OP(input_table_debug_op);
+
+end_op_l:
+	free(s_code);
+	s_code = NULL;
+	return 0;
+}
+
+#undef OP
+#undef DISPATCH
+
+#endif
+
+#if defined(TAIL_CALLS)
+
+/*
+ * Tail calling code. As in the threaded code, we work on a copy of 'code'
+ * where each opcode has been replaced, here by a function that executes the
+ * instruction. It gets the position of the instruction, the top of the stack
+ * and the ram as arguments, which the C calling convention passes in
+ * registers, and ends calling the function of the next instruction with the
+ * same arguments. With __attribute__((musttail)), the compiler must compile
+ * that call as a jump, so the C stack doesn't grow and the state stays in
+ * registers from one instruction to the next. Without it, a long program
+ * would overflow the C stack unless the optimizer made the same jumps, so
+ * configure only defines TAIL_CALLS when the compiler has it.
+ *
+ * The frequent instructions have their own function, which doesn't touch
+ * s_pc and s_sp. The rest, and the cases that must print a warning, go to
+ * tail_slow(), which stores the state in s_pc and s_sp, calls the handler in
+ * vm_ops[] and loads the state back, like the slow path of jit.c. The
+ * handlers read their operands from 'code', as s_code is 'code' here.
+ */
+
+union tail_instr;
+
+typedef int tail_func(const union tail_instr *pc, union ram_value *sp,
+	union ram_value *ram);
+
+union tail_instr {
+	tail_func *func;
+	int id;
+	double num;
+};
+
+#if !defined(HAVE_MUSTTAIL)
+#error "TAIL_CALLS needs __attribute__((musttail))"
+#endif
+
+#define MUSTTAIL	__attribute__((musttail))
+
+#define TAIL(name)	static int name##_t(const union tail_instr *pc, \
+				union ram_value *sp, union ram_value *ram)
+
+/* Goes on with the instruction at 'pc'. */
+#define NEXT()		MUSTTAIL return pc->func(pc, sp, ram)
+
+/* Executes the instruction at 'pc' with its handler in vm_ops[]. */
+#define SLOW()		MUSTTAIL return tail_slow(pc, sp, ram)
+
+/* The copy of 'code' we execute. */
+static union tail_instr *s_tail_code;
+
+/* The position of the copy for the position 'pc' of 'code'. */
+#define AT(pc)		(s_tail_code + (pc))
+
+/*
+ * Continues at 'to'. As in jump_to(), a jump back or to the same instruction
+ * is a polling point: there we stop if there was a break.
+ */
+#define JUMP(to)	do { \
+				if ((to) <= pc && s_break) { \
+					s_pc = (to) - s_tail_code; \
+					check_break(); \
+					pc = AT(s_pc); \
+				} else { \
+					pc = (to); \
+				} \
+			} while (0)
+
+static int tail_slow(const union tail_instr *pc, union ram_value *sp,
+	union ram_value *ram)
+{
+	s_pc = pc - s_tail_code;
+	s_sp = sp - s_stack;
+	vm_ops[s_code[s_pc++].opcode].func();
+	pc = AT(s_pc);
+	sp = s_stack + s_sp;
+	NEXT();
+}
+
+TAIL(end_op)
+{
+	s_pc = pc - s_tail_code + 1;
+	s_sp = sp - s_stack;
+	return 0;
+}
+
+TAIL(push_num_op)
+{
+	sp->d = pc[1].num;
+	sp++;
+	pc += 2;
+	NEXT();
+}
+
+TAIL(get_var_op)
+{
+	sp->d = ram[pc[1].id].d;
+	sp++;
+	pc += 2;
+	NEXT();
+}
+
+TAIL(let_var_op)
+{
+	sp--;
+	ram[pc[1].id].d = sp->d;
+	pc += 2;
+	NEXT();
+}
+
+TAIL(add_op)
+{
+	sp--;
+	sp[-1].d += sp->d;
+	pc++;
+	NEXT();
+}
+
+TAIL(sub_op)
+{
+	sp--;
+	sp[-1].d -= sp->d;
+	pc++;
+	NEXT();
+}
+
+/* Without overflow; else mul_num() warns. */
+TAIL(mul_op)
+{
+	double d;
+
+	d = sp[-2].d * sp[-1].d;
+	if (d - d != 0.0)
+		SLOW();
+	sp--;
+	sp[-1].d = d;
+	pc++;
+	NEXT();
+}
+
+/* Without division by zero; else div_num() warns. */
+TAIL(div_op)
+{
+	if (sp[-1].d == 0.0)
+		SLOW();
+	sp--;
+	sp[-1].d /= sp->d;
+	pc++;
+	NEXT();
+}
+
+TAIL(neg_op)
+{
+	sp[-1].d = -sp[-1].d;
+	pc++;
+	NEXT();
+}
+
+TAIL(goto_op)
+{
+	JUMP(AT(pc[1].id));
+	NEXT();
+}
+
+/* Pops two numbers and jumps to the address operand if 'a op b'. */
+#define IF_TAIL(name, op) \
+TAIL(name) \
+{ \
+	double a, b; \
+\
+	b = sp[-1].d; \
+	a = sp[-2].d; \
+	sp -= 2; \
+	if (a op b) { \
+		JUMP(AT(pc[1].id)); \
+	} else { \
+		pc += 2; \
+	} \
+	NEXT(); \
+}
+
+/* Pops a number and compares it with a variable or a constant. */
+#define IF_ARG_TAIL(name, op, arg) \
+TAIL(name) \
+{ \
+	double a; \
+\
+	a = sp[-1].d; \
+	sp--; \
+	if (a op (arg)) { \
+		JUMP(AT(pc[2].id)); \
+	} else { \
+		pc += 3; \
+	} \
+	NEXT(); \
+}
+
+/* Compares two registers. */
+#define R_IF_TAIL(name, op) \
+TAIL(name) \
+{ \
+	if (ram[pc[1].id].d op ram[pc[2].id].d) { \
+		JUMP(AT(pc[3].id)); \
+	} else { \
+		pc += 4; \
+	} \
+	NEXT(); \
+}
+
+IF_TAIL(if_less_op, <)
+IF_TAIL(if_greater_op, >)
+IF_TAIL(if_less_eq_op, <=)
+IF_TAIL(if_greater_eq_op, >=)
+IF_TAIL(if_eq_op, ==)
+IF_TAIL(if_not_eq_op, !=)
+IF_ARG_TAIL(if_less_var_op, <, ram[pc[1].id].d)
+IF_ARG_TAIL(if_greater_var_op, >, ram[pc[1].id].d)
+IF_ARG_TAIL(if_less_eq_var_op, <=, ram[pc[1].id].d)
+IF_ARG_TAIL(if_greater_eq_var_op, >=, ram[pc[1].id].d)
+IF_ARG_TAIL(if_eq_var_op, ==, ram[pc[1].id].d)
+IF_ARG_TAIL(if_not_eq_var_op, !=, ram[pc[1].id].d)
+IF_ARG_TAIL(if_less_const_op, <, pc[1].num)
+IF_ARG_TAIL(if_greater_const_op, >, pc[1].num)
+IF_ARG_TAIL(if_less_eq_const_op, <=, pc[1].num)
+IF_ARG_TAIL(if_greater_eq_const_op, >=, pc[1].num)
+IF_ARG_TAIL(if_eq_const_op, ==, pc[1].num)
+IF_ARG_TAIL(if_not_eq_const_op, !=, pc[1].num)
+R_IF_TAIL(r_if_less_op, <)
+R_IF_TAIL(r_if_greater_op, >)
+R_IF_TAIL(r_if_less_eq_op, <=)
+R_IF_TAIL(r_if_greater_eq_op, >=)
+R_IF_TAIL(r_if_eq_op, ==)
+R_IF_TAIL(r_if_not_eq_op, !=)
+
+/* The FOR_OP before has the step, limit and variable. */
+TAIL(for_cmp_op)
+{
+	double step;
+
+	step = ram[pc[-3].id].d;
+	if ((ram[pc[-1].id].d - ram[pc[-2].id].d) * sign(step) > 0.0) {
+		pc = AT(pc[1].id);
+	} else {
+		pc += 2;
+	}
+	NEXT();
+}
+
+TAIL(next_op)
+{
+	pc = AT(pc[1].id);
+	ram[pc[-1].id].d += ram[pc[-3].id].d;
+	if (s_break) {
+		s_pc = pc - s_tail_code;
+		check_break();
+		pc = AT(s_pc);
+	}
+	NEXT();
+}
+
+/* body, limit, variable, step */
+TAIL(next_int_op)
+{
+	double var;
+	int step;
+
+	step = pc[4].id;
+	var = ram[pc[3].id].d + step;
+	ram[pc[3].id].d = var;
+	if (for_int_done(var, ram[pc[2].id].d, step)) {
+		pc += 5;
+	} else {
+		JUMP(AT(pc[1].id));
+	}
+	NEXT();
+}
+
+TAIL(get_list_unchecked_op)
+{
+	sp[-1].d = ram[pc[2].id + (int) sp[-1].d].d;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(let_list_unchecked_op)
+{
+	ram[pc[2].id + (int) sp[-2].d].d = sp[-1].d;
+	sp -= 2;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(add_const_op)
+{
+	sp[-1].d += pc[1].num;
+	pc += 2;
+	NEXT();
+}
+
+TAIL(add_var_const_op)
+{
+	sp->d = ram[pc[1].id].d + pc[2].num;
+	sp++;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(add_var_var_op)
+{
+	sp->d = ram[pc[1].id].d + ram[pc[2].id].d;
+	sp++;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(sub_var_var_op)
+{
+	sp->d = ram[pc[1].id].d - ram[pc[2].id].d;
+	sp++;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(let_var_const_op)
+{
+	ram[pc[2].id].d = pc[1].num;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(let_var_from_var_op)
+{
+	ram[pc[2].id].d = ram[pc[1].id].d;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(inc_var_op)
+{
+	ram[pc[1].id].d += pc[2].num;
+	pc += 3;
+	NEXT();
+}
+
+TAIL(r_add_op)
+{
+	ram[pc[3].id].d = ram[pc[1].id].d + ram[pc[2].id].d;
+	pc += 4;
+	NEXT();
+}
+
+TAIL(r_sub_op)
+{
+	ram[pc[3].id].d = ram[pc[1].id].d - ram[pc[2].id].d;
+	pc += 4;
+	NEXT();
+}
+
+TAIL(r_mul_op)
+{
+	double d;
+
+	d = ram[pc[1].id].d * ram[pc[2].id].d;
+	if (d - d != 0.0)
+		SLOW();
+	ram[pc[3].id].d = d;
+	pc += 4;
+	NEXT();
+}
+
+TAIL(r_mov_op)
+{
+	ram[pc[2].id].d = ram[pc[1].id].d;
+	pc += 3;
+	NEXT();
+}
+
+/*
+ * Builds in s_tail_code a copy of 'code' where each opcode is replaced by
+ * its function in 'funcs', or tail_slow().
+ * Returns E_NO_MEM if there is no memory.
+ */
+static enum error_code tail_thread_code(tail_func *const funcs[])
+{
+	int pc, size, n;
+
+	assert(sizeof *s_tail_code == sizeof *code);
+	size = get_code_size();
+	if ((s_tail_code = malloc(size * sizeof *s_tail_code)) == NULL) {
+		return E_NO_MEM;
+	}
+
+	for (pc = 0; pc < size; pc += n) {
+		n = get_instr_size(&code[pc]);
+		s_tail_code[pc].func = funcs[code[pc].opcode];
+		if (s_tail_code[pc].func == NULL) {
+			s_tail_code[pc].func = tail_slow;
+		}
+		memcpy(&s_tail_code[pc + 1], &code[pc + 1],
+			(n - 1) * sizeof *s_tail_code);
+	}
+
+	return 0;
+}
+
+/* Executes instructions from s_pc until END_OP; see exec_loop().
+ * Returns E_NO_MEM, without executing anything, if there is no memory to
+ * copy the code.
+ */
+static enum error_code exec_tail(void)
+{
+	static tail_func *const funcs[VM_NOPS] = {
+		[END_OP] = end_op_t,
+		[PUSH_NUM_OP] = push_num_op_t,
+		[GET_VAR_OP] = get_var_op_t,
+		[GET_FN_VAR_OP] = get_var_op_t,
+		[LET_VAR_OP] = let_var_op_t,
+		[ADD_OP] = add_op_t,
+		[SUB_OP] = sub_op_t,
+		[MUL_OP] = mul_op_t,
+		[DIV_OP] = div_op_t,
+		[NEG_OP] = neg_op_t,
+		[GOTO_OP] = goto_op_t,
+		[IF_LESS_OP] = if_less_op_t,
+		[IF_GREATER_OP] = if_greater_op_t,
+		[IF_LESS_EQ_OP] = if_less_eq_op_t,
+		[IF_GREATER_EQ_OP] = if_greater_eq_op_t,
+		[IF_EQ_OP] = if_eq_op_t,
+		[IF_NOT_EQ_OP] = if_not_eq_op_t,
+		[FOR_CMP_OP] = for_cmp_op_t,
+		[NEXT_OP] = next_op_t,
+		[NEXT_INT_OP] = next_int_op_t,
+		[GET_LIST_UNCHECKED_OP] = get_list_unchecked_op_t,
+		[LET_LIST_UNCHECKED_OP] = let_list_unchecked_op_t,
+		[ADD_CONST_OP] = add_const_op_t,
+		[ADD_VAR_CONST_OP] = add_var_const_op_t,
+		[ADD_VAR_VAR_OP] = add_var_var_op_t,
+		[SUB_VAR_VAR_OP] = sub_var_var_op_t,
+		[LET_VAR_CONST_OP] = let_var_const_op_t,
+		[LET_VAR_FROM_VAR_OP] = let_var_from_var_op_t,
+		[INC_VAR_OP] = inc_var_op_t,
+		[IF_LESS_VAR_OP] = if_less_var_op_t,
+		[IF_GREATER_VAR_OP] = if_greater_var_op_t,
+		[IF_LESS_EQ_VAR_OP] = if_less_eq_var_op_t,
+		[IF_GREATER_EQ_VAR_OP] = if_greater_eq_var_op_t,
+		[IF_EQ_VAR_OP] = if_eq_var_op_t,
+		[IF_NOT_EQ_VAR_OP] = if_not_eq_var_op_t,
+		[IF_LESS_CONST_OP] = if_less_const_op_t,
+		[IF_GREATER_CONST_OP] = if_greater_const_op_t,
+		[IF_LESS_EQ_CONST_OP] = if_less_eq_const_op_t,
+		[IF_GREATER_EQ_CONST_OP] = if_greater_eq_const_op_t,
+		[IF_EQ_CONST_OP] = if_eq_const_op_t,
+		[IF_NOT_EQ_CONST_OP] = if_not_eq_const_op_t,
+		[R_ADD_OP] = r_add_op_t,
+		[R_SUB_OP] = r_sub_op_t,
+		[R_MUL_OP] = r_mul_op_t,
+		[R_MOV_OP] = r_mov_op_t,
+		[R_IF_LESS_OP] = r_if_less_op_t,
+		[R_IF_GREATER_OP] = r_if_greater_op_t,
+		[R_IF_LESS_EQ_OP] = r_if_less_eq_op_t,
+		[R_IF_GREATER_EQ_OP] = r_if_greater_eq_op_t,
+		[R_IF_EQ_OP] = r_if_eq_op_t,
+		[R_IF_NOT_EQ_OP] = r_if_not_eq_op_t,
+	};
+
+	if (tail_thread_code(funcs) != 0)
+		return E_NO_MEM;
+
+	s_code = code;
+	s_tail_code[s_pc].func(&s_tail_code[s_pc], s_stack + s_sp, s_ram);
+	free(s_tail_code);
+	s_tail_code = NULL;
+	return 0;
+}
+
+#undef MUSTTAIL
+#undef TAIL
+#undef NEXT
+#undef SLOW
+#undef AT
+#undef JUMP
+#undef IF_TAIL
+#undef IF_ARG_TAIL
+#undef R_IF_TAIL
+
+#endif
+
+/* The native code of the program, if it was translated to C. */
+static native_program s_native_program = NULL;
+
+/* Makes run() call 'f' instead of interpreting 'code'. 'f' must have been
+ * generated by emitc.c for the program in 'code'.
+ */
+void set_native_program(native_program f)
+{
+	s_native_program = f;
+}
+
+/* Prepares the state of the virtual machine for native code. */
+static void init_jit_vm(struct jit_vm *vm)
+{
+	s_code = code;
+	vm->pc = &s_pc;
+	vm->sp = &s_sp;
+	vm->line_num = &s_break_line_num;
+	vm->brk = &s_break;
+	vm->stack = s_stack;
+	vm->ram = s_ram;
+}
+
+#if defined(JIT)
+
+/* Translates the program to native code (see jit.c) and runs it until END_OP,
+ * a fatal error or a break.
+ * Returns E_NO_MEM, without executing anything, if there is no memory for the
+ * native code.
+ */
+static enum error_code exec_jit(void)
+{
+	struct jit_vm vm;
+	vm_func f;
+
+	init_jit_vm(&vm);
+	if ((f = jit_compile(&vm)) == NULL) {
+		return E_NO_MEM;
+	}
+
+	f();
+	jit_free();
+	return 0;
+}
+
+#endif
+
+#if defined(CLOSURES)
+
+/* Compiles the program to closures (see closure.c) and runs it until END_OP,
+ * a fatal error or a break.
+ * Returns E_NO_MEM, without executing anything, if there is no memory for the
+ * closures.
+ */
+static enum error_code exec_closures(void)
+{
+	struct jit_vm vm;
+	vm_func f;
+
+	init_jit_vm(&vm);
+	if ((f = closure_compile(&vm)) == NULL) {
+		return E_NO_MEM;
+	}
+
+	f();
+	closure_free();
+	return 0;
+}
+
+#endif
+
+/* Executes the program with its native code if it was translated to C, or
+ * else with the fastest engine we have. Without memory for the native code
+ * or the closures, we can still interpret.
+ */
+static void exec_program(void)
+{
+	struct jit_vm vm;
+
+	if (s_native_program != NULL) {
+		init_jit_vm(&vm);
+		s_native_program(&vm);
+		return;
+	}
+#if defined(JIT)
+	if (exec_jit() == 0)
+		return;
+#endif
+#if defined(CLOSURES)
+	if (exec_closures() == 0)
+		return;
+#endif
+#if defined(TAIL_CALLS)
+	if (exec_tail() == 0)
+		return;
+#endif
+#if defined(THREADED_CODE)
+	if (exec_threaded() == 0)
+		return;
+#endif
+	exec_loop();
+}
+
+/**
+ * Runs the current program stored in 'code' which needs an s_ram of size
+ * 'ramsize' and the string constants stored in 'strings'.
+ *
+ * 'array_base_index' is the base index for arrays declared in the program
+ * through OPTION BASE 0 or 1. Must be 0 or 1.
+ *
+ * 'gosub_stack_size' is the number of GOSUB calls that can be pending, or -1
+ * to use the capacity set with set_gosub_stack_capacity().
+ * 
+ * Caller must guarantee that 'ramsize * sizeof *s_ram' does not overflow a
+ * signed int (use is_ram_too_big()).
+ */
+void run(int ramsize, int array_base_index, int stack_size,
+	int gosub_stack_size)
+{
+	assert(ramsize >= 0);
+	assert(array_base_index == 0 || array_base_index == 1);
+	assert(stack_size >= 0);
+
+	reset_strings();
+	restore_data();
+
+	if (gosub_stack_size < 0)
+		gosub_stack_size = s_default_gosub_stack_capacity;
+
+#if 0
+	fprintf(stderr, "Allocating GOSUB stack (%d).\n", gosub_stack_size);
+#endif
+	if (alloc_gosub_stack(gosub_stack_size) != 0) {
+		eprint(E_NO_MEM);
+		enl();
+		return;
+	}
+
+#if 0
+	fprintf(stderr, "Allocating stack (%d).\n", stack_size);
+#endif
+	if (alloc_stack(stack_size) != 0) {
 		eprint(E_NO_MEM);
 		enl();
 		goto stack_fail;
@@ -1546,27 +3645,23 @@ void run(int ramsize, int array_base_index, int stack_size)
 #endif
 
 	s_base_ix = array_base_index;
-	s_fatal = 0;
 	s_pc = 0;
+	s_end_pc = get_code_size() - 1;
+	assert(code[s_end_pc].opcode == END_OP);
 	s_gosub_sp = 0;
 	s_sp = 0;
 	s_print_column = 0;
 	bas55_srand(1);
 	s_break = 0;
 	signal(SIGINT, sigint_handler);
-	while (!s_break && !s_fatal && code[s_pc].opcode != END_OP) {
-		ir = s_pc++;
-		vmop = &vm_ops[code[ir].opcode];
-		assert(vmop->stack_inc + s_sp <= s_stack_capacity);
-		vmop->func();
-	}
+	exec_program();
 	signal(SIGINT, SIG_DFL);
 	if (s_print_column != 0) {
 		s_print_column = 0;
 		putc('\n', stdout);
 	}
 	if (s_break)
-		printf("* break at %d *\n", s_cur_line_num);
+		printf("* break at %d *\n", s_break_line_num);
 
 	free_inited_ram();
 inited_ram_fail:
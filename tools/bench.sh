@@ -0,0 +1,60 @@
+#!/bin/bash
+# ---------------------------------------------------------------------------
+# Copyright (C) 2023 Jorge Giner Cordero
+# This file is part of bas55 (ECMA-55 Minimal BASIC System).
+# bas55 license: GNU GPL v3 or later.
+# ---------------------------------------------------------------------------
+
+# Compares the dispatch engines of the virtual machine: builds bas55 out of
+# the source tree with each one and runs the programs in tools/bench.
+# The native code translation is disabled, so that the program is
+# interpreted.
+#
+# usage: tools/bench.sh [builddir]
+#
+# Run it from a source tree where configure has been generated (see
+# bootstrap). The builds are in 'builddir' (by default, bench-build).
+# The tail call engine is left out if the compiler doesn't have
+# __attribute__((musttail)).
+
+set -e
+
+srcdir=$(cd "$(dirname "$0")/.." && pwd)
+builddir=${1:-bench-build}
+all_engines="loop threaded tailcall closures"
+
+conf_loop="--disable-jit --disable-closures --disable-threaded-code"
+conf_threaded="--disable-jit --disable-closures"
+conf_tailcall="--disable-jit --disable-closures --disable-threaded-code \
+	--enable-tail-calls"
+conf_closures="--disable-jit"
+
+engines=
+for e in $all_engines; do
+	eval conf=\$conf_$e
+	mkdir -p "$builddir/$e"
+	if ! (cd "$builddir/$e" && "$srcdir"/configure $conf >/dev/null); then
+		if [ $e = tailcall ]; then
+			echo "$0: no musttail, tailcall left out" >&2
+			continue
+		fi
+		exit 1
+	fi
+	make -C "$builddir/$e/src" >/dev/null || exit 1
+	engines="$engines $e"
+done
+
+TIMEFORMAT=%R
+printf "%-14s" program
+for e in $engines; do
+	printf "%10s" $e
+done
+echo
+for f in "$srcdir"/tools/bench/*.BAS; do
+	printf "%-14s" $(basename $f)
+	for e in $engines; do
+		t=$( { time "$builddir/$e/src/bas55" $f >/dev/null; } 2>&1 )
+		printf "%10s" $t
+	done
+	echo
+done